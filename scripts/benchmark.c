@@ -1,61 +1,1255 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <glob.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 /*
-    1-) The command will take arguments in the following form: usage build <number of iterations> <command to run>
+    1-) The command will take arguments in the following form: usage benchmark [options] <number of iterations> <command to run>
     2-) The builds can be generated from the different methods but this command can be used for running the binaries or python code
     3-) This C program will parse the arguments getting the value of number of iterations and command to run
     4-) Change the directory to the binaries or build folder
-    5-) Run the command and check for errors
+    5-) Run the command with fork/execvp (no shell in between) and collect the rusage of every child with wait4;
+        with --instances several copies run side by side and an iteration lasts until the last one exits
+    6-) Print the per iteration numbers and the min/median/p90/p99/mean/stddev of the measured iterations
+
+    With --concurrency the command is a request instead: <number of iterations> requests are served by that many
+    copies kept busy, and the requests/s and the latency percentiles under that load are printed
+
+    Options:
+        --warmup <n>        run <n> extra iterations before the measured ones, they are left out of the statistics
+        --results <file>    write a JSONL results file: one "harness" record per iteration plus the guest's own
+                            operation/phase records, collected through the WASM_BENCH_RESULTS environment variable,
+                            after a "topology" record of the CPUs, NUMA node, governors and instances used
+        --cpus <list>       pin the command to these CPUs, e.g. 0-7,16-23 (sched_setaffinity before execvp); the threads
+                            it starts later, such as ORT's intra-op pool, inherit the set
+        --numa-node <n>     bind the command's memory to NUMA node <n> (set_mempolicy MPOL_BIND); without --cpus
+                            it is also pinned to the node's CPUs
+        --instances <n>     run <n> copies side by side, each pinned to its own equal slice of --cpus, and report
+                            throughput; e.g. one socket's CPUs and its node measure throughput per socket (default: 1)
+        --governor <name>   set the cpufreq scaling governor of the CPUs used, e.g. performance (needs root); without
+                            it the governors are only checked, with a warning if one is not performance
+        --concurrency <n>   load mode: keep <n> copies running, pinned like --instances, starting the next request as
+                            soon as one exits, until <number of iterations> requests have been served
+        --duration <s>      load mode: stop taking requests after <s> seconds, even if fewer have been served
+        --qps <rate>        load mode, open loop: request i arrives at i/<rate> seconds whether or not a copy is free,
+                            and its latency counts the time it waited for one, so a rate past the saturation point
+                            shows up as a growing queue instead of a lower rate
+        --energy            read the RAPL/powercap energy counters (or, without them, as on most ARM boards, the
+                            hwmon energy inputs) before and after every iteration and report joules and watts next
+                            to the wall clock; the counters cover the whole package, so keep the machine quiet, and
+                            they are only readable by root. wasmtime-test --energy on splits a run by phase
+
+    The command can be given either as a single string ("./wasmtime-test wasi-nn-module.wasm"), which is split
+    on whitespace, or as the remaining arguments (./wasmtime-test wasi-nn-module.wasm).
+
+    Compile with: gcc -O2 -o benchmark benchmark.c -lm
 */
 
-void parse_args(int argc, char *argv[], int *number_iterations, char **command_to_run)
+#define MAX_COMMAND_ARGS 64
+#define RESULTS_ENV "WASM_BENCH_RESULTS"
+#define MAX_RECORD_LENGTH 4096
+#define MAX_INSTANCES 64
+#define MAX_CPU_LIST 1024
+#define MPOL_BIND 2
+#define MAX_ENERGY_DOMAINS 16
+
+struct options
+{
+    int number_iterations;
+    int warmup_iterations;
+    char results_path[PATH_MAX];
+    char *command_argv[MAX_COMMAND_ARGS + 1];
+    // CPUs to pin to, in the order they are sliced among the instances; none means no pinning
+    int cpus[CPU_SETSIZE];
+    int cpu_count;
+    int numa_node;
+    int instances;
+    const char *governor;
+    // Load mode when positive; its copies are also the instances, for pinning and guest records
+    int concurrency;
+    double qps;
+    double duration_s;
+    int energy;
+};
+
+struct sample
+{
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    double max_rss_kb;
+    // Negative when the energy is not measured
+    double energy_j;
+};
+
+// Energy counters in microjoules: the top-level powercap zones, or the hwmon energy inputs where there are none
+struct energy_meter
 {
-    if (argc < 3)
+    char paths[MAX_ENERGY_DOMAINS][PATH_MAX];
+    // Where a counter wraps to zero, 0 if it does not
+    double range_uj[MAX_ENERGY_DOMAINS];
+    // Counted in the total: the package-* zones when there are any, else every domain
+    int in_total[MAX_ENERGY_DOMAINS];
+    int count;
+};
+
+struct summary
+{
+    double min;
+    double median;
+    double p90;
+    double p99;
+    double max;
+    double mean;
+    double stddev;
+};
+
+// One request of load mode; times are from the start of the load
+struct request
+{
+    double arrival_ms;
+    double start_ms;
+    double end_ms;
+    int slot;
+    int exit_code;
+    struct sample sample;
+};
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./benchmark [--warmup <n>] [--results <file>] [--cpus <list>] [--numa-node <n>] "
+           "[--instances <n>] [--governor <name>] [--concurrency <n> [--duration <s>] [--qps <rate>]] [--energy] "
+           "<number_iterations> <command_to_run>\n");
+}
+
+// Parse a CPU list such as 0-3,8,10-11, the format of --cpus and of sysfs cpulist files
+int parse_cpu_list(const char *list, int cpus[], int max_cpus)
+{
+    int count = 0;
+    const char *c = list;
+    while (*c != '\0' && *c != '\n')
+    {
+        char *end;
+        long first = strtol(c, &end, 10);
+        long last = first;
+        if (end == c || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c || last < first)
+            {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (count == max_cpus || cpu >= CPU_SETSIZE)
+            {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0' && *end != '\n')
+        {
+            return -1;
+        }
+        c = end;
+    }
+    return count;
+}
+
+// Write cpus back as a list with ranges, e.g. 0-3,8
+void format_cpu_list(const int cpus[], int count, char *list, size_t size)
+{
+    size_t used = 0;
+    list[0] = '\0';
+    for (int i = 0; i < count && used < size; i++)
+    {
+        int j = i;
+        while (j + 1 < count && cpus[j + 1] == cpus[j] + 1)
+        {
+            j++;
+        }
+        const char *separator = used == 0 ? "" : ",";
+        if (j > i)
+        {
+            used += snprintf(list + used, size - used, "%s%d-%d", separator, cpus[i], cpus[j]);
+        }
+        else
+        {
+            used += snprintf(list + used, size - used, "%s%d", separator, cpus[i]);
+        }
+        i = j;
+    }
+}
+
+int split_command(char *command, char *command_argv[], int max_args)
+{
+    int count = 0;
+    for (char *token = strtok(command, " \t"); token != NULL; token = strtok(NULL, " \t"))
     {
-        printf("Error parsing, usage: ./benchmark <number_iterations> <command_to_run>");
+        if (count == max_args)
+        {
+            printf("Error parsing, command has more than %d arguments\n", max_args);
+            exit(EXIT_FAILURE);
+        }
+        command_argv[count++] = token;
+    }
+    command_argv[count] = NULL;
+    return count;
+}
+
+void resolve_path(const char *path, char *resolved, size_t size)
+{
+    char current_path[PATH_MAX];
+    if (path[0] == '/' || getcwd(current_path, sizeof(current_path)) == NULL)
+    {
+        snprintf(resolved, size, "%s", path);
+    }
+    else if ((size_t)snprintf(resolved, size, "%s/%s", current_path, path) >= size)
+    {
+        printf("Error parsing, path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    int i = 1;
+    options->warmup_iterations = 0;
+    options->results_path[0] = '\0';
+    options->cpu_count = 0;
+    options->numa_node = -1;
+    options->instances = 1;
+    options->governor = NULL;
+    options->concurrency = 0;
+    options->qps = 0.0;
+    options->duration_s = 0.0;
+    options->energy = 0;
+
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            options->warmup_iterations = atoi(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc)
+        {
+            // The results file is relative to where the benchmark was started, not to ./binaries
+            resolve_path(argv[i + 1], options->results_path, sizeof(options->results_path));
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc)
+        {
+            options->cpu_count = parse_cpu_list(argv[i + 1], options->cpus, CPU_SETSIZE);
+            if (options->cpu_count <= 0)
+            {
+                printf("Error parsing, invalid CPU list: %s\n", argv[i + 1]);
+                exit(EXIT_FAILURE);
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--numa-node") == 0 && i + 1 < argc)
+        {
+            options->numa_node = atoi(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+        {
+            options->instances = atoi(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--governor") == 0 && i + 1 < argc)
+        {
+            options->governor = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc)
+        {
+            options->concurrency = atoi(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--qps") == 0 && i + 1 < argc)
+        {
+            options->qps = atof(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+        {
+            options->duration_s = atof(argv[i + 1]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--energy") == 0)
+        {
+            options->energy = 1;
+            i += 1;
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - i < 2)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    options->number_iterations = atoi(argv[i++]);
+    if (options->number_iterations <= 0 || options->warmup_iterations < 0)
+    {
+        printf("Error parsing, the number of iterations must be positive\n");
         exit(EXIT_FAILURE);
     }
-    *number_iterations = atoi(argv[1]);
-    *command_to_run = argv[2];
+    if (options->instances <= 0 || options->instances > MAX_INSTANCES)
+    {
+        printf("Error parsing, the number of instances must be between 1 and %d\n", MAX_INSTANCES);
+        exit(EXIT_FAILURE);
+    }
+    if (options->qps < 0.0 || options->duration_s < 0.0 ||
+        ((options->qps > 0.0 || options->duration_s > 0.0) && options->concurrency == 0))
+    {
+        printf("Error parsing, --qps and --duration need --concurrency and a positive value\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->concurrency != 0)
+    {
+        if (options->instances != 1 || options->concurrency < 0 || options->concurrency > MAX_INSTANCES)
+        {
+            printf("Error parsing, --concurrency must be between 1 and %d, without --instances\n", MAX_INSTANCES);
+            exit(EXIT_FAILURE);
+        }
+        options->instances = options->concurrency;
+    }
+
+    // A single remaining argument is a command line, otherwise the arguments are the command itself
+    if (argc - i == 1)
+    {
+        if (split_command(argv[i], options->command_argv, MAX_COMMAND_ARGS) == 0)
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        if (argc - i > MAX_COMMAND_ARGS)
+        {
+            printf("Error parsing, command has more than %d arguments\n", MAX_COMMAND_ARGS);
+            exit(EXIT_FAILURE);
+        }
+        int count = 0;
+        for (; i < argc; i++)
+        {
+            options->command_argv[count++] = argv[i];
+        }
+        options->command_argv[count] = NULL;
+    }
 }
 
 void change_dir(char *dir_path)
 {
-    chdir(dir_path);
+    if (chdir(dir_path) != 0)
+    {
+        printf("Error changing directory to %s: %s\n", dir_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     char current_path[PATH_MAX];
-    getcwd(current_path, sizeof(current_path));
-    printf("Path changed, currently at: %s\n", current_path);
+    if (getcwd(current_path, sizeof(current_path)) != NULL)
+    {
+        printf("Path changed, currently at: %s\n", current_path);
+    }
+}
+
+double timespec_to_ms(const struct timespec *ts)
+{
+    return ts->tv_sec * 1e3 + ts->tv_nsec / 1e6;
+}
+
+double timeval_to_ms(const struct timeval *tv)
+{
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
 }
 
-void run_command(char *command, char *output_message, char *error_message)
+// Where instance's guest records go: the scratch file itself, or one per instance when several run at once
+void instance_guest_path(const struct options *options, const char *guest_path, int instance, char *path, size_t size)
 {
-    if (system(command) == 0)
+    if (options->instances == 1)
     {
-        printf("%s\n", output_message);
+        snprintf(path, size, "%s", guest_path);
     }
     else
     {
-        printf("%s\n", error_message);
+        snprintf(path, size, "%s.%d", guest_path, instance);
+    }
+}
+
+// Fork one copy of the command, pinned to its slice of the CPUs and with its memory bound to the NUMA node
+pid_t start_instance(const struct options *options, const char *guest_path, int instance, char *error_message)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        printf("%s: fork failed: %s\n", error_message, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    // Load mode blocks SIGCHLD, and the mask would outlive execvp
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (options->cpu_count > 0)
+    {
+        int per_instance = options->cpu_count / options->instances;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = instance * per_instance; i < (instance + 1) * per_instance; i++)
+        {
+            CPU_SET(options->cpus[i], &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            fprintf(stderr, "sched_setaffinity failed: %s\n", strerror(errno));
+            _exit(127);
+        }
+    }
+    if (options->numa_node >= 0)
+    {
+        unsigned long nodes[16] = {0};
+        size_t bits = sizeof(nodes[0]) * 8;
+        nodes[options->numa_node / bits] |= 1UL << (options->numa_node % bits);
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8) != 0)
+        {
+            fprintf(stderr, "set_mempolicy to node %d failed: %s\n", options->numa_node, strerror(errno));
+            _exit(127);
+        }
+    }
+    if (guest_path != NULL)
+    {
+        char path[PATH_MAX + 32];
+        instance_guest_path(options, guest_path, instance, path, sizeof(path));
+        setenv(RESULTS_ENV, path, 1);
+    }
+    execvp(options->command_argv[0], options->command_argv);
+    fprintf(stderr, "execvp %s failed: %s\n", options->command_argv[0], strerror(errno));
+    _exit(127);
+}
+
+// Run every instance of the command once; the wall clock lasts until the last one exits, user and system time add up
+// Read a decimal sysfs attribute; returns -1 if it cannot be read
+double read_sysfs_number(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    double value = -1.0;
+    if (file == NULL)
+    {
+        return -1.0;
+    }
+    if (fscanf(file, "%lf", &value) != 1)
+    {
+        value = -1.0;
+    }
+    fclose(file);
+    return value;
+}
+
+// Find the energy counters; returns how many can be read
+int open_energy_meter(struct energy_meter *meter)
+{
+    glob_t zones;
+    int packages = 0;
+    meter->count = 0;
+    // intel-rapl:0 and the like, not their subzones (intel-rapl:0:0) that the parents already count; AMD registers
+    // under intel-rapl too
+    if (glob("/sys/class/powercap/*:*/energy_uj", 0, NULL, &zones) == 0)
+    {
+        for (size_t i = 0; i < zones.gl_pathc && meter->count < MAX_ENERGY_DOMAINS; i++)
+        {
+            char zone[PATH_MAX];
+            char name_path[PATH_MAX + 8];
+            char range_path[PATH_MAX + 24];
+            char name[64] = "";
+            snprintf(zone, sizeof(zone), "%s", zones.gl_pathv[i]);
+            *strrchr(zone, '/') = '\0';
+            const char *zone_name = strrchr(zone, '/') + 1;
+            // The MMIO interface repeats package-0 on some Intel CPUs
+            if (strchr(zone_name, ':') != strrchr(zone_name, ':') || strncmp(zone_name, "intel-rapl-mmio", 15) == 0 ||
+                read_sysfs_number(zones.gl_pathv[i]) < 0.0)
+            {
+                continue;
+            }
+            snprintf(name_path, sizeof(name_path), "%s/name", zone);
+            FILE *file = fopen(name_path, "r");
+            if (file != NULL)
+            {
+                if (fscanf(file, "%63s", name) != 1)
+                {
+                    name[0] = '\0';
+                }
+                fclose(file);
+            }
+            int index = meter->count++;
+            snprintf(meter->paths[index], PATH_MAX, "%s", zones.gl_pathv[i]);
+            snprintf(range_path, sizeof(range_path), "%s/max_energy_range_uj", zone);
+            double range = read_sysfs_number(range_path);
+            meter->range_uj[index] = range > 0.0 ? range : 0.0;
+            meter->in_total[index] = strncmp(name, "package", 7) == 0;
+            packages += meter->in_total[index];
+        }
+        globfree(&zones);
+    }
+    if (meter->count == 0 && glob("/sys/class/hwmon/hwmon*/energy*_input", 0, NULL, &zones) == 0)
+    {
+        for (size_t i = 0; i < zones.gl_pathc && meter->count < MAX_ENERGY_DOMAINS; i++)
+        {
+            if (read_sysfs_number(zones.gl_pathv[i]) < 0.0)
+            {
+                continue;
+            }
+            int index = meter->count++;
+            snprintf(meter->paths[index], PATH_MAX, "%s", zones.gl_pathv[i]);
+            meter->range_uj[index] = 0.0;
+        }
+        globfree(&zones);
+    }
+    for (int i = 0; i < meter->count; i++)
+    {
+        meter->in_total[i] = packages == 0 || meter->in_total[i];
+    }
+    return meter->count;
+}
+
+void read_energy(const struct energy_meter *meter, double values_uj[])
+{
+    for (int i = 0; i < meter->count; i++)
+    {
+        values_uj[i] = read_sysfs_number(meter->paths[i]);
+    }
+}
+
+// Joules counted in the total between two readings
+double energy_since(const struct energy_meter *meter, const double start_uj[], const double end_uj[])
+{
+    double total = 0.0;
+    for (int i = 0; i < meter->count; i++)
+    {
+        double delta = end_uj[i] - start_uj[i];
+        if (delta < 0.0 && meter->range_uj[i] > 0.0)
+        {
+            delta += meter->range_uj[i];
+        }
+        if (meter->in_total[i] && delta > 0.0)
+        {
+            total += delta;
+        }
+    }
+    return total / 1e6;
+}
+
+// With a meter, sample->energy_j is the energy from the first start to the last exit
+void run_command(const struct options *options, const struct energy_meter *meter, const char *guest_path,
+                 struct sample *sample, char *error_message)
+{
+    struct timespec start, end;
+    pid_t pids[MAX_INSTANCES];
+    double start_uj[MAX_ENERGY_DOMAINS];
+
+    if (meter != NULL)
+    {
+        read_energy(meter, start_uj);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < options->instances; i++)
+    {
+        pids[i] = start_instance(options, guest_path, i, error_message);
+    }
+
+    sample->user_ms = 0.0;
+    sample->sys_ms = 0.0;
+    sample->max_rss_kb = 0.0;
+    for (int i = 0; i < options->instances; i++)
+    {
+        struct rusage usage;
+        int status = 0;
+        if (wait4(pids[i], &status, 0, &usage) < 0)
+        {
+            printf("%s: wait4 failed: %s\n", error_message, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (WIFSIGNALED(status))
+        {
+            printf("%s (killed by signal %d)\n", error_message, WTERMSIG(status));
+            exit(EXIT_FAILURE);
+        }
+        if (WEXITSTATUS(status) != 0)
+        {
+            printf("%s (exit code %d)\n", error_message, WEXITSTATUS(status));
+            exit(EXIT_FAILURE);
+        }
+        sample->user_ms += timeval_to_ms(&usage.ru_utime);
+        sample->sys_ms += timeval_to_ms(&usage.ru_stime);
+        if ((double)usage.ru_maxrss > sample->max_rss_kb)
+        {
+            sample->max_rss_kb = (double)usage.ru_maxrss;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sample->wall_ms = timespec_to_ms(&end) - timespec_to_ms(&start);
+    sample->energy_j = -1.0;
+    if (meter != NULL)
+    {
+        double end_uj[MAX_ENERGY_DOMAINS];
+        read_energy(meter, end_uj);
+        sample->energy_j = energy_since(meter, start_uj, end_uj);
+    }
+}
+
+// Fill in the CPUs to use when only --numa-node or --instances asked for pinning
+void default_cpus(struct options *options)
+{
+    if (options->cpu_count == 0 && options->numa_node >= 0)
+    {
+        char path[PATH_MAX];
+        char list[MAX_CPU_LIST];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", options->numa_node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL || fgets(list, sizeof(list), file) == NULL ||
+            (options->cpu_count = parse_cpu_list(list, options->cpus, CPU_SETSIZE)) <= 0)
+        {
+            printf("Error reading the CPUs of NUMA node %d from %s\n", options->numa_node, path);
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+    }
+    // The copies of load mode share the CPUs unless asked otherwise, as the requests of a server would
+    if (options->cpu_count == 0 && options->instances > 1 && options->concurrency == 0)
+    {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    options->cpus[options->cpu_count++] = cpu;
+                }
+            }
+        }
+    }
+    if (options->cpu_count > 0 && options->cpu_count < options->instances)
+    {
+        printf("Error: %d CPUs cannot be split among %d instances\n", options->cpu_count, options->instances);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Set (with --governor) or check the scaling governor of every CPU used, or of every CPU without pinning, and list
+// the governors found in governors
+void check_governors(const struct options *options, char *governors, size_t size)
+{
+    int all[CPU_SETSIZE];
+    int count = options->cpu_count;
+    const int *cpus = options->cpus;
+    if (count == 0)
+    {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        count = count < CPU_SETSIZE ? count : CPU_SETSIZE;
+        for (int cpu = 0; cpu < count; cpu++)
+        {
+            all[cpu] = cpu;
+        }
+        cpus = all;
+    }
+
+    governors[0] = '\0';
+    int failed_writes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpus[i]);
+        if (options->governor != NULL)
+        {
+            FILE *file = fopen(path, "w");
+            if (file == NULL || fprintf(file, "%s\n", options->governor) < 0 || fclose(file) != 0)
+            {
+                failed_writes++;
+            }
+        }
+
+        char governor[64] = "unknown";
+        FILE *file = fopen(path, "r");
+        if (file != NULL)
+        {
+            if (fgets(governor, sizeof(governor), file) != NULL)
+            {
+                governor[strcspn(governor, "\n")] = '\0';
+            }
+            fclose(file);
+        }
+        if (strstr(governors, governor) == NULL && strlen(governors) + strlen(governor) + 2 < size)
+        {
+            if (governors[0] != '\0')
+            {
+                strcat(governors, ",");
+            }
+            strcat(governors, governor);
+        }
+    }
+
+    if (failed_writes > 0)
+    {
+        printf("Warning: could not set the %s governor on %d CPUs (needs root and cpufreq)\n", options->governor,
+               failed_writes);
+    }
+    if (strcmp(governors, "performance") != 0)
+    {
+        printf("Warning: CPU frequency governors are %s, not performance; results may vary with frequency scaling\n",
+               governors);
+    }
+}
+
+void write_topology_record(FILE *results, const struct options *options, const char *governors)
+{
+    char list[MAX_CPU_LIST];
+    format_cpu_list(options->cpus, options->cpu_count, list, sizeof(list));
+    fprintf(results,
+            "{\"source\":\"harness\",\"kind\":\"topology\",\"cpus\":\"%s\",\"numa_node\":%d,\"instances\":%d,"
+            "\"online_cpus\":%ld,\"governors\":\"%s\",\"instance_cpus\":[",
+            list, options->numa_node, options->instances, sysconf(_SC_NPROCESSORS_ONLN), governors);
+    int per_instance = options->instances > 0 ? options->cpu_count / options->instances : 0;
+    for (int i = 0; i < options->instances; i++)
+    {
+        format_cpu_list(options->cpus + i * per_instance, per_instance, list, sizeof(list));
+        fprintf(results, "%s\"%s\"", i == 0 ? "" : ",", list);
+    }
+    fprintf(results, "]}\n");
+}
+
+void write_harness_record(FILE *results, int iteration, int instances, const struct sample *sample)
+{
+    char energy[64] = "null";
+    if (sample->energy_j >= 0.0)
+    {
+        snprintf(energy, sizeof(energy), "%.6f", sample->energy_j);
+    }
+    fprintf(results,
+            "{\"source\":\"harness\",\"iteration\":%d,\"kind\":\"process\",\"wall_ms\":%.3f,\"user_ms\":%.3f,"
+            "\"sys_ms\":%.3f,\"max_rss_kb\":%.0f,\"instances\":%d,\"throughput_per_s\":%.3f,\"energy_j\":%s}\n",
+            iteration, sample->wall_ms, sample->user_ms, sample->sys_ms, sample->max_rss_kb, instances,
+            instances * 1e3 / sample->wall_ms, energy);
+}
+
+// Move the records the guest appended during one iteration into the merged results file; instance tells apart the
+// records of instances running side by side, and is left out when it is negative
+void collect_guest_records(FILE *results, const char *guest_path, int iteration, int instance)
+{
+    FILE *guest = fopen(guest_path, "r");
+    if (guest == NULL)
+    {
+        return;
+    }
+
+    char line[MAX_RECORD_LENGTH];
+    while (fgets(line, sizeof(line), guest) != NULL)
+    {
+        char *record = strchr(line, '{');
+        if (record == NULL)
+        {
+            continue;
+        }
+        if (instance >= 0)
+        {
+            fprintf(results, "{\"source\":\"guest\",\"iteration\":%d,\"instance\":%d,%s", iteration, instance, record + 1);
+        }
+        else
+        {
+            fprintf(results, "{\"source\":\"guest\",\"iteration\":%d,%s", iteration, record + 1);
+        }
+        if (line[strlen(line) - 1] != '\n')
+        {
+            fputc('\n', results);
+        }
+    }
+    fclose(guest);
+    remove(guest_path);
+}
+
+double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_ms(&now) - timespec_to_ms(since);
+}
+
+void write_request_record(FILE *results, int iteration, const struct request *request)
+{
+    fprintf(results,
+            "{\"source\":\"harness\",\"iteration\":%d,\"instance\":%d,\"kind\":\"request\",\"arrival_ms\":%.3f,"
+            "\"queue_ms\":%.3f,\"latency_ms\":%.3f,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+            "\"max_rss_kb\":%.0f,\"exit_code\":%d}\n",
+            iteration, request->slot, request->arrival_ms, request->start_ms - request->arrival_ms,
+            request->end_ms - request->arrival_ms, request->sample.wall_ms, request->sample.user_ms,
+            request->sample.sys_ms, request->sample.max_rss_kb, request->exit_code);
+}
+
+// Load mode: serve up to number_iterations requests on the copies, starting one on a free copy as soon as it has
+// arrived (right away in a closed loop, at its slot of the --qps schedule in an open one), and return how many were
+// served. With results, every request gets a record and its guest records, as iteration = request, instance = copy
+int run_load(const struct options *options, const char *guest_path, FILE *results, struct request *requests)
+{
+    pid_t pids[MAX_INSTANCES] = {0};
+    int running_request[MAX_INSTANCES];
+    char path[PATH_MAX + 48];
+    int total = options->number_iterations;
+    int issued = 0;
+    int running = 0;
+    double interval_ms = options->qps > 0.0 ? 1e3 / options->qps : 0.0;
+    double duration_ms = options->duration_s * 1e3;
+
+    // With SIGCHLD blocked, a copy exiting while requests are started is still pending for sigtimedwait below
+    sigset_t child, previous;
+    sigemptyset(&child);
+    sigaddset(&child, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child, &previous);
+
+    struct timespec epoch;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    while (issued < total || running > 0)
+    {
+        double now = elapsed_ms(&epoch);
+        for (int slot = 0; slot < options->instances && issued < total; slot++)
+        {
+            if (pids[slot] != 0)
+            {
+                continue;
+            }
+            double arrival = interval_ms > 0.0 ? issued * interval_ms : now;
+            if (duration_ms > 0.0 && arrival >= duration_ms)
+            {
+                total = issued;
+                break;
+            }
+            if (arrival > now)
+            {
+                break;
+            }
+            requests[issued].arrival_ms = arrival;
+            requests[issued].start_ms = now;
+            requests[issued].slot = slot;
+            pids[slot] = start_instance(options, guest_path, slot, "Error occurred while running command");
+            running_request[slot] = issued++;
+            running++;
+        }
+
+        // Sleep until a copy exits or, with one free, the next request arrives
+        double wait_ms = 1e3;
+        if (interval_ms > 0.0 && running < options->instances && issued < total)
+        {
+            wait_ms = issued * interval_ms - elapsed_ms(&epoch);
+        }
+        if (wait_ms > 0.0)
+        {
+            struct timespec timeout = {(time_t)(wait_ms / 1e3), (long)(fmod(wait_ms, 1e3) * 1e6)};
+            sigtimedwait(&child, NULL, &timeout);
+        }
+
+        struct rusage usage;
+        int status = 0;
+        pid_t pid;
+        while (running > 0 && (pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+        {
+            double end = elapsed_ms(&epoch);
+            int slot = 0;
+            while (slot < options->instances && pids[slot] != pid)
+            {
+                slot++;
+            }
+            if (slot == options->instances)
+            {
+                continue;
+            }
+            int index = running_request[slot];
+            struct request *request = &requests[index];
+            request->end_ms = end;
+            request->exit_code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+            request->sample.wall_ms = end - request->start_ms;
+            request->sample.user_ms = timeval_to_ms(&usage.ru_utime);
+            request->sample.sys_ms = timeval_to_ms(&usage.ru_stime);
+            request->sample.max_rss_kb = (double)usage.ru_maxrss;
+            pids[slot] = 0;
+            running--;
+            if (request->exit_code != 0)
+            {
+                printf("Request %d failed (exit code %d)\n", index + 1, request->exit_code);
+            }
+            if (results != NULL)
+            {
+                write_request_record(results, index + 1, request);
+                instance_guest_path(options, guest_path, slot, path, sizeof(path));
+                collect_guest_records(results, path, index + 1, slot);
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    return total;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Linear interpolation between the closest ranks of an already sorted array
+double percentile(const double *sorted, int count, double p)
+{
+    if (count == 1)
+    {
+        return sorted[0];
+    }
+    double rank = p / 100.0 * (count - 1);
+    int lower = (int)floor(rank);
+    int upper = lower + 1 < count ? lower + 1 : lower;
+    return sorted[lower] + (rank - lower) * (sorted[upper] - sorted[lower]);
+}
+
+void summarize(const double *values, int count, struct summary *summary)
+{
+    double *sorted = malloc(sizeof(double) * count);
+    if (sorted == NULL)
+    {
+        printf("Error allocating memory for statistics\n");
         exit(EXIT_FAILURE);
     }
+    memcpy(sorted, values, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_doubles);
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += sorted[i];
+    }
+    summary->mean = sum / count;
+
+    double squares = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        squares += (sorted[i] - summary->mean) * (sorted[i] - summary->mean);
+    }
+    summary->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+
+    summary->min = sorted[0];
+    summary->median = percentile(sorted, count, 50.0);
+    summary->p90 = percentile(sorted, count, 90.0);
+    summary->p99 = percentile(sorted, count, 99.0);
+    summary->max = sorted[count - 1];
+    free(sorted);
+}
+
+void print_statistics(const struct sample *samples, int count)
+{
+    const char *names[] = {"Wall Clock (ms)", "User time (ms)", "System time (ms)", "Max RSS (KB)", "Energy (J)",
+                           "Power (W)"};
+    // Energy and power only when every iteration has it
+    int metrics = samples[0].energy_j >= 0.0 ? 6 : 4;
+    double *values = malloc(sizeof(double) * count);
+    if (values == NULL)
+    {
+        printf("Error allocating memory for statistics\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("\n============= Benchmark Statistics (%d iterations) =============\n", count);
+    printf("%-18s %12s %12s %12s %12s %12s %12s\n", "Metric", "min", "median", "p90", "p99", "mean", "stddev");
+    for (int metric = 0; metric < metrics; metric++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            double watts = samples[i].energy_j * 1e3 / samples[i].wall_ms;
+            const double fields[] = {samples[i].wall_ms,    samples[i].user_ms,  samples[i].sys_ms,
+                                     samples[i].max_rss_kb, samples[i].energy_j, watts};
+            values[i] = fields[metric];
+        }
+        struct summary summary;
+        summarize(values, count, &summary);
+        printf("%-18s %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", names[metric],
+               summary.min, summary.median, summary.p90, summary.p99, summary.mean, summary.stddev);
+    }
+    printf("================================================================\n");
+    free(values);
+}
+
+// Print the throughput and the latency, service time and queueing percentiles of the requests that succeeded, and
+// return how many failed
+int print_load(const struct options *options, const struct request *requests, int count, double energy_j,
+               FILE *results)
+{
+    const char *names[] = {"Latency (ms)", "Service (ms)", "Queued (ms)"};
+    double *values[3];
+    for (int metric = 0; metric < 3; metric++)
+    {
+        values[metric] = malloc(sizeof(double) * (count > 0 ? count : 1));
+        if (values[metric] == NULL)
+        {
+            printf("Error allocating memory for statistics\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int served = 0;
+    double last_ms = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        last_ms = requests[i].end_ms > last_ms ? requests[i].end_ms : last_ms;
+        if (requests[i].exit_code != 0)
+        {
+            continue;
+        }
+        values[0][served] = requests[i].end_ms - requests[i].arrival_ms;
+        values[1][served] = requests[i].sample.wall_ms;
+        values[2][served] = requests[i].start_ms - requests[i].arrival_ms;
+        served++;
+    }
+    double throughput = last_ms > 0.0 ? served * 1e3 / last_ms : 0.0;
+
+    char load[64] = "closed loop";
+    if (options->qps > 0.0)
+    {
+        snprintf(load, sizeof(load), "open loop at %.2f requests/s", options->qps);
+    }
+    printf("\n============= Load (%d requests, concurrency %d, %s) =============\n", count, options->concurrency,
+           load);
+    struct summary summaries[3] = {{0}};
+    if (served > 0)
+    {
+        printf("%-18s %12s %12s %12s %12s %12s %12s\n", "Metric", "min", "p50", "p90", "p99", "max", "mean");
+        for (int metric = 0; metric < 3; metric++)
+        {
+            summarize(values[metric], served, &summaries[metric]);
+            printf("%-18s %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", names[metric], summaries[metric].min,
+                   summaries[metric].median, summaries[metric].p90, summaries[metric].p99, summaries[metric].max,
+                   summaries[metric].mean);
+        }
+    }
+    printf("Throughput: %.2f requests/s, %d served in %.3f s, %d failed\n", throughput, served, last_ms / 1e3,
+           count - served);
+    char energy[64] = "null";
+    if (energy_j >= 0.0)
+    {
+        printf("Energy: %.3f J, %.3f J per request served, %.2f W\n", energy_j, served > 0 ? energy_j / served : 0.0,
+               last_ms > 0.0 ? energy_j * 1e3 / last_ms : 0.0);
+        snprintf(energy, sizeof(energy), "%.6f", energy_j);
+    }
+    if (options->qps > 0.0 && throughput < options->qps * 0.95)
+    {
+        printf("Saturated: requests arrived faster than %d copies served them, the queue grew over the run\n",
+               options->concurrency);
+    }
+    printf("================================================================\n");
+
+    if (results != NULL)
+    {
+        fprintf(results,
+                "{\"source\":\"harness\",\"kind\":\"load\",\"concurrency\":%d,\"qps\":%.3f,\"duration_s\":%.3f,"
+                "\"requests\":%d,\"failed\":%d,\"elapsed_ms\":%.3f,\"throughput_per_s\":%.3f,\"latency_p50_ms\":%.3f,"
+                "\"latency_p90_ms\":%.3f,\"latency_p99_ms\":%.3f,\"latency_max_ms\":%.3f,\"queue_p99_ms\":%.3f,"
+                "\"energy_j\":%s}\n",
+                options->concurrency, options->qps, options->duration_s, count, count - served, last_ms, throughput,
+                summaries[0].median, summaries[0].p90, summaries[0].p99, summaries[0].max, summaries[2].p99, energy);
+    }
+    for (int metric = 0; metric < 3; metric++)
+    {
+        free(values[metric]);
+    }
+    return count - served;
 }
 
 int main(int argc, char *argv[])
 {
     // Parse the command
-    int number_iterations = 0;
-    char *command_to_run = NULL;
-    parse_args(argc, argv, &number_iterations, &command_to_run);
+    struct options options;
+    parse_args(argc, argv, &options);
+    default_cpus(&options);
+
+    struct sample *samples = malloc(sizeof(struct sample) * options.number_iterations);
+    if (samples == NULL)
+    {
+        printf("Error allocating memory for %d samples\n", options.number_iterations);
+        return EXIT_FAILURE;
+    }
+
+    // Where the runs are placed is part of their results
+    char governors[256];
+    char cpu_list[MAX_CPU_LIST];
+    char numa_node[32] = "not bound";
+    check_governors(&options, governors, sizeof(governors));
+    format_cpu_list(options.cpus, options.cpu_count, cpu_list, sizeof(cpu_list));
+    if (options.numa_node >= 0)
+    {
+        snprintf(numa_node, sizeof(numa_node), "%d", options.numa_node);
+    }
+    printf("Topology: CPUs %s, NUMA node %s, %d instance(s), governors %s\n",
+           options.cpu_count > 0 ? cpu_list : "not pinned", numa_node, options.instances, governors);
+
+    // The guest appends to a scratch file that is merged into the results after every iteration
+    FILE *results = NULL;
+    char guest_path[PATH_MAX + 16];
+    char instance_path[PATH_MAX + 48];
+    if (options.results_path[0] != '\0')
+    {
+        results = fopen(options.results_path, "w");
+        if (results == NULL)
+        {
+            printf("Error opening results file %s: %s\n", options.results_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        snprintf(guest_path, sizeof(guest_path), "%s.guest", options.results_path);
+        for (int instance = 0; instance < options.instances; instance++)
+        {
+            instance_guest_path(&options, guest_path, instance, instance_path, sizeof(instance_path));
+            remove(instance_path);
+        }
+        write_topology_record(results, &options, governors);
+    }
+
+    struct energy_meter energy_meter;
+    const struct energy_meter *meter = NULL;
+    if (options.energy)
+    {
+        if (open_energy_meter(&energy_meter) == 0)
+        {
+            printf("Error: --energy found no readable powercap or hwmon energy counters (they need root)\n");
+            return EXIT_FAILURE;
+        }
+        meter = &energy_meter;
+        printf("Energy: %d counter(s), from %s\n", energy_meter.count, energy_meter.paths[0]);
+    }
 
     // Change the directory and run the command
     change_dir("./binaries");
-    for (int i = 1; i <= number_iterations; i++)
+    for (int i = 1; i <= options.warmup_iterations; i++)
+    {
+        struct sample warmup;
+        run_command(&options, meter, results != NULL ? guest_path : NULL, &warmup,
+                    "Error occurred while running command");
+        printf("Warmup %d: wall %.3f ms\n", i, warmup.wall_ms);
+        for (int instance = 0; results != NULL && instance < options.instances; instance++)
+        {
+            instance_guest_path(&options, guest_path, instance, instance_path, sizeof(instance_path));
+            remove(instance_path);
+        }
+    }
+    if (options.concurrency > 0)
+    {
+        struct request *requests = calloc(options.number_iterations, sizeof(struct request));
+        if (requests == NULL)
+        {
+            printf("Error allocating memory for %d requests\n", options.number_iterations);
+            return EXIT_FAILURE;
+        }
+        double start_uj[MAX_ENERGY_DOMAINS], end_uj[MAX_ENERGY_DOMAINS];
+        if (meter != NULL)
+        {
+            read_energy(meter, start_uj);
+        }
+        int count = run_load(&options, results != NULL ? guest_path : NULL, results, requests);
+        double energy_j = -1.0;
+        if (meter != NULL)
+        {
+            read_energy(meter, end_uj);
+            energy_j = energy_since(meter, start_uj, end_uj);
+        }
+        int failed = print_load(&options, requests, count, energy_j, results);
+        free(requests);
+        free(samples);
+        if (results != NULL)
+        {
+            fclose(results);
+            printf("Results written to: %s\n", options.results_path);
+        }
+        return failed > 0 ? EXIT_FAILURE : 0;
+    }
+    for (int i = 0; i < options.number_iterations; i++)
+    {
+        run_command(&options, meter, results != NULL ? guest_path : NULL, &samples[i],
+                    "Error occurred while running command");
+        printf("Iteration %d: wall %.3f ms, user %.3f ms, sys %.3f ms, max rss %.0f KB", i + 1, samples[i].wall_ms,
+               samples[i].user_ms, samples[i].sys_ms, samples[i].max_rss_kb);
+        if (meter != NULL)
+        {
+            printf(", %.3f J at %.2f W", samples[i].energy_j, samples[i].energy_j * 1e3 / samples[i].wall_ms);
+        }
+        if (options.instances > 1)
+        {
+            printf(", %.2f runs/s", options.instances * 1e3 / samples[i].wall_ms);
+        }
+        printf("\n");
+        if (results != NULL)
+        {
+            write_harness_record(results, i + 1, options.instances, &samples[i]);
+            for (int instance = 0; instance < options.instances; instance++)
+            {
+                instance_guest_path(&options, guest_path, instance, instance_path, sizeof(instance_path));
+                collect_guest_records(results, instance_path, i + 1, options.instances > 1 ? instance : -1);
+            }
+        }
+    }
+
+    print_statistics(samples, options.number_iterations);
+    if (options.instances > 1)
     {
-        run_command(command_to_run, "Command Run Successfully", "Error occurred while running command");
+        double *wall_ms = malloc(sizeof(double) * options.number_iterations);
+        if (wall_ms == NULL)
+        {
+            printf("Error allocating memory for statistics\n");
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < options.number_iterations; i++)
+        {
+            wall_ms[i] = samples[i].wall_ms;
+        }
+        struct summary summary;
+        summarize(wall_ms, options.number_iterations, &summary);
+        printf("Throughput of %d instances side by side: %.2f runs/s at the median wall clock\n", options.instances,
+               options.instances * 1e3 / summary.median);
+        free(wall_ms);
+    }
+    free(samples);
+
+    if (results != NULL)
+    {
+        fclose(results);
+        printf("Results written to: %s\n", options.results_path);
     }
 
     return 0;
-}
\ No newline at end of file
+}
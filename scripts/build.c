@@ -1,21 +1,115 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 /**
- * 1-) Removes the previous builds if any target files are present
- * 2-) Change directory to wasm-module using ../wasm-module
- * 3-) Run the command "cargo build --release --target=wasm32-wasip1" to compile the wasm module
- * 4-) Move the wasm module if generated to ./build, if got an error stop the program and show the error
- * 5-) Change the directory to wasmtime-custom using ../wasmtime-custom
- * 6-) Run the command "cargo build --release" to compile the custom wasmtime wrapper
- * 7-) Move the compiled binary to the ./build folder
+ * 1-) With --clean, removes the previous builds and the artifact cache first
+ * 2-) Skips a crate whose binary in ./binaries is newer than all of its inputs (sources, manifests, lock file and,
+ *     for the host, the vendored wasmtime crates)
+ * 3-) Builds the others in parallel, one child process per crate:
+ *     the wasm module with "cargo build --release --target=wasm32-wasip1" in ../wasm-module and
+ *     the custom wasmtime wrapper with "cargo build --release" in ../wasmtime-custom
+ * 4-) Copies what was built to ./binaries, through a temporary file and a rename, and leaves cargo's own output in
+ *     place so the next cargo build stays incremental; if a build failed, stop the program and show the error
+ * 5-) If anything was rebuilt or the cache is missing, empties the artifact cache and precompiles the wasm module into
+ *     it, so the first run maps it instead of compiling; every --variant is precompiled as well
+ *
+ * With --threads the wasm module is also built for wasm32-wasip1-threads as wasi-nn-module-threads.wasm,
+ * for wasmtime-test --wasi-threads.
+ *
+ * With --snapshot the wasm module is also pre-initialized, with "./wasmtime-test snapshot", into
+ * wasi-nn-module-snapshot.wasm, which is precompiled as well; it is remade whenever anything was rebuilt.
+ *
+ * With --component the guest's nn-component binary is also built for wasm32-wasip2 as wasi-nn-component.wasm, a
+ * component for wasmtime-test --component on; it is compiled at load time, so it is not precompiled.
+ *
+ * --variant "<host options>" (repeatable) precompiles one more artifact with those engine options, e.g.
+ * --variant "--opt-level speed-and-size" for the runs that use it, or
+ * --variant "--compile-target x86_64-unknown-linux-gnu --cpu-features has_avx2,has_fma" for another machine.
  */
 
 #define WASM_MODULE_NAME "wasi-nn-module"
+#define WASM_COMPONENT_BIN "nn-component"
+#define WASM_COMPONENT_NAME "wasi-nn-component"
+#define WASM_SNAPSHOT_NAME "wasi-nn-module-snapshot"
 #define WASMTIME_NAME "wasmtime-test"
+#define WASM_CACHE_DIR ".cwasm-cache"
+#define MAX_VARIANTS 8
+
+struct options
+{
+    int build_threads;
+    int build_component;
+    int build_snapshot;
+    int clean;
+    const char *variants[MAX_VARIANTS];
+    int variant_count;
+};
+
+// One crate built in a child process of its own
+struct crate
+{
+    const char *name;
+    const char *dir;
+    const char *inputs[8];
+    const char *commands[3];
+    // Built file and its destination, per command
+    const char *outputs[3][2];
+    int command_count;
+    pid_t pid;
+};
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./build [--threads] [--component] [--snapshot] [--clean] [--variant \"<host options>\"]...\n");
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    options->build_threads = 0;
+    options->build_component = 0;
+    options->build_snapshot = 0;
+    options->clean = 0;
+    options->variant_count = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0)
+        {
+            options->build_threads = 1;
+        }
+        else if (strcmp(argv[i], "--component") == 0)
+        {
+            options->build_component = 1;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0)
+        {
+            options->build_snapshot = 1;
+        }
+        else if (strcmp(argv[i], "--clean") == 0)
+        {
+            options->clean = 1;
+        }
+        else if (strcmp(argv[i], "--variant") == 0 && i + 1 < argc && options->variant_count < MAX_VARIANTS)
+        {
+            options->variants[options->variant_count++] = argv[++i];
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
 void remove_old_binaries(const char *binaries[], int size)
 {
@@ -49,28 +143,260 @@ void run_command(char *command, char *output_message, char *error_message)
     }
 }
 
-void move_file(char *source_path, char *destination_path, char *output_message, char *error_message)
+// Newest modification time seen by newest_input, and the file it belongs to
+time_t newest_time;
+char newest_path[PATH_MAX];
+
+int visit_input(const char *path, const struct stat *info, int type, struct FTW *ftw)
 {
-    char command[PATH_MAX * 2 + 10]; // giving enough size for mv source_path dest_path command buffer
-    snprintf(command, sizeof(command), "mv %s %s", source_path, destination_path);
-    run_command(command, output_message, error_message);
+    const char *name = path + ftw->base;
+    if (type == FTW_D && (strcmp(name, "target") == 0 || strcmp(name, ".git") == 0))
+    {
+        return FTW_SKIP_SUBTREE;
+    }
+    if (type == FTW_F && info->st_mtime > newest_time)
+    {
+        newest_time = info->st_mtime;
+        snprintf(newest_path, sizeof(newest_path), "%s", path);
+    }
+    return FTW_CONTINUE;
 }
 
-int main()
+// The newest modification time of the files under the inputs of crate; missing inputs are left out
+time_t newest_input(const struct crate *crate)
 {
-    // Remove old binaries
-    const char *binary_files[] = {"./binaries/wasmtime-test", "./binaries/wasi-nn-module.wasm", "./binaries/wasi-nn-module.wasm.SERIALIZED"};
-    remove_old_binaries(binary_files, 3);
+    newest_time = 0;
+    newest_path[0] = '\0';
+    for (int i = 0; crate->inputs[i] != NULL; i++)
+    {
+        nftw(crate->inputs[i], visit_input, 32, FTW_PHYS | FTW_ACTIONRETVAL);
+    }
+    return newest_time;
+}
+
+// Whether every destination of crate exists and is newer than all of its inputs
+int up_to_date(const struct crate *crate)
+{
+    time_t inputs = newest_input(crate);
+    for (int i = 0; i < crate->command_count; i++)
+    {
+        struct stat info;
+        if (stat(crate->outputs[i][1], &info) != 0)
+        {
+            return 0;
+        }
+        if (info.st_mtime <= inputs)
+        {
+            printf("%s: %s changed\n", crate->name, newest_path);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    // Change dir to wasm-module, compile the module and move to binaries folder
-    change_dir("../wasm-module");
-    run_command("cargo build --release --target=wasm32-wasip1", "Wasm Module Compiled Successfully", "Some error occurred while compiling wasm module");
-    move_file("./target/wasm32-wasip1/release/wasi-nn-module.wasm", "../scripts/binaries/wasi-nn-module.wasm", "Moved Compiled Module Successfully", "Error while moving compiled module");
+// Run the cargo commands of crate in a child process in its directory
+void start_build(struct crate *crate)
+{
+    fflush(stdout);
+    crate->pid = fork();
+    if (crate->pid < 0)
+    {
+        printf("Error building %s: fork failed: %s\n", crate->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (crate->pid == 0)
+    {
+        if (chdir(crate->dir) != 0)
+        {
+            fprintf(stderr, "Error changing directory to %s: %s\n", crate->dir, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < crate->command_count; i++)
+        {
+            if (system(crate->commands[i]) != 0)
+            {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(0);
+    }
+    printf("Building %s in %s (pid %d)\n", crate->name, crate->dir, (int)crate->pid);
+}
 
-    // Change dir to wasmtime-custom, compile the binary and move to binaries folder
-    change_dir("../wasmtime-custom");
-    run_command("cargo build --release", "Wasmtime custom Wrapper Compiled Successfully", "Some error occurred while compiling binary");
-    move_file("./target/release/wasmtime-test", "../scripts/binaries/wasmtime-test", "Moved Compiled Binary Successfully", "Error while moving compiled binary");
+// Copy source to destination with source's permissions; the rename keeps a half-written file from being run
+int copy_file(const char *source_path, const char *destination_path)
+{
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s.partial", destination_path);
+    int source = open(source_path, O_RDONLY);
+    if (source < 0)
+    {
+        return -1;
+    }
+    struct stat info;
+    fstat(source, &info);
+    int destination = open(partial, O_WRONLY | O_CREAT | O_TRUNC, info.st_mode & 0777);
+    if (destination < 0)
+    {
+        close(source);
+        return -1;
+    }
+
+    char buffer[1 << 16];
+    ssize_t count;
+    int result = 0;
+    while ((count = read(source, buffer, sizeof(buffer))) > 0)
+    {
+        if (write(destination, buffer, count) != count)
+        {
+            result = -1;
+            break;
+        }
+    }
+    if (count < 0)
+    {
+        result = -1;
+    }
+    close(source);
+    if (close(destination) != 0 || result != 0 || rename(partial, destination_path) != 0)
+    {
+        remove(partial);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the build of crate and copy its outputs to ./binaries
+void finish_build(struct crate *crate)
+{
+    int status = 0;
+    if (waitpid(crate->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("Some error occurred while compiling %s\n", crate->name);
+        exit(EXIT_FAILURE);
+    }
+    printf("%s Compiled Successfully\n", crate->name);
+    for (int i = 0; i < crate->command_count; i++)
+    {
+        if (copy_file(crate->outputs[i][0], crate->outputs[i][1]) != 0)
+        {
+            printf("Error while copying %s to %s: %s\n", crate->outputs[i][0], crate->outputs[i][1], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        printf("Copied %s\n", crate->outputs[i][1]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options;
+    parse_args(argc, argv, &options);
+
+    if (options.clean)
+    {
+        const char *binary_files[] = {"./binaries/wasmtime-test", "./binaries/wasi-nn-module.wasm",
+                                      "./binaries/wasi-nn-module.wasm.SERIALIZED",
+                                      "./binaries/wasi-nn-module-threads.wasm",
+                                      "./binaries/wasi-nn-component.wasm",
+                                      "./binaries/" WASM_SNAPSHOT_NAME ".wasm"};
+        remove_old_binaries(binary_files, 6);
+        system("rm -rf ./binaries/" WASM_CACHE_DIR);
+    }
+
+    struct crate crates[2] = {
+        {"Wasm Module",
+         "../wasm-module",
+         {"../wasm-module/src", "../wasm-module/Cargo.toml", "../wasm-module/Cargo.lock", "../wasm-module/.cargo",
+          NULL},
+         {"cargo build --release --target=wasm32-wasip1"},
+         {{"../wasm-module/target/wasm32-wasip1/release/" WASM_MODULE_NAME ".wasm",
+           "./binaries/" WASM_MODULE_NAME ".wasm"}},
+         1,
+         0},
+        {"Wasmtime custom Wrapper",
+         "../wasmtime-custom",
+         {"../wasmtime-custom/src", "../wasmtime-custom/build.rs", "../wasmtime-custom/Cargo.toml",
+          "../wasmtime-custom/Cargo.lock", "../wasmtime-repo/crates", "../wasmtime-repo/cranelift",
+          "../wasmtime-repo/winch", NULL},
+         {"cargo build --release"},
+         {{"../wasmtime-custom/target/release/" WASMTIME_NAME, "./binaries/" WASMTIME_NAME}},
+         1,
+         0},
+    };
+
+    struct crate *guest = &crates[0];
+    if (options.build_threads)
+    {
+        guest->commands[guest->command_count] = "cargo build --release --target=wasm32-wasip1-threads";
+        guest->outputs[guest->command_count][0] =
+            "../wasm-module/target/wasm32-wasip1-threads/release/" WASM_MODULE_NAME ".wasm";
+        guest->outputs[guest->command_count][1] = "./binaries/" WASM_MODULE_NAME "-threads.wasm";
+        guest->command_count++;
+    }
+    if (options.build_component)
+    {
+        guest->commands[guest->command_count] =
+            "cargo build --release --target=wasm32-wasip2 --features component --bin " WASM_COMPONENT_BIN;
+        guest->outputs[guest->command_count][0] = "../wasm-module/target/wasm32-wasip2/release/" WASM_COMPONENT_BIN ".wasm";
+        guest->outputs[guest->command_count][1] = "./binaries/" WASM_COMPONENT_NAME ".wasm";
+        guest->command_count++;
+    }
+
+    // The crates share nothing, so they build at the same time; cargo serializes within each
+    int rebuilt = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (up_to_date(&crates[i]))
+        {
+            printf("%s is up to date\n", crates[i].name);
+            continue;
+        }
+        start_build(&crates[i]);
+        rebuilt = 1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (crates[i].pid > 0)
+        {
+            finish_build(&crates[i]);
+        }
+    }
+
+    // Artifacts are keyed by module and engine, so a rebuild would only leave stale ones behind
+    struct stat cache;
+    change_dir("./binaries");
+    // The snapshot is the state the guest's init export leaves behind, so it follows both crates
+    if (options.build_snapshot && (rebuilt || stat(WASM_SNAPSHOT_NAME ".wasm", &cache) != 0))
+    {
+        run_command("./wasmtime-test snapshot wasi-nn-module.wasm " WASM_SNAPSHOT_NAME ".wasm", "Snapshotted Module Successfully", "Some error occurred while snapshotting wasm module");
+        rebuilt = 1;
+    }
+    if (!rebuilt && options.variant_count == 0 && stat(WASM_CACHE_DIR, &cache) == 0)
+    {
+        printf("Artifact cache is up to date\n");
+        return 0;
+    }
+    if (rebuilt)
+    {
+        system("rm -rf " WASM_CACHE_DIR);
+    }
+
+    // Warm the artifact cache with the default engine settings and every variant
+    run_command("./wasmtime-test compile wasi-nn-module.wasm", "Precompiled Module Successfully", "Some error occurred while precompiling wasm module");
+    if (options.build_snapshot)
+    {
+        run_command("./wasmtime-test compile " WASM_SNAPSHOT_NAME ".wasm", "Precompiled Snapshot Successfully", "Some error occurred while precompiling the snapshot");
+    }
+    if (options.build_threads)
+    {
+        run_command("./wasmtime-test --wasi-threads 4 compile wasi-nn-module-threads.wasm", "Precompiled Threaded Module Successfully", "Some error occurred while precompiling threaded wasm module");
+    }
+    for (int i = 0; i < options.variant_count; i++)
+    {
+        char command[PATH_MAX];
+        snprintf(command, sizeof(command), "./wasmtime-test %s compile wasi-nn-module.wasm", options.variants[i]);
+        run_command(command, "Precompiled Variant Successfully", "Some error occurred while precompiling a variant");
+    }
 
     return 0;
-}
\ No newline at end of file
+}
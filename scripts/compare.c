@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+    Cross-backend comparison: the Wasm overhead of every phase, per backend.
+
+    1-) For every backend the guest's main runs <iterations> times in Wasm (./wasmtime-test --backend <backend> <module>)
+        and <iterations> times natively (the same with --native on): same model, image and pre-processing
+    2-) Every run appends its operation, phase and total records to a scratch file (WASM_BENCH_RESULTS), which is read
+        back and removed after the run
+    3-) Print the median wall clock of every step in both modes and the Wasm overhead ratio (wasm / native), per backend
+
+    usage: compare [options] <wasm module>
+
+    Options:
+        --iterations <n>        measured runs per backend and mode (default: 10)
+        --warmup <n>            runs per backend and mode before the measured ones, left out of the medians (default: 1)
+        --backends <list>       comma separated backends (default: onnx)
+        --model <path>          guest path of the ONNX model (default: the host's default)
+        --openvino-model <path> guest path of the OpenVINO IR .xml, with its .bin next to it
+                                (default: /assets/models/mobilenetv2-10.xml)
+        --host <path>           the host binary (default: ./wasmtime-test)
+        --results <file>        write one JSON record per backend and step with both medians and the ratio
+
+    Compile with: gcc -O2 -o compare compare.c
+*/
+
+#define RESULTS_ENV "WASM_BENCH_RESULTS"
+#define MAX_RECORD_LENGTH 4096
+#define MAX_BACKENDS 4
+#define MAX_STEPS 32
+#define MAX_FIELD 64
+#define MODES 2
+
+const char *mode_names[MODES] = {"wasm", "native"};
+
+struct options
+{
+    int number_iterations;
+    int warmup_iterations;
+    char *backends[MAX_BACKENDS];
+    int backend_count;
+    const char *model;
+    const char *openvino_model;
+    const char *host;
+    const char *wasm_module;
+    char results_path[PATH_MAX];
+};
+
+// The wall clock of one step (an operation, phase or the total) in every run of every backend and mode
+struct step
+{
+    char kind[MAX_FIELD];
+    char name[MAX_FIELD];
+    double *wall_ms[MAX_BACKENDS][MODES];
+};
+
+struct step steps[MAX_STEPS];
+int step_count = 0;
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./compare [--iterations <n>] [--warmup <n>] [--backends <list>] [--model <path>] "
+           "[--openvino-model <path>] [--host <path>] [--results <file>] <wasm module>\n");
+}
+
+void resolve_path(const char *path, char *resolved, size_t size)
+{
+    char current_path[PATH_MAX];
+    if (path[0] == '/' || getcwd(current_path, sizeof(current_path)) == NULL)
+    {
+        snprintf(resolved, size, "%s", path);
+    }
+    else if ((size_t)snprintf(resolved, size, "%s/%s", current_path, path) >= size)
+    {
+        printf("Error parsing, path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_backends(char *list, struct options *options)
+{
+    options->backend_count = 0;
+    for (char *token = strtok(list, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        if (strcmp(token, "onnx") != 0 && strcmp(token, "openvino") != 0)
+        {
+            printf("Error parsing, unknown backend: %s\n", token);
+            exit(EXIT_FAILURE);
+        }
+        if (options->backend_count == MAX_BACKENDS)
+        {
+            printf("Error parsing, more than %d backends\n", MAX_BACKENDS);
+            exit(EXIT_FAILURE);
+        }
+        options->backends[options->backend_count++] = token;
+    }
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    static char default_backends[] = "onnx";
+    int i = 1;
+    options->number_iterations = 10;
+    options->warmup_iterations = 1;
+    options->model = NULL;
+    options->openvino_model = "/assets/models/mobilenetv2-10.xml";
+    options->host = "./wasmtime-test";
+    options->results_path[0] = '\0';
+    parse_backends(default_backends, options);
+
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "--iterations") == 0)
+        {
+            options->number_iterations = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--warmup") == 0)
+        {
+            options->warmup_iterations = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--backends") == 0)
+        {
+            parse_backends(argv[i + 1], options);
+        }
+        else if (strcmp(argv[i], "--model") == 0)
+        {
+            options->model = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--openvino-model") == 0)
+        {
+            options->openvino_model = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--host") == 0)
+        {
+            options->host = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--results") == 0)
+        {
+            // The results file is relative to where compare was started, not to ./binaries
+            resolve_path(argv[i + 1], options->results_path, sizeof(options->results_path));
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        i += 2;
+    }
+
+    if (argc - i != 1 || options->backend_count == 0)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    options->wasm_module = argv[i];
+    if (options->number_iterations <= 0 || options->warmup_iterations < 0)
+    {
+        printf("Error parsing, the number of iterations must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void change_dir(char *dir_path)
+{
+    if (chdir(dir_path) != 0)
+    {
+        printf("Error changing directory to %s: %s\n", dir_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void run_host(const struct options *options, const char *backend, int mode)
+{
+    const char *model = strcmp(backend, "openvino") == 0 ? options->openvino_model : options->model;
+    char *argv[12];
+    int argc = 0;
+    argv[argc++] = (char *)options->host;
+    argv[argc++] = "--backend";
+    argv[argc++] = (char *)backend;
+    if (model != NULL)
+    {
+        argv[argc++] = "--model";
+        argv[argc++] = (char *)model;
+    }
+    if (mode == 1)
+    {
+        argv[argc++] = "--native";
+        argv[argc++] = "on";
+    }
+    argv[argc++] = (char *)options->wasm_module;
+    argv[argc] = NULL;
+
+    // The host's output is not part of the comparison
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        printf("Error running %s: fork failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "execvp %s failed: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        printf("Error running %s: waitpid failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("Error running %s --backend %s%s: it failed\n", options->host, backend, mode == 1 ? " --native on" : "");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Copy the string value of "field":"..." in record into value
+int string_field(const char *record, const char *field, char *value, size_t size)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    start += strlen(key);
+    const char *end = strchr(start, '"');
+    if (end == NULL || (size_t)(end - start) >= size)
+    {
+        return -1;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 0;
+}
+
+int number_field(const char *record, const char *field, double *value)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    *value = strtod(start + strlen(key), NULL);
+    return 0;
+}
+
+struct step *find_step(const char *kind, const char *name, int iterations)
+{
+    for (int i = 0; i < step_count; i++)
+    {
+        if (strcmp(steps[i].kind, kind) == 0 && strcmp(steps[i].name, name) == 0)
+        {
+            return &steps[i];
+        }
+    }
+    if (step_count == MAX_STEPS)
+    {
+        return NULL;
+    }
+
+    struct step *step = &steps[step_count++];
+    snprintf(step->kind, sizeof(step->kind), "%s", kind);
+    snprintf(step->name, sizeof(step->name), "%s", name);
+    for (int backend = 0; backend < MAX_BACKENDS; backend++)
+    {
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            step->wall_ms[backend][mode] = calloc(iterations, sizeof(double));
+            if (step->wall_ms[backend][mode] == NULL)
+            {
+                printf("Error allocating memory for %d samples\n", iterations);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return step;
+}
+
+// Add the records of one run to iteration of backend and mode; a step recorded more than once adds up
+void collect_records(const char *path, int backend, int mode, int iteration, int iterations)
+{
+    FILE *records = fopen(path, "r");
+    if (records == NULL)
+    {
+        printf("Error: the run wrote no records to %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[MAX_RECORD_LENGTH];
+    while (fgets(line, sizeof(line), records) != NULL)
+    {
+        char kind[MAX_FIELD], name[MAX_FIELD];
+        double wall_us;
+        if (string_field(line, "kind", kind, sizeof(kind)) != 0 || string_field(line, "name", name, sizeof(name)) != 0 ||
+            number_field(line, "wall_clock_us", &wall_us) != 0)
+        {
+            continue;
+        }
+        struct step *step = find_step(kind, name, iterations);
+        if (step != NULL)
+        {
+            step->wall_ms[backend][mode][iteration] += wall_us / 1e3;
+        }
+    }
+    fclose(records);
+    remove(path);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median(const double *values, int count)
+{
+    double *sorted = malloc(sizeof(double) * count);
+    if (sorted == NULL)
+    {
+        printf("Error allocating memory for statistics\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, values, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    double result = count % 2 == 1 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0;
+    free(sorted);
+    return result;
+}
+
+void print_comparison(const struct options *options, FILE *results)
+{
+    for (int backend = 0; backend < options->backend_count; backend++)
+    {
+        printf("\n============= Wasm overhead: %s (median of %d runs) =============\n", options->backends[backend],
+               options->number_iterations);
+        printf("%-10s %-20s %14s %14s %12s\n", "Kind", "Step", "wasm (ms)", "native (ms)", "wasm/native");
+        for (int i = 0; i < step_count; i++)
+        {
+            double wasm_ms = median(steps[i].wall_ms[backend][0], options->number_iterations);
+            double native_ms = median(steps[i].wall_ms[backend][1], options->number_iterations);
+            double ratio = native_ms > 0.0 ? wasm_ms / native_ms : 0.0;
+            printf("%-10s %-20s %14.3f %14.3f %12.2f\n", steps[i].kind, steps[i].name, wasm_ms, native_ms, ratio);
+            if (results != NULL)
+            {
+                fprintf(results,
+                        "{\"backend\":\"%s\",\"kind\":\"%s\",\"name\":\"%s\",\"wasm_ms\":%.3f,\"native_ms\":%.3f,"
+                        "\"ratio\":%.3f}\n",
+                        options->backends[backend], steps[i].kind, steps[i].name, wasm_ms, native_ms, ratio);
+            }
+        }
+    }
+    printf("================================================================\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options;
+    parse_args(argc, argv, &options);
+
+    FILE *results = NULL;
+    if (options.results_path[0] != '\0')
+    {
+        results = fopen(options.results_path, "w");
+        if (results == NULL)
+        {
+            printf("Error opening results file %s: %s\n", options.results_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    change_dir("./binaries");
+    char records_path[PATH_MAX];
+    resolve_path("compare-records.jsonl", records_path, sizeof(records_path));
+    remove(records_path);
+    setenv(RESULTS_ENV, records_path, 1);
+
+    for (int backend = 0; backend < options.backend_count; backend++)
+    {
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            printf("Running %s %s: ", options.backends[backend], mode_names[mode]);
+            for (int i = 0; i < options.warmup_iterations; i++)
+            {
+                run_host(&options, options.backends[backend], mode);
+                remove(records_path);
+            }
+            for (int i = 0; i < options.number_iterations; i++)
+            {
+                run_host(&options, options.backends[backend], mode);
+                collect_records(records_path, backend, mode, i, options.number_iterations);
+                printf(".");
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+
+    print_comparison(&options, results);
+
+    if (results != NULL)
+    {
+        fclose(results);
+        printf("Results written to: %s\n", options.results_path);
+    }
+    return 0;
+}
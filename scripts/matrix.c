@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+    Compiler matrix: what each compiler strategy, optimization level and SIMD setting costs and buys the guest.
+
+    1-) For every configuration the artifact cache is emptied and the guest's main runs once cold
+        (./wasmtime-test --strategy <s> --opt-level <o> --simd <on|off> --relaxed-simd <on|off> <module>), which
+        compiles the module and records the compile time and the size of the artifact
+    2-) Then main runs <iterations> times more, mapping the cached artifact, for the median instantiate time of main and
+        the median Pre-processing and Inference operations
+    3-) Every run appends its records (the guest's operations and the host's engine record) to a scratch file
+        (WASM_BENCH_RESULTS), which is read back and removed after the run
+    4-) Print one row per configuration; a configuration the host rejects, e.g. Winch on a module that uses SIMD, is
+        reported as failed and the others still run
+    5-) With --changed-module, a build of the guest after a small edit, the default configuration (Cranelift, speed,
+        SIMD on) then compiles in the process (--artifact-cache off) through the module cache and the incremental cache:
+        cold, with both emptied; warm, the same module again, served whole by the module cache; and partially warm,
+        the changed module, which misses the module cache and compiles only the functions the incremental cache lacks
+
+    SIMD off needs a guest built without +simd128 (--scalar-module); without one those configurations are skipped.
+
+    usage: matrix [options] <wasm module>
+
+    Options:
+        --iterations <n>        measured runs per configuration after the cold one (default: 5)
+        --scalar-module <path>  the guest built without +simd128, for the configurations with SIMD off
+        --host <path>           the host binary (default: ./wasmtime-test)
+        --changed-module <path> the guest after a small edit, for the compile times with cold, warm and partially warm
+                                compilation caches
+        --results <file>        write one JSON record per configuration, and one per cache state
+
+    Compile with: gcc -O2 -o matrix matrix.c
+*/
+
+#define RESULTS_ENV "WASM_BENCH_RESULTS"
+#define MAX_RECORD_LENGTH 4096
+#define MAX_FIELD 64
+#define CACHE_DIR "matrix-cache"
+#define MODULE_CACHE_DIR CACHE_DIR "/module"
+#define INCREMENTAL_CACHE_DIR CACHE_DIR "/incremental"
+
+struct options
+{
+    int number_iterations;
+    const char *scalar_module;
+    const char *changed_module;
+    const char *host;
+    const char *wasm_module;
+    char results_path[PATH_MAX];
+};
+
+struct configuration
+{
+    const char *strategy;
+    const char *opt_level;
+    const char *simd;
+    const char *relaxed_simd;
+};
+
+// Winch ignores the optimization level, so it is listed once per SIMD setting
+const struct configuration configurations[] = {
+    {"cranelift", "none", "on", "on"},
+    {"cranelift", "none", "on", "off"},
+    {"cranelift", "none", "off", "off"},
+    {"cranelift", "speed", "on", "on"},
+    {"cranelift", "speed", "on", "off"},
+    {"cranelift", "speed", "off", "off"},
+    {"cranelift", "speed-and-size", "on", "on"},
+    {"cranelift", "speed-and-size", "on", "off"},
+    {"cranelift", "speed-and-size", "off", "off"},
+    {"winch", "speed", "on", "off"},
+    {"winch", "speed", "off", "off"},
+};
+
+#define CONFIGURATIONS (int)(sizeof(configurations) / sizeof(configurations[0]))
+
+// What one run recorded; a value the run did not record is negative
+struct sample
+{
+    double compile_ms;
+    double artifact_bytes;
+    double instantiate_ms;
+    double preprocess_ms;
+    double inference_ms;
+    double incremental_hits;
+    double incremental_misses;
+};
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./matrix [--iterations <n>] [--scalar-module <path>] [--changed-module <path>] "
+           "[--host <path>] [--results <file>] <wasm module>\n");
+}
+
+void resolve_path(const char *path, char *resolved, size_t size)
+{
+    char current_path[PATH_MAX];
+    if (path[0] == '/' || getcwd(current_path, sizeof(current_path)) == NULL)
+    {
+        snprintf(resolved, size, "%s", path);
+    }
+    else if ((size_t)snprintf(resolved, size, "%s/%s", current_path, path) >= size)
+    {
+        printf("Error parsing, path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    int i = 1;
+    options->number_iterations = 5;
+    options->scalar_module = NULL;
+    options->changed_module = NULL;
+    options->host = "./wasmtime-test";
+    options->results_path[0] = '\0';
+
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "--iterations") == 0)
+        {
+            options->number_iterations = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--scalar-module") == 0)
+        {
+            options->scalar_module = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--changed-module") == 0)
+        {
+            options->changed_module = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--host") == 0)
+        {
+            options->host = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--results") == 0)
+        {
+            // The results file is relative to where matrix was started, not to ./binaries
+            resolve_path(argv[i + 1], options->results_path, sizeof(options->results_path));
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        i += 2;
+    }
+
+    if (argc - i != 1)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    options->wasm_module = argv[i];
+    if (options->number_iterations <= 0)
+    {
+        printf("Error parsing, the number of iterations must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void change_dir(char *dir_path)
+{
+    if (chdir(dir_path) != 0)
+    {
+        printf("Error changing directory to %s: %s\n", dir_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Run main once with configuration, and the NULL-terminated extra options if any, on module, or else on the guest
+// the configuration needs; returns 0 if the host succeeded
+int run_host(const struct options *options, const struct configuration *configuration, const char *cache_dir,
+             const char *module, const char *const *extra)
+{
+    if (module == NULL)
+    {
+        module = strcmp(configuration->simd, "off") == 0 ? options->scalar_module : options->wasm_module;
+    }
+    char *argv[24];
+    int argc = 0;
+    argv[argc++] = (char *)options->host;
+    argv[argc++] = "--cache-dir";
+    argv[argc++] = (char *)cache_dir;
+    argv[argc++] = "--strategy";
+    argv[argc++] = (char *)configuration->strategy;
+    argv[argc++] = "--opt-level";
+    argv[argc++] = (char *)configuration->opt_level;
+    argv[argc++] = "--simd";
+    argv[argc++] = (char *)configuration->simd;
+    argv[argc++] = "--relaxed-simd";
+    argv[argc++] = (char *)configuration->relaxed_simd;
+    for (int i = 0; extra != NULL && extra[i] != NULL; i++)
+    {
+        argv[argc++] = (char *)extra[i];
+    }
+    argv[argc++] = (char *)module;
+    argv[argc] = NULL;
+
+    // The host's output is not part of the matrix, its errors are
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        printf("Error running %s: fork failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "execvp %s failed: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        printf("Error running %s: waitpid failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Copy the string value of "field":"..." in record into value
+int string_field(const char *record, const char *field, char *value, size_t size)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    start += strlen(key);
+    const char *end = strchr(start, '"');
+    if (end == NULL || (size_t)(end - start) >= size)
+    {
+        return -1;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 0;
+}
+
+// Parse the number of "field":<number> in record; null counts as missing
+int number_field(const char *record, const char *field, double *value)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":", field);
+    const char *start = strstr(record, key);
+    if (start == NULL || strncmp(start + strlen(key), "null", 4) == 0)
+    {
+        return -1;
+    }
+    *value = strtod(start + strlen(key), NULL);
+    return 0;
+}
+
+// Read the records of one run into sample and remove the scratch file
+void collect_records(const char *path, struct sample *sample)
+{
+    sample->compile_ms = -1.0;
+    sample->artifact_bytes = -1.0;
+    sample->instantiate_ms = -1.0;
+    sample->preprocess_ms = -1.0;
+    sample->inference_ms = -1.0;
+    sample->incremental_hits = -1.0;
+    sample->incremental_misses = -1.0;
+
+    FILE *records = fopen(path, "r");
+    if (records == NULL)
+    {
+        return;
+    }
+    char line[MAX_RECORD_LENGTH];
+    while (fgets(line, sizeof(line), records) != NULL)
+    {
+        char kind[MAX_FIELD], name[MAX_FIELD];
+        double value;
+        if (string_field(line, "kind", kind, sizeof(kind)) != 0)
+        {
+            continue;
+        }
+        if (strcmp(kind, "engine") == 0)
+        {
+            if (number_field(line, "compile_us", &value) == 0)
+            {
+                sample->compile_ms = value / 1e3;
+            }
+            if (number_field(line, "artifact_bytes", &value) == 0)
+            {
+                sample->artifact_bytes = value;
+            }
+            if (number_field(line, "instantiate_us", &value) == 0)
+            {
+                sample->instantiate_ms = value / 1e3;
+            }
+            if (number_field(line, "incremental_hits", &value) == 0)
+            {
+                sample->incremental_hits = value;
+            }
+            if (number_field(line, "incremental_misses", &value) == 0)
+            {
+                sample->incremental_misses = value;
+            }
+        }
+        else if (strcmp(kind, "operation") == 0 && string_field(line, "name", name, sizeof(name)) == 0 &&
+                 number_field(line, "wall_clock_us", &value) == 0)
+        {
+            if (strcmp(name, "Pre-processing") == 0)
+            {
+                sample->preprocess_ms = value / 1e3;
+            }
+            else if (strcmp(name, "Inference") == 0)
+            {
+                sample->inference_ms = value / 1e3;
+            }
+        }
+    }
+    fclose(records);
+    remove(path);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The median of the values that were recorded, or -1 if none was
+double median(const double *values, int count)
+{
+    double *sorted = malloc(sizeof(double) * count);
+    if (sorted == NULL)
+    {
+        printf("Error allocating memory for statistics\n");
+        exit(EXIT_FAILURE);
+    }
+    int recorded = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (values[i] >= 0.0)
+        {
+            sorted[recorded++] = values[i];
+        }
+    }
+    double result = -1.0;
+    if (recorded > 0)
+    {
+        qsort(sorted, recorded, sizeof(double), compare_doubles);
+        result = recorded % 2 == 1 ? sorted[recorded / 2] : (sorted[recorded / 2 - 1] + sorted[recorded / 2]) / 2.0;
+    }
+    free(sorted);
+    return result;
+}
+
+// Print a recorded value, or "-" for a missing one
+void print_value(double value, int precision)
+{
+    if (value < 0.0)
+    {
+        printf(" %14s", "-");
+    }
+    else
+    {
+        printf(" %14.*f", precision, value);
+    }
+}
+
+void print_json_value(FILE *results, const char *field, double value, int precision)
+{
+    if (value < 0.0)
+    {
+        fprintf(results, ",\"%s\":null", field);
+    }
+    else
+    {
+        fprintf(results, ",\"%s\":%.*f", field, precision, value);
+    }
+}
+
+// Step 5: the compile time of the default configuration with cold, warm and partially warm compilation caches
+void compile_caches(const struct options *options, const char *records_path, FILE *results)
+{
+    const struct configuration *configuration = &configurations[3];
+    const char *const extra[] = {"--artifact-cache", "off", "--compile-cache", MODULE_CACHE_DIR,
+                                 "--incremental-cache", INCREMENTAL_CACHE_DIR, NULL};
+    const struct
+    {
+        const char *state;
+        const char *module;
+    } runs[] = {
+        {"cold", options->wasm_module},
+        {"warm", options->wasm_module},
+        {"partially warm", options->changed_module},
+    };
+
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s %s", MODULE_CACHE_DIR, INCREMENTAL_CACHE_DIR);
+    system(command);
+
+    printf("\n========== Compilation caches (%s, %s, SIMD %s) ==========\n", configuration->strategy,
+           configuration->opt_level, configuration->simd);
+    printf("%-16s %14s %14s %14s\n", "Cache", "compile (ms)", "fn. cached", "fn. compiled");
+    for (int r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); r++)
+    {
+        printf("%-16s", runs[r].state);
+        fflush(stdout);
+        struct sample sample;
+        int failed = run_host(options, configuration, CACHE_DIR, runs[r].module, extra);
+        collect_records(records_path, &sample);
+        if (failed != 0)
+        {
+            printf(" failed, rerun the host with these options to see why\n");
+            continue;
+        }
+        print_value(sample.compile_ms, 3);
+        print_value(sample.incremental_hits, 0);
+        print_value(sample.incremental_misses, 0);
+        printf("\n");
+        if (results != NULL)
+        {
+            fprintf(results, "{\"cache\":\"%s\",\"module\":\"%s\"", runs[r].state, runs[r].module);
+            print_json_value(results, "compile_ms", sample.compile_ms, 3);
+            print_json_value(results, "incremental_hits", sample.incremental_hits, 0);
+            print_json_value(results, "incremental_misses", sample.incremental_misses, 0);
+            fprintf(results, "}\n");
+        }
+    }
+    printf("================================================================\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options;
+    parse_args(argc, argv, &options);
+
+    FILE *results = NULL;
+    if (options.results_path[0] != '\0')
+    {
+        results = fopen(options.results_path, "w");
+        if (results == NULL)
+        {
+            printf("Error opening results file %s: %s\n", options.results_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    change_dir("./binaries");
+    char records_path[PATH_MAX];
+    resolve_path("matrix-records.jsonl", records_path, sizeof(records_path));
+    remove(records_path);
+    setenv(RESULTS_ENV, records_path, 1);
+
+    double *instantiate_ms = malloc(sizeof(double) * options.number_iterations);
+    double *preprocess_ms = malloc(sizeof(double) * options.number_iterations);
+    double *inference_ms = malloc(sizeof(double) * options.number_iterations);
+    if (instantiate_ms == NULL || preprocess_ms == NULL || inference_ms == NULL)
+    {
+        printf("Error allocating memory for %d samples\n", options.number_iterations);
+        return EXIT_FAILURE;
+    }
+
+    printf("\n============= Compiler matrix (median of %d warm runs) =============\n", options.number_iterations);
+    printf("%-10s %-15s %-5s %-8s %14s %14s %14s %14s %14s\n", "Strategy", "Opt level", "SIMD", "Relaxed",
+           "compile (ms)", "artifact (KiB)", "instant. (ms)", "preproc. (ms)", "infer (ms)");
+    for (int c = 0; c < CONFIGURATIONS; c++)
+    {
+        const struct configuration *configuration = &configurations[c];
+        printf("%-10s %-15s %-5s %-8s", configuration->strategy, configuration->opt_level, configuration->simd,
+               configuration->relaxed_simd);
+        fflush(stdout);
+        if (strcmp(configuration->simd, "off") == 0 && options.scalar_module == NULL)
+        {
+            printf(" skipped, needs --scalar-module\n");
+            continue;
+        }
+
+        // Every configuration compiles into a cache of its own, emptied so that the first run is cold
+        char cache_dir[PATH_MAX];
+        char command[PATH_MAX + 16];
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%d", CACHE_DIR, c);
+        snprintf(command, sizeof(command), "rm -rf %s", cache_dir);
+        system(command);
+
+        struct sample cold;
+        int failed = run_host(&options, configuration, cache_dir, NULL, NULL);
+        collect_records(records_path, &cold);
+        for (int i = 0; i < options.number_iterations && failed == 0; i++)
+        {
+            struct sample warm;
+            failed = run_host(&options, configuration, cache_dir, NULL, NULL);
+            collect_records(records_path, &warm);
+            instantiate_ms[i] = warm.instantiate_ms;
+            preprocess_ms[i] = warm.preprocess_ms;
+            inference_ms[i] = warm.inference_ms;
+        }
+        if (failed != 0)
+        {
+            printf(" failed, rerun the host with these options to see why\n");
+            continue;
+        }
+
+        double artifact_kib = cold.artifact_bytes < 0.0 ? -1.0 : cold.artifact_bytes / 1024.0;
+        double instantiate = median(instantiate_ms, options.number_iterations);
+        double preprocess = median(preprocess_ms, options.number_iterations);
+        double inference = median(inference_ms, options.number_iterations);
+        print_value(cold.compile_ms, 3);
+        print_value(artifact_kib, 1);
+        print_value(instantiate, 3);
+        print_value(preprocess, 3);
+        print_value(inference, 3);
+        printf("\n");
+        if (results != NULL)
+        {
+            fprintf(results, "{\"strategy\":\"%s\",\"opt_level\":\"%s\",\"simd\":\"%s\",\"relaxed_simd\":\"%s\"",
+                    configuration->strategy, configuration->opt_level, configuration->simd,
+                    configuration->relaxed_simd);
+            print_json_value(results, "compile_ms", cold.compile_ms, 3);
+            print_json_value(results, "artifact_bytes", cold.artifact_bytes, 0);
+            print_json_value(results, "instantiate_ms", instantiate, 3);
+            print_json_value(results, "preprocess_ms", preprocess, 3);
+            print_json_value(results, "inference_ms", inference, 3);
+            fprintf(results, "}\n");
+        }
+    }
+    printf("================================================================\n");
+
+    if (options.changed_module != NULL)
+    {
+        compile_caches(&options, records_path, results);
+    }
+
+    free(instantiate_ms);
+    free(preprocess_ms);
+    free(inference_ms);
+    if (results != NULL)
+    {
+        fclose(results);
+        printf("Results written to: %s\n", options.results_path);
+    }
+    return 0;
+}
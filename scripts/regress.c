@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+/*
+    Regression check: compare a baseline and a candidate results file step by step and fail on significant slowdowns.
+
+    1-) Read two results files written by benchmark --results: the guest's operation, phase and total records
+        (wall_clock_us) and the harness' process records (wall_ms), one sample per iteration and step; with
+        --kinds request, the latency of the requests of benchmark --concurrency (latency_ms), one sample per request
+    2-) For every step in both files compare the candidate's samples with the baseline's: the change of the median,
+        a bootstrap confidence interval of that change, and a two-sided Mann-Whitney U test
+    3-) A step regressed when the test is significant (p < --alpha) and the change of the median exceeds --threshold;
+        it improved under the same conditions the other way round
+    4-) Print one row per step and exit with 1 if any step regressed, so a CI job fails on it
+
+    usage: regress [options] <baseline results> <candidate results>
+
+    Options:
+        --threshold <percent>   smallest slowdown of the median that counts as a regression (default: 5)
+        --alpha <p>             significance level of the Mann-Whitney U test (default: 0.05)
+        --confidence <percent>  level of the bootstrap confidence interval (default: 95)
+        --resamples <n>         bootstrap resamples per step (default: 2000)
+        --kinds <list>          comma separated record kinds to compare (default: operation,phase,total,process)
+
+    The U test uses the normal approximation with a tie correction, which wants at least 8 samples per side;
+    steps with fewer are compared but never flagged.
+
+    Compile with: gcc -O2 -o regress regress.c -lm
+*/
+
+#define MAX_RECORD_LENGTH 4096
+#define MAX_STEPS 64
+#define MAX_FIELD 64
+#define MIN_SAMPLES 8
+#define SIDES 2
+
+const char *side_names[SIDES] = {"baseline", "candidate"};
+
+struct options
+{
+    double threshold_percent;
+    double alpha;
+    double confidence_percent;
+    int resamples;
+    char kinds[256];
+    const char *paths[SIDES];
+};
+
+// The wall clock of one step in every iteration of both files
+struct step
+{
+    char kind[MAX_FIELD];
+    char name[MAX_FIELD];
+    double *wall_ms[SIDES];
+    int count[SIDES];
+    int capacity[SIDES];
+    // Iteration and instance of the last sample, to add up a step recorded more than once in one run
+    int last_run[SIDES];
+};
+
+struct step steps[MAX_STEPS];
+int step_count = 0;
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./regress [--threshold <percent>] [--alpha <p>] [--confidence <percent>] "
+           "[--resamples <n>] [--kinds <list>] <baseline results> <candidate results>\n");
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    int i = 1;
+    options->threshold_percent = 5.0;
+    options->alpha = 0.05;
+    options->confidence_percent = 95.0;
+    options->resamples = 2000;
+    snprintf(options->kinds, sizeof(options->kinds), "operation,phase,total,process");
+
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "--threshold") == 0)
+        {
+            options->threshold_percent = atof(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--alpha") == 0)
+        {
+            options->alpha = atof(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--confidence") == 0)
+        {
+            options->confidence_percent = atof(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--resamples") == 0)
+        {
+            options->resamples = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--kinds") == 0)
+        {
+            snprintf(options->kinds, sizeof(options->kinds), "%s", argv[i + 1]);
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        i += 2;
+    }
+
+    if (argc - i != SIDES)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    options->paths[0] = argv[i];
+    options->paths[1] = argv[i + 1];
+    if (options->threshold_percent < 0.0 || options->alpha <= 0.0 || options->alpha >= 1.0 ||
+        options->confidence_percent <= 0.0 || options->confidence_percent >= 100.0 || options->resamples <= 0)
+    {
+        printf("Error parsing, threshold, alpha, confidence or resamples out of range\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Whether kind is one of the comma separated kinds
+int wanted_kind(const struct options *options, const char *kind)
+{
+    size_t length = strlen(kind);
+    for (const char *start = options->kinds; *start != '\0';)
+    {
+        const char *end = strchr(start, ',');
+        size_t item = end != NULL ? (size_t)(end - start) : strlen(start);
+        if (item == length && strncmp(start, kind, length) == 0)
+        {
+            return 1;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        start = end + 1;
+    }
+    return 0;
+}
+
+// Copy the string value of "field":"..." in record into value
+int string_field(const char *record, const char *field, char *value, size_t size)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    start += strlen(key);
+    const char *end = strchr(start, '"');
+    if (end == NULL || (size_t)(end - start) >= size)
+    {
+        return -1;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 0;
+}
+
+int number_field(const char *record, const char *field, double *value)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    *value = strtod(start + strlen(key), NULL);
+    return 0;
+}
+
+struct step *find_step(const char *kind, const char *name)
+{
+    for (int i = 0; i < step_count; i++)
+    {
+        if (strcmp(steps[i].kind, kind) == 0 && strcmp(steps[i].name, name) == 0)
+        {
+            return &steps[i];
+        }
+    }
+    if (step_count == MAX_STEPS)
+    {
+        return NULL;
+    }
+    struct step *step = &steps[step_count++];
+    memset(step, 0, sizeof(*step));
+    snprintf(step->kind, sizeof(step->kind), "%s", kind);
+    snprintf(step->name, sizeof(step->name), "%s", name);
+    step->last_run[0] = -1;
+    step->last_run[1] = -1;
+    return step;
+}
+
+void add_sample(struct step *step, int side, double wall_ms)
+{
+    if (step->count[side] == step->capacity[side])
+    {
+        step->capacity[side] = step->capacity[side] == 0 ? 64 : step->capacity[side] * 2;
+        step->wall_ms[side] = realloc(step->wall_ms[side], sizeof(double) * step->capacity[side]);
+        if (step->wall_ms[side] == NULL)
+        {
+            printf("Error allocating memory for %d samples\n", step->capacity[side]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    step->wall_ms[side][step->count[side]++] = wall_ms;
+}
+
+// Read every wanted record of one results file; a step recorded more than once per run adds up
+void read_results(const struct options *options, int side)
+{
+    FILE *records = fopen(options->paths[side], "r");
+    if (records == NULL)
+    {
+        printf("Error opening %s results %s: %s\n", side_names[side], options->paths[side], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char line[MAX_RECORD_LENGTH];
+    while (fgets(line, sizeof(line), records) != NULL)
+    {
+        char kind[MAX_FIELD], name[MAX_FIELD];
+        double wall_ms, iteration = -1.0, instance = 0.0;
+        if (string_field(line, "kind", kind, sizeof(kind)) != 0 || !wanted_kind(options, kind))
+        {
+            continue;
+        }
+        // Instances that ran side by side (benchmark --instances) are runs of their own
+        number_field(line, "iteration", &iteration);
+        number_field(line, "instance", &instance);
+        int run = iteration >= 0.0 ? (int)iteration * 1024 + (int)instance : -1;
+        if (strcmp(kind, "process") == 0)
+        {
+            // The harness' own record of the whole process
+            snprintf(name, sizeof(name), "wall clock");
+            if (number_field(line, "wall_ms", &wall_ms) != 0)
+            {
+                continue;
+            }
+        }
+        else if (strcmp(kind, "request") == 0)
+        {
+            // A request of benchmark --concurrency, from its arrival on
+            snprintf(name, sizeof(name), "request latency");
+            if (number_field(line, "latency_ms", &wall_ms) != 0)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            double wall_us;
+            if (string_field(line, "name", name, sizeof(name)) != 0 || number_field(line, "wall_clock_us", &wall_us) != 0)
+            {
+                continue;
+            }
+            wall_ms = wall_us / 1e3;
+        }
+
+        struct step *step = find_step(kind, name);
+        if (step == NULL)
+        {
+            continue;
+        }
+        if (run >= 0 && run == step->last_run[side])
+        {
+            step->wall_ms[side][step->count[side] - 1] += wall_ms;
+        }
+        else
+        {
+            add_sample(step, side, wall_ms);
+            step->last_run[side] = run;
+        }
+    }
+    fclose(records);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The median of an already sorted array
+double sorted_median(const double *sorted, int count)
+{
+    return count % 2 == 1 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0;
+}
+
+double median(const double *values, int count, double *scratch)
+{
+    memcpy(scratch, values, sizeof(double) * count);
+    qsort(scratch, count, sizeof(double), compare_doubles);
+    return sorted_median(scratch, count);
+}
+
+// xorshift64*, seeded the same way every run so a comparison is reproducible
+uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+void resample(const double *values, int count, double *resampled)
+{
+    for (int i = 0; i < count; i++)
+    {
+        resampled[i] = values[next_random() % (uint64_t)count];
+    }
+}
+
+// Percentile bootstrap interval of the relative change of the median, candidate over baseline, in percent
+void bootstrap_change(const struct options *options, const struct step *step, double *low, double *high)
+{
+    int largest = step->count[0] > step->count[1] ? step->count[0] : step->count[1];
+    double *resampled = malloc(sizeof(double) * largest);
+    double *scratch = malloc(sizeof(double) * largest);
+    double *changes = malloc(sizeof(double) * options->resamples);
+    if (resampled == NULL || scratch == NULL || changes == NULL)
+    {
+        printf("Error allocating memory for %d resamples\n", options->resamples);
+        exit(EXIT_FAILURE);
+    }
+
+    int valid = 0;
+    for (int r = 0; r < options->resamples; r++)
+    {
+        resample(step->wall_ms[0], step->count[0], resampled);
+        double baseline = median(resampled, step->count[0], scratch);
+        resample(step->wall_ms[1], step->count[1], resampled);
+        double candidate = median(resampled, step->count[1], scratch);
+        if (baseline > 0.0)
+        {
+            changes[valid++] = (candidate / baseline - 1.0) * 100.0;
+        }
+    }
+    *low = 0.0;
+    *high = 0.0;
+    if (valid > 0)
+    {
+        qsort(changes, valid, sizeof(double), compare_doubles);
+        double tail = (100.0 - options->confidence_percent) / 200.0;
+        *low = changes[(int)floor(tail * (valid - 1))];
+        *high = changes[(int)ceil((1.0 - tail) * (valid - 1))];
+    }
+    free(resampled);
+    free(scratch);
+    free(changes);
+}
+
+struct ranked
+{
+    double value;
+    int side;
+};
+
+int compare_ranked(const void *a, const void *b)
+{
+    return compare_doubles(&((const struct ranked *)a)->value, &((const struct ranked *)b)->value);
+}
+
+// Two-sided p-value of the Mann-Whitney U test, normal approximation with tie and continuity corrections
+double mann_whitney_p(const struct step *step)
+{
+    int n1 = step->count[0];
+    int n2 = step->count[1];
+    int n = n1 + n2;
+    struct ranked *all = malloc(sizeof(struct ranked) * n);
+    if (all == NULL)
+    {
+        printf("Error allocating memory for %d samples\n", n);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n1; i++)
+    {
+        all[i].value = step->wall_ms[0][i];
+        all[i].side = 0;
+    }
+    for (int i = 0; i < n2; i++)
+    {
+        all[n1 + i].value = step->wall_ms[1][i];
+        all[n1 + i].side = 1;
+    }
+    qsort(all, n, sizeof(struct ranked), compare_ranked);
+
+    // Tied values share the average of their ranks
+    double baseline_ranks = 0.0;
+    double ties = 0.0;
+    for (int i = 0; i < n;)
+    {
+        int j = i;
+        while (j + 1 < n && all[j + 1].value == all[i].value)
+        {
+            j++;
+        }
+        double rank = (i + j) / 2.0 + 1.0;
+        for (int k = i; k <= j; k++)
+        {
+            if (all[k].side == 0)
+            {
+                baseline_ranks += rank;
+            }
+        }
+        double tied = j - i + 1;
+        ties += tied * tied * tied - tied;
+        i = j + 1;
+    }
+    free(all);
+
+    double u = baseline_ranks - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * (double)n2 / 2.0;
+    double variance = n1 * (double)n2 / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (variance <= 0.0)
+    {
+        return 1.0;
+    }
+    double distance = fabs(u - mean) - 0.5;
+    double z = (distance > 0.0 ? distance : 0.0) / sqrt(variance);
+    return erfc(z / sqrt(2.0));
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options;
+    parse_args(argc, argv, &options);
+    for (int side = 0; side < SIDES; side++)
+    {
+        read_results(&options, side);
+    }
+
+    int regressions = 0;
+    printf("\n============= Regression check: %s vs %s =============\n", options.paths[1], options.paths[0]);
+    printf("%-10s %-20s %5s %5s %12s %12s %9s %19s %9s  %s\n", "Kind", "Step", "n0", "n1", "base (ms)", "cand (ms)",
+           "change", "CI", "p", "verdict");
+    for (int i = 0; i < step_count; i++)
+    {
+        struct step *step = &steps[i];
+        if (step->count[0] == 0 || step->count[1] == 0)
+        {
+            printf("%-10s %-20s %5d %5d only in the %s\n", step->kind, step->name, step->count[0], step->count[1],
+                   step->count[0] == 0 ? side_names[1] : side_names[0]);
+            continue;
+        }
+
+        int largest = step->count[0] > step->count[1] ? step->count[0] : step->count[1];
+        double *scratch = malloc(sizeof(double) * largest);
+        if (scratch == NULL)
+        {
+            printf("Error allocating memory for statistics\n");
+            return EXIT_FAILURE;
+        }
+        double baseline = median(step->wall_ms[0], step->count[0], scratch);
+        double candidate = median(step->wall_ms[1], step->count[1], scratch);
+        free(scratch);
+        double change = baseline > 0.0 ? (candidate / baseline - 1.0) * 100.0 : 0.0;
+        double low, high;
+        bootstrap_change(&options, step, &low, &high);
+        double p = mann_whitney_p(step);
+
+        const char *verdict = "same";
+        if (step->count[0] < MIN_SAMPLES || step->count[1] < MIN_SAMPLES)
+        {
+            verdict = "too few samples";
+        }
+        else if (p < options.alpha && change > options.threshold_percent)
+        {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        else if (p < options.alpha && change < -options.threshold_percent)
+        {
+            verdict = "improvement";
+        }
+        char interval[32];
+        snprintf(interval, sizeof(interval), "[%+.1f%%, %+.1f%%]", low, high);
+        printf("%-10s %-20s %5d %5d %12.3f %12.3f %+8.1f%% %19s %9.4f  %s\n", step->kind, step->name, step->count[0],
+               step->count[1], baseline, candidate, change, interval, p, verdict);
+    }
+    printf("================================================================\n");
+    printf("%d step(s) regressed by more than %.1f%% (alpha %.3f, %.0f%% bootstrap intervals of %d resamples)\n",
+           regressions, options.threshold_percent, options.alpha, options.confidence_percent, options.resamples);
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+    Benchmark suite: a matrix of models, inputs, batch sizes and thread counts from one suite file, run on this node.
+
+    1-) Read the suite file (default: suite.toml), a flat TOML subset of integers, strings and one-line arrays:
+            iterations = 5                              measured runs per configuration
+            warmup = 1                                  runs per configuration before the measured ones
+            models = ["/assets/models/mobilenetv2-10.onnx"]
+                                                        guest paths; a .xml model runs on the openvino backend
+            inputs = ["assets/imgs/unseen_dog.jpg", "assets/imgs"]
+                                                        host paths in assets/imgs: an image runs main on it, a
+                                                        directory runs batch mode over every image in it
+            batch_sizes = [1, 8]                        images per batch, for directory inputs
+            threads = [1, 4]                            ONNX Runtime intra-op threads (--ort-intra-threads)
+            host_args = ["--pooling", "on"]             passed to every run of the host
+    2-) For every configuration run ./wasmtime-test with --model, --image or --batch-dir/--batch-size and
+        --ort-intra-threads, which the host hands to the guest as WASI environment variables
+    3-) Every run appends the guest's records to a scratch file (WASM_BENCH_RESULTS), which is read back and removed
+    4-) Print one table of all configurations: the median total wall clock of main, the median inference (the
+        Inference operation of an image, the batch operations of a directory) and images per second, headed by the
+        node's host name, CPU model and core count; with --results the same rows are appended as JSON records that
+        carry the node, so the results files of several nodes can be concatenated and compared like for like
+
+    usage: suite [options] <wasm module>
+
+    Options:
+        --suite <file>          the suite file (default: suite.toml)
+        --host <path>           the host binary (default: ./wasmtime-test)
+        --results <file>        append one JSON record per configuration
+
+    Compile with: gcc -O2 -o suite suite.c
+*/
+
+#define RESULTS_ENV "WASM_BENCH_RESULTS"
+#define MAX_RECORD_LENGTH 4096
+#define MAX_LINE 1024
+#define MAX_ITEMS 16
+#define MAX_FIELD 64
+#define MAX_HOST_ARGS 32
+
+struct options
+{
+    char suite_path[PATH_MAX];
+    const char *host;
+    const char *wasm_module;
+    char results_path[PATH_MAX];
+};
+
+struct list
+{
+    char *items[MAX_ITEMS];
+    int count;
+};
+
+struct suite
+{
+    int number_iterations;
+    int warmup_iterations;
+    struct list models;
+    struct list inputs;
+    struct list batch_sizes;
+    struct list threads;
+    struct list host_args;
+};
+
+// Where the results of a configuration can be told apart from another node's
+struct node
+{
+    char host_name[256];
+    char cpu[256];
+    long cores;
+};
+
+// What one run recorded; a value the run did not record is negative
+struct sample
+{
+    double total_ms;
+    double inference_ms;
+};
+
+void print_usage(void)
+{
+    printf("Error parsing, usage: ./suite [--suite <file>] [--host <path>] [--results <file>] <wasm module>\n");
+}
+
+void resolve_path(const char *path, char *resolved, size_t size)
+{
+    char current_path[PATH_MAX];
+    if (path[0] == '/' || getcwd(current_path, sizeof(current_path)) == NULL)
+    {
+        snprintf(resolved, size, "%s", path);
+    }
+    else if ((size_t)snprintf(resolved, size, "%s/%s", current_path, path) >= size)
+    {
+        printf("Error parsing, path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_args(int argc, char *argv[], struct options *options)
+{
+    int i = 1;
+    resolve_path("suite.toml", options->suite_path, sizeof(options->suite_path));
+    options->host = "./wasmtime-test";
+    options->results_path[0] = '\0';
+
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "--suite") == 0)
+        {
+            resolve_path(argv[i + 1], options->suite_path, sizeof(options->suite_path));
+        }
+        else if (strcmp(argv[i], "--host") == 0)
+        {
+            options->host = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--results") == 0)
+        {
+            // The results file is relative to where suite was started, not to ./binaries
+            resolve_path(argv[i + 1], options->results_path, sizeof(options->results_path));
+        }
+        else
+        {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        i += 2;
+    }
+
+    if (argc - i != 1)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    options->wasm_module = argv[i];
+}
+
+char *trim(char *text)
+{
+    while (isspace((unsigned char)*text))
+    {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+    return text;
+}
+
+// Parse a one-line array of integers or double-quoted strings, e.g. ["a", "b"] or [1, 4]
+int parse_list(char *value, struct list *list)
+{
+    size_t length = strlen(value);
+    if (length < 2 || value[0] != '[' || value[length - 1] != ']')
+    {
+        return -1;
+    }
+    value[length - 1] = '\0';
+    list->count = 0;
+    for (char *item = strtok(value + 1, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        item = trim(item);
+        size_t item_length = strlen(item);
+        if (item_length == 0)
+        {
+            continue;
+        }
+        if (list->count == MAX_ITEMS)
+        {
+            return -1;
+        }
+        if (item[0] == '"')
+        {
+            if (item_length < 2 || item[item_length - 1] != '"')
+            {
+                return -1;
+            }
+            item[item_length - 1] = '\0';
+            item++;
+        }
+        list->items[list->count++] = strdup(item);
+    }
+    return 0;
+}
+
+void read_suite(const char *path, struct suite *suite)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printf("Error opening suite file %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    memset(suite, 0, sizeof(*suite));
+    suite->number_iterations = 5;
+    suite->warmup_iterations = 1;
+
+    char line[MAX_LINE];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        // A '#' outside a string starts a comment
+        int quoted = 0;
+        for (char *c = line; *c != '\0'; c++)
+        {
+            if (*c == '"')
+            {
+                quoted = !quoted;
+            }
+            else if (*c == '#' && !quoted)
+            {
+                *c = '\0';
+                break;
+            }
+        }
+        char *text = trim(line);
+        if (text[0] == '\0')
+        {
+            continue;
+        }
+        char *equals = strchr(text, '=');
+        if (equals == NULL)
+        {
+            printf("Error parsing %s:%d: expected key = value\n", path, line_number);
+            exit(EXIT_FAILURE);
+        }
+        *equals = '\0';
+        char *key = trim(text);
+        char *value = trim(equals + 1);
+
+        int result = 0;
+        if (strcmp(key, "iterations") == 0)
+        {
+            suite->number_iterations = atoi(value);
+        }
+        else if (strcmp(key, "warmup") == 0)
+        {
+            suite->warmup_iterations = atoi(value);
+        }
+        else if (strcmp(key, "models") == 0)
+        {
+            result = parse_list(value, &suite->models);
+        }
+        else if (strcmp(key, "inputs") == 0)
+        {
+            result = parse_list(value, &suite->inputs);
+        }
+        else if (strcmp(key, "batch_sizes") == 0)
+        {
+            result = parse_list(value, &suite->batch_sizes);
+        }
+        else if (strcmp(key, "threads") == 0)
+        {
+            result = parse_list(value, &suite->threads);
+        }
+        else if (strcmp(key, "host_args") == 0)
+        {
+            result = parse_list(value, &suite->host_args);
+        }
+        else
+        {
+            printf("Error parsing %s:%d: unknown key %s\n", path, line_number, key);
+            exit(EXIT_FAILURE);
+        }
+        if (result != 0)
+        {
+            printf("Error parsing %s:%d: %s needs a one-line array of at most %d items\n", path, line_number, key,
+                   MAX_ITEMS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file);
+
+    if (suite->number_iterations <= 0 || suite->warmup_iterations < 0)
+    {
+        printf("Error parsing %s: the number of iterations must be positive\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (suite->models.count == 0 || suite->inputs.count == 0)
+    {
+        printf("Error parsing %s: the suite needs models and inputs\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // Without batch sizes or thread counts every configuration runs with the host's defaults
+    if (suite->batch_sizes.count == 0)
+    {
+        suite->batch_sizes.items[suite->batch_sizes.count++] = "8";
+    }
+    if (suite->threads.count == 0)
+    {
+        suite->threads.items[suite->threads.count++] = "0";
+    }
+}
+
+void read_node(struct node *node)
+{
+    if (gethostname(node->host_name, sizeof(node->host_name)) != 0)
+    {
+        snprintf(node->host_name, sizeof(node->host_name), "unknown");
+    }
+    node->host_name[sizeof(node->host_name) - 1] = '\0';
+    node->cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    snprintf(node->cpu, sizeof(node->cpu), "unknown");
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo == NULL)
+    {
+        return;
+    }
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), cpuinfo) != NULL)
+    {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL)
+        {
+            snprintf(node->cpu, sizeof(node->cpu), "%s", trim(colon + 1));
+            break;
+        }
+    }
+    fclose(cpuinfo);
+}
+
+void change_dir(char *dir_path)
+{
+    if (chdir(dir_path) != 0)
+    {
+        printf("Error changing directory to %s: %s\n", dir_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int is_directory(const char *path)
+{
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// The images batch mode classifies in dir: its .jpg, .jpeg and .png files
+int count_images(const char *dir)
+{
+    DIR *entries = opendir(dir);
+    if (entries == NULL)
+    {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(entries)) != NULL)
+    {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (extension != NULL &&
+            (strcasecmp(extension, ".jpg") == 0 || strcasecmp(extension, ".jpeg") == 0 ||
+             strcasecmp(extension, ".png") == 0))
+        {
+            count++;
+        }
+    }
+    closedir(entries);
+    return count;
+}
+
+int ends_with(const char *text, const char *suffix)
+{
+    size_t length = strlen(text);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(text + length - suffix_length, suffix) == 0;
+}
+
+// Run the host once on model and input; batch_size is only used for a directory input. Returns 0 if it succeeded
+int run_host(const struct options *options, const struct suite *suite, const char *model, const char *input,
+             const char *batch_size, const char *threads)
+{
+    char guest_dir[PATH_MAX];
+    char *argv[16 + MAX_HOST_ARGS];
+    int argc = 0;
+    argv[argc++] = (char *)options->host;
+    argv[argc++] = "--model";
+    argv[argc++] = (char *)model;
+    if (ends_with(model, ".xml"))
+    {
+        argv[argc++] = "--backend";
+        argv[argc++] = "openvino";
+    }
+    if (is_directory(input))
+    {
+        // The guest sees assets/imgs at /assets/imgs
+        snprintf(guest_dir, sizeof(guest_dir), "/%s", input);
+        argv[argc++] = "--batch-dir";
+        argv[argc++] = guest_dir;
+        argv[argc++] = "--batch-size";
+        argv[argc++] = (char *)batch_size;
+    }
+    else
+    {
+        argv[argc++] = "--image";
+        argv[argc++] = (char *)input;
+    }
+    if (strcmp(threads, "0") != 0)
+    {
+        argv[argc++] = "--ort-intra-threads";
+        argv[argc++] = (char *)threads;
+    }
+    for (int i = 0; i < suite->host_args.count && i < MAX_HOST_ARGS; i++)
+    {
+        argv[argc++] = suite->host_args.items[i];
+    }
+    argv[argc++] = (char *)options->wasm_module;
+    argv[argc] = NULL;
+
+    // The host's output is not part of the suite, its errors are
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        printf("Error running %s: fork failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "execvp %s failed: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        printf("Error running %s: waitpid failed: %s\n", options->host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Copy the string value of "field":"..." in record into value
+int string_field(const char *record, const char *field, char *value, size_t size)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    start += strlen(key);
+    const char *end = strchr(start, '"');
+    if (end == NULL || (size_t)(end - start) >= size)
+    {
+        return -1;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 0;
+}
+
+int number_field(const char *record, const char *field, double *value)
+{
+    char key[MAX_FIELD + 4];
+    snprintf(key, sizeof(key), "\"%s\":", field);
+    const char *start = strstr(record, key);
+    if (start == NULL)
+    {
+        return -1;
+    }
+    *value = strtod(start + strlen(key), NULL);
+    return 0;
+}
+
+// Read the records of one run into sample and remove the scratch file
+void collect_records(const char *path, struct sample *sample)
+{
+    sample->total_ms = -1.0;
+    sample->inference_ms = -1.0;
+
+    FILE *records = fopen(path, "r");
+    if (records == NULL)
+    {
+        return;
+    }
+    char line[MAX_RECORD_LENGTH];
+    while (fgets(line, sizeof(line), records) != NULL)
+    {
+        char kind[MAX_FIELD], name[MAX_FIELD];
+        double wall_us;
+        if (string_field(line, "kind", kind, sizeof(kind)) != 0 || string_field(line, "name", name, sizeof(name)) != 0 ||
+            number_field(line, "wall_clock_us", &wall_us) != 0)
+        {
+            continue;
+        }
+        if (strcmp(kind, "total") == 0)
+        {
+            sample->total_ms = wall_us / 1e3;
+        }
+        else if (strcmp(kind, "operation") == 0 && (strcmp(name, "Inference") == 0 || strncmp(name, "batch-", 6) == 0))
+        {
+            sample->inference_ms = (sample->inference_ms < 0.0 ? 0.0 : sample->inference_ms) + wall_us / 1e3;
+        }
+    }
+    fclose(records);
+    remove(path);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The median of the values that were recorded, or -1 if none was
+double median(const double *values, int count)
+{
+    double *sorted = malloc(sizeof(double) * count);
+    if (sorted == NULL)
+    {
+        printf("Error allocating memory for statistics\n");
+        exit(EXIT_FAILURE);
+    }
+    int recorded = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (values[i] >= 0.0)
+        {
+            sorted[recorded++] = values[i];
+        }
+    }
+    double result = -1.0;
+    if (recorded > 0)
+    {
+        qsort(sorted, recorded, sizeof(double), compare_doubles);
+        result = recorded % 2 == 1 ? sorted[recorded / 2] : (sorted[recorded / 2 - 1] + sorted[recorded / 2]) / 2.0;
+    }
+    free(sorted);
+    return result;
+}
+
+// Print a recorded value, or "-" for a missing one
+void print_value(double value, int precision)
+{
+    if (value < 0.0)
+    {
+        printf(" %12s", "-");
+    }
+    else
+    {
+        printf(" %12.*f", precision, value);
+    }
+}
+
+void print_json_value(FILE *results, const char *field, double value, int precision)
+{
+    if (value < 0.0)
+    {
+        fprintf(results, ",\"%s\":null", field);
+    }
+    else
+    {
+        fprintf(results, ",\"%s\":%.*f", field, precision, value);
+    }
+}
+
+// Print JSON string contents, escaping what a CPU or host name could contain
+void print_json_string(FILE *results, const char *value)
+{
+    for (const char *c = value; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fputc('\\', results);
+        }
+        if ((unsigned char)*c >= 0x20)
+        {
+            fputc(*c, results);
+        }
+    }
+}
+
+// Run every measured iteration of one configuration and print its row
+void run_configuration(const struct options *options, const struct suite *suite, const struct node *node,
+                       const char *records_path, const char *model, const char *input, const char *batch_size,
+                       const char *threads, FILE *results)
+{
+    int directory = is_directory(input);
+    const char *model_name = strrchr(model, '/') != NULL ? strrchr(model, '/') + 1 : model;
+    printf("%-24s %-28s %6s %8s", model_name, input, directory ? batch_size : "-",
+           strcmp(threads, "0") == 0 ? "default" : threads);
+    fflush(stdout);
+
+    double *total_ms = malloc(sizeof(double) * suite->number_iterations);
+    double *inference_ms = malloc(sizeof(double) * suite->number_iterations);
+    if (total_ms == NULL || inference_ms == NULL)
+    {
+        printf("Error allocating memory for %d samples\n", suite->number_iterations);
+        exit(EXIT_FAILURE);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < suite->warmup_iterations && failed == 0; i++)
+    {
+        failed = run_host(options, suite, model, input, batch_size, threads);
+        remove(records_path);
+    }
+    for (int i = 0; i < suite->number_iterations && failed == 0; i++)
+    {
+        struct sample sample;
+        failed = run_host(options, suite, model, input, batch_size, threads);
+        collect_records(records_path, &sample);
+        total_ms[i] = sample.total_ms;
+        inference_ms[i] = sample.inference_ms;
+    }
+    if (failed != 0)
+    {
+        printf(" failed, rerun the host with these options to see why\n");
+        free(total_ms);
+        free(inference_ms);
+        return;
+    }
+
+    double total = median(total_ms, suite->number_iterations);
+    double inference = median(inference_ms, suite->number_iterations);
+    int images = directory ? count_images(input) : 1;
+    double images_per_second = inference > 0.0 ? images * 1e3 / inference : -1.0;
+    print_value(total, 3);
+    print_value(inference, 3);
+    print_value(images_per_second, 1);
+    printf("\n");
+
+    if (results != NULL)
+    {
+        fprintf(results, "{\"node\":\"");
+        print_json_string(results, node->host_name);
+        fprintf(results, "\",\"cpu\":\"");
+        print_json_string(results, node->cpu);
+        fprintf(results, "\",\"cores\":%ld,\"model\":\"", node->cores);
+        print_json_string(results, model);
+        fprintf(results, "\",\"input\":\"");
+        print_json_string(results, input);
+        fprintf(results, "\",\"batch_size\":%s,\"threads\":%s,\"iterations\":%d", directory ? batch_size : "1",
+                threads, suite->number_iterations);
+        print_json_value(results, "total_ms", total, 3);
+        print_json_value(results, "inference_ms", inference, 3);
+        print_json_value(results, "images_per_second", images_per_second, 1);
+        fprintf(results, "}\n");
+    }
+    free(total_ms);
+    free(inference_ms);
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options;
+    parse_args(argc, argv, &options);
+    struct suite suite;
+    read_suite(options.suite_path, &suite);
+    struct node node;
+    read_node(&node);
+
+    FILE *results = NULL;
+    if (options.results_path[0] != '\0')
+    {
+        // Appended to, so the runs of several nodes or days can share one file
+        results = fopen(options.results_path, "a");
+        if (results == NULL)
+        {
+            printf("Error opening results file %s: %s\n", options.results_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    change_dir("./binaries");
+    char records_path[PATH_MAX];
+    resolve_path("suite-records.jsonl", records_path, sizeof(records_path));
+    remove(records_path);
+    setenv(RESULTS_ENV, records_path, 1);
+
+    printf("\n============= Suite %s (median of %d runs) =============\n", options.suite_path,
+           suite.number_iterations);
+    printf("Node: %s, CPU: %s, %ld cores\n", node.host_name, node.cpu, node.cores);
+    printf("%-24s %-28s %6s %8s %12s %12s %12s\n", "Model", "Input", "Batch", "Threads", "total (ms)", "infer (ms)",
+           "images/s");
+    for (int m = 0; m < suite.models.count; m++)
+    {
+        for (int n = 0; n < suite.inputs.count; n++)
+        {
+            const char *input = suite.inputs.items[n];
+            // Batch sizes only apply to directories of images
+            int batch_count = is_directory(input) ? suite.batch_sizes.count : 1;
+            for (int b = 0; b < batch_count; b++)
+            {
+                for (int t = 0; t < suite.threads.count; t++)
+                {
+                    run_configuration(&options, &suite, &node, records_path, suite.models.items[m], input,
+                                      suite.batch_sizes.items[b], suite.threads.items[t], results);
+                }
+            }
+        }
+    }
+    printf("================================================================\n");
+
+    if (results != NULL)
+    {
+        fclose(results);
+        printf("Results appended to: %s\n", options.results_path);
+    }
+    return 0;
+}
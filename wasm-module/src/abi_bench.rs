@@ -0,0 +1,122 @@
+//! Per-call timing of the wasi-nn ABI, set by the host as NN_ABI_BENCH=<n>
+//! (`--abi-bench`). The witx build (`main.rs`) and the component build
+//! (`bin/nn-component.rs`) run the calls of one inference `n` times each and
+//! report every call on its own, so the two ABIs compare call by call.
+//!
+//! `get_output_size` moves no data: it is the cost of a hostcall. `set_input`
+//! adds the 588 KiB input crossing into the host, copied out of linear memory
+//! for witx and lowered as a `list<u8>` for WIT, and `get_output` the 4 KiB of
+//! scores coming back. `compute` is the backend's, the same for both. The
+//! WIT-only `set_input_tensor` sets a `tensor-handle` that stays on the host,
+//! so it pays for the hostcall and not for the copy.
+//!
+//! Shared with the component build through `#[path]`, so it only uses std.
+
+use std::env;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::time::{Duration, Instant};
+
+/// The iterations the host asked for, if any.
+pub fn iterations() -> Option<usize> {
+    env::var("NN_ABI_BENCH")
+        .ok()?
+        .parse()
+        .ok()
+        .filter(|&n| n > 0)
+}
+
+/// The samples of every call, in the order they were first made.
+pub struct AbiBench {
+    abi: &'static str,
+    calls: Vec<(&'static str, Vec<Duration>)>,
+}
+
+impl AbiBench {
+    pub fn new(abi: &'static str) -> Self {
+        Self {
+            abi,
+            calls: Vec::new(),
+        }
+    }
+
+    /// Run `call` and add its time to the samples of `name`.
+    pub fn time<T>(&mut self, name: &'static str, call: impl FnOnce() -> T) -> T {
+        let start = Instant::now();
+        let result = call();
+        let elapsed = start.elapsed();
+        match self.calls.iter_mut().find(|(call, _)| *call == name) {
+            Some((_, samples)) => samples.push(elapsed),
+            None => self.calls.push((name, vec![elapsed])),
+        }
+        result
+    }
+
+    /// Every call's sorted samples.
+    fn sorted(&self) -> impl Iterator<Item = (&'static str, Vec<Duration>)> + '_ {
+        self.calls.iter().map(|(name, samples)| {
+            let mut sorted = samples.clone();
+            sorted.sort();
+            (*name, sorted)
+        })
+    }
+
+    pub fn print(&self) {
+        println!("\n=========== {} ABI calls ===========", self.abi);
+        println!(
+            "{:<18} {:>6} {:>12} {:>12} {:>12} {:>12}",
+            "call", "n", "min", "p50", "p99", "mean"
+        );
+        for (name, sorted) in self.sorted() {
+            let mean = sorted.iter().sum::<Duration>() / sorted.len() as u32;
+            println!(
+                "{:<18} {:>6} {:>12} {:>12} {:>12} {:>12}",
+                name,
+                sorted.len(),
+                format!("{:?}", sorted[0]),
+                format!("{:?}", percentile(&sorted, 50.0)),
+                format!("{:?}", percentile(&sorted, 99.0)),
+                format!("{:?}", mean)
+            );
+        }
+        println!("====================================\n");
+    }
+
+    /// Append one `operation` record per call to `path`, named `<abi>
+    /// <call>` with the median as its `wall_clock_us`.
+    pub fn export_jsonl(&self, path: &str) -> io::Result<()> {
+        let file = fs::OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(path)?;
+        let mut writer = BufWriter::new(file);
+        for (name, sorted) in self.sorted() {
+            writeln!(
+                writer,
+                "{{\"kind\":\"operation\",\"name\":\"{} {}\",\"wall_clock_us\":{:.3},\"p99_us\":{:.3},\"calls\":{}}}",
+                self.abi,
+                name,
+                percentile(&sorted, 50.0).as_secs_f64() * 1e6,
+                percentile(&sorted, 99.0).as_secs_f64() * 1e6,
+                sorted.len()
+            )?;
+        }
+        writer.flush()
+    }
+
+    /// Print the report and append it to BENCH_RESULTS when the host set it.
+    pub fn report(&self) {
+        self.print();
+        if let Ok(results_path) = env::var("BENCH_RESULTS") {
+            if let Err(error) = self.export_jsonl(&results_path) {
+                println!("Error writing results to {}: {}", results_path, error);
+            }
+        }
+    }
+}
+
+/// Nearest-rank percentile of non-empty sorted samples.
+fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    let rank = (p / 100.0 * sorted.len() as f64).ceil() as usize;
+    sorted[rank.clamp(1, sorted.len()) - 1]
+}
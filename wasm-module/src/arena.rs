@@ -0,0 +1,224 @@
+//! Request arena: a bump allocator for the temporaries of one request.
+//!
+//! A request decodes an image, resizes it and normalizes it, and every step
+//! allocates: the decoder's buffers, the decoded `DynamicImage`, the resized
+//! `ImageBuffer`. Through dlmalloc alone they fragment linear memory, which
+//! keeps growing with `memory.grow` long after the first request. That
+//! matters most in the pooling allocator's fixed-size memory slots.
+//!
+//! Inside `scope`, the global allocator serves this thread's allocations
+//! from one chunk by bumping an offset. Frees inside the chunk are no-ops,
+//! except for the latest allocation, which gives its space back. The offset
+//! goes back to zero when the scope ends. What the chunk cannot hold comes
+//! from dlmalloc as usual, and the chunk is then regrown to what the request
+//! needed. From the second request on a request fits the chunk, so
+//! steady-state requests do not grow memory and the footprint stays flat.
+//!
+//! Nothing allocated in a scope may outlive it, which the `Copy` bound on
+//! its result enforces for the return value. Buffers that are kept between
+//! requests, such as the session's input tensor, must be sized before the
+//! scope. Growing an existing dlmalloc block inside a scope is fine, because
+//! reallocations of blocks outside the chunk stay with dlmalloc.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::ptr;
+
+#[global_allocator]
+static ALLOCATOR: RequestArena = RequestArena;
+
+/// Chunks grow in steps of one wasm page.
+const CHUNK_ALIGN: usize = 64 * 1024;
+
+struct Arena {
+    base: Cell<*mut u8>,
+    capacity: Cell<usize>,
+    used: Cell<usize>,
+    /// Bytes the current scope took from `System` because the chunk was full.
+    overflow: Cell<usize>,
+    /// The most the current scope had in the chunk and `System` at once;
+    /// overflow is never given back, so this is an upper bound.
+    peak: Cell<usize>,
+    active: Cell<bool>,
+}
+
+thread_local! {
+    // Const-initialized and without a destructor, so using it never
+    // allocates, which would recurse into the allocator.
+    static ARENA: Arena = const {
+        Arena {
+            base: Cell::new(ptr::null_mut()),
+            capacity: Cell::new(0),
+            used: Cell::new(0),
+            overflow: Cell::new(0),
+            peak: Cell::new(0),
+            active: Cell::new(false),
+        }
+    };
+}
+
+impl Arena {
+    fn contains(&self, ptr: *mut u8) -> bool {
+        let base = self.base.get() as usize;
+        (base..base + self.capacity.get()).contains(&(ptr as usize))
+    }
+
+    fn note_peak(&self) {
+        let total = self.used.get() + self.overflow.get();
+        self.peak.set(self.peak.get().max(total));
+    }
+
+    /// Bump-allocate `layout`, or null if the chunk is full.
+    fn alloc(&self, layout: Layout) -> *mut u8 {
+        let base = self.base.get() as usize;
+        let start = (base + self.used.get() + layout.align() - 1) & !(layout.align() - 1);
+        let end = start - base + layout.size();
+        if base == 0 || end > self.capacity.get() {
+            self.overflow
+                .set(self.overflow.get() + layout.size() + layout.align());
+            self.note_peak();
+            return ptr::null_mut();
+        }
+        self.used.set(end);
+        self.note_peak();
+        start as *mut u8
+    }
+
+    /// Give space back if `ptr` is the latest allocation.
+    fn release(&self, ptr: *mut u8, size: usize) {
+        let offset = ptr as usize - self.base.get() as usize;
+        if offset + size == self.used.get() {
+            self.used.set(offset);
+        }
+    }
+
+    /// Resize the allocation at `ptr` in place: the latest one as long as
+    /// there is room, any other one only to shrink.
+    fn resize(&self, ptr: *mut u8, size: usize, new_size: usize) -> bool {
+        let offset = ptr as usize - self.base.get() as usize;
+        if offset + size == self.used.get() && offset + new_size <= self.capacity.get() {
+            self.used.set(offset + new_size);
+            self.note_peak();
+            return true;
+        }
+        new_size <= size
+    }
+
+    /// Empty the chunk, first regrowing it if the scope needed more.
+    fn reset(&self) {
+        self.used.set(0);
+        self.overflow.set(0);
+        let peak = self.peak.replace(0);
+        if peak <= self.capacity.get() {
+            return;
+        }
+        let capacity = (peak + CHUNK_ALIGN - 1) & !(CHUNK_ALIGN - 1);
+        // SAFETY: the old chunk came from `System` with this layout, and
+        // nothing in it is alive once its scope has ended.
+        unsafe {
+            if !self.base.get().is_null() {
+                System.dealloc(self.base.get(), chunk_layout(self.capacity.get()));
+            }
+            let base = System.alloc(chunk_layout(capacity));
+            self.base.set(base);
+            self.capacity.set(if base.is_null() { 0 } else { capacity });
+        }
+    }
+}
+
+fn chunk_layout(capacity: usize) -> Layout {
+    Layout::from_size_align(capacity, 16).unwrap()
+}
+
+/// Run `f` with this thread's allocations served from the request arena,
+/// then reset it. A nested scope is part of the outer one.
+pub fn scope<R: Copy>(f: impl FnOnce() -> R) -> R {
+    if ARENA.with(|arena| arena.active.replace(true)) {
+        return f();
+    }
+    let result = f();
+    ARENA.with(|arena| {
+        arena.active.set(false);
+        arena.reset();
+    });
+    result
+}
+
+/// Grow this thread's chunk to at least `capacity` bytes now, rather than at
+/// the end of the first scope that needs them (see `preinit`).
+pub fn reserve(capacity: usize) {
+    ARENA.with(|arena| {
+        if !arena.active.get() {
+            arena.peak.set(capacity);
+            arena.reset();
+        }
+    });
+}
+
+/// Run `f` with the arena set aside, for allocations inside a scope that
+/// have to outlive it.
+pub fn outside<R>(f: impl FnOnce() -> R) -> R {
+    let active = ARENA.with(|arena| arena.active.replace(false));
+    let result = f();
+    ARENA.with(|arena| arena.active.set(active));
+    result
+}
+
+/// `System` with the request arena in front of it, see the module docs.
+struct RequestArena;
+
+unsafe impl GlobalAlloc for RequestArena {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let bumped = ARENA
+            .try_with(|arena| {
+                if arena.active.get() {
+                    arena.alloc(layout)
+                } else {
+                    ptr::null_mut()
+                }
+            })
+            .unwrap_or(ptr::null_mut());
+        if bumped.is_null() {
+            System.alloc(layout)
+        } else {
+            bumped
+        }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        let in_arena = ARENA
+            .try_with(|arena| {
+                let contains = arena.contains(ptr);
+                if contains {
+                    arena.release(ptr, layout.size());
+                }
+                contains
+            })
+            .unwrap_or(false);
+        if !in_arena {
+            System.dealloc(ptr, layout)
+        }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let grown = ARENA.try_with(|arena| {
+            if !arena.contains(ptr) {
+                return None;
+            }
+            Some(arena.resize(ptr, layout.size(), new_size))
+        });
+        match grown {
+            Ok(Some(true)) => ptr,
+            Ok(Some(false)) => {
+                let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+                let new_ptr = self.alloc(new_layout);
+                if !new_ptr.is_null() {
+                    ptr::copy_nonoverlapping(ptr, new_ptr, layout.size());
+                    self.dealloc(ptr, layout);
+                }
+                new_ptr
+            }
+            _ => System.realloc(ptr, layout, new_size),
+        }
+    }
+}
@@ -0,0 +1,170 @@
+//! The component build of the guest, for `wasmtime-test --component on`:
+//! main's classification of NN_IMAGE with NN_MODEL through the WIT wasi-nn
+//! ABI (`wit/wasi-nn.wit` of the vendored crate) instead of witx, and the
+//! WIT side of `abi_bench` with NN_ABI_BENCH.
+//!
+//! It only links WIT imports, so wasm32-wasip2 makes a component of it:
+//! `./build --component` runs
+//! `cargo build --release --target=wasm32-wasip2 --features component --bin nn-component`.
+
+wit_bindgen::generate!({
+    path: "../wasmtime-repo/crates/wasi-nn/wit",
+    world: "ml",
+});
+
+#[path = "../abi_bench.rs"]
+mod abi_bench;
+// Only the RGBA conversion is used here
+#[allow(dead_code)]
+#[path = "../preprocess.rs"]
+mod preprocess;
+
+use std::env;
+use std::error::Error;
+use std::fs;
+use std::path::Path;
+use wasi::nn::errors::Error as NnError;
+use wasi::nn::graph::{self, ExecutionTarget, Graph, GraphEncoding};
+use wasi::nn::inference::{self, GraphExecutionContext};
+use wasi::nn::tensor::{Tensor, TensorHandle, TensorType};
+
+const MODEL_PATH: &str = "/assets/models/mobilenetv2-10.onnx";
+const IMAGE_PATH: &str = "/assets/imgs/unseen_dog.jpg";
+const DIMENSIONS: [u32; 4] = [1, 3, 224, 224];
+
+/// The generated error enum has no `Display`, so name the call that failed.
+fn check<T>(call: &str, result: Result<T, NnError>) -> Result<T, Box<dyn Error>> {
+    result.map_err(|error| format!("{} failed: {:?}", call, error).into())
+}
+
+/// The graph the host preloaded under NN_GRAPH_NAME or the model's stem, as
+/// in main, or else the model files loaded through `load`.
+fn load_model(model_path: &str) -> Result<Graph, Box<dyn Error>> {
+    let name = env::var("NN_GRAPH_NAME").ok().or_else(|| {
+        Path::new(model_path)
+            .file_stem()
+            .map(|stem| stem.to_string_lossy().into_owned())
+    });
+    if let Some(graph) = name.and_then(|name| graph::load_by_name(&name).ok()) {
+        return Ok(graph);
+    }
+
+    let target = match env::var("NN_TARGET").as_deref() {
+        Ok("gpu") => ExecutionTarget::Gpu,
+        Ok("tpu") => ExecutionTarget::Tpu,
+        _ => ExecutionTarget::Cpu,
+    };
+    match env::var("NN_ENCODING").as_deref() {
+        Ok("openvino") => {
+            let weights = Path::new(model_path).with_extension("bin");
+            let builders = [fs::read(model_path)?, fs::read(weights)?];
+            check(
+                "load",
+                graph::load(&builders, GraphEncoding::Openvino, target),
+            )
+        }
+        _ => check(
+            "load",
+            graph::load(&[fs::read(model_path)?], GraphEncoding::Onnx, target),
+        ),
+    }
+}
+
+/// Decode, resize and pre-process the image at `path` like main does.
+fn read_input(path: &str) -> Result<Tensor, Box<dyn Error>> {
+    let image = image::load_from_memory(&fs::read(path)?)?;
+    let resized = image::imageops::resize(&image, 224, 224, image::imageops::FilterType::Triangle);
+    let mut input = vec![0.0f32; 3 * 224 * 224];
+    preprocess::rgba_to_chw(
+        resized.as_raw(),
+        &preprocess::Normalization::default(),
+        &mut input,
+    );
+    Ok(Tensor {
+        dimensions: DIMENSIONS.to_vec(),
+        tensor_type: TensorType::Fp32,
+        data: preprocess::as_bytes(&input).to_vec(),
+    })
+}
+
+/// The best score of output 0 and its 1-based class number.
+fn best_class(output: &[u8]) -> Option<(f32, i32)> {
+    output
+        .chunks_exact(4)
+        .map(|bytes| f32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+        .enumerate()
+        .filter(|(_, score)| !score.is_nan())
+        .max_by(|(_, a), (_, b)| a.total_cmp(b))
+        .map(|(index, score)| (score, index as i32 + 1))
+}
+
+fn classify(context: GraphExecutionContext, input: &Tensor) -> Result<(f32, i32), Box<dyn Error>> {
+    check("set_input", inference::set_input(context, 0, input))?;
+    check("compute", inference::compute(context))?;
+    let output = check("get_output", inference::get_output(context, 0))?;
+    best_class(&output).ok_or_else(|| "Empty output buffer".into())
+}
+
+/// The WIT side of `abi_bench`: the witx calls, plus their `tensor-handle`
+/// variants, each timed `iterations` times.
+fn run_abi_bench(
+    context: GraphExecutionContext,
+    input: &Tensor,
+    iterations: usize,
+) -> Result<(), Box<dyn Error>> {
+    let handle = TensorHandle::new(&input.dimensions, input.tensor_type, &input.data);
+    let mut bench = abi_bench::AbiBench::new("wit");
+    for _ in 0..iterations {
+        check(
+            "set_input",
+            bench.time("set_input", || inference::set_input(context, 0, input)),
+        )?;
+        let set = bench.time("set_input_tensor", || {
+            inference::set_input_tensor(context, 0, &handle)
+        });
+        check("set_input_tensor", set)?;
+        check(
+            "compute",
+            bench.time("compute", || inference::compute(context)),
+        )?;
+        let size = bench.time("get_output_size", || inference::get_output_size(context, 0));
+        check("get_output_size", size)?;
+        check(
+            "get_output",
+            bench.time("get_output", || inference::get_output(context, 0)),
+        )?;
+        let output = bench.time("get_output_tensor", || {
+            inference::get_output_tensor(context, 0)
+        });
+        let output = check("get_output_tensor", output)?;
+        bench.time("tensor_data", || output.data());
+    }
+    bench.report();
+    Ok(())
+}
+
+fn run(model_path: &str, image_path: &str) -> Result<(), Box<dyn Error>> {
+    let input = read_input(image_path)?;
+    let graph = load_model(model_path)?;
+    let context = check(
+        "init_execution_context",
+        inference::init_execution_context(graph),
+    )?;
+
+    if let Some(iterations) = abi_bench::iterations() {
+        return run_abi_bench(context, &input, iterations);
+    }
+    let (score, class) = classify(context, &input)?;
+    println!("{}: class {} (score: {})", image_path, class, score);
+    println!("Predicted Class Index: {}", class);
+    Ok(())
+}
+
+fn main() {
+    let model_path = env::var("NN_MODEL").unwrap_or_else(|_| String::from(MODEL_PATH));
+    let image_path = env::var("NN_IMAGE").unwrap_or_else(|_| String::from(IMAGE_PATH));
+    if let Err(error) = run(&model_path, &image_path) {
+        println!("Error: {}", error);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,336 @@
+//! Object detection workload (NN_DETECT_IMAGE, `--detect` on the host): a
+//! YOLOv8-style ONNX model, e.g. `yolov8n.onnx` from `yolo export
+//! model=yolov8n.pt format=onnx`, run on one image such as
+//! `/assets/imgs/bus.jpg`.
+//!
+//! Pre-processing letterboxes the image into the square input: scaled to fit
+//! with its aspect ratio kept, centered on grey padding and converted to
+//! planar f32 in [0, 1]. The output is `[1, 4 + classes, anchors]`, i.e. for
+//! every anchor the box center and size followed by one score per class.
+//! It is far larger than a classifier's and so is its post-processing:
+//! decoding every anchor, then class-aware non-maximum suppression, which
+//! with `+simd128` computes the overlap of a kept box with four candidates
+//! at a time.
+
+use image::{imageops, DynamicImage, Rgba, RgbaImage};
+use std::error::Error;
+
+use crate::nn::Context;
+use crate::postprocess::{self, OutputBuffer};
+use crate::preprocess::{self, Normalization};
+use crate::BenchmarkTracker;
+
+/// Side of the square model input.
+const INPUT_SIZE: u32 = 640;
+/// The grey YOLO pads letterboxed images with.
+const PAD: u8 = 114;
+/// Strides of the three detection heads; every cell of every head is an
+/// anchor.
+const STRIDES: [u32; 3] = [8, 16, 32];
+const SCORE_THRESHOLD: f32 = 0.25;
+const IOU_THRESHOLD: f32 = 0.45;
+
+/// How the original image maps into the letterboxed input.
+struct Letterbox {
+    scale: f32,
+    pad_x: f32,
+    pad_y: f32,
+    width: f32,
+    height: f32,
+}
+
+/// A box in original image pixels, `[x1, y1, x2, y2]`, with its 0-based
+/// class.
+#[derive(Debug, Clone)]
+struct Detection {
+    class: usize,
+    score: f32,
+    bbox: [f32; 4],
+}
+
+/// Letterbox `image` into a `[3, size, size]` tensor in `out`.
+fn letterbox(image: &DynamicImage, size: u32, out: &mut Vec<f32>) -> Letterbox {
+    let (width, height) = (image.width(), image.height());
+    let scale = (size as f32 / width as f32).min(size as f32 / height as f32);
+    let scaled_width = ((width as f32 * scale).round() as u32).clamp(1, size);
+    let scaled_height = ((height as f32 * scale).round() as u32).clamp(1, size);
+    let resized = imageops::resize(
+        image,
+        scaled_width,
+        scaled_height,
+        imageops::FilterType::Triangle,
+    );
+
+    let (pad_x, pad_y) = ((size - scaled_width) / 2, (size - scaled_height) / 2);
+    let mut canvas = RgbaImage::from_pixel(size, size, Rgba([PAD, PAD, PAD, 255]));
+    imageops::replace(&mut canvas, &resized, pad_x as i64, pad_y as i64);
+
+    out.resize(3 * (size * size) as usize, 0.0);
+    let unit = Normalization::new([0.0; 3], [1.0; 3]);
+    preprocess::rgba_to_chw(canvas.as_raw(), &unit, out);
+    Letterbox {
+        scale,
+        pad_x: pad_x as f32,
+        pad_y: pad_y as f32,
+        width: width as f32,
+        height: height as f32,
+    }
+}
+
+/// Anchors of a square input of `size` pixels.
+fn anchors(size: u32) -> usize {
+    STRIDES
+        .iter()
+        .map(|stride| ((size / stride) * (size / stride)) as usize)
+        .sum()
+}
+
+/// The anchors of `output` whose best class scores at least `threshold`, as
+/// boxes in the original image.
+fn decode(
+    output: &[f32],
+    anchors: usize,
+    letterbox: &Letterbox,
+    threshold: f32,
+) -> Result<Vec<Detection>, String> {
+    if anchors == 0 || output.len() % anchors != 0 || output.len() / anchors <= 4 {
+        return Err(format!(
+            "{} outputs are not [4 + classes, {}] detections",
+            output.len(),
+            anchors
+        ));
+    }
+    let classes = output.len() / anchors - 4;
+    let row = |index: usize| &output[index * anchors..(index + 1) * anchors];
+
+    // The best class of every anchor, one class row at a time so that each
+    // pass streams through contiguous scores.
+    let mut best = vec![f32::NEG_INFINITY; anchors];
+    let mut best_class = vec![0usize; anchors];
+    for class in 0..classes {
+        let scores = row(4 + class);
+        for ((score, best), best_class) in scores.iter().zip(&mut best).zip(&mut best_class) {
+            if *score > *best {
+                *best = *score;
+                *best_class = class;
+            }
+        }
+    }
+
+    let (cx, cy, w, h) = (row(0), row(1), row(2), row(3));
+    let unmap =
+        |value: f32, pad: f32, limit: f32| ((value - pad) / letterbox.scale).clamp(0.0, limit);
+    let mut detections = Vec::new();
+    for anchor in 0..anchors {
+        if best[anchor] < threshold {
+            continue;
+        }
+        let (half_w, half_h) = (w[anchor] / 2.0, h[anchor] / 2.0);
+        detections.push(Detection {
+            class: best_class[anchor],
+            score: best[anchor],
+            bbox: [
+                unmap(cx[anchor] - half_w, letterbox.pad_x, letterbox.width),
+                unmap(cy[anchor] - half_h, letterbox.pad_y, letterbox.height),
+                unmap(cx[anchor] + half_w, letterbox.pad_x, letterbox.width),
+                unmap(cy[anchor] + half_h, letterbox.pad_y, letterbox.height),
+            ],
+        });
+    }
+    Ok(detections)
+}
+
+/// Boxes as separate coordinate arrays, so that four of them load as one
+/// vector per coordinate. Every class is shifted by more than the largest
+/// coordinate, so boxes of different classes never overlap and one pass of
+/// suppression is class-aware.
+struct Boxes {
+    x1: Vec<f32>,
+    y1: Vec<f32>,
+    x2: Vec<f32>,
+    y2: Vec<f32>,
+    area: Vec<f32>,
+}
+
+impl Boxes {
+    fn new(detections: &[Detection]) -> Self {
+        let extent = detections
+            .iter()
+            .flat_map(|detection| detection.bbox)
+            .fold(0.0f32, f32::max)
+            + 1.0;
+        let mut boxes = Boxes {
+            x1: Vec::with_capacity(detections.len()),
+            y1: Vec::with_capacity(detections.len()),
+            x2: Vec::with_capacity(detections.len()),
+            y2: Vec::with_capacity(detections.len()),
+            area: Vec::with_capacity(detections.len()),
+        };
+        for detection in detections {
+            let offset = detection.class as f32 * extent;
+            let [x1, y1, x2, y2] = detection.bbox;
+            boxes.x1.push(x1 + offset);
+            boxes.y1.push(y1 + offset);
+            boxes.x2.push(x2 + offset);
+            boxes.y2.push(y2 + offset);
+            boxes.area.push((x2 - x1) * (y2 - y1));
+        }
+        boxes
+    }
+
+    fn iou(&self, i: usize, j: usize) -> f32 {
+        let w = (self.x2[i].min(self.x2[j]) - self.x1[i].max(self.x1[j])).max(0.0);
+        let h = (self.y2[i].min(self.y2[j]) - self.y1[i].max(self.y1[j])).max(0.0);
+        let intersection = w * h;
+        intersection / (self.area[i] + self.area[j] - intersection)
+    }
+}
+
+/// Keep the best box, drop every box of its class that overlaps it by more
+/// than `iou_threshold` and repeat with the best box left.
+///
+/// Boxes are ordered with `f32::total_cmp`, a total order even if a score is
+/// NaN, which the sort needs.
+fn nms(mut detections: Vec<Detection>, iou_threshold: f32) -> Vec<Detection> {
+    detections.sort_unstable_by(|a, b| b.score.total_cmp(&a.score));
+    let boxes = Boxes::new(&detections);
+    let mut suppressed = vec![false; detections.len()];
+    let mut ious = vec![0.0f32; detections.len()];
+    let mut kept = Vec::new();
+    for i in 0..detections.len() {
+        if suppressed[i] {
+            continue;
+        }
+        kept.push(detections[i].clone());
+
+        let candidates = &mut ious[i + 1..];
+        let done = simd::ious(&boxes, i, candidates);
+        for (k, iou) in candidates.iter_mut().enumerate().skip(done) {
+            *iou = boxes.iou(i, i + 1 + k);
+        }
+        for (suppressed, iou) in suppressed[i + 1..].iter_mut().zip(candidates.iter()) {
+            // false for NaN, i.e. two empty boxes
+            if *iou > iou_threshold {
+                *suppressed = true;
+            }
+        }
+    }
+    kept
+}
+
+/// Detect objects in the image at `image_path` and print them. Ends the RED
+/// BOX phase `main` started and tracks the GREEN BOX one; returns the number
+/// of detections.
+pub fn run(
+    context: &mut Context,
+    tracker: &mut BenchmarkTracker,
+    image_path: &str,
+) -> Result<usize, Box<dyn Error>> {
+    tracker.start_operation("readimg");
+    let image = image::open(image_path)?;
+    tracker.finish_operation();
+    tracker.end_phase("RED BOX Phase");
+
+    tracker.start_phase("GREEN BOX Phase");
+    tracker.start_operation("Pre-processing");
+    let mut input = Vec::new();
+    let letterbox = letterbox(&image, INPUT_SIZE, &mut input);
+    let dimensions = [1, 3, INPUT_SIZE, INPUT_SIZE];
+    context
+        .set_input(0, &dimensions, preprocess::as_bytes(&input))
+        .map_err(|_| "Error setting the letterboxed input")?;
+    tracker.finish_operation();
+
+    tracker.start_operation("Inference");
+    context
+        .compute()
+        .map_err(|_| "Error occurred while running the model")?;
+    tracker.finish_operation();
+
+    tracker.start_operation("decode");
+    let mut output = OutputBuffer::default();
+    let detections = decode(
+        output.read(context, 0)?,
+        anchors(INPUT_SIZE),
+        &letterbox,
+        SCORE_THRESHOLD,
+    )?;
+    tracker.finish_operation();
+
+    tracker.start_operation("nms");
+    let candidates = detections.len();
+    let kept = nms(detections, IOU_THRESHOLD);
+    tracker.finish_operation();
+    tracker.end_phase("GREEN BOX Phase");
+
+    println!(
+        "{}: {} detections ({} candidates)",
+        image_path,
+        kept.len(),
+        candidates
+    );
+    for detection in &kept {
+        let [x1, y1, x2, y2] = detection.bbox;
+        println!(
+            "  {} at [{:.0}, {:.0}, {:.0}, {:.0}] (score: {:.3})",
+            postprocess::describe(detection.class as i32 + 1),
+            x1,
+            y1,
+            x2,
+            y2,
+            detection.score
+        );
+    }
+    Ok(kept.len())
+}
+
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+mod simd {
+    use super::Boxes;
+    use core::arch::wasm32::*;
+
+    /// The IoU of box `i` with the boxes after it, into `out`, for as many
+    /// whole groups of four as there are; returns the number done.
+    pub fn ious(boxes: &Boxes, i: usize, out: &mut [f32]) -> usize {
+        let (x1, y1) = (f32x4_splat(boxes.x1[i]), f32x4_splat(boxes.y1[i]));
+        let (x2, y2) = (f32x4_splat(boxes.x2[i]), f32x4_splat(boxes.y2[i]));
+        let area = f32x4_splat(boxes.area[i]);
+        let zero = f32x4_splat(0.0);
+
+        let groups = out.len() / 4;
+        for group in 0..groups {
+            let j = i + 1 + group * 4;
+            // SAFETY: `out` holds the boxes after `i`, so `j + 4` is at most
+            // the number of boxes each coordinate array holds; wasm allows
+            // unaligned loads and stores.
+            unsafe {
+                let load = |values: &Vec<f32>| v128_load(values.as_ptr().add(j) as *const v128);
+                let w = f32x4_sub(
+                    f32x4_min(x2, load(&boxes.x2)),
+                    f32x4_max(x1, load(&boxes.x1)),
+                );
+                let h = f32x4_sub(
+                    f32x4_min(y2, load(&boxes.y2)),
+                    f32x4_max(y1, load(&boxes.y1)),
+                );
+                let intersection = f32x4_mul(f32x4_max(w, zero), f32x4_max(h, zero));
+                let union = f32x4_sub(f32x4_add(area, load(&boxes.area)), intersection);
+                v128_store(
+                    out.as_mut_ptr().add(group * 4) as *mut v128,
+                    f32x4_div(intersection, union),
+                );
+            }
+        }
+        groups * 4
+    }
+}
+
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+mod simd {
+    use super::Boxes;
+
+    /// Without simd128 every candidate goes through the scalar loop.
+    pub fn ious(_: &Boxes, _: usize, _: &mut [f32]) -> usize {
+        0
+    }
+}
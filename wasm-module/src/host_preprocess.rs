@@ -0,0 +1,86 @@
+//! Host-assisted pipeline: the host decodes, resizes and normalizes the image
+//! natively and sets it as the execution context's input itself (the
+//! `preprocess` import, see wasmtime-custom/src/preprocess.rs), so the
+//! guest only hands over the encoded bytes.
+//!
+//! The host takes the raw execution context handle of an `nn::Context`;
+//! the session drops it, and its graph, with the context.
+
+use std::error::Error;
+
+use crate::nn::Context;
+
+#[link(wasm_import_module = "preprocess")]
+extern "C" {
+    fn set_input_from_image(
+        context: u32,
+        index: u32,
+        image: *const u8,
+        image_len: u32,
+        width: u32,
+        height: u32,
+        normalization: *const f32,
+    ) -> u32;
+}
+
+/// The input size when the model does not fix it, e.g. a dynamic height.
+const DEFAULT_SIZE: (u32, u32) = (224, 224);
+
+/// An execution context the host sets inputs of, and the size of its input.
+pub struct HostSession {
+    context: Context,
+    /// The `(height, width)` of input 0, from the model.
+    input_size: (u32, u32),
+}
+
+impl HostSession {
+    /// Take over `context`, of which only output 0 is read.
+    pub fn new(mut context: Context) -> Result<Self, Box<dyn Error>> {
+        // Only output 0 is read, so the backend need not produce the others
+        context.select_outputs(&[0])?;
+        let input_size = input_size(&context).unwrap_or(DEFAULT_SIZE);
+        Ok(Self {
+            context,
+            input_size,
+        })
+    }
+
+    /// Let the host turn `encoded` into the `[1, 3, height, width]` input 0,
+    /// at the size the model declares.
+    pub fn set_input_from_image(&mut self, encoded: &[u8]) -> Result<(), Box<dyn Error>> {
+        let errno = unsafe {
+            set_input_from_image(
+                self.context.handle(),
+                0,
+                encoded.as_ptr(),
+                encoded.len() as u32,
+                self.input_size.1,
+                self.input_size.0,
+                std::ptr::null(),
+            )
+        };
+        match errno {
+            0 => Ok(()),
+            errno => {
+                Err(format!("set_input_from_image failed with wasi-nn errno {}", errno).into())
+            }
+        }
+    }
+
+    /// The context, to compute and read outputs with.
+    pub fn context(&mut self) -> &mut Context {
+        &mut self.context
+    }
+}
+
+/// The static height and width of an NCHW input 0 of `context`, if it has
+/// them.
+fn input_size(context: &Context) -> Option<(u32, u32)> {
+    let mut dimensions = [0i64; 4];
+    match (context.input_dimensions(0, &mut dimensions), dimensions) {
+        (Ok(4), [_, 3, height, width]) if height > 0 && width > 0 => {
+            Some((height as u32, width as u32))
+        }
+        _ => None,
+    }
+}
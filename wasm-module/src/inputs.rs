@@ -0,0 +1,157 @@
+//! Inputs of `main` and batch mode: encoded images, which the guest decodes
+//! and resizes, and pre-decoded tensors, which skip both.
+//!
+//! A pre-decoded file is a raw `[1, 3, 224, 224]` tensor in NCHW order, like
+//! wasi-nn's `tests/fixtures/000000062808.rgb`:
+//!
+//! - `.rgb` or `.f32`: little-endian f32 values, already normalized, set as
+//!   the input as they are;
+//! - `.u8`: one byte per value, normalized like decoded pixels.
+//!
+//! They isolate inference from decode cost. `TensorCache` does the same for
+//! encoded images classified again and again: it keeps the pre-processed
+//! tensors of the most recently used paths.
+
+use image::{ImageBuffer, Rgba};
+use std::env;
+use std::error::Error;
+use std::path::{Path, PathBuf};
+
+use crate::preprocess::{self, Normalization};
+use crate::IMAGE_SIZE;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Format {
+    Encoded,
+    F32,
+    U8,
+}
+
+impl Format {
+    /// The format of the file at `path`, by its extension.
+    pub fn of(path: &Path) -> Self {
+        let extension = path.extension().map(|e| e.to_string_lossy().to_lowercase());
+        match extension.as_deref() {
+            Some("rgb") | Some("f32") => Format::F32,
+            Some("u8") => Format::U8,
+            _ => Format::Encoded,
+        }
+    }
+}
+
+/// A file after `decode`: what is left for pre-processing to do.
+pub enum Decoded<'a> {
+    Image(ImageBuffer<Rgba<u8>, Vec<u8>>),
+    F32(&'a [u8]),
+    U8(&'a [u8]),
+}
+
+/// Decode and resize `bytes`, read from `path`, or only check the size of a
+/// pre-decoded tensor.
+pub fn decode<'a>(path: &Path, bytes: &'a [u8]) -> Result<Decoded<'a>, Box<dyn Error>> {
+    let check = |expected: usize| -> Result<(), Box<dyn Error>> {
+        if bytes.len() == expected {
+            return Ok(());
+        }
+        Err(format!(
+            "{}: {} bytes, expected {} for a [1, 3, 224, 224] tensor",
+            path.display(),
+            bytes.len(),
+            expected
+        )
+        .into())
+    };
+    match Format::of(path) {
+        Format::Encoded => Ok(Decoded::Image(crate::decode_img(bytes)?)),
+        Format::F32 => check(IMAGE_SIZE * 4).map(|_| Decoded::F32(bytes)),
+        Format::U8 => check(IMAGE_SIZE).map(|_| Decoded::U8(bytes)),
+    }
+}
+
+impl Decoded<'_> {
+    /// Pre-process into `out`, which holds one image (`IMAGE_SIZE` floats).
+    pub fn to_tensor(&self, out: &mut [f32]) -> Result<(), Box<dyn Error>> {
+        match self {
+            Decoded::Image(image) => crate::image_into(image, out)?,
+            Decoded::F32(bytes) => {
+                for (value, bytes) in out.iter_mut().zip(bytes.chunks_exact(4)) {
+                    *value = f32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]);
+                }
+            }
+            Decoded::U8(bytes) => preprocess::planes_to_chw(bytes, &Normalization::default(), out),
+        }
+        Ok(())
+    }
+}
+
+/// Read, decode and pre-process the file at `path` into `out`.
+pub fn load_into(path: &Path, out: &mut [f32]) -> Result<(), Box<dyn Error>> {
+    let bytes = std::fs::read(path)?;
+    decode(path, &bytes)?.to_tensor(out)
+}
+
+/// Pre-processed tensors of the `capacity` most recently used paths, set by
+/// the host as NN_TENSOR_CACHE (default: 0, off).
+///
+/// Entries are kept in use order, the most recent last, and found by a
+/// linear scan: at 588 KiB per tensor only a few dozen fit in linear memory,
+/// and comparing that many paths is nothing next to a decode.
+pub struct TensorCache {
+    capacity: usize,
+    entries: Vec<(PathBuf, Vec<f32>)>,
+    pub hits: u64,
+    pub misses: u64,
+}
+
+impl TensorCache {
+    pub fn from_env() -> Self {
+        let capacity = env::var("NN_TENSOR_CACHE")
+            .ok()
+            .and_then(|value| value.parse().ok())
+            .unwrap_or(0);
+        Self {
+            capacity,
+            entries: Vec::new(),
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.capacity > 0
+    }
+
+    /// Copy the tensor of `path` into `out` and make it the most recently
+    /// used, or return false if it is not cached.
+    pub fn get(&mut self, path: &Path, out: &mut [f32]) -> bool {
+        match self.entries.iter().position(|(cached, _)| cached == path) {
+            Some(index) => {
+                let entry = self.entries.remove(index);
+                out.copy_from_slice(&entry.1);
+                self.entries.push(entry);
+                self.hits += 1;
+                true
+            }
+            None => {
+                self.misses += 1;
+                false
+            }
+        }
+    }
+
+    /// Cache `tensor` as the one of `path`, reusing the buffer of the least
+    /// recently used entry when full.
+    pub fn insert(&mut self, path: &Path, tensor: &[f32]) {
+        if self.capacity == 0 {
+            return;
+        }
+        let mut buffer = if self.entries.len() == self.capacity {
+            self.entries.remove(0).1
+        } else {
+            Vec::with_capacity(tensor.len())
+        };
+        buffer.clear();
+        buffer.extend_from_slice(tensor);
+        self.entries.push((path.to_path_buf(), buffer));
+    }
+}
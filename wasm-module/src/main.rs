@@ -1,17 +1,57 @@
-use image::{ImageBuffer, Pixel, Rgba};
-use libc::rusage;
-use ndarray::s;
+use image::{DynamicImage, ImageBuffer, Rgba};
 use std::error::Error;
 use std::fs;
+use std::io::{BufWriter, ErrorKind, Read, Write};
 use std::{
-    cmp::Ordering,
+    cell::RefCell,
     collections::HashMap,
+    env,
     fmt::Debug,
     num::NonZero,
-    ops::RangeFrom,
+    path::{Path, PathBuf},
     time::{Duration, Instant},
 };
-use wasi_nn::{ExecutionTarget, Graph, GraphBuilder, GraphEncoding, GraphExecutionContext};
+use nn::{Context, Graph};
+use postprocess::OutputBuffer;
+
+/// Resource usage of the host process, filled in by `bench::process_rusage`.
+#[repr(C)]
+#[derive(Debug, Default)]
+struct HostRusage {
+    user_us: u64,
+    system_us: u64,
+    max_rss_bytes: u64,
+}
+
+mod abi_bench;
+mod arena;
+mod detect;
+mod host_preprocess;
+mod inputs;
+mod nn;
+mod postprocess;
+mod preinit;
+mod preprocess;
+mod trace;
+
+/// Host-provided resource accounting, WASI has no getrusage (see
+/// wasmtime-custom/src/bench.rs).
+mod host {
+    use super::HostRusage;
+
+    #[link(wasm_import_module = "bench")]
+    extern "C" {
+        pub fn thread_cpu_time_ns() -> u64;
+        pub fn process_rusage(out: *mut HostRusage) -> i32;
+        pub fn memory_size() -> u64;
+        /// Tell the host's memory timeline that a tracker phase started
+        /// (`start` is 1) or ended.
+        pub fn phase(name: *const u8, name_len: usize, start: i32);
+        /// The same for a tracker operation, for the host's hardware
+        /// counters.
+        pub fn operation(name: *const u8, name_len: usize, start: i32);
+    }
+}
 
 #[derive(Debug, Clone)]
 struct Metrics {
@@ -20,26 +60,23 @@ struct Metrics {
     wall_clock_time: Duration,
     user_time: Duration,
     system_time: Duration,
+    thread_time: Duration,
     max_rss: u64,
+    linear_memory: u64,
     cpu_usage: f32,
 }
 
 impl Metrics {
     fn current(name: String) -> Self {
         unsafe {
-            let mut usage: rusage = std::mem::zeroed();
-            usage.ru_utime.tv_sec = 1;
-            usage.ru_utime.tv_usec = 0;
-            usage.ru_stime.tv_sec = 1;
-            usage.ru_stime.tv_usec = 0;
-
-            // getrusage(0, &mut usage);
-
-            let user_time: Duration = Duration::from_secs(usage.ru_utime.tv_sec as u64)
-                + Duration::from_micros(usage.ru_utime.tv_usec as u64);
+            let mut usage: HostRusage = HostRusage::default();
+            if host::process_rusage(&mut usage) != 0 {
+                usage = HostRusage::default();
+            }
 
-            let system_time: Duration = Duration::from_secs(usage.ru_stime.tv_sec as u64)
-                + Duration::from_micros(usage.ru_stime.tv_usec as u64);
+            let user_time: Duration = Duration::from_micros(usage.user_us);
+            let system_time: Duration = Duration::from_micros(usage.system_us);
+            let thread_time: Duration = Duration::from_nanos(host::thread_cpu_time_ns());
 
             let cpu_usage: f32 = 0.0;
             Self {
@@ -48,7 +85,9 @@ impl Metrics {
                 wall_clock_time: Duration::default(),
                 user_time,
                 system_time,
-                max_rss: 0 as u64,
+                thread_time,
+                max_rss: usage.max_rss_bytes,
+                linear_memory: host::memory_size(),
                 cpu_usage,
             }
         }
@@ -56,8 +95,9 @@ impl Metrics {
 
     fn diff(&self, prev: &Self) -> Self {
         let wall_clock_time: Duration = self.timestamp.duration_since(prev.timestamp);
-        let user_time: Duration = self.user_time - prev.user_time;
-        let system_time: Duration = self.system_time - prev.system_time;
+        let user_time: Duration = self.user_time.saturating_sub(prev.user_time);
+        let system_time: Duration = self.system_time.saturating_sub(prev.system_time);
+        let thread_time: Duration = self.thread_time.saturating_sub(prev.thread_time);
 
         let cpu_usage: f32 = if wall_clock_time.as_secs_f32() > 0.0 {
             let cpu_time: f32 = (user_time + system_time).as_secs_f32();
@@ -72,7 +112,9 @@ impl Metrics {
             wall_clock_time,
             user_time,
             system_time,
-            max_rss: self.max_rss - prev.max_rss,
+            thread_time,
+            max_rss: self.max_rss.saturating_sub(prev.max_rss),
+            linear_memory: self.linear_memory,
             cpu_usage,
         }
     }
@@ -81,6 +123,7 @@ impl Metrics {
         let combined_wall_clock = self.wall_clock_time + other.wall_clock_time;
         let combined_user_time = self.user_time + other.user_time;
         let combined_system_time = self.system_time + other.system_time;
+        let combined_thread_time = self.thread_time + other.thread_time;
 
         let cpu_usage = if combined_wall_clock.as_secs_f32() > 0.0 {
             let cpu_time = (combined_user_time + combined_system_time).as_secs_f32();
@@ -95,7 +138,9 @@ impl Metrics {
             wall_clock_time: combined_wall_clock,
             user_time: combined_user_time,
             system_time: combined_system_time,
+            thread_time: combined_thread_time,
             max_rss: self.max_rss.max(other.max_rss),
+            linear_memory: self.linear_memory.max(other.linear_memory),
             cpu_usage,
         }
     }
@@ -107,12 +152,46 @@ impl std::fmt::Display for Metrics {
         writeln!(f, "Wall Clock Time: {:?}", self.wall_clock_time)?;
         writeln!(f, "User time: {:?}", self.user_time)?;
         writeln!(f, "System time: {:?}", self.system_time)?;
+        writeln!(f, "Thread CPU time: {:?}", self.thread_time)?;
         writeln!(f, "Max RSS: {} bytes", self.max_rss)?;
+        writeln!(f, "Linear Memory: {} bytes", self.linear_memory)?;
         writeln!(f, "CPU Usage: {}%", self.cpu_usage)?;
         writeln!(f, "=======================================")
     }
 }
 
+impl Metrics {
+    /// One JSON object (without a trailing newline) describing these metrics,
+    /// `kind` tells apart operations, phases and the total.
+    fn to_json(&self, kind: &str) -> String {
+        format!(
+            "{{\"kind\":\"{}\",\"name\":\"{}\",\"wall_clock_us\":{:.3},\"user_time_us\":{:.3},\"system_time_us\":{:.3},\"thread_time_us\":{:.3},\"max_rss\":{},\"linear_memory\":{},\"cpu_usage\":{:.3}}}",
+            kind,
+            escape_json(&self.name),
+            self.wall_clock_time.as_secs_f64() * 1e6,
+            self.user_time.as_secs_f64() * 1e6,
+            self.system_time.as_secs_f64() * 1e6,
+            self.thread_time.as_secs_f64() * 1e6,
+            self.max_rss,
+            self.linear_memory,
+            self.cpu_usage
+        )
+    }
+}
+
+fn escape_json(value: &str) -> String {
+    let mut escaped = String::with_capacity(value.len());
+    for c in value.chars() {
+        match c {
+            '"' => escaped.push_str("\\\""),
+            '\\' => escaped.push_str("\\\\"),
+            c if (c as u32) < 0x20 => escaped.push_str(&format!("\\u{:04x}", c as u32)),
+            c => escaped.push(c),
+        }
+    }
+    escaped
+}
+
 #[derive(Debug)]
 struct BenchmarkTracker {
     start_metrics: Metrics,
@@ -136,6 +215,8 @@ impl BenchmarkTracker {
     }
 
     fn start_operation(&mut self, name: &str) {
+        unsafe { host::operation(name.as_ptr(), name.len(), 1) };
+        trace::mark(name, true);
         self.current_operation = Some(Metrics::current(name.to_string()));
     }
 
@@ -147,6 +228,9 @@ impl BenchmarkTracker {
 
     fn finish_operation_internal(&mut self, start_metrics: Metrics) {
         let end_metrics: Metrics = Metrics::current(start_metrics.name.clone());
+        let name = &start_metrics.name;
+        unsafe { host::operation(name.as_ptr(), name.len(), 0) };
+        trace::mark(name, false);
         let diff_metrics: Metrics = end_metrics.diff(&start_metrics);
 
         self.completed_metrics.push(diff_metrics.clone());
@@ -157,13 +241,16 @@ impl BenchmarkTracker {
     }
 
     fn start_phase(&mut self, phase_name: &str) {
+        unsafe { host::phase(phase_name.as_ptr(), phase_name.len(), 1) };
         let zero_metrics = Metrics {
             name: phase_name.to_string(),
             timestamp: Instant::now(),
             wall_clock_time: Duration::default(),
             user_time: Duration::default(),
             system_time: Duration::default(),
+            thread_time: Duration::default(),
             max_rss: 0,
+            linear_memory: 0,
             cpu_usage: 0.0,
         };
 
@@ -176,6 +263,7 @@ impl BenchmarkTracker {
     }
 
     fn end_phase(&mut self, phase_name: &str) {
+        unsafe { host::phase(phase_name.as_ptr(), phase_name.len(), 0) };
         if let Some(metrics) = self.active_phases.remove(phase_name) {
             self.phase_metrics.push((phase_name.to_string(), metrics));
         }
@@ -212,70 +300,268 @@ impl BenchmarkTracker {
 
         print!("{}", total);
     }
+
+    /// Write one JSONL record per operation, per phase and one for the total.
+    fn write_jsonl<W: Write>(&self, writer: &mut W) -> std::io::Result<()> {
+        for metrics in &self.completed_metrics {
+            writeln!(writer, "{}", metrics.to_json("operation"))?;
+        }
+        for phase_name in &self.phase_order {
+            for (_, metrics) in self.phase_metrics.iter().filter(|(name, _)| name == phase_name) {
+                writeln!(writer, "{}", metrics.to_json("phase"))?;
+            }
+        }
+        writeln!(writer, "{}", self.get_total_metrics().to_json("total"))?;
+        writer.flush()
+    }
+
+    /// Append the records to `path`, which has to be inside a preopened dir.
+    fn export_jsonl(&self, path: &str) -> Result<(), Box<dyn Error>> {
+        let file = fs::OpenOptions::new().create(true).append(true).open(path)?;
+        self.write_jsonl(&mut BufWriter::new(file))?;
+        Ok(())
+    }
 }
 
-fn initialize_env(model: &Graph) -> Result<GraphExecutionContext<'_>, Box<dyn Error>> {
+fn initialize_env(model: Graph) -> Result<Context, Box<dyn Error>> {
     match model.init_execution_context() {
         Ok(context) => Ok(context),
         Err(_) => Err("Error occured while initializing the env".into()),
     }
 }
 
-fn load_model(model_path: &str) -> Result<Graph, wasi_nn::Error> {
-    GraphBuilder::new(GraphEncoding::Onnx, ExecutionTarget::CPU).build_from_files([model_path])
+/// Prefer a graph the host preloaded under NN_GRAPH_NAME (by default the model
+/// file's stem, e.g. `mobilenetv2-10`): `load_by_name` hands back the host's
+/// graph without the model bytes ever entering linear memory. Only when the
+/// host has no such graph are the files read and copied through `load`.
+fn load_model(model_path: &str) -> Result<Graph, Box<dyn Error>> {
+    let encoding = graph_encoding();
+    if let Some(name) = graph_name(model_path) {
+        if let Some(graph) = Graph::by_name(&name) {
+            return Ok(graph);
+        }
+    }
+    let builders = match encoding {
+        // OpenVINO IR is the topology in `model_path` (.xml) plus the weights
+        // next to it (.bin)
+        nn::ENCODING_OPENVINO => {
+            let weights = Path::new(model_path).with_extension("bin");
+            vec![fs::read(model_path)?, fs::read(weights)?]
+        }
+        _ => vec![fs::read(model_path)?],
+    };
+    let builders: Vec<&[u8]> = builders.iter().map(Vec::as_slice).collect();
+    Ok(Graph::load(&builders, encoding, execution_target())?)
 }
 
-fn read_img(image_path: &str) -> Result<ImageBuffer<Rgba<u8>, Vec<u8>>, Box<dyn Error>> {
-    const IMAGE_WIDTH: u32 = 224;
-    const IMAGE_HEIGHT: u32 = 224;
+/// The host passes `--backend` through as NN_ENCODING (onnx or openvino).
+fn graph_encoding() -> u32 {
+    match env::var("NN_ENCODING").as_deref() {
+        Ok("openvino") => nn::ENCODING_OPENVINO,
+        _ => nn::ENCODING_ONNX,
+    }
+}
+
+fn graph_name(model_path: &str) -> Option<String> {
+    env::var("NN_GRAPH_NAME").ok().or_else(|| {
+        Path::new(model_path)
+            .file_stem()
+            .map(|stem| stem.to_string_lossy().into_owned())
+    })
+}
+
+/// The host passes `--target` through as NN_TARGET (cpu, gpu or tpu).
+fn execution_target() -> u32 {
+    match env::var("NN_TARGET").as_deref() {
+        Ok("gpu") => nn::TARGET_GPU,
+        Ok("tpu") => nn::TARGET_TPU,
+        _ => nn::TARGET_CPU,
+    }
+}
 
-    let image = image::imageops::resize(
-        &image::open(image_path)?,
+const IMAGE_WIDTH: u32 = 224;
+const IMAGE_HEIGHT: u32 = 224;
+
+/// Decode an encoded image that is already in memory and resize it.
+fn decode_img(encoded: &[u8]) -> Result<ImageBuffer<Rgba<u8>, Vec<u8>>, Box<dyn Error>> {
+    if let Some(image) = decode_jpeg_scaled(encoded) {
+        return Ok(image);
+    }
+    Ok(resize_img(&image::load_from_memory(encoded)?))
+}
+
+/// Decode a JPEG with the decoder's scaled IDCT, at the smallest of 1/8,
+/// 1/4, 1/2 or full size that still covers 224x224, and resize that. A
+/// multi-megapixel photo is then never decoded at full resolution, and the
+/// Triangle filter runs over a few hundred pixels a side instead of
+/// thousands. The pixels stay RGB or gray until the resize, which writes the
+/// 224x224 RGBA pre-processing reads.
+///
+/// `None` for other formats and for JPEGs this path does not take (CMYK,
+/// 16-bit, or broken ones), which `image` decodes or reports instead.
+fn decode_jpeg_scaled(encoded: &[u8]) -> Option<ImageBuffer<Rgba<u8>, Vec<u8>>> {
+    if image::guess_format(encoded).ok()? != image::ImageFormat::Jpeg {
+        return None;
+    }
+    let mut decoder = jpeg_decoder::Decoder::new(encoded);
+    decoder.read_info().ok()?;
+    let (width, height) = decoder
+        .scale(IMAGE_WIDTH as u16, IMAGE_HEIGHT as u16)
+        .ok()?;
+    let pixels = decoder.decode().ok()?;
+    let (width, height) = (u32::from(width), u32::from(height));
+    let image = match decoder.info()?.pixel_format {
+        jpeg_decoder::PixelFormat::RGB24 => {
+            DynamicImage::ImageRgb8(ImageBuffer::from_raw(width, height, pixels)?)
+        }
+        jpeg_decoder::PixelFormat::L8 => {
+            DynamicImage::ImageLuma8(ImageBuffer::from_raw(width, height, pixels)?)
+        }
+        _ => return None,
+    };
+    Some(resize_img(&image))
+}
+
+fn resize_img(image: &DynamicImage) -> ImageBuffer<Rgba<u8>, Vec<u8>> {
+    image::imageops::resize(
+        image,
         IMAGE_WIDTH,
         IMAGE_HEIGHT,
         image::imageops::FilterType::Triangle,
-    );
+    )
+}
 
-    Ok(image)
+/// Pre-process one resized image into `buffer` as a `[1, 3, 224, 224]`
+/// tensor; see `images_to_tensor`.
+pub fn image_to_tensor(
+    image: &ImageBuffer<Rgba<u8>, Vec<u8>>,
+    buffer: &mut Vec<f32>,
+) -> Result<(), Box<dyn Error>> {
+    images_to_tensor(std::slice::from_ref(image), buffer)
 }
 
-pub fn image_to_tensor(image: ImageBuffer<Rgba<u8>, Vec<u8>>) -> Result<Vec<u8>, Box<dyn Error>> {
-    let mut array = ndarray::Array::from_shape_fn((1, 3, 224, 224), |(_, c, j, i)| {
-        let pixel = image.get_pixel(i as u32, j as u32);
-        let channels = pixel.channels();
+/// Elements of one `[3, 224, 224]` image in a tensor.
+const IMAGE_SIZE: usize = 3 * 224 * 224;
+
+/// Pre-process a batch of resized images into `buffer` as one
+/// `[N, 3, 224, 224]` tensor, one fused pass per image (see `preprocess`).
+/// The buffer is meant to be kept between requests: it only grows, and
+/// `preprocess::as_bytes` hands it to `set_input` without another copy.
+pub fn images_to_tensor(
+    images: &[ImageBuffer<Rgba<u8>, Vec<u8>>],
+    buffer: &mut Vec<f32>,
+) -> Result<(), Box<dyn Error>> {
+    // Every element is overwritten below, so only newly grown space is zeroed
+    buffer.resize(images.len() * IMAGE_SIZE, 0.0);
+    for (image, out) in images.iter().zip(buffer.chunks_exact_mut(IMAGE_SIZE)) {
+        image_into(image, out)?;
+    }
+    Ok(())
+}
 
-        // range [0, 255] -> range [0, 1]
-        (channels[c] as f32) / 255.0
-    });
+fn image_into(image: &ImageBuffer<Rgba<u8>, Vec<u8>>, out: &mut [f32]) -> Result<(), String> {
+    if image.dimensions() != (224, 224) {
+        return Err(format!("image is {:?}, expected 224x224", image.dimensions()));
+    }
+    preprocess::rgba_to_chw(image.as_raw(), &preprocess::Normalization::default(), out);
+    Ok(())
+}
 
-    let mean = [0.485, 0.456, 0.406];
-    let std = [0.229, 0.224, 0.225];
-    for c in 0..3 {
-        let mut channel_array = array.slice_mut(s![0, c, .., ..]);
-        channel_array -= mean[c];
-        channel_array /= std[c];
+/// Read, decode and pre-process the files at `paths`, images or pre-decoded
+/// tensors (see `inputs`), into `buffer` like `images_to_tensor`, spread over
+/// `threads` threads: each takes a contiguous share of the files and writes
+/// straight into its part of the buffer. Threads need the
+/// `wasm32-wasip1-threads` build and a host with wasi-threads, see
+/// `preprocess_threads`.
+fn read_images_to_tensor(
+    paths: &[PathBuf],
+    buffer: &mut Vec<f32>,
+    threads: usize,
+) -> Result<(), Box<dyn Error>> {
+    buffer.resize(paths.len() * IMAGE_SIZE, 0.0);
+    if threads <= 1 || paths.len() < 2 {
+        for (path, out) in paths.iter().zip(buffer.chunks_exact_mut(IMAGE_SIZE)) {
+            inputs::load_into(path, out).map_err(|e| format!("{}: {}", path.display(), e))?;
+        }
+        return Ok(());
     }
 
-    Ok(f32_vec_to_bytes(array.as_slice().unwrap().to_vec()))
+    let per_thread = (paths.len() + threads - 1) / threads;
+    std::thread::scope(|scope| {
+        let handles: Vec<_> = paths
+            .chunks(per_thread)
+            .zip(buffer.chunks_mut(per_thread * IMAGE_SIZE))
+            .map(|(paths, out)| {
+                scope.spawn(move || -> Result<(), String> {
+                    for (path, out) in paths.iter().zip(out.chunks_exact_mut(IMAGE_SIZE)) {
+                        inputs::load_into(path, out)
+                            .map_err(|e| format!("{}: {}", path.display(), e))?;
+                    }
+                    Ok(())
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .map(|handle| handle.join().unwrap_or_else(|_| Err("pre-processing thread panicked".into())))
+            .collect::<Result<(), String>>()
+    })?;
+    Ok(())
 }
 
-fn f32_vec_to_bytes(data: Vec<f32>) -> Vec<u8> {
-    let chunks: Vec<[u8; 4]> = data.into_iter().map(|f| f.to_le_bytes()).collect();
-    let mut result: Vec<u8> = Vec::new();
-
-    for c in chunks {
-        for u in c.iter() {
-            result.push(*u);
+/// `read_images_to_tensor` through `cache`: cached tensors are copied into
+/// place and only the others are read, on `threads` threads, and cached.
+fn load_batch(
+    paths: &[PathBuf],
+    buffer: &mut Vec<f32>,
+    threads: usize,
+    cache: &mut inputs::TensorCache,
+) -> Result<(), Box<dyn Error>> {
+    if !cache.is_enabled() {
+        return read_images_to_tensor(paths, buffer, threads);
+    }
+    buffer.resize(paths.len() * IMAGE_SIZE, 0.0);
+    let mut missing = Vec::new();
+    for (index, (path, out)) in paths.iter().zip(buffer.chunks_exact_mut(IMAGE_SIZE)).enumerate() {
+        if !cache.get(path, out) {
+            missing.push(index);
         }
     }
-    result
+    if missing.is_empty() {
+        return Ok(());
+    }
+
+    let missing_paths: Vec<PathBuf> = missing.iter().map(|&index| paths[index].clone()).collect();
+    let mut loaded = Vec::new();
+    read_images_to_tensor(&missing_paths, &mut loaded, threads)?;
+    for (&index, tensor) in missing.iter().zip(loaded.chunks_exact(IMAGE_SIZE)) {
+        buffer[index * IMAGE_SIZE..(index + 1) * IMAGE_SIZE].copy_from_slice(tensor);
+        cache.insert(&paths[index], tensor);
+    }
+    Ok(())
+}
+
+/// Threads for pre-processing, passed by the host as NN_PREPROCESS_THREADS
+/// when it links wasi-threads; always 1 in builds without atomics, where
+/// `std::thread` cannot spawn.
+fn preprocess_threads() -> usize {
+    if !cfg!(target_feature = "atomics") {
+        return 1;
+    }
+    env::var("NN_PREPROCESS_THREADS")
+        .ok()
+        .and_then(|value| value.parse().ok())
+        .unwrap_or(1)
 }
 
-fn process_image(image_path: ImageBuffer<Rgba<u8>, Vec<u8>>) -> Result<Vec<u8>, Box<dyn Error>> {
-    image_to_tensor(image_path)
+fn process_image(
+    image: &ImageBuffer<Rgba<u8>, Vec<u8>>,
+    buffer: &mut Vec<f32>,
+) -> Result<(), Box<dyn Error>> {
+    image_to_tensor(image, buffer)
 }
 
-fn run_model(context: &mut GraphExecutionContext) -> Result<(), Box<dyn Error>> {
+fn run_model(context: &mut Context) -> Result<(), Box<dyn Error>> {
     context.compute().map_err(|_| {
         Box::<dyn std::error::Error>::from("Error occurred while running the model")
     })?;
@@ -283,28 +569,13 @@ fn run_model(context: &mut GraphExecutionContext) -> Result<(), Box<dyn Error>>
 }
 
 fn post_process(
-    context: &mut GraphExecutionContext,
+    context: &mut Context,
+    output: &mut OutputBuffer,
     image_name: &str,
 ) -> Result<i32, Box<dyn Error>> {
-    const OUTPUT_BUFFER_CAPACITY: usize = 4000;
-    let mut output_buffer: Vec<f32> = vec![0.0; OUTPUT_BUFFER_CAPACITY];
-    let context = context;
-
-    match context.get_output(0, &mut output_buffer) {
-        Ok(_) => (),
-        Err(_) => return Err("Error occurred while getting output".into()),
-    }
-
-    let result = output_buffer
-        .iter()
-        .cloned()
-        .zip(RangeFrom::<i32> { start: 1 })
-        .max_by(|(score1, _), (score2, _)| score1.partial_cmp(score2).unwrap_or(Ordering::Equal))
-        .map_or_else(|| Err("testing"), Ok);
-
-    match result {
+    match classify(context, output) {
         Ok((score, class)) => {
-            println!("{}: {} (score: {})", image_name, class, score);
+            println!("{}: {} (score: {})", image_name, postprocess::describe(class), score);
             Ok(class)
         }
         Err(error) => {
@@ -314,6 +585,520 @@ fn post_process(
     }
 }
 
+/// Return the best `(score, class)` of output 0, read into `output`.
+fn classify(
+    context: &mut Context,
+    output: &mut OutputBuffer,
+) -> Result<(f32, i32), Box<dyn Error>> {
+    let scores = output.read(context, 0)?;
+    postprocess::best_class(scores).ok_or_else(|| "Empty output buffer".into())
+}
+
+/// The witx side of `abi_bench`: the calls of one inference on the image at
+/// `image_path`, pre-processed once, each timed `iterations` times.
+fn run_abi_bench(
+    model_path: &str,
+    image_path: &str,
+    iterations: usize,
+) -> Result<(), Box<dyn Error>> {
+    let encoded = fs::read(image_path)?;
+    let mut input: Vec<f32> = vec![0.0; IMAGE_SIZE];
+    inputs::decode(Path::new(image_path), &encoded)?.to_tensor(&mut input)?;
+
+    let mut context = initialize_env(load_model(model_path)?)?;
+    context.select_outputs(&[0])?;
+    let tensor = preprocess::as_bytes(&input);
+    let mut output: Vec<f32> = Vec::new();
+    let mut bench = abi_bench::AbiBench::new("witx");
+    for _ in 0..iterations {
+        bench.time("set_input", || {
+            context.set_input(0, &[1, 3, 224, 224], tensor)
+        })?;
+        bench.time("compute", || context.compute())?;
+        let len = bench.time("get_output_size", || context.output_len(0))?;
+        output.resize(len, 0.0);
+        bench.time("get_output", || context.get_output(0, &mut output))?;
+    }
+    bench.report();
+    Ok(())
+}
+
+/// The steps of `main` with decoding, resizing and normalization done by the
+/// host (`host_preprocess`). `readimg` only reads the encoded file here, so
+/// compare `readimg` + `Pre-processing` against `readimg` + `decode` +
+/// `Pre-processing` of the pure Wasm pipeline.
+fn run_host_assisted(
+    tracker: &mut BenchmarkTracker,
+    model_path: &str,
+    image_path: &str,
+) -> Result<i32, Box<dyn Error>> {
+    tracker.start_phase("RED BOX Phase");
+    tracker.start_operation("loadmodel+envload");
+    let context = initialize_env(load_model(model_path)?)?;
+    let mut session = host_preprocess::HostSession::new(context)?;
+    tracker.finish_operation();
+
+    tracker.start_operation("readimg");
+    let encoded = fs::read(image_path)?;
+    tracker.finish_operation();
+    tracker.end_phase("RED BOX Phase");
+
+    tracker.start_phase("GREEN BOX Phase");
+    tracker.start_operation("Pre-processing");
+    session.set_input_from_image(&encoded)?;
+    tracker.finish_operation();
+
+    tracker.start_operation("Inference");
+    session.context().compute()?;
+    tracker.finish_operation();
+
+    tracker.start_operation("Post-processing");
+    let (score, class) = classify(session.context(), &mut OutputBuffer::default())?;
+    println!("{}: {} (score: {})", image_path, postprocess::describe(class), score);
+    tracker.finish_operation();
+    tracker.end_phase("GREEN BOX Phase");
+    Ok(class)
+}
+
+/// Print the collected metrics and append them to BENCH_RESULTS, which the
+/// host sets when the harness collects structured results.
+fn report(tracker: &BenchmarkTracker) {
+    tracker.print_all_metrics();
+    if let Ok(results_path) = env::var("BENCH_RESULTS") {
+        if let Err(error) = tracker.export_jsonl(results_path.as_str()) {
+            println!("Error writing results to {}: {}", results_path, error);
+        }
+    }
+}
+
+/// Return the `k` best `(score, class)` pairs of every row of output 0 for a
+/// batch of `batch_size` inputs, as probabilities if `softmax` is set.
+fn classify_batch(
+    context: &mut Context,
+    output: &mut OutputBuffer,
+    batch_size: usize,
+    k: usize,
+    softmax: bool,
+) -> Result<Vec<Vec<(f32, i32)>>, Box<dyn Error>> {
+    let scores = output.read(context, 0)?;
+    if batch_size == 0 || scores.len() % batch_size != 0 {
+        return Err(format!("{} outputs do not split into {} rows", scores.len(), batch_size).into());
+    }
+
+    let classes = scores.len() / batch_size;
+    Ok(scores
+        .chunks_exact(classes)
+        .map(|row| {
+            let mut best = postprocess::top_k(row, k);
+            if softmax {
+                postprocess::softmax(row, &mut best);
+            }
+            best
+        })
+        .collect())
+}
+
+/// Classify every `.jpg`/`.jpeg`/`.png` image and pre-decoded `.rgb`/`.f32`/
+/// `.u8` tensor in `dir` in batches of `batch_size`, `passes` times over, and
+/// print the top `k` classes of each on the first pass. `decode-<n>` covers
+/// reading, decoding and pre-processing batch `n`, or copying it from the
+/// `TensorCache`, and `batch-<n>` the rest.
+fn run_batches(
+    context: &mut Context,
+    tracker: &mut BenchmarkTracker,
+    dir: &str,
+    batch_size: usize,
+    k: usize,
+    passes: usize,
+) -> Result<(), Box<dyn Error>> {
+    let mut paths: Vec<_> = fs::read_dir(dir)?
+        .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+        .filter(|path| {
+            let extension = path.extension().map(|e| e.to_string_lossy().to_lowercase());
+            inputs::Format::of(path) != inputs::Format::Encoded
+                || matches!(extension.as_deref(), Some("jpg") | Some("jpeg") | Some("png"))
+        })
+        .collect();
+    paths.sort();
+    if paths.is_empty() {
+        return Err(format!("no images in {}", dir).into());
+    }
+
+    let threads = preprocess_threads();
+    let softmax = postprocess::softmax_enabled();
+    let start = Instant::now();
+    let mut input: Vec<f32> = Vec::new();
+    let mut output = OutputBuffer::default();
+    let mut cache = inputs::TensorCache::from_env();
+    let batches = paths.chunks(batch_size.max(1)).count();
+    for pass in 0..passes.max(1) {
+        for (index, batch) in paths.chunks(batch_size.max(1)).enumerate() {
+            let step = pass * batches + index;
+            tracker.start_operation(&format!("decode-{}", step));
+            load_batch(batch, &mut input, threads, &mut cache)?;
+            tracker.finish_operation();
+
+            tracker.start_operation(&format!("batch-{}", step));
+            let dimensions = [batch.len() as u32, 3, 224, 224];
+            if context
+                .set_input(0, &dimensions, preprocess::as_bytes(&input))
+                .is_err()
+            {
+                return Err(format!("Error setting a batch of {} images", batch.len()).into());
+            }
+            run_model(context)?;
+            let rows = classify_batch(context, &mut output, batch.len(), k, softmax)?;
+            tracker.finish_operation();
+
+            if pass > 0 {
+                continue;
+            }
+            for (path, row) in batch.iter().zip(rows) {
+                let classes: Vec<String> = row
+                    .iter()
+                    .map(|(score, class)| {
+                        format!("{} ({:.3})", postprocess::describe(*class), score)
+                    })
+                    .collect();
+                println!("{}: {}", path.display(), classes.join(", "));
+            }
+        }
+    }
+
+    let elapsed = start.elapsed();
+    let classified = paths.len() * passes.max(1);
+    println!(
+        "Classified {} images in batches of {} in {:?} ({:.1} images/s)",
+        classified,
+        batch_size,
+        elapsed,
+        classified as f64 / elapsed.as_secs_f64()
+    );
+    if cache.is_enabled() {
+        println!("Tensor cache: {} hits, {} misses", cache.hits, cache.misses);
+    }
+    Ok(())
+}
+
+/// Batch mode settings, passed by the host as NN_BATCH_DIR, NN_BATCH_SIZE,
+/// NN_TOP_K and NN_BATCH_PASSES.
+fn batch_settings() -> Option<(String, usize, usize, usize)> {
+    let dir = env::var("NN_BATCH_DIR").ok()?;
+    let number = |name: &str, default: usize| {
+        env::var(name)
+            .ok()
+            .and_then(|value| value.parse().ok())
+            .unwrap_or(default)
+    };
+    Some((
+        dir,
+        number("NN_BATCH_SIZE", 8),
+        number("NN_TOP_K", 5),
+        number("NN_BATCH_PASSES", 1),
+    ))
+}
+
+/// Stream mode, set by the host as NN_STREAM: classify length-prefixed
+/// encoded images from stdin as they arrive, until end of input or a zero
+/// length. Each frame is a little-endian u32 byte count and the image.
+///
+/// The graph, context and buffers stay resident across items and decoding
+/// runs in the request arena, like `nn_infer`. Every item gets one line on
+/// stdout, `<seq> <class> <score>` or `<seq> error <message>`, flushed so
+/// the host sees it at once; anything else goes to stderr. Returns the
+/// number of items read.
+fn run_stream(context: &mut Context) -> Result<u64, Box<dyn Error>> {
+    let mut stdin = std::io::stdin().lock();
+    let mut stdout = std::io::stdout().lock();
+    let mut encoded: Vec<u8> = Vec::new();
+    let mut input: Vec<f32> = vec![0.0; IMAGE_SIZE];
+    let mut output = OutputBuffer::default();
+    let start = Instant::now();
+
+    let mut seq: u64 = 0;
+    loop {
+        let mut length = [0u8; 4];
+        match stdin.read_exact(&mut length) {
+            Ok(()) => {}
+            Err(error) if error.kind() == ErrorKind::UnexpectedEof => break,
+            Err(error) => return Err(error.into()),
+        }
+        let length = u32::from_le_bytes(length) as usize;
+        if length == 0 {
+            break;
+        }
+        encoded.resize(length, 0);
+        stdin.read_exact(&mut encoded)?;
+
+        let decoded = arena::scope(|| match decode_img(&encoded) {
+            Ok(image) => image_into(&image, &mut input).is_ok(),
+            Err(_) => false,
+        });
+        let answer = if !decoded {
+            Err("cannot decode the image".into())
+        } else {
+            let tensor = preprocess::as_bytes(&input);
+            context
+                .set_input(0, &[1, 3, 224, 224], tensor)
+                .map_err(|_| Box::<dyn Error>::from("Error setting the input"))
+                .and_then(|_| run_model(context))
+                .and_then(|_| classify(context, &mut output))
+        };
+        match answer {
+            Ok((score, class)) => writeln!(stdout, "{} {} {}", seq, class, score)?,
+            Err(error) => writeln!(stdout, "{} error {}", seq, error)?,
+        }
+        stdout.flush()?;
+        seq += 1;
+    }
+
+    let elapsed = start.elapsed();
+    eprintln!(
+        "Streamed {} images in {:?} ({:.1} images/s)",
+        seq,
+        elapsed,
+        seq as f64 / elapsed.as_secs_f64()
+    );
+    Ok(seq)
+}
+
+const MODEL_PATH: &str = "/assets/models/mobilenetv2-10.onnx";
+const IMAGE_PATH: &str = "/assets/imgs/unseen_dog.jpg";
+
+/// The loaded model and its execution context, kept in a guest global
+/// between calls of the `nn_*` exports so the host can amortize graph load
+/// and context creation across requests.
+struct InferenceSession {
+    /// Owns the graph too; dropping the session releases both on the host.
+    context: Context,
+    /// Pre-processed input, reused by every `nn_infer`.
+    input: Vec<f32>,
+    /// Scores of output 0, sized by the first `nn_infer`.
+    output: OutputBuffer,
+}
+
+thread_local! {
+    static SESSION: RefCell<Option<InferenceSession>> = RefCell::new(None);
+}
+
+/// Allocate `len` bytes of guest memory for the host to write the arguments
+/// of `nn_init`/`nn_infer` into.
+#[no_mangle]
+pub extern "C" fn nn_alloc(len: u32) -> *mut u8 {
+    let mut buffer: Vec<u8> = Vec::with_capacity(len as usize);
+    let ptr = buffer.as_mut_ptr();
+    std::mem::forget(buffer);
+    ptr
+}
+
+/// Release a buffer returned by `nn_alloc`.
+///
+/// # Safety
+/// `ptr` and `len` must come from the same `nn_alloc` call.
+#[no_mangle]
+pub unsafe extern "C" fn nn_free(ptr: *mut u8, len: u32) {
+    drop(Vec::from_raw_parts(ptr, 0, len as usize));
+}
+
+/// Load the model at the guest path `model_path` and create its execution
+/// context, replacing any previous session. The previous graph and context
+/// are dropped on the host first, so a re-init never holds two backend
+/// sessions at once; if loading fails there is no session afterwards.
+/// Returns 0 on success.
+///
+/// # Safety
+/// `model_path_ptr` must point to `model_path_len` bytes of UTF-8.
+#[no_mangle]
+pub unsafe extern "C" fn nn_init(model_path_ptr: *const u8, model_path_len: u32) -> i32 {
+    trace::init();
+    let model_path = match std::str::from_utf8(std::slice::from_raw_parts(
+        model_path_ptr,
+        model_path_len as usize,
+    )) {
+        Ok(model_path) => model_path,
+        Err(_) => return -1,
+    };
+
+    drop(SESSION.with(|session| session.borrow_mut().take()));
+    let model = match load_model(model_path) {
+        Ok(model) => model,
+        Err(error) => {
+            println!("Error loading model {}: {}", model_path, error);
+            return -1;
+        }
+    };
+    let context = match initialize_env(model) {
+        Ok(context) => context,
+        Err(error) => {
+            println!("{}", error);
+            return -1;
+        }
+    };
+
+    SESSION.with(|session| *session.borrow_mut() = Some(InferenceSession {
+            context,
+            input: Vec::new(),
+            output: OutputBuffer::default(),
+        }));
+    0
+}
+
+// Ring-buffer probes of the steps of `nn_infer`, see `trace`
+static DECODE: trace::Probe = trace::Probe::new("decode");
+static PREPROCESS: trace::Probe = trace::Probe::new("preprocess");
+static SET_INPUT: trace::Probe = trace::Probe::new("set_input");
+static COMPUTE: trace::Probe = trace::Probe::new("compute");
+static CLASSIFY: trace::Probe = trace::Probe::new("classify");
+
+/// Classify one encoded image (JPEG, PNG, ...) of `input_len` bytes: decode,
+/// pre-process, run inference and post-process on the session set up by
+/// `nn_init`. Returns the predicted class, or -1 on error.
+///
+/// # Safety
+/// `input_ptr` must point to `input_len` readable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn nn_infer(input_ptr: *const u8, input_len: u32) -> i32 {
+    let encoded = std::slice::from_raw_parts(input_ptr, input_len as usize);
+    SESSION.with(|session| {
+        let mut session = session.borrow_mut();
+        let session = match session.as_mut() {
+            Some(session) => session,
+            None => return -1,
+        };
+
+        // Decoding and resizing allocate afresh for every request, so they
+        // run in the request arena; the input is sized before, as it is kept.
+        session.input.resize(IMAGE_SIZE, 0.0);
+        let input = &mut session.input;
+        let processed = arena::scope(|| match DECODE.time(|| decode_img(encoded)) {
+            Ok(image) => PREPROCESS.time(|| process_image(&image, input).is_ok()),
+            Err(_) => false,
+        });
+        if !processed {
+            return -1;
+        }
+        let context = &mut session.context;
+        let tensor = preprocess::as_bytes(&session.input);
+        let set = SET_INPUT.time(|| context.set_input(0, &[1, 3, 224, 224], tensor));
+        if set.is_err() {
+            return -1;
+        }
+        if COMPUTE.time(|| run_model(context)).is_err() {
+            return -1;
+        }
+        match CLASSIFY.time(|| classify(context, &mut session.output)) {
+            Ok((_, class)) => class,
+            Err(_) => -1,
+        }
+    })
+}
+
+// The steps of `nn_infer` as separate exports for the host's pipelined mode,
+// which runs each one in its own instance and thread. Buffers are passed by
+// the host, allocated with `nn_alloc`, so they are suitably aligned for f32.
+
+/// Pipeline stage 1: decode and pre-process one encoded image into the
+/// `[1, 3, 224, 224]` f32 tensor at `tensor_ptr` (`tensor_len` bytes). Needs
+/// no session. Returns 0, or -1 on error.
+///
+/// # Safety
+/// `input_ptr` must point to `input_len` readable bytes and `tensor_ptr` to
+/// `tensor_len` writable, 4-byte aligned bytes.
+#[no_mangle]
+pub unsafe extern "C" fn nn_preprocess(
+    input_ptr: *const u8,
+    input_len: u32,
+    tensor_ptr: *mut u8,
+    tensor_len: u32,
+) -> i32 {
+    const TENSOR_LEN: usize = 3 * 224 * 224;
+    if tensor_len as usize != TENSOR_LEN * std::mem::size_of::<f32>() {
+        return -1;
+    }
+    let encoded = std::slice::from_raw_parts(input_ptr, input_len as usize);
+    let tensor = std::slice::from_raw_parts_mut(tensor_ptr as *mut f32, TENSOR_LEN);
+    arena::scope(|| match decode_img(encoded) {
+        Ok(image) => {
+            preprocess::rgba_to_chw(
+                image.as_raw(),
+                &preprocess::Normalization::default(),
+                tensor,
+            );
+            0
+        }
+        Err(_) => -1,
+    })
+}
+
+/// Pipeline stage 2: set the tensor bytes at `tensor_ptr` as input 0 of the
+/// session's context, compute and copy output 0 into `scores_ptr`
+/// (`scores_len` bytes). Returns the number of scores written, or -1.
+///
+/// # Safety
+/// `tensor_ptr` must point to `tensor_len` readable bytes and `scores_ptr` to
+/// `scores_len` writable, 4-byte aligned bytes.
+#[no_mangle]
+pub unsafe extern "C" fn nn_compute(
+    tensor_ptr: *const u8,
+    tensor_len: u32,
+    scores_ptr: *mut u8,
+    scores_len: u32,
+) -> i32 {
+    let tensor = std::slice::from_raw_parts(tensor_ptr, tensor_len as usize);
+    let scores = std::slice::from_raw_parts_mut(
+        scores_ptr as *mut f32,
+        scores_len as usize / std::mem::size_of::<f32>(),
+    );
+    SESSION.with(|session| {
+        let mut session = session.borrow_mut();
+        let session = match session.as_mut() {
+            Some(session) => session,
+            None => return -1,
+        };
+        if session
+            .context
+            .set_input(0, &[1, 3, 224, 224], tensor)
+            .is_err()
+        {
+            return -1;
+        }
+        if run_model(&mut session.context).is_err() {
+            return -1;
+        }
+        match session.context.get_output(0, scores) {
+            Ok(written) => written as i32,
+            Err(_) => -1,
+        }
+    })
+}
+
+/// Pipeline stage 3: the predicted class of the `scores_len` bytes of f32
+/// scores at `scores_ptr`, or -1 if there are none.
+///
+/// # Safety
+/// `scores_ptr` must point to `scores_len` readable, 4-byte aligned bytes.
+#[no_mangle]
+pub unsafe extern "C" fn nn_postprocess(scores_ptr: *const u8, scores_len: u32) -> i32 {
+    let scores = std::slice::from_raw_parts(
+        scores_ptr as *const f32,
+        scores_len as usize / std::mem::size_of::<f32>(),
+    );
+    match postprocess::best_class(scores) {
+        Some((_, class)) => class,
+        None => -1,
+    }
+}
+
+/// Drop the session created by `nn_init`, which gives its execution context
+/// and graph back to the host. Returns 0 if there was one.
+#[no_mangle]
+pub extern "C" fn nn_shutdown() -> i32 {
+    match SESSION.with(|session| session.borrow_mut().take()) {
+        Some(_) => 0,
+        None => -1,
+    }
+}
+
 #[no_mangle]
 pub fn main() {
     // let args: Vec<String> = env::args().collect();
@@ -322,25 +1107,94 @@ pub fn main() {
     //     return Err(format!("Usage: {} <model> <image>", args[0]).into());
     // }
 
-    let model_path: String = String::from("/assets/models/mobilenetv2-10.onnx");
-    let image_path: String = String::from("/assets/imgs/unseen_dog.jpg");
+    // The host passes `--model` as NN_MODEL, e.g. an OpenVINO .xml, and
+    // `--image` as NN_IMAGE when the image is in a preopened directory
+    let model_path: String = env::var("NN_MODEL").unwrap_or_else(|_| String::from(MODEL_PATH));
+    let image_path: String = env::var("NN_IMAGE").unwrap_or_else(|_| String::from(IMAGE_PATH));
 
+    trace::init();
     let mut tracker: BenchmarkTracker = BenchmarkTracker::new();
 
+    // The host passes `--abi-bench` as NN_ABI_BENCH
+    if let Some(iterations) = abi_bench::iterations() {
+        if let Err(error) = run_abi_bench(&model_path, &image_path, iterations) {
+            println!("Error: {}", error);
+        }
+        return;
+    }
+
+    if env::var_os("NN_HOST_PREPROCESS").is_some() {
+        match run_host_assisted(&mut tracker, &model_path, &image_path) {
+            Ok(output) => {
+                report(&tracker);
+                println!("Predicted Class Index: {}", output);
+            }
+            Err(error) => println!("Error: {}", error),
+        }
+        return;
+    }
+
     // RED BOX: Environment setup, image loading, processing, and model loading
     tracker.start_phase("RED BOX Phase");
 
     tracker.start_operation("loadmodel");
-    let model: Result<Graph, wasi_nn::Error> = load_model(model_path.as_str());
-    let model = model.unwrap();
+    let model: Graph = load_model(model_path.as_str()).unwrap();
     tracker.finish_operation();
 
     tracker.start_operation("envload");
-    let mut context: GraphExecutionContext<'_> = initialize_env(&model).unwrap();
+    let mut context: Context = initialize_env(model).unwrap();
     tracker.finish_operation();
 
+    // The host passes `--detect` as NN_DETECT_IMAGE
+    if let Ok(path) = env::var("NN_DETECT_IMAGE") {
+        match detect::run(&mut context, &mut tracker, &path) {
+            Ok(detections) => {
+                report(&tracker);
+                println!("Detections: {}", detections);
+            }
+            Err(error) => println!("Error: {}", error),
+        }
+        return;
+    }
+
+    // The host passes `--stream` as NN_STREAM. Answers own stdout, so the
+    // metrics only go to BENCH_RESULTS.
+    if env::var_os("NN_STREAM").is_some() {
+        tracker.end_phase("RED BOX Phase");
+        tracker.start_phase("Stream Phase");
+        tracker.start_operation("stream");
+        let streamed = run_stream(&mut context);
+        tracker.finish_operation();
+        tracker.end_phase("Stream Phase");
+        if let Err(error) = streamed {
+            eprintln!("Error: {}", error);
+        }
+        if let Ok(results_path) = env::var("BENCH_RESULTS") {
+            if let Err(error) = tracker.export_jsonl(results_path.as_str()) {
+                eprintln!("Error writing results to {}: {}", results_path, error);
+            }
+        }
+        return;
+    }
+
+    if let Some((dir, batch_size, k, passes)) = batch_settings() {
+        tracker.end_phase("RED BOX Phase");
+        tracker.start_phase("Batch Phase");
+        if let Err(error) = run_batches(&mut context, &mut tracker, &dir, batch_size, k, passes) {
+            println!("Error: {}", error);
+        }
+        tracker.end_phase("Batch Phase");
+        report(&tracker);
+        return;
+    }
+
     tracker.start_operation("readimg");
-    let original_img: ImageBuffer<Rgba<u8>, Vec<u8>> = read_img(image_path.as_str()).unwrap();
+    let encoded: Vec<u8> = fs::read(image_path.as_str()).unwrap();
+    tracker.finish_operation();
+
+    // Decoding and resizing, or nothing for a pre-decoded tensor
+    tracker.start_operation("decode");
+    let decoded = inputs::decode(Path::new(&image_path), &encoded).unwrap();
     tracker.finish_operation();
 
     tracker.end_phase("RED BOX Phase");
@@ -349,21 +1203,31 @@ pub fn main() {
     tracker.start_phase("GREEN BOX Phase");
 
     tracker.start_operation("Pre-processing");
-    let input = process_image(original_img).unwrap();
-    context.set_input(0, wasi_nn::TensorType::F32, &[1, 3, 224, 224], &input);
+    let mut input: Vec<f32> = vec![0.0; IMAGE_SIZE];
+    decoded.to_tensor(&mut input).unwrap();
+    let _ = context.set_input(0, &[1, 3, 224, 224], preprocess::as_bytes(&input));
     tracker.finish_operation();
 
+    // The host passes `--save-tensor` as NN_SAVE_TENSOR: the input as a
+    // pre-decoded .rgb file, for later runs without decoding
+    if let Ok(path) = env::var("NN_SAVE_TENSOR") {
+        if let Err(error) = fs::write(&path, preprocess::as_bytes(&input)) {
+            println!("Error writing the input tensor to {}: {}", path, error);
+        }
+    }
+
     tracker.start_operation("Inference");
     let _ = run_model(&mut context);
     tracker.finish_operation();
 
     tracker.start_operation("Post-processing");
-    let output: i32 = post_process(&mut context, image_path.as_str()).unwrap();
+    let mut scores = OutputBuffer::default();
+    let output: i32 = post_process(&mut context, &mut scores, image_path.as_str()).unwrap();
     tracker.finish_operation();
 
     tracker.end_phase("GREEN BOX Phase");
 
-    tracker.print_all_metrics();
+    report(&tracker);
 
     println!("Predicted Class Index: {}", output);
 
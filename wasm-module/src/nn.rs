@@ -0,0 +1,268 @@
+//! The `wasi_ephemeral_nn` imports, called directly rather than through the
+//! `wasi-nn` crate. The crate keeps its graph and execution context handles
+//! to itself, so it can neither size an output with `get_output_size`, nor
+//! hand a context to the host (see `host_preprocess`), nor give a graph
+//! back. A [`Graph`] and a [`Context`] own their handles and drop them on
+//! the host when they are dropped, so a long-running instance that loads
+//! models again and again does not pile up ORT sessions.
+
+use std::error::Error;
+use std::fmt;
+
+pub mod sys {
+    /// One `$graph_builder` of a `$graph_builder_array`.
+    #[repr(C)]
+    pub struct GraphBuilder {
+        pub ptr: *const u8,
+        pub len: u32,
+    }
+
+    #[link(wasm_import_module = "wasi_ephemeral_nn")]
+    extern "C" {
+        #[link_name = "load"]
+        pub fn nn_load(
+            builders: *const GraphBuilder,
+            builders_len: u32,
+            encoding: u32,
+            target: u32,
+            graph: *mut u32,
+        ) -> u32;
+        #[link_name = "load_by_name"]
+        pub fn nn_load_by_name(name: *const u8, name_len: u32, graph: *mut u32) -> u32;
+        #[link_name = "init_execution_context"]
+        pub fn nn_init_execution_context(graph: u32, context: *mut u32) -> u32;
+        #[link_name = "set_input"]
+        pub fn nn_set_input(context: u32, index: u32, tensor: *const Tensor) -> u32;
+        #[link_name = "compute"]
+        pub fn nn_compute(context: u32) -> u32;
+        #[link_name = "get_output"]
+        pub fn nn_get_output(
+            context: u32,
+            index: u32,
+            out: *mut u8,
+            out_max: u32,
+            written: *mut u32,
+        ) -> u32;
+        #[link_name = "get_input_info"]
+        pub fn nn_get_input_info(
+            context: u32,
+            index: u32,
+            dimensions: *mut i64,
+            dimensions_max: u32,
+            info: *mut TensorInfo,
+        ) -> u32;
+        #[link_name = "get_output_size"]
+        pub fn nn_get_output_size(context: u32, index: u32, size: *mut u32) -> u32;
+        #[link_name = "select_outputs"]
+        pub fn nn_select_outputs(context: u32, indices: *const u32, indices_len: u32) -> u32;
+        #[link_name = "drop_execution_context"]
+        pub fn nn_drop_execution_context(context: u32) -> u32;
+        #[link_name = "drop_graph"]
+        pub fn nn_drop_graph(graph: u32) -> u32;
+    }
+
+    /// A `$tensor`: its dimensions, element type and data.
+    #[repr(C)]
+    pub struct Tensor {
+        pub dimensions: *const u32,
+        pub dimensions_len: u32,
+        pub tensor_type: u8,
+        pub data: *const u8,
+        pub data_len: u32,
+    }
+
+    /// A `$tensor_info`: the element type and how many dimensions were
+    /// written.
+    #[repr(C)]
+    #[derive(Default)]
+    pub struct TensorInfo {
+        pub tensor_type: u8,
+        pub rank: u32,
+    }
+}
+
+/// `$graph_encoding` values.
+pub const ENCODING_OPENVINO: u32 = 0;
+pub const ENCODING_ONNX: u32 = 1;
+
+/// `$execution_target` values.
+pub const TARGET_CPU: u32 = 0;
+pub const TARGET_GPU: u32 = 1;
+pub const TARGET_TPU: u32 = 2;
+
+const TENSOR_TYPE_F32: u8 = 1;
+
+/// The `$nn_errno` of a buffer too small for the output.
+const ERRNO_TOO_LARGE: u32 = 7;
+
+/// A call that returned an `$nn_errno` other than success.
+#[derive(Debug)]
+pub struct Errno {
+    operation: &'static str,
+    errno: u32,
+}
+
+impl Errno {
+    /// Whether the guest's buffer was too small, so a larger one would do.
+    pub fn is_too_large(&self) -> bool {
+        self.errno == ERRNO_TOO_LARGE
+    }
+}
+
+impl fmt::Display for Errno {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{} failed with wasi-nn errno {}",
+            self.operation, self.errno
+        )
+    }
+}
+
+impl Error for Errno {}
+
+fn check(operation: &'static str, errno: u32) -> Result<(), Errno> {
+    match errno {
+        0 => Ok(()),
+        errno => Err(Errno { operation, errno }),
+    }
+}
+
+/// A graph handle, dropped on the host with the `Graph`.
+pub struct Graph(u32);
+
+impl Graph {
+    /// The graph the host preloaded as `name`, if there is one.
+    pub fn by_name(name: &str) -> Option<Self> {
+        let mut graph = 0;
+        let errno = unsafe { sys::nn_load_by_name(name.as_ptr(), name.len() as u32, &mut graph) };
+        check("load_by_name", errno).ok().map(|()| Self(graph))
+    }
+
+    /// Load a graph from `builders`, e.g. an ONNX model or OpenVINO's
+    /// topology and weights.
+    pub fn load(builders: &[&[u8]], encoding: u32, target: u32) -> Result<Self, Errno> {
+        let builders: Vec<sys::GraphBuilder> = builders
+            .iter()
+            .map(|builder| sys::GraphBuilder {
+                ptr: builder.as_ptr(),
+                len: builder.len() as u32,
+            })
+            .collect();
+        let mut graph = 0;
+        check("load", unsafe {
+            sys::nn_load(
+                builders.as_ptr(),
+                builders.len() as u32,
+                encoding,
+                target,
+                &mut graph,
+            )
+        })?;
+        Ok(Self(graph))
+    }
+
+    /// Create an execution context, which owns the graph from then on.
+    pub fn init_execution_context(self) -> Result<Context, Errno> {
+        let mut context = 0;
+        check("init_execution_context", unsafe {
+            sys::nn_init_execution_context(self.0, &mut context)
+        })?;
+        Ok(Context {
+            handle: context,
+            _graph: self,
+        })
+    }
+}
+
+impl Drop for Graph {
+    fn drop(&mut self) {
+        unsafe { sys::nn_drop_graph(self.0) };
+    }
+}
+
+/// An execution context handle and the graph it was created from; dropping
+/// it drops the context on the host, then the graph.
+pub struct Context {
+    handle: u32,
+    _graph: Graph,
+}
+
+impl Context {
+    /// The raw handle, for imports that take one, e.g. `preprocess`'s.
+    pub fn handle(&self) -> u32 {
+        self.handle
+    }
+
+    /// Have `compute` produce only the outputs at `indices`.
+    pub fn select_outputs(&mut self, indices: &[u32]) -> Result<(), Errno> {
+        check("select_outputs", unsafe {
+            sys::nn_select_outputs(self.handle, indices.as_ptr(), indices.len() as u32)
+        })
+    }
+
+    /// Write the dimensions of input `index` to `dimensions`, negative where
+    /// the model leaves them dynamic, and return its rank.
+    pub fn input_dimensions(&self, index: u32, dimensions: &mut [i64]) -> Result<u32, Errno> {
+        let mut info = sys::TensorInfo::default();
+        check("get_input_info", unsafe {
+            sys::nn_get_input_info(
+                self.handle,
+                index,
+                dimensions.as_mut_ptr(),
+                dimensions.len() as u32,
+                &mut info,
+            )
+        })?;
+        Ok(info.rank)
+    }
+
+    /// Set the f32 tensor `data`, its bytes, as input `index`.
+    pub fn set_input(&mut self, index: u32, dimensions: &[u32], data: &[u8]) -> Result<(), Errno> {
+        let tensor = sys::Tensor {
+            dimensions: dimensions.as_ptr(),
+            dimensions_len: dimensions.len() as u32,
+            tensor_type: TENSOR_TYPE_F32,
+            data: data.as_ptr(),
+            data_len: data.len() as u32,
+        };
+        check("set_input", unsafe {
+            sys::nn_set_input(self.handle, index, &tensor)
+        })
+    }
+
+    pub fn compute(&mut self) -> Result<(), Errno> {
+        check("compute", unsafe { sys::nn_compute(self.handle) })
+    }
+
+    /// The number of floats in output `index` of the last `compute`.
+    pub fn output_len(&self, index: u32) -> Result<usize, Errno> {
+        let mut size = 0;
+        check("get_output_size", unsafe {
+            sys::nn_get_output_size(self.handle, index, &mut size)
+        })?;
+        Ok(size as usize / std::mem::size_of::<f32>())
+    }
+
+    /// Copy output `index` into `buffer`, returning the number of floats
+    /// written.
+    pub fn get_output(&mut self, index: u32, buffer: &mut [f32]) -> Result<usize, Errno> {
+        let mut written = 0;
+        check("get_output", unsafe {
+            sys::nn_get_output(
+                self.handle,
+                index,
+                buffer.as_mut_ptr() as *mut u8,
+                std::mem::size_of_val(buffer) as u32,
+                &mut written,
+            )
+        })?;
+        Ok(written as usize / std::mem::size_of::<f32>())
+    }
+}
+
+impl Drop for Context {
+    fn drop(&mut self) {
+        unsafe { sys::nn_drop_execution_context(self.handle) };
+    }
+}
@@ -0,0 +1,178 @@
+//! Post-processing of classification scores: argmax, partial top-k
+//! selection, softmax and label names.
+//!
+//! Scores are only ever read up to the number of values the backend wrote,
+//! so spare room in an output buffer cannot win the argmax. With `+simd128`
+//! the argmax keeps four running maxima and their indices in two vectors and
+//! reduces them once at the end.
+
+use std::env;
+use std::error::Error;
+use std::fs;
+use std::sync::OnceLock;
+
+use crate::nn::Context;
+
+/// A reusable buffer for an output, sized from `get_output_size` by the
+/// first read and reused by every later one.
+#[derive(Default)]
+pub struct OutputBuffer {
+    scores: Vec<f32>,
+}
+
+impl OutputBuffer {
+    /// Read output `index` of `context` and return the scores written. The
+    /// size is only asked for again if the output outgrew the buffer, e.g. a
+    /// larger batch; any other error is returned as it is.
+    pub fn read(&mut self, context: &mut Context, index: u32) -> Result<&[f32], Box<dyn Error>> {
+        if self.scores.is_empty() {
+            self.scores.resize(context.output_len(index)?, 0.0);
+        }
+        let written = match context.get_output(index, &mut self.scores) {
+            Err(errno) if errno.is_too_large() => {
+                self.scores.resize(context.output_len(index)?, 0.0);
+                context.get_output(index, &mut self.scores)?
+            }
+            written => written?,
+        };
+        Ok(&self.scores[..written])
+    }
+}
+
+/// The highest score and its 1-based class number; NaNs never win.
+pub fn best_class(scores: &[f32]) -> Option<(f32, i32)> {
+    let (done, mut best) = simd::argmax(scores);
+    for (index, &score) in scores.iter().enumerate().skip(done) {
+        if best.map_or(score == score, |(max, _)| score > max) {
+            best = Some((score, index));
+        }
+    }
+    best.map(|(score, index)| (score, index as i32 + 1))
+}
+
+/// The `k` highest scores of `row` with their 1-based class numbers, best
+/// first; NaNs are left out, as in `best_class`. Selects the `k` before
+/// sorting them, so a row of `n` scores costs O(n + k log k) rather than a
+/// full sort.
+pub fn top_k(row: &[f32], k: usize) -> Vec<(f32, i32)> {
+    if k == 1 {
+        return best_class(row).into_iter().collect();
+    }
+    let descending = |(score1, _): &(f32, i32), (score2, _): &(f32, i32)| score2.total_cmp(score1);
+    let mut scored: Vec<(f32, i32)> = row
+        .iter()
+        .cloned()
+        .zip(1..)
+        .filter(|(score, _)| !score.is_nan())
+        .collect();
+    if k == 0 || scored.is_empty() {
+        return Vec::new();
+    }
+    if k < scored.len() {
+        scored.select_nth_unstable_by(k - 1, descending);
+        scored.truncate(k);
+    }
+    scored.sort_unstable_by(descending);
+    scored
+}
+
+/// Replace the scores of `selected`, taken from `row`, by their softmax
+/// probabilities over the whole row. Only the selected entries are
+/// normalized; the sum still covers every score.
+pub fn softmax(row: &[f32], selected: &mut [(f32, i32)]) {
+    let max = row.iter().cloned().fold(f32::NEG_INFINITY, f32::max);
+    let sum: f32 = row.iter().map(|score| (score - max).exp()).sum();
+    for (score, _) in selected {
+        *score = (*score - max).exp() / sum;
+    }
+}
+
+/// Whether the host asked for probabilities rather than raw scores
+/// (NN_SOFTMAX).
+pub fn softmax_enabled() -> bool {
+    env::var_os("NN_SOFTMAX").is_some()
+}
+
+/// The name of 1-based `class` from the labels file at the guest path in
+/// NN_LABELS, one label per line in class order. The file is read once; an
+/// unset variable or unreadable file gives no names.
+pub fn label(class: i32) -> Option<&'static str> {
+    static LABELS: OnceLock<Vec<String>> = OnceLock::new();
+    let labels = LABELS.get_or_init(|| {
+        let path = match env::var("NN_LABELS") {
+            Ok(path) => path,
+            Err(_) => return Vec::new(),
+        };
+        match fs::read_to_string(&path) {
+            Ok(text) => text.lines().map(|line| line.trim().to_string()).collect(),
+            Err(error) => {
+                println!("Error reading labels {}: {}", path, error);
+                Vec::new()
+            }
+        }
+    });
+    let index = usize::try_from(class).ok()?.checked_sub(1)?;
+    labels.get(index).map(String::as_str)
+}
+
+/// `class` followed by its label, if there is one.
+pub fn describe(class: i32) -> String {
+    match label(class) {
+        Some(name) => format!("{} {}", class, name),
+        None => class.to_string(),
+    }
+}
+
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+mod simd {
+    use core::arch::wasm32::*;
+
+    /// Argmax of the whole groups of four scores, with the number of scores
+    /// done; the caller goes on from there with the rest.
+    pub fn argmax(scores: &[f32]) -> (usize, Option<(f32, usize)>) {
+        let groups = scores.len() / 4;
+        if groups == 0 {
+            return (0, None);
+        }
+        let mut max = f32x4_splat(f32::NEG_INFINITY);
+        let mut max_index = i32x4_splat(-1);
+        let mut index = i32x4(0, 1, 2, 3);
+        let step = i32x4_splat(4);
+        for group in 0..groups {
+            // SAFETY: `group * 4 + 4 <= scores.len()`; wasm allows unaligned
+            // loads.
+            let values = unsafe { v128_load(scores.as_ptr().add(group * 4) as *const v128) };
+            // false for NaN, so a NaN never replaces a lane's maximum
+            let greater = f32x4_gt(values, max);
+            max = v128_bitselect(values, max, greater);
+            max_index = v128_bitselect(index, max_index, greater);
+            index = i32x4_add(index, step);
+        }
+
+        // Among equal lane maxima the lowest index wins, as in a scalar scan
+        let lanes = [
+            (f32x4_extract_lane::<0>(max), i32x4_extract_lane::<0>(max_index)),
+            (f32x4_extract_lane::<1>(max), i32x4_extract_lane::<1>(max_index)),
+            (f32x4_extract_lane::<2>(max), i32x4_extract_lane::<2>(max_index)),
+            (f32x4_extract_lane::<3>(max), i32x4_extract_lane::<3>(max_index)),
+        ];
+        let best = lanes
+            .iter()
+            .filter(|(_, index)| *index >= 0)
+            .fold(None, |best: Option<(f32, i32)>, &(score, index)| match best {
+                Some((max, best_index)) if max > score || (max == score && best_index < index) => {
+                    best
+                }
+                _ => Some((score, index)),
+            });
+        (groups * 4, best.map(|(score, index)| (score, index as usize)))
+    }
+}
+
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+mod simd {
+    /// Without simd128 every score goes through the scalar loop.
+    pub fn argmax(_: &[f32]) -> (usize, Option<(f32, usize)>) {
+        (0, None)
+    }
+}
@@ -0,0 +1,34 @@
+//! Pre-initialization for `wasmtime-test snapshot`: the host runs the
+//! `wizer.initialize` export once at build time and writes the linear memory
+//! it leaves behind back into the module as data segments, Wizer-style. With
+//! copy-on-write memory images (`--memory-init-cow on`, the default) every
+//! instance of the snapshot then starts from that memory for the cost of a
+//! mapping.
+//!
+//! The snapshot is taken with every import trapping, so nothing here may
+//! reach WASI or the host: no environment, files or clocks. wasi-libc caches
+//! the environment and the preopens in linear memory once they are first
+//! used, and a snapshot of them would replay the build's view into every
+//! run, so `main` still finds both on its own. What this does ahead of time
+//! is the allocation work of the first request: it grows the heap and the
+//! request arena to their steady-state size, so a fresh instance does not
+//! begin with `memory.grow` calls.
+
+use crate::arena;
+
+/// The request arena's chunk: what the scope of a 1280×960 JPEG decoded,
+/// converted to RGBA and resized to 224×224 peaks at.
+const ARENA_RESERVE: usize = 12 << 20;
+/// Heap left free for what `main` allocates outside the arena: the encoded
+/// image, the input tensor and the scores.
+const HEAP_RESERVE: usize = 4 << 20;
+
+/// Named as Wizer expects its init function.
+#[export_name = "wizer.initialize"]
+pub extern "C" fn initialize() {
+    arena::reserve(ARENA_RESERVE);
+    // wasi-libc's dlmalloc cannot give memory back, so the freed block stays
+    // in its heap for main's first allocations; `black_box` keeps the
+    // allocation from being optimized out
+    drop(std::hint::black_box(Vec::<u8>::with_capacity(HEAP_RESERVE)));
+}
@@ -0,0 +1,143 @@
+//! Fused image pre-processing: interleaved RGBA u8 pixels to normalized,
+//! planar (CHW) f32 in a single pass.
+//!
+//! Every channel value `v` becomes `(v / 255 - mean) / std`, which is folded
+//! into one multiply-add `v * scale + bias` with per-channel constants
+//! computed once. With `+simd128` (see `.cargo/config.toml`) four pixels are
+//! converted per iteration: one 16-byte load, a swizzle per channel that
+//! gathers its bytes into zero-extended u32 lanes, a conversion to f32 and
+//! the multiply-add.
+
+/// ImageNet statistics the MobileNet model was trained with.
+pub const MEAN: [f32; 3] = [0.485, 0.456, 0.406];
+pub const STD: [f32; 3] = [0.229, 0.224, 0.225];
+
+/// Per-channel `v * scale + bias` equivalent of `(v / 255 - mean) / std`.
+#[derive(Debug, Clone, Copy)]
+pub struct Normalization {
+    scale: [f32; 3],
+    bias: [f32; 3],
+}
+
+impl Normalization {
+    pub fn new(mean: [f32; 3], std: [f32; 3]) -> Self {
+        Self {
+            scale: [
+                1.0 / (255.0 * std[0]),
+                1.0 / (255.0 * std[1]),
+                1.0 / (255.0 * std[2]),
+            ],
+            bias: [-mean[0] / std[0], -mean[1] / std[1], -mean[2] / std[2]],
+        }
+    }
+}
+
+impl Default for Normalization {
+    fn default() -> Self {
+        Self::new(MEAN, STD)
+    }
+}
+
+/// Convert `rgba` (4 bytes per pixel, row-major) into three consecutive
+/// channel planes in `out`, which must hold `3 * pixels` floats. The alpha
+/// channel is dropped.
+pub fn rgba_to_chw(rgba: &[u8], norm: &Normalization, out: &mut [f32]) {
+    let pixels = rgba.len() / 4;
+    assert_eq!(out.len(), 3 * pixels, "output does not match the image size");
+    let (r, rest) = out.split_at_mut(pixels);
+    let (g, b) = rest.split_at_mut(pixels);
+
+    let done = simd::rgba_to_chw(rgba, norm, r, g, b);
+    for i in done..pixels {
+        let pixel = &rgba[4 * i..4 * i + 4];
+        r[i] = pixel[0] as f32 * norm.scale[0] + norm.bias[0];
+        g[i] = pixel[1] as f32 * norm.scale[1] + norm.bias[1];
+        b[i] = pixel[2] as f32 * norm.scale[2] + norm.bias[2];
+    }
+}
+
+/// Normalize three consecutive channel planes of u8 values, a pre-decoded
+/// `.u8` tensor, into `out`, which must be as long.
+pub fn planes_to_chw(planes: &[u8], norm: &Normalization, out: &mut [f32]) {
+    assert_eq!(out.len(), planes.len(), "output does not match the tensor size");
+    let pixels = planes.len() / 3;
+    for (channel, (plane, out)) in planes
+        .chunks_exact(pixels)
+        .zip(out.chunks_exact_mut(pixels))
+        .enumerate()
+    {
+        for (value, out) in plane.iter().zip(out) {
+            *out = *value as f32 * norm.scale[channel] + norm.bias[channel];
+        }
+    }
+}
+
+/// View a tensor as the little-endian bytes wasi-nn expects, without copying.
+#[cfg(target_endian = "little")]
+pub fn as_bytes(data: &[f32]) -> &[u8] {
+    // SAFETY: f32 has no padding and any byte pattern is a valid u8
+    unsafe { std::slice::from_raw_parts(data.as_ptr() as *const u8, std::mem::size_of_val(data)) }
+}
+
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+mod simd {
+    use super::Normalization;
+    use core::arch::wasm32::*;
+
+    /// Swizzle masks moving byte `channel` of each of four RGBA pixels into
+    /// the low byte of a u32 lane; out-of-range indices produce zeros.
+    const fn channel_mask(channel: u8) -> v128 {
+        const Z: u8 = 0x80;
+        let (c0, c1, c2, c3) = (channel, channel + 4, channel + 8, channel + 12);
+        u8x16(c0, Z, Z, Z, c1, Z, Z, Z, c2, Z, Z, Z, c3, Z, Z, Z)
+    }
+
+    /// Convert as many whole groups of four pixels as there are and return
+    /// the number of pixels done.
+    pub fn rgba_to_chw(
+        rgba: &[u8],
+        norm: &Normalization,
+        r: &mut [f32],
+        g: &mut [f32],
+        b: &mut [f32],
+    ) -> usize {
+        let masks = [channel_mask(0), channel_mask(1), channel_mask(2)];
+        let scale = [
+            f32x4_splat(norm.scale[0]),
+            f32x4_splat(norm.scale[1]),
+            f32x4_splat(norm.scale[2]),
+        ];
+        let bias = [
+            f32x4_splat(norm.bias[0]),
+            f32x4_splat(norm.bias[1]),
+            f32x4_splat(norm.bias[2]),
+        ];
+        let mut planes = [r, g, b];
+
+        let groups = rgba.len() / 16;
+        for group in 0..groups {
+            // SAFETY: `group * 16 + 16 <= rgba.len()` and every plane holds
+            // `rgba.len() / 4 >= group * 4 + 4` floats; both accesses are
+            // unaligned loads/stores, which wasm allows.
+            unsafe {
+                let pixels = v128_load(rgba.as_ptr().add(group * 16) as *const v128);
+                for c in 0..3 {
+                    let values = f32x4_convert_u32x4(u8x16_swizzle(pixels, masks[c]));
+                    let normalized = f32x4_add(f32x4_mul(values, scale[c]), bias[c]);
+                    v128_store(planes[c].as_mut_ptr().add(group * 4) as *mut v128, normalized);
+                }
+            }
+        }
+        groups * 4
+    }
+}
+
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+mod simd {
+    use super::Normalization;
+
+    /// Without simd128 every pixel goes through the scalar loop.
+    pub fn rgba_to_chw(_: &[u8], _: &Normalization, _: &mut [f32], _: &mut [f32], _: &mut [f32]) -> usize {
+        0
+    }
+}
@@ -0,0 +1,155 @@
+//! Ring-buffer tracing (NN_TRACE, `--trace-ring on` on the host): probes
+//! cheap enough for loops.
+//!
+//! `Metrics::current` costs several host calls, WASI `clock_time_get`
+//! dispatch for `Instant::now` and a `String` per sample. A probe here
+//! writes one 16-byte event into a preallocated ring in linear memory: its
+//! interned id, whether it begins or ends a span, and a timestamp from the
+//! `bench` import `monotonic_ns`, which skips the WASI layer. The host
+//! learns where the ring is once, in `init`, and the name of every id the
+//! first time it is used. It reads the ring at exit and prints per-probe
+//! statistics, so a probe costs one small host call and a store.
+//!
+//! When tracing is off, no ring is allocated and a probe is one load and a
+//! branch. When the ring wraps, the oldest events are overwritten.
+
+use std::sync::atomic::{AtomicPtr, AtomicU32, Ordering};
+use std::sync::Mutex;
+
+use crate::arena;
+
+/// Events in the ring, 1 MiB of them.
+const CAPACITY: usize = 1 << 16;
+/// Set in `Event::probe` on the event that ends a span.
+const END: u32 = 1 << 31;
+
+mod host {
+    #[link(wasm_import_module = "bench")]
+    extern "C" {
+        pub fn monotonic_ns() -> u64;
+        pub fn trace_ring(events: *const super::Event, capacity: usize, head: *const u32);
+        pub fn trace_name(id: u32, name: *const u8, name_len: usize);
+    }
+}
+
+/// The layout the host reads: probe id (with `END`), padding, timestamp.
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Event {
+    probe: u32,
+    _padding: u32,
+    timestamp: u64,
+}
+
+static RING: AtomicPtr<Event> = AtomicPtr::new(std::ptr::null_mut());
+/// Events written so far; the next one goes to `HEAD % CAPACITY`.
+static HEAD: AtomicU32 = AtomicU32::new(0);
+/// Interned names, id `n` at index `n - 1`.
+static NAMES: Mutex<Vec<String>> = Mutex::new(Vec::new());
+
+/// Allocate the ring and hand it to the host if NN_TRACE is set. Called by
+/// `main` and `nn_init` before anything is traced; later calls do nothing.
+pub fn init() {
+    if !RING.load(Ordering::Relaxed).is_null() || std::env::var_os("NN_TRACE").is_none() {
+        return;
+    }
+    let empty = Event {
+        probe: 0,
+        _padding: 0,
+        timestamp: 0,
+    };
+    let ring = Box::leak(vec![empty; CAPACITY].into_boxed_slice()).as_mut_ptr();
+    RING.store(ring, Ordering::Relaxed);
+    unsafe { host::trace_ring(ring, CAPACITY, HEAD.as_ptr()) };
+}
+
+/// The id of `name`, telling the host about it the first time.
+fn intern(name: &str) -> u32 {
+    let mut names = NAMES
+        .lock()
+        .unwrap_or_else(|poisoned| poisoned.into_inner());
+    if let Some(index) = names.iter().position(|known| known == name) {
+        return index as u32 + 1;
+    }
+    // Names live on, even if first used in a request's arena scope
+    arena::outside(|| names.push(name.to_string()));
+    let id = names.len() as u32;
+    unsafe { host::trace_name(id, name.as_ptr(), name.len()) };
+    id
+}
+
+fn record(probe: u32) {
+    let ring = RING.load(Ordering::Relaxed);
+    if ring.is_null() {
+        return;
+    }
+    let index = HEAD.fetch_add(1, Ordering::Relaxed) as usize % CAPACITY;
+    let event = Event {
+        probe,
+        _padding: 0,
+        timestamp: unsafe { host::monotonic_ns() },
+    };
+    // SAFETY: `index` is below the ring's `CAPACITY` events
+    unsafe { ring.add(index).write(event) };
+}
+
+/// Whether probes are recorded at all.
+pub fn enabled() -> bool {
+    !RING.load(Ordering::Relaxed).is_null()
+}
+
+/// A named probe, interned on first use:
+/// `static DECODE: Probe = Probe::new("decode");`
+pub struct Probe {
+    name: &'static str,
+    id: AtomicU32,
+}
+
+impl Probe {
+    pub const fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            id: AtomicU32::new(0),
+        }
+    }
+
+    fn id(&self) -> u32 {
+        match self.id.load(Ordering::Relaxed) {
+            0 => {
+                let id = intern(self.name);
+                self.id.store(id, Ordering::Relaxed);
+                id
+            }
+            id => id,
+        }
+    }
+
+    pub fn begin(&self) {
+        if enabled() {
+            record(self.id());
+        }
+    }
+
+    pub fn end(&self) {
+        if enabled() {
+            record(self.id() | END);
+        }
+    }
+
+    /// Record `f` as one span of this probe.
+    pub fn time<R>(&self, f: impl FnOnce() -> R) -> R {
+        self.begin();
+        let result = f();
+        self.end();
+        result
+    }
+}
+
+/// Begin (`start`) or end a span under a name only known at run time, such
+/// as a tracker operation; interning costs a lookup per call.
+pub fn mark(name: &str, start: bool) {
+    if enabled() {
+        let id = intern(name);
+        record(if start { id } else { id | END });
+    }
+}
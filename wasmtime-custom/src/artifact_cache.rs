@@ -0,0 +1,155 @@
+//! Cache of precompiled modules (`.cwasm`), keyed by what makes an artifact
+//! valid: the exact wasm bytes and `Engine::precompile_compatibility_hash`,
+//! which covers the wasmtime version, engine config and target CPU features.
+//!
+//! A changed module or engine simply maps to a different file, so a stale
+//! artifact is never loaded; `Module::deserialize_file` still checks the
+//! header of whatever it maps and a rejected artifact is recompiled.
+//! Artifacts are mapped rather than read, so only the pages the instance
+//! touches are loaded.
+
+use anyhow::{Context, Result};
+use std::collections::hash_map::DefaultHasher;
+use std::fs;
+use std::hash::{Hash, Hasher};
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+use wasmtime::{Engine, Module};
+
+/// Directory used next to the module when no `--cache-dir` is given.
+pub const DEFAULT_DIR_NAME: &str = ".cwasm-cache";
+
+/// The artifact a module was loaded from.
+pub struct Artifact {
+    pub bytes: u64,
+    /// Time spent compiling, `None` if a cached artifact was mapped.
+    pub compile_time: Option<Duration>,
+    /// When the compile started, for the cold-start timeline.
+    pub compile_start: Option<Instant>,
+}
+
+impl Artifact {
+    fn mapped(bytes: u64) -> Self {
+        Self {
+            bytes,
+            compile_time: None,
+            compile_start: None,
+        }
+    }
+
+    fn compiled(bytes: u64, start: Instant, compile_time: Duration) -> Self {
+        Self {
+            bytes,
+            compile_time: Some(compile_time),
+            compile_start: Some(start),
+        }
+    }
+}
+
+/// Compile `wasm_path` in the process, without an artifact, as
+/// `--artifact-cache off` does on every run; the module cache serves this
+/// compile when it is on. The artifact's size is that of the compiled code
+/// in memory.
+pub fn compile_in_process(engine: &Engine, wasm_path: &Path) -> Result<(Module, Artifact)> {
+    let wasm =
+        fs::read(wasm_path).with_context(|| format!("failed to read {}", wasm_path.display()))?;
+    let start = Instant::now();
+    let module = Module::new(engine, &wasm)?;
+    let compile_time = start.elapsed();
+    let image = module.image_range();
+    let bytes = (image.end as usize - image.start as usize) as u64;
+    println!("Compiled {} in {:?}", wasm_path.display(), compile_time);
+    Ok((module, Artifact::compiled(bytes, start, compile_time)))
+}
+
+pub struct ArtifactCache {
+    dir: PathBuf,
+}
+
+impl ArtifactCache {
+    pub fn new(dir: impl Into<PathBuf>) -> Self {
+        Self { dir: dir.into() }
+    }
+
+    /// The cache in `dir`, or in `DEFAULT_DIR_NAME` next to `wasm_path`.
+    pub fn for_module(wasm_path: &Path, dir: Option<&str>) -> Self {
+        match dir {
+            Some(dir) => Self::new(dir),
+            None => {
+                let parent = wasm_path.parent().unwrap_or_else(|| Path::new(""));
+                Self::new(parent.join(DEFAULT_DIR_NAME))
+            }
+        }
+    }
+
+    fn artifact_path(&self, engine: &Engine, wasm_path: &Path, wasm: &[u8]) -> PathBuf {
+        let mut module_hasher = DefaultHasher::new();
+        wasm.hash(&mut module_hasher);
+        let mut engine_hasher = DefaultHasher::new();
+        engine.precompile_compatibility_hash().hash(&mut engine_hasher);
+
+        let stem = wasm_path
+            .file_stem()
+            .map(|s| s.to_string_lossy().into_owned())
+            .unwrap_or_else(|| String::from("module"));
+        self.dir.join(format!(
+            "{}-{:016x}-{:016x}.cwasm",
+            stem,
+            module_hasher.finish(),
+            engine_hasher.finish()
+        ))
+    }
+
+    /// Map the cached artifact for `wasm_path`, compiling and storing it
+    /// first if there is none or it is rejected.
+    pub fn load(&self, engine: &Engine, wasm_path: &Path) -> Result<(Module, Artifact)> {
+        let wasm = fs::read(wasm_path)
+            .with_context(|| format!("failed to read {}", wasm_path.display()))?;
+        let artifact = self.artifact_path(engine, wasm_path, &wasm);
+        if artifact.exists() {
+            // SAFETY: the file was written by `store` for this engine; a
+            // mismatching header is reported as an error, not loaded.
+            match unsafe { Module::deserialize_file(engine, &artifact) } {
+                Ok(module) => {
+                    let bytes = fs::metadata(&artifact)?.len();
+                    return Ok((module, Artifact::mapped(bytes)));
+                }
+                Err(error) => println!(
+                    "Recompiling {}: cached artifact rejected: {}",
+                    wasm_path.display(),
+                    error
+                ),
+            }
+        }
+        let compiled = self.store(engine, &wasm, &artifact)?;
+        let module = unsafe { Module::deserialize_file(engine, &artifact) }?;
+        Ok((module, compiled))
+    }
+
+    /// Compile `wasm_path` into the cache even if an artifact exists, e.g. to
+    /// warm it at deploy time; returns the artifact's path.
+    pub fn compile(&self, engine: &Engine, wasm_path: &Path) -> Result<PathBuf> {
+        let wasm = fs::read(wasm_path)
+            .with_context(|| format!("failed to read {}", wasm_path.display()))?;
+        let artifact = self.artifact_path(engine, wasm_path, &wasm);
+        self.store(engine, &wasm, &artifact)?;
+        Ok(artifact)
+    }
+
+    /// Compile `wasm` to `artifact`; returns its compile time and size.
+    fn store(&self, engine: &Engine, wasm: &[u8], artifact: &Path) -> Result<Artifact> {
+        let start = Instant::now();
+        let compiled = engine.precompile_module(wasm)?;
+        let compile_time = start.elapsed();
+        fs::create_dir_all(&self.dir)
+            .with_context(|| format!("failed to create {}", self.dir.display()))?;
+        // Write then rename, so a concurrent reader never maps a partial file
+        let partial = artifact.with_extension(format!("partial.{}", std::process::id()));
+        fs::write(&partial, &compiled)
+            .with_context(|| format!("failed to write {}", partial.display()))?;
+        fs::rename(&partial, artifact)?;
+        println!("Compiled {} in {:?}", artifact.display(), compile_time);
+        let bytes = compiled.len() as u64;
+        Ok(Artifact::compiled(bytes, start, compile_time))
+    }
+}
@@ -0,0 +1,169 @@
+//! The `bench` import module: host-side resource accounting for the guest.
+//!
+//! WASI has no `getrusage`, so the guest's `Metrics::current` asks the host
+//! for the numbers instead:
+//! - `thread_cpu_time_ns() -> i64`: CPU time of the calling host thread
+//! - `process_rusage(out: i32) -> i32`: writes `{ user_us, system_us,
+//!   max_rss_bytes }` as three little-endian u64 at `out`
+//! - `memory_size() -> i64`: current size of the guest's linear memory
+//! - `phase(name: i32, name_len: i32, start: i32)`: the guest started
+//!   (`start` is 1) or ended the tracker phase with the UTF-8 name at `name`,
+//!   for the memory timeline, the hardware counters, the energy meter and
+//!   the cold-start timeline
+//! - `operation(name: i32, name_len: i32, start: i32)`: the same for a
+//!   tracker operation, for the hardware counters and the energy meter
+//! - `monotonic_ns() -> i64`, `trace_ring(events: i32, capacity: i32,
+//!   head: i32)` and `trace_name(id: i32, name: i32, name_len: i32)`: the
+//!   clock and the registrations of the guest's ring-buffer tracing
+
+use anyhow::Result;
+use wasmtime::{Caller, Linker};
+
+use crate::energy::EnergyMeter;
+use crate::guest_memory::GuestMemory;
+use crate::memory_timeline::MemoryTimeline;
+use crate::perf_counters::PerfCounters;
+use crate::startup::StartupTimeline;
+use crate::trace_ring::TraceRing;
+
+pub const MODULE_NAME: &str = "bench";
+
+/// Process-wide resource usage as reported by `getrusage(RUSAGE_SELF)`.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ProcessUsage {
+    pub user_us: u64,
+    pub system_us: u64,
+    pub max_rss_bytes: u64,
+}
+
+pub fn process_usage() -> ProcessUsage {
+    unsafe {
+        let mut usage: libc::rusage = std::mem::zeroed();
+        if libc::getrusage(libc::RUSAGE_SELF, &mut usage) != 0 {
+            return ProcessUsage::default();
+        }
+        ProcessUsage {
+            user_us: timeval_to_us(&usage.ru_utime),
+            system_us: timeval_to_us(&usage.ru_stime),
+            // Linux reports kilobytes
+            max_rss_bytes: usage.ru_maxrss as u64 * 1024,
+        }
+    }
+}
+
+pub fn thread_cpu_time_ns() -> u64 {
+    clock_ns(libc::CLOCK_THREAD_CPUTIME_ID)
+}
+
+fn clock_ns(clock: libc::clockid_t) -> u64 {
+    unsafe {
+        let mut ts: libc::timespec = std::mem::zeroed();
+        if libc::clock_gettime(clock, &mut ts) != 0 {
+            return 0;
+        }
+        ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+    }
+}
+
+fn timeval_to_us(tv: &libc::timeval) -> u64 {
+    tv.tv_sec as u64 * 1_000_000 + tv.tv_usec as u64
+}
+
+pub fn add_to_linker<T: 'static>(
+    linker: &mut Linker<T>,
+    timeline: impl Fn(&mut T) -> &mut MemoryTimeline + Send + Sync + Copy + 'static,
+    counters: impl Fn(&mut T) -> &mut PerfCounters + Send + Sync + Copy + 'static,
+    energy: impl Fn(&mut T) -> &mut EnergyMeter + Send + Sync + Copy + 'static,
+    startup: impl Fn(&mut T) -> &mut StartupTimeline + Send + Sync + Copy + 'static,
+    trace: impl Fn(&mut T) -> &mut TraceRing + Send + Sync + Copy + 'static,
+) -> Result<()> {
+    linker.func_wrap(MODULE_NAME, "thread_cpu_time_ns", || -> i64 {
+        thread_cpu_time_ns() as i64
+    })?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "process_rusage",
+        |mut caller: Caller<'_, T>, out: i32| -> Result<i32> {
+            let usage = process_usage();
+            let mut bytes = [0u8; 24];
+            bytes[0..8].copy_from_slice(&usage.user_us.to_le_bytes());
+            bytes[8..16].copy_from_slice(&usage.system_us.to_le_bytes());
+            bytes[16..24].copy_from_slice(&usage.max_rss_bytes.to_le_bytes());
+
+            let memory = GuestMemory::of(&mut caller)?;
+            memory.write(&mut caller, out as u32 as usize, &bytes)?;
+            Ok(0)
+        },
+    )?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "memory_size",
+        |mut caller: Caller<'_, T>| -> Result<i64> {
+            let memory = GuestMemory::of(&mut caller)?;
+            Ok(memory.data_size(&caller) as i64)
+        },
+    )?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "phase",
+        move |mut caller: Caller<'_, T>, name: i32, name_len: i32, start: i32| -> Result<()> {
+            let memory = GuestMemory::of(&mut caller)?;
+            let name = memory.read(&caller, name as u32 as usize, name_len as u32 as usize)?;
+            let (name, linear_memory) = (String::from_utf8_lossy(&name), memory.data_size(&caller));
+            timeline(caller.data_mut()).phase(&name, start != 0, linear_memory);
+            counters(caller.data_mut()).mark("phase", &name, start != 0);
+            energy(caller.data_mut()).mark("phase", &name, start != 0);
+            startup(caller.data_mut()).phase(&name, start != 0);
+            Ok(())
+        },
+    )?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "operation",
+        move |mut caller: Caller<'_, T>, name: i32, name_len: i32, start: i32| -> Result<()> {
+            let memory = GuestMemory::of(&mut caller)?;
+            let name = memory.read(&caller, name as u32 as usize, name_len as u32 as usize)?;
+            let name = String::from_utf8_lossy(&name);
+            counters(caller.data_mut()).mark("operation", &name, start != 0);
+            energy(caller.data_mut()).mark("operation", &name, start != 0);
+            Ok(())
+        },
+    )?;
+
+    linker.func_wrap(MODULE_NAME, "monotonic_ns", || -> i64 {
+        clock_ns(libc::CLOCK_MONOTONIC) as i64
+    })?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "trace_ring",
+        move |mut caller: Caller<'_, T>, events: i32, capacity: i32, head: i32| -> Result<()> {
+            let memory = GuestMemory::of(&mut caller)?;
+            trace(caller.data_mut()).register(
+                memory,
+                events as u32 as usize,
+                capacity as u32 as usize,
+                head as u32 as usize,
+            );
+            Ok(())
+        },
+    )?;
+
+    linker.func_wrap(
+        MODULE_NAME,
+        "trace_name",
+        move |mut caller: Caller<'_, T>, id: i32, name: i32, name_len: i32| -> Result<()> {
+            let memory = GuestMemory::of(&mut caller)?;
+            let name = memory.read(&caller, name as u32 as usize, name_len as u32 as usize)?;
+            let name = String::from_utf8_lossy(&name).into_owned();
+            trace(caller.data_mut()).name(id as u32, name);
+            Ok(())
+        },
+    )?;
+
+    Ok(())
+}
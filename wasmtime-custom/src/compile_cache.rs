@@ -0,0 +1,110 @@
+//! Compilation caches below the artifact cache, for the compiles it does not
+//! save: a guest that changed, or `--artifact-cache off`.
+//!
+//! `--compile-cache <dir>` is wasmtime's module cache (crates/cache): whole
+//! compiled modules keyed by the wasm and the engine, served to
+//! `Module::from_file` and `Component::from_file`, with the cache worker
+//! compressing and cleaning up `<dir>` in the background. Precompiling into
+//! the artifact cache does not go through it.
+//!
+//! `--incremental-cache <dir>` is Cranelift's incremental cache: every
+//! function is keyed by a hash of its IR and the ISA, so after a small edit
+//! of the guest only the functions whose code changed are compiled again and
+//! the rest are copied out of `<dir>`. It serves every Cranelift compile,
+//! precompiles included.
+
+use anyhow::{bail, Context, Result};
+use std::borrow::Cow;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use wasmtime::{CacheStore, Config};
+
+/// Tells apart the partial files of one process's compile threads.
+static PARTIALS: AtomicU64 = AtomicU64::new(0);
+
+/// Turn on the module cache in `dir`, which is created if needed.
+pub fn enable_module_cache(config: &mut Config, dir: &Path) -> Result<()> {
+    fs::create_dir_all(dir).with_context(|| format!("failed to create {}", dir.display()))?;
+    // The cache wants an absolute directory, set in a configuration file
+    let dir = fs::canonicalize(dir)?;
+    let dir = dir.to_string_lossy();
+    if dir.contains('\'') {
+        bail!("--compile-cache {} cannot contain a quote", dir);
+    }
+    let file =
+        std::env::temp_dir().join(format!("wasmtime-test-cache-{}.toml", std::process::id()));
+    fs::write(
+        &file,
+        format!("[cache]\nenabled = true\ndirectory = '{}'\n", dir),
+    )
+    .with_context(|| format!("failed to write {}", file.display()))?;
+    let loaded = config.cache_config_load(&file).map(|_| ());
+    let _ = fs::remove_file(&file);
+    loaded
+}
+
+/// Cranelift's per-function cache as one file per key in a directory, in
+/// 256 subdirectories after the key's first byte.
+#[derive(Debug)]
+pub struct IncrementalCache {
+    dir: PathBuf,
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl IncrementalCache {
+    pub fn new(dir: impl Into<PathBuf>) -> Self {
+        Self {
+            dir: dir.into(),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }
+    }
+
+    /// Functions copied from the cache instead of compiled.
+    pub fn hits(&self) -> u64 {
+        self.hits.load(Ordering::Relaxed)
+    }
+
+    /// Functions compiled, and stored for the next compile.
+    pub fn misses(&self) -> u64 {
+        self.misses.load(Ordering::Relaxed)
+    }
+
+    fn path(&self, key: &[u8]) -> PathBuf {
+        let hex: String = key.iter().map(|byte| format!("{:02x}", byte)).collect();
+        let (fan_out, name) = hex.split_at(hex.len().min(2));
+        self.dir.join(fan_out).join(name)
+    }
+}
+
+impl CacheStore for IncrementalCache {
+    fn get(&self, key: &[u8]) -> Option<Cow<[u8]>> {
+        let entry = fs::read(self.path(key)).ok();
+        let counter = if entry.is_some() {
+            &self.hits
+        } else {
+            &self.misses
+        };
+        counter.fetch_add(1, Ordering::Relaxed);
+        entry.map(Cow::from)
+    }
+
+    fn insert(&self, key: &[u8], value: Vec<u8>) -> bool {
+        let path = self.path(key);
+        // Write then rename, as compiles on several threads and processes
+        // may store the same function
+        let partial = path.with_extension(format!(
+            "partial.{}.{}",
+            std::process::id(),
+            PARTIALS.fetch_add(1, Ordering::Relaxed)
+        ));
+        let stored = path
+            .parent()
+            .map_or(Ok(()), fs::create_dir_all)
+            .and_then(|_| fs::write(&partial, &value))
+            .and_then(|_| fs::rename(&partial, &path));
+        stored.is_ok()
+    }
+}
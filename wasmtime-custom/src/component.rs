@@ -0,0 +1,78 @@
+//! Component mode (`--component on`): run the component build of the guest,
+//! wasi-nn-component.wasm (wasm-module/src/bin/nn-component.rs), through a
+//! component `Linker` with wasmtime-wasi's preview2 and wasi-nn's WIT ABI,
+//! where the core module build goes through wasi-common's preview1 and the
+//! witx ABI.
+//!
+//! The guest gets the same environment and preopens as main does, so with
+//! `--abi-bench` both builds time the same calls on the same model and
+//! their reports can be put side by side. The component is compiled on every
+//! run, as the artifact cache only holds core modules.
+
+use anyhow::{anyhow, Result};
+use std::path::Path;
+use wasmtime::component::{Component, Linker};
+use wasmtime::{Engine, Store};
+use wasmtime_wasi::{DirPerms, FilePerms, ResourceTable, WasiCtx, WasiCtxBuilder, WasiView};
+use wasmtime_wasi_nn::WasiNnCtx;
+
+/// The state of the component's store.
+struct Host {
+    wasi: WasiCtx,
+    table: ResourceTable,
+    wasi_nn: WasiNnCtx,
+}
+
+impl WasiView for Host {
+    fn table(&mut self) -> &mut ResourceTable {
+        &mut self.table
+    }
+
+    fn ctx(&mut self) -> &mut WasiCtx {
+        &mut self.wasi
+    }
+}
+
+/// Run the `wasi:cli/run` export of the component at `path` with `env`,
+/// the host `directories` preopened under their own names and, when set, the
+/// `results` directory as `results_preopen`.
+pub fn run(
+    engine: &Engine,
+    path: &Path,
+    env: &[(&str, String)],
+    directories: &[&str],
+    results: Option<(&Path, &str)>,
+    wasi_nn: WasiNnCtx,
+) -> Result<()> {
+    let component = Component::from_file(engine, path)?;
+    let mut linker = Linker::new(engine);
+    wasmtime_wasi::add_to_linker_sync(&mut linker)?;
+    wasmtime_wasi_nn::wit::ML::add_to_linker(&mut linker, |host: &mut Host| &mut host.wasi_nn)?;
+
+    let mut builder = WasiCtxBuilder::new();
+    builder.inherit_stdio().envs(env);
+    for dir in directories {
+        builder.preopened_dir(dir, dir, DirPerms::all(), FilePerms::all())?;
+    }
+    if let Some((results_dir, results_preopen)) = results {
+        builder.preopened_dir(
+            results_dir,
+            results_preopen,
+            DirPerms::all(),
+            FilePerms::all(),
+        )?;
+    }
+    let host = Host {
+        wasi: builder.build(),
+        table: ResourceTable::new(),
+        wasi_nn,
+    };
+    let mut store = Store::new(engine, host);
+
+    let (command, _instance) =
+        wasmtime_wasi::bindings::sync::Command::instantiate(&mut store, &component, &linker)?;
+    command
+        .wasi_cli_run()
+        .call_run(&mut store)?
+        .map_err(|()| anyhow!("{} exited with an error", path.display()))
+}
@@ -0,0 +1,147 @@
+//! Request deadlines in server mode (`--deadline-ms <ms>[,<ms per MiB>]`):
+//! every request must be answered within `<ms>`, plus `<ms per MiB>` for
+//! each MiB of its encoded image, of its arrival.
+//!
+//! The queue hands out the earliest deadline first, and a request whose
+//! deadline passed while it was queued is shed without running. A ticker
+//! thread advances the engine's epoch every `TICK`, and each store's epoch
+//! callback traps the guest once the request it serves is past its deadline,
+//! so one huge JPEG cannot hold a worker for longer than its budget. Epochs
+//! only interrupt guest code: a `compute` inside ORT finishes first, and the
+//! guest traps when it returns to wasm.
+//!
+//! A trap can leave the guest's state half updated, so the worker drops the
+//! store and serves the next request from a new instance. Yielding instead of
+//! trapping needs async stores, which the host does not use.
+
+use anyhow::{bail, Result};
+use std::fmt;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use wasmtime::{Engine, Store, UpdateDeadline};
+
+/// How often the ticker advances the epoch, i.e. how late an overrun can
+/// be noticed in guest code.
+pub const TICK: Duration = Duration::from_millis(1);
+/// The epoch deadline of a store between requests, about 49 days of ticks.
+const IDLE_TICKS: u64 = u32::MAX as u64;
+
+/// The time a request is given, from its arrival.
+#[derive(Debug, Clone, Copy)]
+pub struct DeadlinePolicy {
+    pub base: Duration,
+    pub per_mib: Duration,
+}
+
+impl DeadlinePolicy {
+    /// `<ms>` or `<ms>,<ms per MiB>`.
+    pub fn parse(name: &str, value: &str) -> Result<Self> {
+        let ms = |ms: &str| match ms.parse::<f64>() {
+            Ok(ms) if ms >= 0.0 && ms.is_finite() => Ok(Duration::from_secs_f64(ms / 1000.0)),
+            _ => bail!("invalid value for {}: {}", name, value),
+        };
+        let (base, per_mib) = match value.find(',') {
+            Some(index) => (ms(&value[..index])?, ms(&value[index + 1..])?),
+            None => (ms(value)?, Duration::ZERO),
+        };
+        if base.is_zero() {
+            bail!(
+                "invalid value for {}: {} (the deadline must be positive)",
+                name,
+                value
+            );
+        }
+        Ok(Self { base, per_mib })
+    }
+
+    /// The budget of a request for an encoded image of `bytes`.
+    pub fn budget(&self, bytes: usize) -> Duration {
+        self.base + self.per_mib.mul_f64(bytes as f64 / (1 << 20) as f64)
+    }
+}
+
+/// The error a guest traps with when its request is past its deadline.
+#[derive(Debug)]
+pub struct DeadlineExceeded;
+
+impl fmt::Display for DeadlineExceeded {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "the request is past its deadline")
+    }
+}
+
+impl std::error::Error for DeadlineExceeded {}
+
+/// The deadline of the request a store is serving, read by its epoch
+/// callback.
+#[derive(Clone, Default)]
+pub struct DeadlineSlot(Arc<Mutex<Option<Instant>>>);
+
+impl DeadlineSlot {
+    /// Make the epoch callback of `store` trap once past the deadline set in
+    /// this slot.
+    pub fn watch<T>(&self, store: &mut Store<T>) {
+        let slot = self.0.clone();
+        store.epoch_deadline_callback(move |_| match *slot.lock().unwrap() {
+            Some(deadline) => match deadline.checked_duration_since(Instant::now()) {
+                Some(left) if !left.is_zero() => Ok(UpdateDeadline::Continue(ticks(left))),
+                _ => Err(DeadlineExceeded.into()),
+            },
+            None => Ok(UpdateDeadline::Continue(IDLE_TICKS)),
+        });
+        store.set_epoch_deadline(IDLE_TICKS);
+    }
+
+    /// Start serving a request due at `deadline` in `store`.
+    pub fn arm<T>(&self, store: &mut Store<T>, deadline: Instant) {
+        *self.0.lock().unwrap() = Some(deadline);
+        store.set_epoch_deadline(ticks(deadline.saturating_duration_since(Instant::now())));
+    }
+
+    /// Stop checking `store` after its request.
+    pub fn disarm<T>(&self, store: &mut Store<T>) {
+        *self.0.lock().unwrap() = None;
+        store.set_epoch_deadline(IDLE_TICKS);
+    }
+}
+
+/// Whole ticks in `time`, rounded up so the callback runs at or after it.
+fn ticks(time: Duration) -> u64 {
+    let tick = TICK.as_nanos();
+    ((time.as_nanos() + tick - 1) / tick).max(1) as u64
+}
+
+/// The thread advancing the engine's epoch, stopped when dropped.
+pub struct Ticker {
+    stop: Arc<AtomicBool>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Ticker {
+    pub fn start(engine: &Engine) -> Self {
+        let stop = Arc::new(AtomicBool::new(false));
+        let engine = engine.clone();
+        let stopped = stop.clone();
+        let thread = thread::spawn(move || {
+            while !stopped.load(Ordering::Relaxed) {
+                thread::sleep(TICK);
+                engine.increment_epoch();
+            }
+        });
+        Self {
+            stop,
+            thread: Some(thread),
+        }
+    }
+}
+
+impl Drop for Ticker {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
@@ -0,0 +1,342 @@
+//! Energy per tracker phase and operation (`--energy on`), and per call of
+//! the steady-state loop, from the kernel's energy counters.
+//!
+//! The counters are the powercap zones in /sys/class/powercap: RAPL on Intel,
+//! and on AMD, whose driver registers under the same `intel-rapl` control
+//! type. Boards without powercap, as most ARM ones, may have hwmon energy
+//! inputs (`/sys/class/hwmon/*/energy*_input`) instead, which are used when
+//! there are no zones. Either way the values are microjoules of a whole
+//! package or rail, so everything else running on the machine is counted
+//! too, and RAPL updates about every millisecond, so steps shorter than a
+//! few milliseconds read as noise. Pin the run and keep the machine quiet.
+//!
+//! The total of a step sums the `package-*` zones, which include the cores
+//! and uncore, or every domain where there are none. Each domain is also
+//! exported on its own. Since Linux 5.10 `energy_uj` is only readable by
+//! root.
+
+use anyhow::Result;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+const POWERCAP: &str = "/sys/class/powercap";
+const HWMON: &str = "/sys/class/hwmon";
+
+/// One energy counter.
+struct Domain {
+    name: String,
+    file: File,
+    /// Where the counter wraps to zero, if it does.
+    range: Option<u64>,
+    /// Counted in the total of a step.
+    in_total: bool,
+}
+
+/// The energy counters of the machine, opened once.
+pub struct Domains(Vec<Domain>);
+
+impl Domains {
+    /// The top-level powercap zones, or else the hwmon energy inputs.
+    pub fn open() -> io::Result<Self> {
+        let mut domains = powercap_zones()?;
+        if domains.is_empty() {
+            domains = hwmon_inputs()?;
+        }
+        if domains.is_empty() {
+            return Err(io::Error::new(
+                io::ErrorKind::NotFound,
+                "no powercap zones or hwmon energy inputs",
+            ));
+        }
+        let packages = domains
+            .iter()
+            .any(|domain| domain.name.starts_with("package"));
+        for domain in &mut domains {
+            domain.in_total = !packages || domain.name.starts_with("package");
+        }
+        let domains = Domains(domains);
+        domains.read()?;
+        Ok(domains)
+    }
+
+    /// `open`, or a warning and `None` when nothing can be read.
+    pub fn open_or_warn() -> Option<Self> {
+        match Self::open() {
+            Ok(domains) => Some(domains),
+            Err(error) => {
+                eprintln!("Warning: cannot read energy counters, no energy: {}", error);
+                None
+            }
+        }
+    }
+
+    /// Microjoules of every domain, in order.
+    pub fn read(&self) -> io::Result<Reading> {
+        let mut values = Vec::with_capacity(self.0.len());
+        for domain in &self.0 {
+            values.push(read_number(&domain.file)?);
+        }
+        Ok(Reading {
+            time: Instant::now(),
+            values,
+        })
+    }
+
+    /// Energy and time from `start` to `end`.
+    pub fn delta(&self, start: &Reading, end: &Reading) -> Delta {
+        let microjoules = self
+            .0
+            .iter()
+            .zip(start.values.iter().zip(&end.values))
+            .map(|(domain, (&start, &end))| match domain.range {
+                Some(range) if end < start => end + range - start,
+                _ => end.saturating_sub(start),
+            })
+            .collect();
+        Delta {
+            elapsed: end.time.saturating_duration_since(start.time),
+            microjoules,
+        }
+    }
+
+    /// Joules counted in the total of `delta`.
+    pub fn joules(&self, delta: &Delta) -> f64 {
+        let microjoules: u64 = self
+            .0
+            .iter()
+            .zip(&delta.microjoules)
+            .filter(|(domain, _)| domain.in_total)
+            .map(|(_, &value)| value)
+            .sum();
+        microjoules as f64 / 1e6
+    }
+}
+
+/// The counters at one moment.
+#[derive(Debug, Clone)]
+pub struct Reading {
+    time: Instant,
+    values: Vec<u64>,
+}
+
+/// Energy of every domain over a step, and its length.
+#[derive(Debug, Clone)]
+pub struct Delta {
+    pub elapsed: Duration,
+    microjoules: Vec<u64>,
+}
+
+impl Delta {
+    /// Average power over the step.
+    fn watts(&self, joules: f64) -> Option<f64> {
+        let seconds = self.elapsed.as_secs_f64();
+        if seconds > 0.0 {
+            Some(joules / seconds)
+        } else {
+            None
+        }
+    }
+}
+
+/// `intel-rapl:0` and the like, without their subzones (`intel-rapl:0:0`),
+/// which the parents already count. The MMIO interface repeats the package
+/// zone on some Intel CPUs, so a name is only taken once.
+fn powercap_zones() -> io::Result<Vec<Domain>> {
+    let mut zones: Vec<PathBuf> = match fs::read_dir(POWERCAP) {
+        Ok(entries) => entries
+            .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+            .filter(|path| {
+                let name = path
+                    .file_name()
+                    .map(|name| name.to_string_lossy().into_owned());
+                name.map_or(false, |name| name.matches(':').count() == 1)
+            })
+            .filter(|path| path.join("energy_uj").exists())
+            .collect(),
+        Err(_) => return Ok(Vec::new()),
+    };
+    zones.sort();
+    let mut domains: Vec<Domain> = Vec::new();
+    for zone in zones {
+        let name = fs::read_to_string(zone.join("name"))?.trim().to_string();
+        if domains.iter().any(|domain| domain.name == name) {
+            continue;
+        }
+        let range = fs::read_to_string(zone.join("max_energy_range_uj"))
+            .ok()
+            .and_then(|range| range.trim().parse().ok());
+        domains.push(Domain {
+            name,
+            file: File::open(zone.join("energy_uj"))?,
+            range,
+            in_total: true,
+        });
+    }
+    Ok(domains)
+}
+
+/// `energy<n>_input` of every hwmon device, named after the device and the
+/// input's label.
+fn hwmon_inputs() -> io::Result<Vec<Domain>> {
+    let mut inputs = Vec::new();
+    let devices = match fs::read_dir(HWMON) {
+        Ok(entries) => entries,
+        Err(_) => return Ok(inputs),
+    };
+    for device in devices.filter_map(|entry| entry.ok().map(|entry| entry.path())) {
+        let device_name = fs::read_to_string(device.join("name")).unwrap_or_default();
+        let entries = match fs::read_dir(&device) {
+            Ok(entries) => entries,
+            Err(_) => continue,
+        };
+        for path in entries.filter_map(|entry| entry.ok().map(|entry| entry.path())) {
+            let file_name = path
+                .file_name()
+                .unwrap_or_default()
+                .to_string_lossy()
+                .into_owned();
+            if !(file_name.starts_with("energy") && file_name.ends_with("_input")) {
+                continue;
+            }
+            let label = path.with_file_name(file_name.replace("_input", "_label"));
+            let label = fs::read_to_string(label).unwrap_or(file_name.clone());
+            inputs.push(Domain {
+                name: format!("{}/{}", device_name.trim(), label.trim()),
+                file: File::open(&path)?,
+                range: None,
+                in_total: true,
+            });
+        }
+    }
+    inputs.sort_by(|a, b| a.name.cmp(&b.name));
+    Ok(inputs)
+}
+
+/// The decimal number a sysfs attribute holds, read again from its start.
+fn read_number(file: &File) -> io::Result<u64> {
+    let mut buffer = [0u8; 32];
+    let length = file.read_at(&mut buffer, 0)?;
+    std::str::from_utf8(&buffer[..length])
+        .ok()
+        .and_then(|text| text.trim().parse().ok())
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "not an energy counter"))
+}
+
+/// Energy of the steps the tracker marked, for one store.
+pub struct EnergyMeter {
+    /// `None` until the first mark, or if the counters cannot be read.
+    domains: Option<Domains>,
+    enabled: bool,
+    /// Steps started and not ended yet, with the reading at their start.
+    open: Vec<(String, String, Reading)>,
+    /// Finished steps: kind, name and energy.
+    steps: Vec<(String, String, Delta)>,
+}
+
+impl EnergyMeter {
+    pub fn new(enabled: bool) -> Self {
+        Self {
+            domains: None,
+            enabled,
+            open: Vec::new(),
+            steps: Vec::new(),
+        }
+    }
+
+    /// Read the counters, opening them the first time.
+    fn read(&mut self) -> Option<Reading> {
+        if !self.enabled {
+            return None;
+        }
+        if self.domains.is_none() {
+            self.domains = Domains::open_or_warn();
+            if self.domains.is_none() {
+                self.enabled = false;
+                return None;
+            }
+        }
+        self.domains
+            .as_ref()
+            .and_then(|domains| domains.read().ok())
+    }
+
+    /// The tracker started (`start`) or ended the `kind` step `name`, as
+    /// `PerfCounters::mark`.
+    pub fn mark(&mut self, kind: &str, name: &str, start: bool) {
+        let reading = match self.read() {
+            Some(reading) => reading,
+            None => return,
+        };
+        if start {
+            self.open
+                .push((kind.to_string(), name.to_string(), reading));
+            return;
+        }
+        let position = self
+            .open
+            .iter()
+            .rposition(|(open_kind, open_name, _)| open_kind == kind && open_name == name);
+        if let (Some(index), Some(domains)) = (position, &self.domains) {
+            let (kind, name, start) = self.open.remove(index);
+            self.steps
+                .push((kind, name, domains.delta(&start, &reading)));
+        }
+    }
+
+    pub fn print(&self) {
+        let domains = match &self.domains {
+            Some(domains) if !self.steps.is_empty() => domains,
+            _ => return,
+        };
+        println!("Energy (whole package, every process):");
+        println!(
+            "  {:<10} {:<20} {:>12} {:>12} {:>9}",
+            "kind", "name", "time", "joules", "watts"
+        );
+        for (kind, name, delta) in &self.steps {
+            let joules = domains.joules(delta);
+            println!(
+                "  {:<10} {:<20} {:>12} {:>12.6} {:>9}",
+                kind,
+                name,
+                format!("{:.3?}", delta.elapsed),
+                joules,
+                delta
+                    .watts(joules)
+                    .map_or(String::from("-"), |watts| format!("{:.2}", watts)),
+            );
+        }
+    }
+
+    /// Append one `energy` record per step to the JSONL file at `path`, with
+    /// the total and every domain in joules. Like the `counters` records they
+    /// carry no `wall_clock_us`, so `compare` passes over them.
+    pub fn export(&self, path: &Path) -> Result<()> {
+        let domains = match &self.domains {
+            Some(domains) if !self.steps.is_empty() => domains,
+            _ => return Ok(()),
+        };
+        let mut file = OpenOptions::new().create(true).append(true).open(path)?;
+        for (kind, name, delta) in &self.steps {
+            let per_domain: Vec<String> = domains
+                .0
+                .iter()
+                .zip(&delta.microjoules)
+                .map(|(domain, &value)| format!("\"{}\":{:.6}", domain.name, value as f64 / 1e6))
+                .collect();
+            writeln!(
+                file,
+                "{{\"kind\":\"energy\",\"step\":\"{}\",\"name\":\"{}\",\"elapsed_us\":{:.3},\"joules\":{:.6},\"domains\":{{{}}}}}",
+                kind,
+                name,
+                delta.elapsed.as_secs_f64() * 1e6,
+                domains.joules(delta),
+                per_domain.join(","),
+            )?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,68 @@
+//! Access to the guest's exported `memory` for host imports, which is a
+//! shared memory in the `wasm32-wasip1-threads` build (`--wasi-threads`).
+//!
+//! A shared memory cannot be borrowed as a slice, since other guest threads
+//! may write to it at any time; its bytes are copied in and out instead.
+
+use anyhow::{anyhow, Result};
+use wasmtime::{AsContext, AsContextMut, Caller, Extern, Memory, SharedMemory};
+
+pub enum GuestMemory {
+    Unshared(Memory),
+    Shared(SharedMemory),
+}
+
+impl GuestMemory {
+    pub fn of<T>(caller: &mut Caller<'_, T>) -> Result<Self> {
+        match caller.get_export("memory") {
+            Some(Extern::Memory(memory)) => Ok(GuestMemory::Unshared(memory)),
+            Some(Extern::SharedMemory(memory)) => Ok(GuestMemory::Shared(memory)),
+            _ => Err(anyhow!("guest does not export a memory")),
+        }
+    }
+
+    pub fn data_size(&self, store: impl AsContext) -> usize {
+        match self {
+            GuestMemory::Unshared(memory) => memory.data_size(store),
+            GuestMemory::Shared(memory) => memory.data_size(),
+        }
+    }
+
+    pub fn read(&self, store: impl AsContext, offset: usize, len: usize) -> Result<Vec<u8>> {
+        match self {
+            GuestMemory::Unshared(memory) => {
+                let mut bytes = vec![0; len];
+                memory.read(store, offset, &mut bytes)?;
+                Ok(bytes)
+            }
+            GuestMemory::Shared(memory) => copy_shared(memory, offset, len)
+                .ok_or_else(|| anyhow!("out of bounds memory access")),
+        }
+    }
+
+    pub fn write(&self, store: impl AsContextMut, offset: usize, bytes: &[u8]) -> Result<()> {
+        match self {
+            GuestMemory::Unshared(memory) => Ok(memory.write(store, offset, bytes)?),
+            GuestMemory::Shared(memory) => {
+                let cells = memory
+                    .data()
+                    .get(offset..offset.checked_add(bytes.len()).unwrap_or(usize::MAX))
+                    .ok_or_else(|| anyhow!("out of bounds memory access"))?;
+                for (cell, byte) in cells.iter().zip(bytes) {
+                    // SAFETY: in bounds; racing guest accesses are the
+                    // guest's problem, as with any shared-memory write.
+                    unsafe { *cell.get() = *byte };
+                }
+                Ok(())
+            }
+        }
+    }
+}
+
+/// Copy `len` bytes at `offset` out of a shared memory, or `None` if they
+/// are out of bounds.
+pub fn copy_shared(memory: &SharedMemory, offset: usize, len: usize) -> Option<Vec<u8>> {
+    let cells = memory.data().get(offset..offset.checked_add(len)?)?;
+    // SAFETY: as in `GuestMemory::write`
+    Some(cells.iter().map(|cell| unsafe { *cell.get() }).collect())
+}
@@ -0,0 +1,117 @@
+//! Guest profiling (`--profile guest[,<interval ms>]`): a thread ticks the
+//! engine's epoch every interval, each tick samples the guest's stack into a
+//! `GuestProfiler`, and the run ends by writing the profile as JSON for
+//! https://profiler.firefox.com/.
+//!
+//! Epoch ticks only interrupt guest code, so host calls are recorded by the
+//! store's call hook instead, as one sample per call weighted by its length:
+//! a wasi-nn `compute`, i.e. the time inside ORT, under a `wasi-nn compute`
+//! frame and every other import under `host`. Guest pre-processing such as
+//! `image::imageops::resize` or `from_shape_fn` keeps its own frames.
+
+use anyhow::{Context, Result};
+use std::fs::File;
+use std::io::BufWriter;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
+use wasmtime::{CallHook, GuestProfiler, Module, Store, StoreContextMut, UpdateDeadline};
+use wasmtime_wasi_nn::WasiNnCtx;
+
+pub const DEFAULT_INTERVAL: Duration = Duration::from_millis(10);
+
+/// Raised by wasi-nn when a `compute` starts, so the call hook can tell
+/// inference from the other host calls when it returns.
+#[derive(Clone, Default)]
+pub struct ComputeFlag(Arc<AtomicBool>);
+
+impl ComputeFlag {
+    /// Make `cx` raise the flag at the start of every `compute`.
+    pub fn watch(&self, cx: WasiNnCtx) -> WasiNnCtx {
+        let flag = self.0.clone();
+        cx.with_compute_markers(move || flag.store(true, Ordering::Relaxed), || {})
+    }
+
+    fn take(&self) -> bool {
+        self.0.swap(false, Ordering::Relaxed)
+    }
+}
+
+/// Where the profile of this run of `wasm_module` goes: its file name with
+/// the process id, in the working directory, so repeated runs keep theirs.
+pub fn output_path(wasm_module: &str) -> PathBuf {
+    let stem = Path::new(wasm_module)
+        .file_stem()
+        .map(|stem| stem.to_string_lossy().into_owned())
+        .unwrap_or_else(|| String::from("guest"));
+    PathBuf::from(format!("{}-{}.profile.json", stem, std::process::id()))
+}
+
+/// Start profiling the guest in `store`, instantiated from `module`, into the
+/// profiler slot `get` finds in the store's state.
+pub fn start<T: 'static>(
+    store: &mut Store<T>,
+    module_name: &str,
+    module: &Module,
+    interval: Duration,
+    compute: ComputeFlag,
+    get: impl Fn(&mut T) -> &mut Option<GuestProfiler> + Send + Sync + Copy + 'static,
+) {
+    let modules = vec![(module_name.to_string(), module.clone())];
+    *get(store.data_mut()) = Some(GuestProfiler::new(module_name, interval, modules));
+
+    store.epoch_deadline_callback(move |mut store| {
+        with_profiler(&mut store, get, |profiler, store| {
+            profiler.sample(store, Duration::ZERO)
+        });
+        Ok(UpdateDeadline::Continue(1))
+    });
+    store.call_hook(move |mut store, kind| {
+        with_profiler(&mut store, get, |profiler, store| {
+            let name = match kind {
+                CallHook::ReturningFromHost if compute.take() => "wasi-nn compute",
+                _ => "host",
+            };
+            profiler.call_hook_named(store, kind, name)
+        });
+        Ok(())
+    });
+
+    store.set_epoch_deadline(1);
+    let engine = store.engine().clone();
+    thread::spawn(move || loop {
+        thread::sleep(interval);
+        engine.increment_epoch();
+    });
+}
+
+/// Write the profile of `store` to `path`.
+pub fn finish<T>(
+    store: &mut Store<T>,
+    path: &Path,
+    get: impl Fn(&mut T) -> &mut Option<GuestProfiler>,
+) -> Result<()> {
+    let profiler = get(store.data_mut())
+        .take()
+        .context("the guest is not being profiled")?;
+    let output =
+        File::create(path).with_context(|| format!("failed to create {}", path.display()))?;
+    profiler.finish(BufWriter::new(output))?;
+    eprintln!("Profile written to {}", path.display());
+    eprintln!("View it at https://profiler.firefox.com/");
+    Ok(())
+}
+
+/// Take the profiler out of the store's state while `f` samples the store.
+fn with_profiler<T>(
+    store: &mut StoreContextMut<'_, T>,
+    get: impl Fn(&mut T) -> &mut Option<GuestProfiler>,
+    f: impl FnOnce(&mut GuestProfiler, &StoreContextMut<'_, T>),
+) {
+    if let Some(mut profiler) = get(store.data_mut()).take() {
+        f(&mut profiler, store);
+        *get(store.data_mut()) = Some(profiler);
+    }
+}
@@ -0,0 +1,403 @@
+//! Steady-state mode: instantiate the guest once and call its inference
+//! export many times on the same `Store`, graph and execution context.
+//!
+//! The cold-start path (`main`) pays for engine, module, linker, ONNX session
+//! and context creation on every run; here those costs are paid once by
+//! `nn_init` and only `nn_infer` is timed.
+
+use anyhow::{anyhow, bail, Result};
+use std::future::Future;
+use std::time::Instant;
+use wasmtime::{
+    AsContextMut, Engine, Instance, InstancePre, Linker, Memory, Module, ModuleExport, Store,
+    TypedFunc, WasmParams, WasmResults,
+};
+
+use crate::energy::Domains;
+use crate::stats::LatencyStats;
+
+pub const ALLOC_FUNCTION: &str = "nn_alloc";
+pub const FREE_FUNCTION: &str = "nn_free";
+pub const INIT_FUNCTION: &str = "nn_init";
+pub const INFER_FUNCTION: &str = "nn_infer";
+pub const SHUTDOWN_FUNCTION: &str = "nn_shutdown";
+pub const MAIN_FUNCTION: &str = "main";
+pub const PREPROCESS_FUNCTION: &str = "nn_preprocess";
+pub const COMPUTE_FUNCTION: &str = "nn_compute";
+pub const POSTPROCESS_FUNCTION: &str = "nn_postprocess";
+
+/// The guest with its imports resolved once (`InstancePre`) and its exports
+/// resolved to indices once, so a new store needs neither import resolution
+/// nor export lookups by name. `TypedFunc`s belong to a store, which is why
+/// these are kept per module and turned into `GuestExports` per instance.
+pub struct GuestPre<T> {
+    instance_pre: InstancePre<T>,
+    memory: ModuleExport,
+    alloc: ModuleExport,
+    free: ModuleExport,
+    init: ModuleExport,
+    infer: ModuleExport,
+    shutdown: ModuleExport,
+    main: ModuleExport,
+    preprocess: ModuleExport,
+    compute: ModuleExport,
+    postprocess: ModuleExport,
+}
+
+fn export_index(module: &Module, name: &str) -> Result<ModuleExport> {
+    module
+        .get_export_index(name)
+        .ok_or_else(|| anyhow!("guest does not export {}", name))
+}
+
+impl<T> GuestPre<T> {
+    pub fn new(linker: &Linker<T>, module: &Module) -> Result<Self> {
+        Ok(Self {
+            instance_pre: linker.instantiate_pre(module)?,
+            memory: export_index(module, "memory")?,
+            alloc: export_index(module, ALLOC_FUNCTION)?,
+            free: export_index(module, FREE_FUNCTION)?,
+            init: export_index(module, INIT_FUNCTION)?,
+            infer: export_index(module, INFER_FUNCTION)?,
+            shutdown: export_index(module, SHUTDOWN_FUNCTION)?,
+            main: export_index(module, MAIN_FUNCTION)?,
+            preprocess: export_index(module, PREPROCESS_FUNCTION)?,
+            compute: export_index(module, COMPUTE_FUNCTION)?,
+            postprocess: export_index(module, POSTPROCESS_FUNCTION)?,
+        })
+    }
+
+    pub fn engine(&self) -> &Engine {
+        self.instance_pre.module().engine()
+    }
+
+    /// Instantiate the guest in `store` and type its exports.
+    pub fn instantiate(&self, mut store: impl AsContextMut<Data = T>) -> Result<GuestExports> {
+        let instance = self.instance(&mut store)?;
+        self.exports(store, &instance)
+    }
+
+    /// Instantiate the guest in `store`, leaving its exports untyped.
+    pub fn instance(&self, mut store: impl AsContextMut<Data = T>) -> Result<Instance> {
+        self.instance_pre.instantiate(store.as_context_mut())
+    }
+
+    /// `instance` for a store with `Config::async_support`, see
+    /// `inference_pool`.
+    pub fn instance_async<'a>(
+        &'a self,
+        store: &'a mut Store<T>,
+    ) -> impl Future<Output = Result<Instance>> + 'a
+    where
+        T: Send,
+    {
+        self.instance_pre.instantiate_async(store)
+    }
+
+    /// Type the exports of `instance`, an instance of this guest in `store`.
+    pub fn exports(
+        &self,
+        mut store: impl AsContextMut,
+        instance: &Instance,
+    ) -> Result<GuestExports> {
+        let mut store = store.as_context_mut();
+        let instance = *instance;
+        let memory = instance
+            .get_module_export(&mut store, &self.memory)
+            .and_then(|export| export.into_memory())
+            .ok_or_else(|| anyhow!("guest does not export a memory"))?;
+        Ok(GuestExports {
+            memory,
+            alloc: typed_export(&mut store, &instance, &self.alloc, ALLOC_FUNCTION)?,
+            free: typed_export(&mut store, &instance, &self.free, FREE_FUNCTION)?,
+            init: typed_export(&mut store, &instance, &self.init, INIT_FUNCTION)?,
+            infer: typed_export(&mut store, &instance, &self.infer, INFER_FUNCTION)?,
+            shutdown: typed_export(&mut store, &instance, &self.shutdown, SHUTDOWN_FUNCTION)?,
+            main: typed_export(&mut store, &instance, &self.main, MAIN_FUNCTION)?,
+            preprocess: typed_export(&mut store, &instance, &self.preprocess, PREPROCESS_FUNCTION)?,
+            compute: typed_export(&mut store, &instance, &self.compute, COMPUTE_FUNCTION)?,
+            postprocess: typed_export(
+                &mut store,
+                &instance,
+                &self.postprocess,
+                POSTPROCESS_FUNCTION,
+            )?,
+        })
+    }
+}
+
+fn typed_export<P: WasmParams, R: WasmResults>(
+    mut store: impl AsContextMut,
+    instance: &Instance,
+    export: &ModuleExport,
+    name: &str,
+) -> Result<TypedFunc<P, R>> {
+    instance
+        .get_module_export(&mut store, export)
+        .and_then(|export| export.into_func())
+        .ok_or_else(|| anyhow!("guest export {} is not a function", name))?
+        .typed(&store)
+}
+
+/// Typed handles to the guest's `nn_*` exports.
+pub struct GuestExports {
+    memory: Memory,
+    alloc: TypedFunc<u32, u32>,
+    free: TypedFunc<(u32, u32), ()>,
+    init: TypedFunc<(u32, u32), i32>,
+    infer: TypedFunc<(u32, u32), i32>,
+    shutdown: TypedFunc<(), i32>,
+    main: TypedFunc<(), ()>,
+    preprocess: TypedFunc<(u32, u32, u32, u32), i32>,
+    compute: TypedFunc<(u32, u32, u32, u32), i32>,
+    postprocess: TypedFunc<(u32, u32), i32>,
+}
+
+/// A buffer in guest memory returned by `nn_alloc`.
+#[derive(Debug, Clone, Copy)]
+pub struct GuestBuffer {
+    pub ptr: u32,
+    pub len: u32,
+}
+
+impl GuestExports {
+    /// Allocate an uninitialized guest buffer of `len` bytes.
+    pub fn alloc_buffer(&self, store: impl AsContextMut, len: u32) -> Result<GuestBuffer> {
+        let ptr = self.alloc.call(store, len)?;
+        if ptr == 0 && len > 0 {
+            bail!("{} failed to allocate {} bytes", ALLOC_FUNCTION, len);
+        }
+        Ok(GuestBuffer { ptr, len })
+    }
+
+    /// Copy `bytes` into a freshly allocated guest buffer.
+    pub fn write_buffer(&self, mut store: impl AsContextMut, bytes: &[u8]) -> Result<GuestBuffer> {
+        let buffer = self.alloc_buffer(&mut store, bytes.len() as u32)?;
+        self.memory.write(&mut store, buffer.ptr as usize, bytes)?;
+        Ok(buffer)
+    }
+
+    /// Copy `bytes` to the start of `buffer`, returning the part written.
+    pub fn write_into(
+        &self,
+        store: impl AsContextMut,
+        buffer: GuestBuffer,
+        bytes: &[u8],
+    ) -> Result<GuestBuffer> {
+        if bytes.len() > buffer.len as usize {
+            bail!("{} bytes do not fit a {} byte guest buffer", bytes.len(), buffer.len);
+        }
+        self.memory.write(store, buffer.ptr as usize, bytes)?;
+        Ok(GuestBuffer {
+            ptr: buffer.ptr,
+            len: bytes.len() as u32,
+        })
+    }
+
+    /// Copy the start of `buffer` into `out`.
+    pub fn read_buffer(
+        &self,
+        store: impl AsContextMut,
+        buffer: GuestBuffer,
+        out: &mut [u8],
+    ) -> Result<()> {
+        if out.len() > buffer.len as usize {
+            bail!("cannot read {} bytes from a {} byte guest buffer", out.len(), buffer.len);
+        }
+        self.memory.read(store, buffer.ptr as usize, out)?;
+        Ok(())
+    }
+
+    pub fn free_buffer(&self, store: impl AsContextMut, buffer: GuestBuffer) -> Result<()> {
+        self.free.call(store, (buffer.ptr, buffer.len))
+    }
+
+    pub fn init(&self, mut store: impl AsContextMut, model_path: &str) -> Result<()> {
+        let path = self.write_buffer(&mut store, model_path.as_bytes())?;
+        let status = self.init.call(&mut store, (path.ptr, path.len))?;
+        self.free_buffer(&mut store, path)?;
+        if status != 0 {
+            bail!("{}({}) failed", INIT_FUNCTION, model_path);
+        }
+        Ok(())
+    }
+
+    /// Classify the encoded image in `input`, returning the predicted class.
+    pub fn infer(&self, store: impl AsContextMut, input: GuestBuffer) -> Result<i32> {
+        let class = self.infer.call(store, (input.ptr, input.len))?;
+        if class < 0 {
+            bail!("{} failed", INFER_FUNCTION);
+        }
+        Ok(class)
+    }
+
+    pub fn shutdown(&self, store: impl AsContextMut) -> Result<()> {
+        if self.shutdown.call(store, ())? != 0 {
+            bail!("{} failed", SHUTDOWN_FUNCTION);
+        }
+        Ok(())
+    }
+
+    /// Decode and pre-process the encoded image in `input` into `tensor`.
+    pub fn preprocess(
+        &self,
+        store: impl AsContextMut,
+        input: GuestBuffer,
+        tensor: GuestBuffer,
+    ) -> Result<()> {
+        let status = self
+            .preprocess
+            .call(store, (input.ptr, input.len, tensor.ptr, tensor.len))?;
+        if status != 0 {
+            bail!("{} failed", PREPROCESS_FUNCTION);
+        }
+        Ok(())
+    }
+
+    /// Run the session's model on `tensor`, returning the number of f32
+    /// scores written to `scores`.
+    pub fn compute(
+        &self,
+        store: impl AsContextMut,
+        tensor: GuestBuffer,
+        scores: GuestBuffer,
+    ) -> Result<usize> {
+        let written = self
+            .compute
+            .call(store, (tensor.ptr, tensor.len, scores.ptr, scores.len))?;
+        if written < 0 {
+            bail!("{} failed", COMPUTE_FUNCTION);
+        }
+        Ok(written as usize)
+    }
+
+    /// The predicted class of the f32 scores in `scores`.
+    pub fn postprocess(&self, store: impl AsContextMut, scores: GuestBuffer) -> Result<i32> {
+        let class = self.postprocess.call(store, (scores.ptr, scores.len))?;
+        if class < 0 {
+            bail!("{} failed", POSTPROCESS_FUNCTION);
+        }
+        Ok(class)
+    }
+
+    /// The cold-start entry point: one read, classify and report.
+    pub fn main(&self, store: impl AsContextMut) -> Result<()> {
+        self.main.call(store, ())
+    }
+
+    // With `Config::async_support` every call into the guest goes through
+    // `call_async`; these return its future for the caller to poll, see
+    // `inference_pool`.
+
+    pub fn alloc_async<'a, T: Send>(
+        &'a self,
+        store: &'a mut Store<T>,
+        len: u32,
+    ) -> impl Future<Output = Result<u32>> + 'a {
+        self.alloc.call_async(store, len)
+    }
+
+    pub fn free_async<'a, T: Send>(
+        &'a self,
+        store: &'a mut Store<T>,
+        buffer: GuestBuffer,
+    ) -> impl Future<Output = Result<()>> + 'a {
+        self.free.call_async(store, (buffer.ptr, buffer.len))
+    }
+
+    /// `nn_init` of the model path in `path`, returning its status.
+    pub fn init_async<'a, T: Send>(
+        &'a self,
+        store: &'a mut Store<T>,
+        path: GuestBuffer,
+    ) -> impl Future<Output = Result<i32>> + 'a {
+        self.init.call_async(store, (path.ptr, path.len))
+    }
+
+    /// `nn_infer` of `input`, returning the class or a negative status.
+    pub fn infer_async<'a, T: Send>(
+        &'a self,
+        store: &'a mut Store<T>,
+        input: GuestBuffer,
+    ) -> impl Future<Output = Result<i32>> + 'a {
+        self.infer.call_async(store, (input.ptr, input.len))
+    }
+}
+
+pub fn run<T>(
+    guest_pre: &GuestPre<T>,
+    store: &mut Store<T>,
+    model_path: &str,
+    image: &[u8],
+    iterations: u32,
+    warmup: u32,
+    energy: bool,
+) -> Result<LatencyStats> {
+    // A command module would get a fresh instance per export call through
+    // `linker.module`, so instantiate it directly to keep the guest state.
+    let guest = guest_pre.instantiate(&mut *store)?;
+
+    let start = Instant::now();
+    guest.init(&mut *store, model_path)?;
+    println!("{} took {:?}", INIT_FUNCTION, start.elapsed());
+
+    // The request stays in guest memory, only the call itself is timed. The
+    // first call pays for ORT's lazy allocations and kernel set-up unless the
+    // graph was warmed up at load, so it is reported apart from the steady
+    // state and counts as one of the warmup calls.
+    let input = guest.write_buffer(&mut *store, image)?;
+    let start = Instant::now();
+    let first_class = guest.infer(&mut *store, input)?;
+    let first = start.elapsed();
+    for _ in 1..warmup {
+        guest.infer(&mut *store, input)?;
+    }
+
+    // Steady-state requests should not grow the guest's memory, see the
+    // guest's request arena.
+    let pages = guest.memory.size(&*store);
+    let domains = if energy {
+        Domains::open_or_warn()
+    } else {
+        None
+    };
+    let before = domains.as_ref().and_then(|domains| domains.read().ok());
+    let mut stats = LatencyStats::with_capacity(iterations as usize);
+    for _ in 0..iterations {
+        let start = Instant::now();
+        let class = guest.infer(&mut *store, input)?;
+        stats.record(start.elapsed());
+
+        if class != first_class {
+            println!("Warning: prediction changed between calls ({} vs {})", first_class, class)
+        }
+    }
+
+    let after = domains.as_ref().and_then(|domains| domains.read().ok());
+    let grown = guest.memory.size(&*store) - pages;
+
+    guest.free_buffer(&mut *store, input)?;
+    guest.shutdown(&mut *store)?;
+
+    println!("Predicted Class Index: {}", first_class);
+    println!("first {} (cold) took {:?}", INFER_FUNCTION, first);
+    println!("guest memory grew by {} pages during the measured calls", grown);
+    if let (Some(domains), Some(before), Some(after)) = (&domains, before, after) {
+        let delta = domains.delta(&before, &after);
+        let joules = domains.joules(&delta);
+        println!(
+            "measured calls used {:.3} J in {:?}: {:.3} mJ per {} at {:.2} W",
+            joules,
+            delta.elapsed,
+            joules * 1e3 / iterations as f64,
+            INFER_FUNCTION,
+            joules / delta.elapsed.as_secs_f64()
+        );
+    }
+    stats.print_histogram(&format!(
+        "steady-state {} latency ({} warmup)",
+        INFER_FUNCTION,
+        warmup.max(1)
+    ));
+    Ok(stats)
+}
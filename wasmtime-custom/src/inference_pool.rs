@@ -0,0 +1,169 @@
+//! Async mode (`--inference-pool <threads>`): `--pool-guests` instances of
+//! the guest share the main thread, each in its own async store, and the
+//! wasi-nn `compute`s of all of them run on one `InferencePool`.
+//!
+//! The engine has `Config::async_support` and the linker wasi-nn's async
+//! bindings, so a guest's fiber yields while its compute is on a pool
+//! thread and the main thread runs another guest meanwhile, e.g. decoding
+//! its image. Every round sends one request to each guest and polls all of
+//! their `nn_infer` calls until they are answered; the number of inferences
+//! in flight is bounded by the pool's threads, not by host threads.
+
+use anyhow::{anyhow, bail, Result};
+use std::future::Future;
+use std::sync::Arc;
+use std::task::{Context, Poll, Wake, Waker};
+use std::thread;
+use std::time::Instant;
+use wasmtime::Store;
+
+use crate::inference_loop::{
+    GuestBuffer, GuestExports, GuestPre, ALLOC_FUNCTION, INFER_FUNCTION, INIT_FUNCTION,
+};
+use crate::stats::LatencyStats;
+
+struct ThreadWaker(thread::Thread);
+
+impl Wake for ThreadWaker {
+    fn wake(self: Arc<Self>) {
+        self.0.unpark();
+    }
+}
+
+/// Poll `futures` on this thread, parking while none of them can make
+/// progress, and pass each output to `done` with the future's index as soon
+/// as it is ready.
+fn join<F: Future>(futures: Vec<F>, mut done: impl FnMut(usize, F::Output)) {
+    let mut pending: Vec<_> = futures.into_iter().map(|future| Some(Box::pin(future))).collect();
+    let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+    let mut cx = Context::from_waker(&waker);
+    while pending.iter().any(Option::is_some) {
+        for (index, slot) in pending.iter_mut().enumerate() {
+            let ready = match slot {
+                Some(future) => match future.as_mut().poll(&mut cx) {
+                    Poll::Ready(output) => Some(output),
+                    Poll::Pending => None,
+                },
+                None => None,
+            };
+            if let Some(output) = ready {
+                *slot = None;
+                done(index, output);
+            }
+        }
+        if pending.iter().any(Option::is_some) {
+            // A pool thread unparks this one when a compute is done
+            thread::park();
+        }
+    }
+}
+
+/// Wait on this thread for one future, e.g. a setup call of a guest.
+fn block_on<F: Future>(future: F) -> F::Output {
+    let mut output = None;
+    join(vec![future], |_, ready| output = Some(ready));
+    output.unwrap()
+}
+
+/// Copy `bytes` into a new buffer of the guest in `store`.
+fn write_buffer<T: Send>(
+    guest: &GuestExports,
+    store: &mut Store<T>,
+    bytes: &[u8],
+) -> Result<GuestBuffer> {
+    let ptr = block_on(guest.alloc_async(store, bytes.len() as u32))?;
+    if ptr == 0 && !bytes.is_empty() {
+        bail!("{} failed to allocate {} bytes", ALLOC_FUNCTION, bytes.len());
+    }
+    let buffer = GuestBuffer {
+        ptr,
+        len: bytes.len() as u32,
+    };
+    guest.write_into(&mut *store, buffer, bytes)
+}
+
+pub fn run<T: Send>(
+    guest_pre: &GuestPre<T>,
+    mut new_store: impl FnMut() -> Result<Store<T>>,
+    model_path: &str,
+    image: &[u8],
+    guests: u32,
+    pool_threads: u32,
+    requests: u64,
+) -> Result<()> {
+    let mut stores = Vec::new();
+    let mut exports = Vec::new();
+    let mut inputs = Vec::new();
+    let start = Instant::now();
+    for _ in 0..guests.max(1) {
+        let mut store = new_store()?;
+        let instance = block_on(guest_pre.instance_async(&mut store))?;
+        let guest = guest_pre.exports(&mut store, &instance)?;
+        let path = write_buffer(&guest, &mut store, model_path.as_bytes())?;
+        let status = block_on(guest.init_async(&mut store, path))?;
+        block_on(guest.free_async(&mut store, path))?;
+        if status != 0 {
+            bail!("{}({}) failed", INIT_FUNCTION, model_path);
+        }
+        inputs.push(write_buffer(&guest, &mut store, image)?);
+        stores.push(store);
+        exports.push(guest);
+    }
+    println!(
+        "{} guests instantiated and initialized in {:?}",
+        stores.len(),
+        start.elapsed()
+    );
+
+    let mut latency = LatencyStats::with_capacity(requests as usize);
+    // The first class each guest predicted
+    let mut classes = vec![None; stores.len()];
+    let serving = Instant::now();
+    let mut answered = 0;
+    while answered < requests {
+        let round = (requests - answered).min(stores.len() as u64) as usize;
+        let sent = Instant::now();
+        let calls: Vec<_> = stores
+            .iter_mut()
+            .zip(&exports)
+            .zip(&inputs)
+            .take(round)
+            .map(|((store, guest), input)| guest.infer_async(store, *input))
+            .collect();
+        let mut failed = None;
+        join(calls, |guest, class| {
+            latency.record(sent.elapsed());
+            match class {
+                Ok(class) if class >= 0 => match classes[guest] {
+                    None => classes[guest] = Some(class),
+                    Some(first) if first != class => println!(
+                        "Warning: guest {} changed its prediction ({} vs {})",
+                        guest, first, class
+                    ),
+                    Some(_) => {}
+                },
+                Ok(_) => failed = Some(anyhow!("{} failed", INFER_FUNCTION)),
+                Err(error) => failed = Some(error),
+            }
+        });
+        if let Some(error) = failed {
+            return Err(error);
+        }
+        answered += round as u64;
+    }
+    let elapsed = serving.elapsed();
+
+    if let Some(Some(class)) = classes.first() {
+        println!("Predicted Class Index: {}", class);
+    }
+    println!(
+        "{} requests on {} guests and {} inference threads in {:?}: {:.1} requests/s",
+        latency.len(),
+        stores.len(),
+        pool_threads,
+        elapsed,
+        latency.len() as f64 / elapsed.as_secs_f64()
+    );
+    latency.print_histogram(&format!("{} latency, all guests", INFER_FUNCTION));
+    Ok(())
+}
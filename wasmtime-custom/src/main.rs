@@ -4,46 +4,366 @@ extern crate wasi_common;
 extern crate anyhow;
 extern crate cap_std;
 extern crate wasmtime_wasi_nn;
+extern crate wasmtime_wasi_threads;
+extern crate libc;
+extern crate tracing_subscriber;
+extern crate image;
+extern crate wasm_encoder;
+extern crate wasmparser;
+
+mod artifact_cache;
+mod bench;
+mod compile_cache;
+mod component;
+mod deadline;
+mod energy;
+mod guest_memory;
+mod guest_profile;
+mod inference_loop;
+mod inference_pool;
+mod memory_timeline;
+mod native;
+mod options;
+mod per_request;
+mod perf_counters;
+mod pipeline;
+mod preload;
+mod preprocess;
+mod server;
+mod snapshot;
+mod startup;
+mod stats;
+mod stream;
+mod trace_ring;
 
 use anyhow::{Ok, Result};
-use std::{env, path::Path, time::Instant};
-use wasmtime::{Config, Engine, Module, Store};
+use std::{env, fs::OpenOptions, io::Write, path::{Path, PathBuf}, sync::Arc, time::{Duration, Instant}};
+use wasmtime::{Config, Engine, GuestProfiler, InstanceAllocationStrategy, PoolingAllocationConfig, Store};
 use wasi_common::{sync::Dir, sync::WasiCtxBuilder, WasiCtx};
-use wasmtime::component::__internal::wasmtime_environ::__core::result::Result::Ok as WasmtimeResultOk;
-use wasmtime_wasi_nn::{InMemoryRegistry, WasiNnCtx, backend::onnxruntime::OnnxBackend};
+use wasmtime_wasi_nn::{Backend, GraphCache, InMemoryRegistry, InferencePool, ResultCache, WasiNnCtx};
+use wasmtime_wasi_nn::backend::{onnxruntime::OnnxBackend, openvino::OpenvinoBackend};
+use wasmtime_wasi_threads::WasiThreadsCtx;
+use artifact_cache::{Artifact, ArtifactCache};
+use compile_cache::IncrementalCache;
+use energy::EnergyMeter;
+use guest_profile::ComputeFlag;
+use options::Options;
+use inference_loop::GuestPre;
+use memory_timeline::MemoryTimeline;
+use perf_counters::PerfCounters;
+use startup::StartupTimeline;
+use trace_ring::TraceRing;
+use preload::Preload;
 
+/// Host environment variable naming the JSONL file the guest appends its
+/// metrics to; `benchmark --results` sets it for every iteration.
+const RESULTS_ENV: &str = "WASM_BENCH_RESULTS";
+const RESULTS_PREOPEN: &str = "results";
 
 /// The host state for running wasi-nn tests.
 struct Ctx {
     wasi: WasiCtx,
     wasi_nn: WasiNnCtx,
+    new_wasi_nn: Arc<dyn Fn() -> WasiNnCtx + Send + Sync>,
+    wasi_threads: Option<Arc<WasiThreadsCtx<Ctx>>>,
+    profiler: Option<GuestProfiler>,
+    compute_flag: ComputeFlag,
+    memory: MemoryTimeline,
+    counters: PerfCounters,
+    energy: EnergyMeter,
+    trace: TraceRing,
+    startup: StartupTimeline,
+}
+
+/// wasi-threads gives every guest thread a clone of the spawning thread's
+/// state. Graph and context handles belong to the thread that created them,
+/// so a new thread shares the WASI state and gets an empty wasi-nn context
+/// with the same backends, registry and graph cache.
+impl Clone for Ctx {
+    fn clone(&self) -> Self {
+        Self {
+            wasi: self.wasi.clone(),
+            wasi_nn: (self.new_wasi_nn)(),
+            new_wasi_nn: self.new_wasi_nn.clone(),
+            wasi_threads: self.wasi_threads.clone(),
+            profiler: None,
+            compute_flag: self.compute_flag.clone(),
+            memory: MemoryTimeline::default(),
+            counters: PerfCounters::new(false),
+            energy: EnergyMeter::new(false),
+            trace: TraceRing::default(),
+            startup: StartupTimeline::new(false),
+        }
+    }
 }
 impl Ctx {
-    fn new(directories: &Vec<&str>) -> Result<Self> {
-        let preopen_dirs = directories
+    fn new(
+        directories: &Vec<&str>,
+        options: &Options,
+        graph_cache: &GraphCache,
+        result_cache: &Option<ResultCache>,
+        registry: InMemoryRegistry,
+    ) -> Result<Self> {
+        let mut startup = StartupTimeline::new(options.startup_timeline);
+        let start = Instant::now();
+        let preopen_dirs: Vec<Dir> = directories
             .iter()
             .map(|dir| {
                 Dir::open_ambient_dir(Path::new(dir), cap_std::ambient_authority())
-            }.unwrap());
+            }.unwrap())
+            .collect();
+        startup.host("open preopened directories", start);
 
+        let start = Instant::now();
         let mut binding = WasiCtxBuilder::new();
         let builder = binding.inherit_stdio();
-        for (preopen_dir, path) in preopen_dirs.zip(directories) {
+        for (key, value) in guest_env(directories, options) {
+            builder.env(key, &value)?;
+        }
+        for (preopen_dir, path) in preopen_dirs.into_iter().zip(directories) {
             builder.preopened_dir(preopen_dir, path)?;
         }
+        if let Some((results_dir, results_path)) = results_preopen()? {
+            let dir = Dir::open_ambient_dir(&results_dir, cap_std::ambient_authority())?;
+            builder.preopened_dir(dir, RESULTS_PREOPEN)?;
+            builder.env("BENCH_RESULTS", &results_path)?;
+        }
 
         let wasi = builder.build();
-        let wasi_nn = WasiNnCtx::new(
-            [OnnxBackend::default().into()],
-            InMemoryRegistry::new().into()
-        );
+        startup.host("WasiCtxBuilder", start);
+        let (options, graph_cache) = (options.clone(), graph_cache.clone());
+        let result_cache = result_cache.clone();
+        let compute_flag = ComputeFlag::default();
+        let (profiling, flag) = (options.profile.is_some(), compute_flag.clone());
+        let new_wasi_nn: Arc<dyn Fn() -> WasiNnCtx + Send + Sync> = Arc::new(move || {
+            let cx = WasiNnCtx::new([backend(&options)], registry.clone().into())
+                .with_graph_cache(graph_cache.clone());
+            let cx = match &result_cache {
+                Some(cache) => cx.with_result_cache(cache.clone()),
+                None => cx,
+            };
+            if profiling { flag.watch(cx) } else { cx }
+        });
+        let wasi_nn = startup.time("wasi-nn context", || new_wasi_nn());
+
+        Ok(Self {
+            wasi,
+            wasi_nn,
+            new_wasi_nn,
+            wasi_threads: None,
+            profiler: None,
+            compute_flag,
+            memory: MemoryTimeline::default(),
+            counters: PerfCounters::new(options.perf_counters),
+            energy: EnergyMeter::new(options.energy),
+            trace: TraceRing::default(),
+            startup,
+        })
+    }
+}
+
+/// The environment of the guest: the settings of `options` main reads, as
+/// NN_* variables. `directories` are the preopened host directories.
+fn guest_env(directories: &[&str], options: &Options) -> Vec<(&'static str, String)> {
+    let mut env = vec![
+        ("NN_TARGET", options.target.clone()),
+        ("NN_ENCODING", options.backend.clone()),
+        ("NN_MODEL", options.model.clone()),
+    ];
+    // main reads --image through the preopen it lies in, as /assets/imgs/...
+    if directories.iter().any(|dir| Path::new(&options.image).starts_with(dir)) {
+        env.push(("NN_IMAGE", format!("/{}", options.image)));
+    }
+    if options.host_preprocess {
+        env.push(("NN_HOST_PREPROCESS", String::from("1")));
+    }
+    if let Some(batch_dir) = &options.batch_dir {
+        env.push(("NN_BATCH_DIR", batch_dir.clone()));
+        env.push(("NN_BATCH_SIZE", options.batch_size.to_string()));
+        env.push(("NN_TOP_K", options.top_k.to_string()));
+        if options.softmax {
+            env.push(("NN_SOFTMAX", String::from("1")));
+        }
+        env.push(("NN_BATCH_PASSES", options.batch_passes.to_string()));
+        env.push(("NN_TENSOR_CACHE", options.tensor_cache.to_string()));
+    }
+    if let Some(path) = &options.save_tensor {
+        env.push(("NN_SAVE_TENSOR", path.clone()));
+    }
+    if let Some(image) = &options.detect {
+        env.push(("NN_DETECT_IMAGE", image.clone()));
+    }
+    if options.stream.is_some() {
+        env.push(("NN_STREAM", String::from("1")));
+    }
+    if options.abi_bench > 0 {
+        env.push(("NN_ABI_BENCH", options.abi_bench.to_string()));
+    }
+    if let Some(labels) = &options.labels {
+        env.push(("NN_LABELS", labels.clone()));
+    }
+    if options.trace_ring {
+        env.push(("NN_TRACE", String::from("1")));
+    }
+    if options.wasi_threads > 0 {
+        env.push(("NN_PREPROCESS_THREADS", options.wasi_threads.to_string()));
+    }
+    env
+}
+
+/// When the harness asks for structured results, the directory of the results
+/// file, to preopen as RESULTS_PREOPEN, and the guest path to append its
+/// records to, passed as BENCH_RESULTS.
+fn results_preopen() -> Result<Option<(PathBuf, String)>> {
+    let results_file = match env::var_os(RESULTS_ENV) {
+        Some(results_file) => PathBuf::from(results_file),
+        None => return Ok(None),
+    };
+    let results_dir = match results_file.parent() {
+        Some(parent) if !parent.as_os_str().is_empty() => parent.to_path_buf(),
+        _ => PathBuf::from("."),
+    };
+    let file_name = results_file
+        .file_name()
+        .ok_or_else(|| anyhow::anyhow!("{} has no file name", results_file.display()))?;
+    let results_path = format!("/{}/{}", RESULTS_PREOPEN, file_name.to_string_lossy());
+    Ok(Some((results_dir, results_path)))
+}
+
+/// The `--result-cache` shared by every store, unless it is off.
+fn new_result_cache(options: &Options) -> Option<ResultCache> {
+    match options.result_cache_mib {
+        0 => None,
+        mib => Some(ResultCache::new(mib << 20)),
+    }
+}
 
-        Ok(Self { wasi, wasi_nn })
+/// Print the counters of the result cache and append them to the results
+/// file, if there is one, as a `result_cache` record.
+fn report_result_cache(cache: &Option<ResultCache>) -> Result<()> {
+    let cache = match cache {
+        Some(cache) => cache,
+        None => return Ok(()),
+    };
+    println!(
+        "Result cache: {} hits, {} misses, {} evictions, {} entries of {} bytes",
+        cache.hits(),
+        cache.misses(),
+        cache.evictions(),
+        cache.len(),
+        cache.bytes()
+    );
+    if let Some(results) = env::var_os(RESULTS_ENV) {
+        let mut file = OpenOptions::new().create(true).append(true).open(results)?;
+        writeln!(
+            file,
+            "{{\"kind\":\"result_cache\",\"hits\":{},\"misses\":{},\"evictions\":{},\"entries\":{},\"bytes\":{}}}",
+            cache.hits(),
+            cache.misses(),
+            cache.evictions(),
+            cache.len(),
+            cache.bytes()
+        )?;
     }
+    Ok(())
 }
 
+/// The backend `--backend` selects, with the `--ort-*` session options for
+/// ONNX and the `--openvino-*` ones for OpenVINO.
+fn backend(options: &Options) -> Backend {
+    match options.backend.as_str() {
+        "openvino" => OpenvinoBackend::new(options.openvino.clone()).into(),
+        _ => OnnxBackend::new(options.onnx.clone()).into(),
+    }
+}
+
+/// Engine settings for the instance allocator; everything else keeps the
+/// wasmtime defaults. Compiles go through `incremental` when it is set.
+fn engine_config(options: &Options, incremental: &Option<Arc<IncrementalCache>>) -> Result<Config> {
+    let mut config = Config::default();
+    if let Some(target) = &options.compile_target {
+        config.target(target)?;
+        for feature in &options.cpu_features {
+            // SAFETY: such an artifact is only written by compile; loading it
+            // on a CPU without the features fails the engine's flag check.
+            unsafe { config.cranelift_flag_enable(feature) };
+        }
+    }
+    config.strategy(options.strategy);
+    config.cranelift_opt_level(options.opt_level);
+    config.wasm_simd(options.simd);
+    config.wasm_relaxed_simd(options.simd && options.relaxed_simd);
+    config.memory_init_cow(options.memory_init_cow);
+    if let Some(dir) = &options.compile_cache {
+        compile_cache::enable_module_cache(&mut config, Path::new(dir))?;
+    }
+    if let Some(cache) = incremental {
+        config.enable_incremental_compilation(cache.clone())?;
+    }
+    if options.wasi_threads > 0 {
+        config.wasm_threads(true);
+    }
+    if options.component {
+        config.wasm_component_model(true);
+    }
+    // Async mode runs every guest's compute on the inference pool
+    if options.inference_pool > 0 {
+        config.async_support(true);
+    }
+    // The guest profiler samples, and server deadlines are checked, at epoch
+    // interruptions
+    config.epoch_interruption(options.profile.is_some() || options.deadline.is_some());
+    if options.pooling {
+        let mut pooling = PoolingAllocationConfig::default();
+        pooling
+            .total_core_instances(options.pool_instances)
+            .total_memories(options.pool_instances)
+            .total_tables(options.pool_instances)
+            .max_memory_size(options.pool_max_memory_mib << 20)
+            .linear_memory_keep_resident(options.pool_keep_resident_kib << 10)
+            .max_unused_warm_slots(options.pool_warm_slots);
+        config.allocation_strategy(InstanceAllocationStrategy::Pooling(pooling));
+    }
+    Ok(config)
+}
+
+/// Append the engine's compile time, artifact size and the instantiation of
+/// main to the results file, as an `engine` record without `wall_clock_us`.
+/// `compile_us` is null when the artifact came from the cache;
+/// `incremental_hits` and `incremental_misses` count functions, and are null
+/// without `--incremental-cache`.
+fn export_engine_record(
+    path: &Path,
+    options: &Options,
+    artifact: &Artifact,
+    instantiate_time: Option<Duration>,
+    incremental: &Option<Arc<IncrementalCache>>,
+) -> Result<()> {
+    let micros = |time: Option<Duration>| {
+        time.map_or(String::from("null"), |time| {
+            format!("{:.3}", time.as_secs_f64() * 1e6)
+        })
+    };
+    let count = |count: Option<u64>| count.map_or(String::from("null"), |count| count.to_string());
+    let mut file = OpenOptions::new().create(true).append(true).open(path)?;
+    writeln!(
+        file,
+        "{{\"kind\":\"engine\",\"strategy\":\"{:?}\",\"opt_level\":\"{:?}\",\"simd\":{},\"relaxed_simd\":{},\"compile_us\":{},\"artifact_bytes\":{},\"instantiate_us\":{},\"incremental_hits\":{},\"incremental_misses\":{}}}",
+        options.strategy,
+        options.opt_level,
+        options.simd,
+        options.simd && options.relaxed_simd,
+        micros(artifact.compile_time),
+        artifact.bytes,
+        micros(instantiate_time),
+        count(incremental.as_ref().map(|cache| cache.hits())),
+        count(incremental.as_ref().map(|cache| cache.misses())),
+    )?;
+    Ok(())
+}
 
 fn main() -> wasmtime::Result<()> {
+    startup::main_started();
     const MODEL_DIR: &str = "assets/models";
     const IMAGE_DIR: &str = "assets/imgs";
     let shared_dirs: Vec<&str> = vec![MODEL_DIR, IMAGE_DIR];
@@ -54,7 +374,74 @@ fn main() -> wasmtime::Result<()> {
     //     return Ok(());
     // }
 
-    let wasm_module_filename: &str = &args[1];
+    let options = Options::parse(&args)?;
+    let mut startup = StartupTimeline::new(options.startup_timeline);
+    startup.exec_to_main();
+
+    // Same switch as the wasmtime CLI, e.g. WASMTIME_LOG=wasmtime_wasi_nn=info
+    // shows which ORT execution provider a graph was loaded on.
+    if env::var_os("WASMTIME_LOG").is_some() {
+        tracing_subscriber::fmt()
+            .with_writer(std::io::stderr)
+            .with_env_filter(tracing_subscriber::EnvFilter::from_env("WASMTIME_LOG"))
+            .init();
+    }
+    let wasm_module_filename: &str = &options.wasm_module;
+    let incremental = options
+        .incremental_cache
+        .as_ref()
+        .map(|dir| Arc::new(IncrementalCache::new(dir.as_str())));
+
+    if let Some((model, output)) = &options.convert {
+        if options.backend != "onnx" {
+            anyhow::bail!("convert only works with the onnx backend");
+        }
+        let start = Instant::now();
+        OnnxBackend::new(options.onnx.clone()).convert(
+            Path::new(model),
+            Path::new(output),
+            preload::execution_target(&options.target),
+        )?;
+        println!(
+            "Converted {} to {} ({} bytes) in {:?}",
+            model,
+            output,
+            std::fs::metadata(output)?.len(),
+            start.elapsed()
+        );
+        return Ok(());
+    }
+
+    if let Some((guest, output)) = &options.snapshot {
+        let start = Instant::now();
+        let engine = Engine::new(&engine_config(&options, &incremental)?)?;
+        let snapshot = snapshot::snapshot(&engine, Path::new(guest), Path::new(output))?;
+        println!(
+            "Snapshotted {} to {} ({} pages of memory, {} bytes in {} data segments) in {:?}",
+            guest,
+            output,
+            snapshot.pages,
+            snapshot.data_bytes,
+            snapshot.segments,
+            start.elapsed()
+        );
+        return Ok(());
+    }
+
+    if options.native {
+        let results = env::var_os(RESULTS_ENV).map(PathBuf::from);
+        native::run(
+            backend(&options),
+            &options.backend,
+            preload::execution_target(&options.target),
+            &options.model,
+            &options.image,
+            results.as_deref(),
+            options.perf_counters,
+            options.energy,
+        )?;
+        return Ok(());
+    }
     // let model_filename: &str = &args[2];
     // let image_name: &str = &args[3];
     // let model_index = match get_model_index(model_filename) {
@@ -73,42 +460,389 @@ fn main() -> wasmtime::Result<()> {
     // };
     // let repeats: u32 = args[4].parse().unwrap();
 
-    let config = Config::default();
-    let engine = Engine::new(&config)?;
+    let config = startup.time("engine config", || engine_config(&options, &incremental))?;
+    let engine = startup.time("Engine::new", || Engine::new(&config))?;
+    if options.component {
+        if options.compile_only
+            || options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0
+            || options.iterations > 0
+            || options.stream.is_some()
+            || options.host_preprocess
+            || options.wasi_threads > 0
+            || options.profile.is_some()
+            || options.memory_timeline
+            || options.perf_counters
+            || options.energy
+            || options.trace_ring
+            || options.startup_timeline
+        {
+            anyhow::bail!("--component only works with main");
+        }
+        let preload = Preload::start(
+            options.graphs.clone(),
+            options.onnx.clone(),
+            preload::execution_target(&options.target),
+            false,
+        )?;
+        let result_cache = new_result_cache(&options);
+        let mut wasi_nn = WasiNnCtx::new([backend(&options)], preload.finish()?.into())
+            .with_graph_cache(GraphCache::new());
+        if let Some(cache) = &result_cache {
+            wasi_nn = wasi_nn.with_result_cache(cache.clone());
+        }
+        let mut env = guest_env(&shared_dirs, &options);
+        let results = results_preopen()?;
+        if let Some((_, results_path)) = &results {
+            env.push(("BENCH_RESULTS", results_path.clone()));
+        }
+        component::run(
+            &engine,
+            Path::new(wasm_module_filename),
+            &env,
+            &shared_dirs,
+            results.as_ref().map(|(dir, _)| (dir.as_path(), RESULTS_PREOPEN)),
+            wasi_nn,
+        )?;
+        return report_result_cache(&result_cache);
+    }
+
+    let artifact_cache =
+        ArtifactCache::for_module(Path::new(wasm_module_filename), options.cache_dir.as_deref());
+    if options.compile_only {
+        let artifact = artifact_cache.compile(&engine, Path::new(wasm_module_filename))?;
+        println!("Cached {} as {}", wasm_module_filename, artifact.display());
+        return Ok(());
+    }
+
+    // Graph loading overlaps with engine setup and module deserialization
+    let preload = startup.time("start graph preload", || {
+        Preload::start(
+            options.graphs.clone(),
+            options.onnx.clone(),
+            preload::execution_target(&options.target),
+            options.preload_background,
+        )
+    })?;
+
     let mut linker = wasmtime::Linker::new(&engine);
 
-    wasi_common::sync::add_to_linker(&mut linker, |host: &mut Ctx| &mut host.wasi)?;
-    wasmtime_wasi_nn::witx::add_to_linker(&mut linker, |host| &mut host.wasi_nn)?;
+    startup.time("add WASI to linker", || {
+        wasi_common::sync::add_to_linker(&mut linker, |host: &mut Ctx| &mut host.wasi)
+    })?;
+    startup.time("add wasi-nn to linker", || {
+        if options.inference_pool > 0 {
+            wasmtime_wasi_nn::witx::add_to_linker_async(&mut linker, |host: &mut Ctx| &mut host.wasi_nn)
+        } else {
+            wasmtime_wasi_nn::witx::add_to_linker(&mut linker, |host: &mut Ctx| &mut host.wasi_nn)
+        }
+    })?;
+    startup.time("add bench to linker", || {
+        bench::add_to_linker(
+            &mut linker,
+            |host: &mut Ctx| &mut host.memory,
+            |host: &mut Ctx| &mut host.counters,
+            |host: &mut Ctx| &mut host.energy,
+            |host: &mut Ctx| &mut host.startup,
+            |host: &mut Ctx| &mut host.trace,
+        )
+    })?;
+    startup.time("add preprocess to linker", || {
+        preprocess::add_to_linker(&mut linker, |host: &mut Ctx| &mut host.wasi_nn)
+    })?;
 
-    let mut store = Store::new(
-        &engine,
-        Ctx::new(&shared_dirs)?
-    );
+    let start = Instant::now();
+    let (wasm_module, artifact) = if options.artifact_cache {
+        artifact_cache.load(&engine, Path::new(wasm_module_filename))?
+    } else {
+        artifact_cache::compile_in_process(&engine, Path::new(wasm_module_filename))?
+    };
+    let module_step = match (options.artifact_cache, artifact.compile_time) {
+        (true, None) => "deserialize module",
+        (true, Some(_)) => "compile, serialize and deserialize module",
+        (false, _) => "compile module",
+    };
+    startup.host(module_step, start);
+    if let (Some(start), Some(time)) = (artifact.compile_start, artifact.compile_time) {
+        startup.host_between("compile", start, start + time);
+    }
+    if let (Some(cache), Some(_)) = (&incremental, artifact.compile_time) {
+        println!(
+            "Incremental cache: {} functions from the cache, {} compiled",
+            cache.hits(),
+            cache.misses()
+        );
+    }
 
-    let wasm_module_serialized_name = wasm_module_filename.to_string() + ".SERIALIZED";
-    let wasm_module =
-        match unsafe { Module::deserialize_file(&engine, wasm_module_serialized_name.clone()) } {
-            WasmtimeResultOk(serialized_module) => serialized_module,
-            Err(_) => {
-                let loaded_module = Module::from_file(&engine, wasm_module_filename)?;
-                let byte_module = loaded_module.serialize()?;
-                std::fs::write(wasm_module_serialized_name, byte_module).unwrap();
+    let registry = startup.time("wait for graph preload", || preload.finish())?;
 
-                loaded_module
+    // Shared by every store of this process, so loading the same model bytes
+    // again reuses the ORT session instead of optimizing the graph anew.
+    let graph_cache = GraphCache::new();
+    // Shared the same way, so a request repeated in another store is served
+    // from the first one's outputs
+    let result_cache = new_result_cache(&options);
+    // wasi-threads defines the guest's shared memory in the linker for one
+    // store, so it only combines with the single-store modes below
+    let mut threads_store = None;
+    if options.profile.is_some()
+        && (options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0
+            || options.wasi_threads > 0)
+    {
+        anyhow::bail!("--profile only works with main and --iterations");
+    }
+    if (options.memory_timeline || options.perf_counters || options.energy || options.trace_ring)
+        && (options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0)
+    {
+        anyhow::bail!(
+            "--memory-timeline, --perf-counters, --energy and --trace-ring only work with main and --iterations"
+        );
+    }
+    if options.startup_timeline
+        && (options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0
+            || options.iterations > 0)
+    {
+        anyhow::bail!("--startup-timeline and --startup-trace only work with main");
+    }
+    if options.wasi_threads > 0 {
+        if options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0
+        {
+            anyhow::bail!("--wasi-threads only works with main and --iterations");
+        }
+        let start = Instant::now();
+        let mut store = Store::new(
+            &engine,
+            Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry.clone())?
+        );
+        startup.host("create store", start);
+        startup.time("add wasi-threads to linker", || {
+            wasmtime_wasi_threads::add_to_linker(&mut linker, &store, &wasm_module, |host| {
+                host.wasi_threads.as_ref().unwrap()
+            })
+        })?;
+        store.data_mut().wasi_threads = Some(Arc::new(WasiThreadsCtx::new(
+            wasm_module.clone(),
+            Arc::new(linker.clone()),
+        )?));
+        if options.memory_timeline {
+            store.limiter(|host| &mut host.memory);
+        }
+        threads_store = Some(store);
+    }
+
+    if options.stream.is_some()
+        && (options.workers > 0
+            || options.pipeline_dir.is_some()
+            || options.instantiate_iterations > 0
+            || options.iterations > 0
+            || options.batch_dir.is_some()
+            || options.detect.is_some()
+            || options.host_preprocess)
+    {
+        anyhow::bail!("--stream only works with main");
+    }
+
+    // Imports and exports are resolved here once for every store below
+    let guest_pre = startup.time("InstancePre and export indices", || {
+        GuestPre::new(&linker, &wasm_module)
+    })?;
+
+    if options.inference_pool > 0 {
+        let image = std::fs::read(&options.image)?;
+        let pool = InferencePool::new(options.inference_pool as usize);
+        let new_store = || {
+            let mut ctx = Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry.clone())?;
+            ctx.wasi_nn = (ctx.new_wasi_nn)().with_inference_pool(pool.clone());
+            Ok(Store::new(&engine, ctx))
+        };
+        inference_pool::run(
+            &guest_pre,
+            new_store,
+            &options.model,
+            &image,
+            options.pool_guests,
+            options.inference_pool,
+            options.requests,
+        )?;
+        return report_result_cache(&result_cache);
+    }
+
+    if options.workers > 0 {
+        let images = match &options.request_images {
+            Some(dir) => pipeline::read_images(dir)?,
+            None => vec![std::fs::read(&options.image)?],
+        };
+        let new_store = || {
+            let ctx = Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry.clone())?;
+            Ok(Store::new(&engine, ctx))
+        };
+        server::run(
+            &guest_pre,
+            new_store,
+            &options.model,
+            &images,
+            options.workers,
+            options.requests,
+            options.qps,
+            options.deadline,
+        )?;
+        return report_result_cache(&result_cache);
+    }
+
+    if let Some(pipeline_dir) = &options.pipeline_dir {
+        let images = pipeline::read_images(pipeline_dir)?;
+        let new_store = || {
+            let ctx = Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry.clone())?;
+            Ok(Store::new(&engine, ctx))
+        };
+        pipeline::run(
+            &guest_pre,
+            new_store,
+            &options.model,
+            &images,
+            options.pipeline_items,
+            options.pipeline_depth,
+        )?;
+        return report_result_cache(&result_cache);
+    }
+
+    if options.instantiate_iterations > 0 {
+        let image = std::fs::read(&options.image)?;
+        let new_store = || {
+            let ctx = Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry.clone())?;
+            Ok(Store::new(&engine, ctx))
+        };
+        per_request::run(
+            &guest_pre,
+            new_store,
+            &options.model,
+            &image,
+            options.instantiate_iterations,
+        )?;
+        return report_result_cache(&result_cache);
+    }
+
+    let mut store = match threads_store {
+        Some(store) => store,
+        None => {
+            let start = Instant::now();
+            let mut store = Store::new(
+                &engine,
+                Ctx::new(&shared_dirs, &options, &graph_cache, &result_cache, registry)?
+            );
+            startup.host("create store", start);
+            if options.memory_timeline {
+                store.limiter(|host| &mut host.memory);
+            }
+            store
+        }
+    };
+
+    if let Some(interval) = options.profile {
+        let module_name = match Path::new(wasm_module_filename).file_name() {
+            Some(name) => name.to_string_lossy().into_owned(),
+            None => wasm_module_filename.to_string(),
+        };
+        let compute_flag = store.data().compute_flag.clone();
+        guest_profile::start(
+            &mut store,
+            &module_name,
+            &wasm_module,
+            interval,
+            compute_flag,
+            |host: &mut Ctx| &mut host.profiler,
+        );
+    }
+
+    let mut instantiate_time = None;
+    if options.iterations > 0 {
+        let image = std::fs::read(&options.image)?;
+        inference_loop::run(
+            &guest_pre,
+            &mut store,
+            &options.model,
+            &image,
+            options.iterations,
+            options.warmup,
+            options.energy,
+        )?;
+    } else {
+        // A --stream directory is fed by the host through the guest's stdio
+        let stream = match &options.stream {
+            Some(dir) if dir != "-" => {
+                let images = pipeline::read_images(dir)?;
+                let wasi = &store.data().wasi;
+                let stream = stream::Stream::start(wasi, images, options.stream_items, options.qps);
+                Some(stream?)
             }
+            _ => None,
         };
+        let start = Instant::now();
+        let instance = guest_pre.instance(&mut store)?;
+        let instantiated = Instant::now();
+        let guest = guest_pre.exports(&mut store, &instance)?;
+        instantiate_time = Some(start.elapsed());
+        startup.host_between("instantiate", start, instantiated);
+        startup.host("typed export lookups", instantiated);
+        let _result = startup.time("main", || guest.main(&mut store));
+        if let Some(stream) = stream {
+            stream.finish(&store.data().wasi)?;
+        }
+    }
+    if let Some(results) = env::var_os(RESULTS_ENV) {
+        export_engine_record(
+            Path::new(&results),
+            &options,
+            &artifact,
+            instantiate_time,
+            &incremental,
+        )?;
+    }
+    report_result_cache(&result_cache)?;
 
-    // add the module to the linker
-    const MODULE_NAME: &str = "test";
-    const FUNCTION_NAME: &str = "main";
-    linker.module(&mut store, MODULE_NAME, &wasm_module)?;
+    if options.memory_timeline {
+        store.data().memory.print();
+    }
+    if options.trace_ring {
+        store.data().trace.print(&store)?;
+    }
+    if options.perf_counters {
+        store.data().counters.print();
+        if let Some(results) = env::var_os(RESULTS_ENV) {
+            store.data().counters.export(Path::new(&results))?;
+        }
+    }
+    if options.energy {
+        store.data().energy.print();
+        if let Some(results) = env::var_os(RESULTS_ENV) {
+            store.data().energy.export(Path::new(&results))?;
+        }
+    }
 
-    let inference_function = linker
-        .get(&mut store, MODULE_NAME, FUNCTION_NAME).unwrap()
-        .into_func().unwrap()
-        .typed::<(), ()>(&mut store).unwrap();
+    if options.startup_timeline {
+        startup.merge(&mut store.data_mut().startup);
+        startup.print();
+        if let Some(results) = env::var_os(RESULTS_ENV) {
+            startup.export(Path::new(&results))?;
+        }
+        if let Some(path) = &options.startup_trace {
+            startup.write_trace(Path::new(path))?;
+        }
+    }
 
-    let _result = inference_function.call(&mut store, ());
+    if options.profile.is_some() {
+        let path = guest_profile::output_path(wasm_module_filename);
+        guest_profile::finish(&mut store, &path, |host: &mut Ctx| &mut host.profiler)?;
+    }
 
     Ok(())
 }
@@ -0,0 +1,148 @@
+//! Linear-memory timeline (`--memory-timeline on`): a `ResourceLimiter` on the
+//! store that sees every `memory.grow` of the guest, and the instantiation
+//! that sizes its memory in the first place.
+//!
+//! Each growth is recorded with its time since the store was created and
+//! the phase the guest last reported through the `bench` import `phase`
+//! (the `BenchmarkTracker` phases, "RED BOX Phase" and so on). The report
+//! lists the growths and then, per phase, the high-water mark of linear
+//! memory next to the host's max RSS at the phase's end. The latter includes
+//! ORT's arenas, which never show up in linear memory. The high-water marks
+//! are what a pooling allocator slot (`--pool-max-memory-mib`) has to hold.
+
+use anyhow::Result;
+use std::time::{Duration, Instant};
+use wasmtime::ResourceLimiter;
+
+use crate::bench;
+
+const NO_PHASE: &str = "(no phase)";
+const WASM_PAGE_SIZE: usize = 64 * 1024;
+
+struct Growth {
+    at: Duration,
+    phase: String,
+    from: usize,
+    to: usize,
+}
+
+struct PhaseMemory {
+    name: String,
+    linear_memory: usize,
+    growths: usize,
+    max_rss: u64,
+}
+
+pub struct MemoryTimeline {
+    start: Instant,
+    /// Phases the guest has started and not ended yet, innermost last.
+    open: Vec<String>,
+    growths: Vec<Growth>,
+    /// Every phase reported, in the order they were first started.
+    phases: Vec<PhaseMemory>,
+}
+
+impl Default for MemoryTimeline {
+    fn default() -> Self {
+        Self {
+            start: Instant::now(),
+            open: Vec::new(),
+            growths: Vec::new(),
+            phases: Vec::new(),
+        }
+    }
+}
+
+impl MemoryTimeline {
+    /// The guest started (`start`) or ended the phase `name` with
+    /// `linear_memory` bytes of memory.
+    pub fn phase(&mut self, name: &str, start: bool, linear_memory: usize) {
+        if start {
+            self.open.push(name.to_string());
+        } else if let Some(index) = self.open.iter().rposition(|open| open == name) {
+            self.open.remove(index);
+        }
+
+        let phase = match self.phases.iter().position(|phase| phase.name == name) {
+            Some(index) => &mut self.phases[index],
+            None => {
+                self.phases.push(PhaseMemory {
+                    name: name.to_string(),
+                    linear_memory: 0,
+                    growths: 0,
+                    max_rss: 0,
+                });
+                self.phases.last_mut().unwrap()
+            }
+        };
+        phase.linear_memory = phase.linear_memory.max(linear_memory);
+        if !start {
+            phase.max_rss = bench::process_usage().max_rss_bytes;
+        }
+    }
+
+    pub fn print(&self) {
+        println!("Linear memory growths:");
+        for growth in &self.growths {
+            println!(
+                "  {:>10.3} ms  {:<20} {:>10} -> {:>10} bytes (+{} pages)",
+                growth.at.as_secs_f64() * 1e3,
+                growth.phase,
+                growth.from,
+                growth.to,
+                (growth.to - growth.from) / WASM_PAGE_SIZE,
+            );
+        }
+        println!("Linear memory by phase:");
+        println!(
+            "  {:<20} {:>16} {:>8} {:>16}",
+            "phase", "high-water bytes", "growths", "host max RSS"
+        );
+        for phase in &self.phases {
+            println!(
+                "  {:<20} {:>16} {:>8} {:>16}",
+                phase.name, phase.linear_memory, phase.growths, phase.max_rss
+            );
+        }
+    }
+}
+
+impl ResourceLimiter for MemoryTimeline {
+    fn memory_growing(
+        &mut self,
+        current: usize,
+        desired: usize,
+        _maximum: Option<usize>,
+    ) -> Result<bool> {
+        // Growth of a phase counts for the phases enclosing it, too
+        let open = &self.open;
+        for phase in self
+            .phases
+            .iter_mut()
+            .filter(|phase| open.contains(&phase.name))
+        {
+            phase.linear_memory = phase.linear_memory.max(desired);
+            phase.growths += 1;
+        }
+        self.growths.push(Growth {
+            at: self.start.elapsed(),
+            phase: self
+                .open
+                .last()
+                .map_or(NO_PHASE, String::as_str)
+                .to_string(),
+            from: current,
+            to: desired,
+        });
+        Ok(true)
+    }
+
+    fn table_growing(
+        &mut self,
+        _current: u32,
+        _desired: u32,
+        _maximum: Option<u32>,
+    ) -> Result<bool> {
+        Ok(true)
+    }
+}
@@ -0,0 +1,216 @@
+//! Native baseline (`--native on`): the guest's `main` run directly on the
+//! host, with nothing compiled to Wasm.
+//!
+//! It reuses the backend, session options and target the guest would get,
+//! and the host build of `image` for decoding and resizing. The tensors match
+//! the guest's, and the steps are timed under the guest's operation and
+//! phase names (`loadmodel`, `envload`, `readimg`, `decode` and so on). Records go to
+//! the same JSONL results file, so `compare` can divide every Wasm phase by
+//! its native counterpart. With `--perf-counters on` and `--energy on` the
+//! steps get hardware counters and energy under the same names, too.
+
+use anyhow::{anyhow, Result};
+use std::fs::{self, OpenOptions};
+use std::io::Write;
+use std::path::Path;
+use std::time::Instant;
+use wasmtime_wasi_nn::backend::{BackendError, TensorView};
+use wasmtime_wasi_nn::wit::types::{ExecutionTarget, TensorType};
+use wasmtime_wasi_nn::Backend;
+
+use crate::bench;
+use crate::energy::EnergyMeter;
+use crate::perf_counters::PerfCounters;
+use crate::preprocess;
+
+const IMAGE_WIDTH: u32 = 224;
+const IMAGE_HEIGHT: u32 = 224;
+
+/// Resource usage at one point of the run, as the guest's `Metrics` records it.
+struct Sample {
+    name: String,
+    at: Instant,
+    usage: bench::ProcessUsage,
+    thread_ns: u64,
+}
+
+impl Sample {
+    fn now(name: &str) -> Self {
+        Self {
+            name: name.to_string(),
+            at: Instant::now(),
+            usage: bench::process_usage(),
+            thread_ns: bench::thread_cpu_time_ns(),
+        }
+    }
+
+    /// The guest's JSONL record of what happened since `self`.
+    fn record(&self, kind: &str) -> String {
+        let end = Sample::now(&self.name);
+        let wall_us = end.at.duration_since(self.at).as_secs_f64() * 1e6;
+        let user_us = end.usage.user_us.saturating_sub(self.usage.user_us);
+        let system_us = end.usage.system_us.saturating_sub(self.usage.system_us);
+        let cpu_usage = if wall_us > 0.0 {
+            (user_us + system_us) as f64 / wall_us * 100.0
+        } else {
+            0.0
+        };
+        format!(
+            "{{\"kind\":\"{}\",\"name\":\"{}\",\"wall_clock_us\":{:.3},\"user_time_us\":{:.3},\"system_time_us\":{:.3},\"thread_time_us\":{:.3},\"max_rss\":{},\"linear_memory\":0,\"cpu_usage\":{:.3}}}",
+            kind,
+            self.name,
+            wall_us,
+            user_us as f64,
+            system_us as f64,
+            end.thread_ns.saturating_sub(self.thread_ns) as f64 / 1e3,
+            end.usage.max_rss_bytes,
+            cpu_usage,
+        )
+    }
+}
+
+/// Operations and phases in the order the guest reports them: every
+/// operation first, then the phases.
+struct Tracker {
+    operations: Vec<String>,
+    phases: Vec<String>,
+    counters: PerfCounters,
+    energy: EnergyMeter,
+}
+
+impl Tracker {
+    fn new(perf_counters: bool, energy: bool) -> Self {
+        Self {
+            operations: Vec::new(),
+            phases: Vec::new(),
+            counters: PerfCounters::new(perf_counters),
+            energy: EnergyMeter::new(energy),
+        }
+    }
+
+    fn time<R>(&mut self, name: &str, f: impl FnOnce() -> Result<R>) -> Result<R> {
+        self.energy.mark("operation", name, true);
+        self.counters.mark("operation", name, true);
+        let start = Sample::now(name);
+        let result = f()?;
+        self.operations.push(start.record("operation"));
+        self.counters.mark("operation", name, false);
+        self.energy.mark("operation", name, false);
+        Ok(result)
+    }
+
+    fn phase<R>(&mut self, name: &str, f: impl FnOnce(&mut Self) -> Result<R>) -> Result<R> {
+        self.energy.mark("phase", name, true);
+        self.counters.mark("phase", name, true);
+        let start = Sample::now(name);
+        let result = f(self)?;
+        self.phases.push(start.record("phase"));
+        self.counters.mark("phase", name, false);
+        self.energy.mark("phase", name, false);
+        Ok(result)
+    }
+
+    fn export(&self, total: &Sample, path: &Path) -> Result<()> {
+        let mut file = OpenOptions::new().create(true).append(true).open(path)?;
+        for record in self.operations.iter().chain(&self.phases) {
+            writeln!(file, "{}", record)?;
+        }
+        writeln!(file, "{}", total.record("total"))?;
+        self.counters.export(path)?;
+        self.energy.export(path)
+    }
+}
+
+/// Read the model files at the host path `model` for `backend`: OpenVINO IR
+/// is the `.xml` topology plus the `.bin` weights next to it.
+fn read_model(model: &Path, backend: &str) -> Result<Vec<Vec<u8>>> {
+    let mut files = vec![fs::read(model)?];
+    if backend == "openvino" {
+        files.push(fs::read(model.with_extension("bin"))?);
+    }
+    Ok(files)
+}
+
+/// The highest of the little-endian f32 scores in `output` and its 1-based
+/// class, like the guest's `postprocess::best_class`: NaNs never win and the
+/// first of equal scores does.
+fn best_class(output: &[u8]) -> Option<(f32, i32)> {
+    let scores = output
+        .chunks_exact(4)
+        .map(|c| f32::from_le_bytes([c[0], c[1], c[2], c[3]]));
+    let mut best: Option<(f32, i32)> = None;
+    for (score, class) in scores.zip(1..) {
+        if best.map_or(!score.is_nan(), |(max, _)| score > max) {
+            best = Some((score, class));
+        }
+    }
+    best
+}
+
+/// Run the pipeline once and return the predicted 1-based class. `model` is
+/// the guest path, which maps onto the host's working directory.
+pub fn run(
+    mut backend: Backend,
+    backend_name: &str,
+    target: ExecutionTarget,
+    model: &str,
+    image: &str,
+    results: Option<&Path>,
+    perf_counters: bool,
+    energy: bool,
+) -> Result<i32> {
+    let total = Sample::now("Total");
+    let mut tracker = Tracker::new(perf_counters, energy);
+    let model = Path::new(model.trim_start_matches('/'));
+
+    let (mut context, resized) = tracker.phase("RED BOX Phase", |tracker| {
+        let graph = tracker.time("loadmodel", || {
+            let files = read_model(model, backend_name)?;
+            let builders: Vec<&[u8]> = files.iter().map(|file| file.as_slice()).collect();
+            Ok(backend.load(&builders, target)?)
+        })?;
+        let context = tracker.time("envload", || Ok(graph.init_execution_context()?))?;
+        let encoded = tracker.time("readimg", || Ok(fs::read(image)?))?;
+        let resized = tracker.time("decode", || {
+            preprocess::decode_resize(&encoded, IMAGE_WIDTH, IMAGE_HEIGHT)
+        })?;
+        Ok((context, resized))
+    })?;
+
+    let (score, class) = tracker.phase("GREEN BOX Phase", |tracker| {
+        tracker.time("Pre-processing", || {
+            let tensor = preprocess::normalize(&resized, preprocess::MEAN, preprocess::STD);
+            let dimensions = [1, 3, IMAGE_HEIGHT, IMAGE_WIDTH];
+            let view = TensorView {
+                dimensions: &dimensions,
+                tensor_type: TensorType::Fp32,
+                data: preprocess::as_bytes(&tensor),
+            };
+            Ok(context.set_input(0, &view)?)
+        })?;
+        tracker.time("Inference", || Ok(context.compute()?))?;
+        tracker.time("Post-processing", || {
+            let mut output = vec![0u8; 4096];
+            let written = loop {
+                match context.get_output(0, &mut output) {
+                    Ok(written) => break written as usize,
+                    Err(BackendError::NotEnoughMemory(_)) if output.len() < 1 << 26 => {
+                        let grown = output.len() * 2;
+                        output.resize(grown, 0);
+                    }
+                    Err(error) => return Err(error.into()),
+                }
+            };
+            best_class(&output[..written]).ok_or_else(|| anyhow!("empty output"))
+        })
+    })?;
+    println!("{}: {} (score: {})", image, class, score);
+    tracker.counters.print();
+    tracker.energy.print();
+
+    if let Some(path) = results {
+        tracker.export(&total, path)?;
+    }
+    println!("Predicted Class Index: {}", class);
+    Ok(class)
+}
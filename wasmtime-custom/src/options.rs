@@ -0,0 +1,619 @@
+//! Command line options of the custom host.
+//!
+//! Usage: `wasmtime-test [options] <wasm module>`, or `wasmtime-test
+//! [options] compile <wasm module>` to only fill the artifact cache, or
+//! `wasmtime-test [options] convert <model.onnx> <model.ort>` to write an
+//! ORT-format model, or `wasmtime-test [options] snapshot <guest> <snapshot>`
+//! to write a pre-initialized guest. Options take their value either as `--name value` or as
+//! `--name=value`.
+
+use anyhow::{anyhow, bail, Result};
+use std::time::Duration;
+use wasmtime::{OptLevel, Strategy};
+use crate::deadline::DeadlinePolicy;
+use crate::guest_profile;
+use crate::preload::GraphDirectory;
+use wasmtime_wasi_nn::backend::onnxruntime::{ExecutionMode, OnnxOptions, OptimizationLevel};
+use wasmtime_wasi_nn::backend::openvino::OpenvinoOptions;
+
+pub const USAGE: &str = "Usage: wasmtime-test [options] <wasm module>
+       wasmtime-test [options] compile <wasm module>
+       wasmtime-test [options] convert <host path of model.onnx> <host path of model.ort>
+       wasmtime-test [options] snapshot <wasm module> <snapshot wasm module>
+
+compile precompiles the module into the artifact cache and exits, so the next run maps it
+instead of compiling (e.g. at deploy time).
+
+convert optimizes an ONNX model once with the ONNX Runtime session options and --target below
+and saves it in the ORT format, which loads without being optimized again. Write it as model.ort
+next to model.onnx in an --nn-graph directory to have it preloaded instead; convert once per
+model and hardware profile, as --ort-opt-level 3 layouts depend on the CPU.
+
+snapshot runs the module's wizer.initialize export, which pre-grows the guest's heap and request
+arena, with every import trapping, and writes a copy of the module whose data segments hold the
+memory it left behind (as Wizer does). Instances of the snapshot start from that memory, mapped
+copy-on-write with --memory-init-cow on; ./build --snapshot makes wasi-nn-module-snapshot.wasm.
+
+Options:
+    --cache-dir <path>  artifact cache of precompiled modules, keyed by module and engine
+                        (default: .cwasm-cache next to the module)
+    --iterations <n>    instantiate once, call nn_init and then the guest's nn_infer export <n> times,
+                        reporting a per-call latency histogram (default: 0, run main once)
+    --warmup <n>        calls of nn_infer before the measured ones, the first of them reported on
+                        its own as the cold inference (default: 0, still one cold call)
+    --model <path>      model path inside the guest for nn_init
+                        (default: /assets/models/mobilenetv2-10.onnx)
+    --image <path>      host path of the encoded image sent to nn_infer, and read by main when it
+                        is in assets/imgs (default: assets/imgs/unseen_dog.jpg)
+    --target <target>   execution target the guest asks for: cpu, gpu or tpu (default: cpu);
+                        gpu/tpu use the ORT execution providers enabled as cargo features
+    --backend <backend> wasi-nn backend and graph encoding: onnx or openvino (default: onnx);
+                        openvino needs an IR --model, e.g. /assets/models/mobilenetv2.xml, with
+                        its .bin next to it
+    --native <on|off>   run main's pipeline natively on the host, with the same backend, image
+                        and pre-processing, as the baseline of compare (default: off)
+    --workers <n>       server mode: <n> threads with their own store, instantiated from one
+                        InstancePre, serve --requests requests from a shared queue, reporting
+                        throughput and per-worker tail latency (default: 0, off)
+    --requests <n>      requests served in total in server mode (default: 1000)
+    --qps <rate>        server and streaming mode: open loop, one request arrives every 1/<rate>
+                        seconds whether or not the guest is free, and latency counts the time it
+                        waited in the queue (default: 0, closed loop)
+    --request-images <dir>
+                        server mode: requests cycle through the images in this host directory
+                        instead of --image, for a mix of request sizes, and p99 is also reported
+                        per image
+    --deadline-ms <ms>[,<ms per MiB>]
+                        server mode: every request is due <ms>, plus <ms per MiB> of its encoded
+                        image, after it arrives. Open loop serves the earliest deadline first and
+                        sheds requests already late; an epoch ticker aborts guests past their
+                        deadline and the worker continues on a new instance (default: off)
+    --pipeline-dir <path>
+                        pipelined mode: stream the images in this host directory, e.g. assets/imgs,
+                        through nn_preprocess, nn_compute and nn_postprocess running in three
+                        instances on three threads, reporting each stage's occupancy
+    --pipeline-items <n>
+                        items streamed through the pipeline, cycling the images (default: 1000)
+    --pipeline-depth <n>
+                        capacity of the queues between stages (default: 4)
+    --stream <dir|->    streaming mode: main classifies length-prefixed images (a little-endian u32
+                        byte count, then the encoded image) from its stdin until end of input and
+                        answers each on stdout as '<seq> <class> <score>'; - passes the host's
+                        stdin and stdout through, a host directory, e.g. assets/imgs, is streamed
+                        by the host, which reports throughput and per-item latency
+    --stream-items <n>  items streamed from the --stream directory, cycling the images
+                        (default: 1000)
+    --instantiate-iterations <n>
+                        per-request isolation benchmark: <n> times create a store, instantiate,
+                        call nn_init and nn_infer once and drop the store, reporting each step
+    --inference-pool <n>
+                        async mode: --pool-guests guests share the main thread in async stores
+                        and their wasi-nn computes run on <n> inference threads, so one guest
+                        decodes its image while another one's inference runs; serves --requests
+                        requests, one per guest at a time, reporting throughput and latency
+                        (default: 0, off)
+    --pool-guests <n>   guests of async mode (default: 2)
+    --host-preprocess <on|off>
+                        let the host decode, resize and normalize images and set them as the
+                        context's input (the preprocess import) instead of the guest (default: off)
+    --component <on|off>
+                        run <wasm module> as a component, the wasm32-wasip2 build of the guest
+                        (wasi-nn-component.wasm), with preview2 WASI and the WIT wasi-nn ABI
+                        instead of preview1 and witx; works with main only (default: off)
+    --abi-bench <n>     time each wasi-nn call of an inference <n> times in main and report them per
+                        call, to compare the witx and --component builds (default: 0, off)
+    --wasi-threads <n>  link wasi-threads with a shared memory and let the guest pre-process on <n>
+                        threads; needs the wasm32-wasip1-threads build of the guest and works
+                        with main and --iterations (default: 0, off)
+    --batch-dir <path>  batch mode of main: classify every image in this guest directory, e.g.
+                        /assets/imgs, as [N, 3, 224, 224] tensors
+    --batch-size <n>    images per batch in batch mode (default: 8)
+    --top-k <n>         classes printed per image in batch mode (default: 5)
+    --softmax <on|off>  print batch mode scores as softmax probabilities (default: off)
+    --batch-passes <n>  times batch mode goes over the directory, printing classes on the first
+                        pass only (default: 1)
+    --tensor-cache <n>  keep the pre-processed tensors of the <n> most recently used batch mode
+                        files in the guest, so later passes skip decoding (default: 0, off)
+    --save-tensor <path>
+                        guest path, e.g. /assets/imgs/unseen_dog.rgb, where main writes its
+                        pre-processed input as a raw [1, 3, 224, 224] f32 tensor; --image and
+                        batch mode take such .rgb (f32) and .u8 files without decoding them
+    --labels <path>     guest path of a labels file, one class name per line, e.g.
+                        /assets/models/synset.txt; printed next to class numbers
+    --detect <path>     detection mode of main: run a YOLOv8-style --model, e.g.
+                        /assets/models/yolov8n.onnx, on this guest image, e.g.
+                        /assets/imgs/bus.jpg, with letterboxing and NMS in the guest
+    --nn-graph <encoding>::<dir>
+                        preload the graph in <dir> for load_by_name under the directory's name,
+                        e.g. onnx::assets/models/mobilenetv2-10 (repeatable; only onnx)
+    --preload-background <on|off>
+                        load --nn-graph graphs on a thread while the module is prepared (default: on)
+    --result-cache <MiB>
+                        keep up to <MiB> of outputs keyed by graph and a hash of the inputs, shared
+                        by every store, so compute on inputs seen before skips the backend; prints
+                        hits and misses at exit and adds a result_cache record to the results
+                        (default: 0, off)
+    --profile guest[,<ms>]
+                        sample the guest's stack every <ms> milliseconds (default: 10) and write a
+                        Firefox profiler JSON, <module>-<pid>.profile.json, with wasi-nn compute
+                        and other host calls as frames of their own; works with main and
+                        --iterations
+    --memory-timeline <on|off>
+                        record every growth of the guest's linear memory with the tracker phase it
+                        happened in and print them, then each phase's linear memory high-water
+                        mark next to the host's max RSS; works with main and --iterations
+                        (default: off)
+    --perf-counters <on|off>
+                        count cycles, instructions, LLC, branch and dTLB misses of every tracker
+                        phase and operation with perf_event_open, in the guest or with --native,
+                        and print IPC and misses per thousand instructions; counts user space on
+                        the calling thread only; works with main, --iterations and --native
+                        (default: off)
+    --energy <on|off>   read the RAPL/powercap energy counters, or hwmon energy inputs where there
+                        are none, around every tracker phase and operation, in the guest or with
+                        --native, and around the --iterations calls, printing joules and watts
+                        next to the time; counts the whole package, not only this process, and
+                        energy_uj is only readable by root (default: off)
+    --trace-ring <on|off>
+                        have the guest record probe events (tracker operations and the steps of
+                        nn_infer) into a ring in its memory, stamped by a host clock import without
+                        WASI dispatch, and print per-probe statistics from it at exit; works with
+                        main and --iterations (default: off)
+    --startup-timeline <on|off>
+                        time the host's cold-start steps (engine, module deserialize or compile,
+                        linking, graph preload, WASI context and preopens, wasi-nn context,
+                        instantiation and export lookups) from the exec of the process and print
+                        them with the guest's tracker phases as one timeline; works with main
+                        only (default: off)
+    --startup-trace <path>
+                        --startup-timeline, and write it to <path> as Chrome trace-event JSON for
+                        chrome://tracing or ui.perfetto.dev
+
+Compilation:
+    --strategy <compiler>           cranelift, or winch, the baseline compiler that compiles fast but
+                                    not all proposals, e.g. no SIMD (default: cranelift)
+    --opt-level <level>             Cranelift optimization: none, speed or speed-and-size
+                                    (default: speed)
+    --simd <on|off>                 the fixed-width SIMD proposal; a guest built with +simd128 fails
+                                    to compile without it (default: on)
+    --relaxed-simd <on|off>         the relaxed SIMD proposal; off with --simd off (default: on)
+    --compile-target <triple>       with compile only: an artifact for another target, e.g.
+                                    x86_64-unknown-linux-gnu on a different machine, instead of
+                                    this host and its CPU features
+    --cpu-features <list>           with --compile-target: comma separated Cranelift ISA flags the
+                                    artifact may use, e.g. has_sse41,has_avx2,has_fma
+    --artifact-cache <on|off>       map artifacts from --cache-dir; off compiles the module in the
+                                    process on every run, through --compile-cache if set (default: on)
+    --compile-cache <dir>           wasmtime's module cache in <dir>, with its worker compressing and
+                                    cleaning it up, for in-process compiles: --artifact-cache off,
+                                    --component and snapshot
+    --incremental-cache <dir>       Cranelift's per-function cache in <dir>, for every compile: after
+                                    a small change of the guest only the changed functions compile
+
+Instance allocation:
+    --pooling <on|off>              pooling instance allocator with preallocated slots (default: off)
+    --pool-instances <n>            instances, memories and tables in the pool (default: 100)
+    --pool-max-memory <MiB>         maximum linear memory of a pooled instance (default: 256)
+    --pool-keep-resident <KiB>      linear memory kept resident in a freed slot instead of being
+                                    returned to the OS, avoiding page faults on reuse (default: 0)
+    --pool-warm-slots <n>           freed slots kept warm for reuse by the same module (default: 100)
+    --memory-init-cow <on|off>      map data segments copy-on-write from the module image (default: on)
+
+ONNX Runtime session options:
+    --ort-intra-threads <n>         threads used within a node (default: chosen by ORT)
+    --ort-inter-threads <n>         threads used across nodes in parallel mode (default: chosen by ORT)
+    --ort-execution-mode <mode>     sequential or parallel (default: sequential)
+    --ort-opt-level <level>         disable, 1, 2 or 3 (default: 3)
+    --ort-memory-pattern <on|off>   pre-plan allocations from the first run (default: on)
+    --ort-cpu-arena <on|off>        use ORT's arena allocator for CPU memory (default: on)
+    --ort-warmup <n>                inferences on zero inputs when a graph is loaded or preloaded,
+                                    so the first compute is not the cold one (default: 0)
+    --ort-mapped-weights <on|off>   load an --nn-graph directory's ORT-format model.ort from a shared
+                                    read-only mapping whose weights the session uses in place, so
+                                    processes on a node share one copy of them (default: off)
+
+OpenVINO options:
+    --openvino-requests <n>         infer requests created with each graph and handed to contexts
+                                    without a lock; match the config's streams (default: 1)
+    --openvino-config <path>        plugins XML to create the core from, e.g. with NUM_STREAMS or
+                                    PERFORMANCE_HINT THROUGHPUT properties for the CPU plugin
+
+    --help              print this message";
+
+#[derive(Debug, Clone)]
+pub struct Options {
+    pub wasm_module: String,
+    pub compile_only: bool,
+    /// `convert`: the ONNX model read and the ORT-format model written.
+    pub convert: Option<(String, String)>,
+    /// `snapshot`: the guest initialized and the snapshot written.
+    pub snapshot: Option<(String, String)>,
+    pub cache_dir: Option<String>,
+    pub iterations: u32,
+    pub warmup: u32,
+    pub model: String,
+    pub image: String,
+    pub target: String,
+    pub backend: String,
+    pub native: bool,
+    pub workers: u32,
+    pub requests: u64,
+    pub qps: f64,
+    pub request_images: Option<String>,
+    pub deadline: Option<DeadlinePolicy>,
+    pub pipeline_dir: Option<String>,
+    pub pipeline_items: u64,
+    pub pipeline_depth: usize,
+    pub stream: Option<String>,
+    pub stream_items: u64,
+    pub instantiate_iterations: u32,
+    pub inference_pool: u32,
+    pub pool_guests: u32,
+    pub pooling: bool,
+    pub pool_instances: u32,
+    pub pool_max_memory_mib: usize,
+    pub pool_keep_resident_kib: usize,
+    pub pool_warm_slots: u32,
+    pub memory_init_cow: bool,
+    pub host_preprocess: bool,
+    pub wasi_threads: u32,
+    pub component: bool,
+    pub abi_bench: u32,
+    pub batch_dir: Option<String>,
+    pub batch_size: u32,
+    pub top_k: u32,
+    pub softmax: bool,
+    pub batch_passes: u32,
+    pub tensor_cache: u32,
+    pub save_tensor: Option<String>,
+    pub labels: Option<String>,
+    pub detect: Option<String>,
+    pub graphs: Vec<GraphDirectory>,
+    pub preload_background: bool,
+    pub result_cache_mib: usize,
+    /// Sampling interval of the guest profiler, when profiling.
+    pub profile: Option<Duration>,
+    pub memory_timeline: bool,
+    pub perf_counters: bool,
+    pub energy: bool,
+    pub trace_ring: bool,
+    pub startup_timeline: bool,
+    pub startup_trace: Option<String>,
+    pub strategy: Strategy,
+    pub opt_level: OptLevel,
+    pub simd: bool,
+    pub relaxed_simd: bool,
+    pub compile_target: Option<String>,
+    pub cpu_features: Vec<String>,
+    pub artifact_cache: bool,
+    pub compile_cache: Option<String>,
+    pub incremental_cache: Option<String>,
+    pub onnx: OnnxOptions,
+    pub openvino: OpenvinoOptions,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Self {
+            wasm_module: String::new(),
+            compile_only: false,
+            convert: None,
+            snapshot: None,
+            cache_dir: None,
+            iterations: 0,
+            warmup: 0,
+            model: String::from("/assets/models/mobilenetv2-10.onnx"),
+            image: String::from("assets/imgs/unseen_dog.jpg"),
+            target: String::from("cpu"),
+            backend: String::from("onnx"),
+            native: false,
+            workers: 0,
+            requests: 1000,
+            qps: 0.0,
+            request_images: None,
+            deadline: None,
+            pipeline_dir: None,
+            pipeline_items: 1000,
+            pipeline_depth: 4,
+            stream: None,
+            stream_items: 1000,
+            instantiate_iterations: 0,
+            inference_pool: 0,
+            pool_guests: 2,
+            pooling: false,
+            pool_instances: 100,
+            pool_max_memory_mib: 256,
+            pool_keep_resident_kib: 0,
+            pool_warm_slots: 100,
+            memory_init_cow: true,
+            host_preprocess: false,
+            wasi_threads: 0,
+            component: false,
+            abi_bench: 0,
+            batch_dir: None,
+            batch_size: 8,
+            top_k: 5,
+            softmax: false,
+            batch_passes: 1,
+            tensor_cache: 0,
+            save_tensor: None,
+            labels: None,
+            detect: None,
+            graphs: Vec::new(),
+            preload_background: true,
+            result_cache_mib: 0,
+            profile: None,
+            memory_timeline: false,
+            perf_counters: false,
+            energy: false,
+            trace_ring: false,
+            startup_timeline: false,
+            startup_trace: None,
+            strategy: Strategy::Cranelift,
+            opt_level: OptLevel::Speed,
+            simd: true,
+            relaxed_simd: true,
+            compile_target: None,
+            cpu_features: Vec::new(),
+            artifact_cache: true,
+            compile_cache: None,
+            incremental_cache: None,
+            onnx: OnnxOptions::default(),
+            openvino: OpenvinoOptions::default(),
+        }
+    }
+}
+
+impl Options {
+    pub fn parse(args: &[String]) -> Result<Self> {
+        let mut options = Options::default();
+        let mut positional: Vec<String> = Vec::new();
+        let mut args = args.iter().skip(1);
+
+        while let Some(arg) = args.next() {
+            if !arg.starts_with("--") {
+                positional.push(arg.clone());
+                continue;
+            }
+
+            let (name, inline_value) = match arg.find('=') {
+                Some(index) => (&arg[..index], Some(arg[index + 1..].to_string())),
+                None => (arg.as_str(), None),
+            };
+            let mut value = || -> Result<String> {
+                match inline_value.clone() {
+                    Some(value) => Ok(value),
+                    None => args
+                        .next()
+                        .cloned()
+                        .ok_or_else(|| anyhow!("missing value for {}", name)),
+                }
+            };
+
+            match name {
+                "--cache-dir" => options.cache_dir = Some(value()?),
+                "--iterations" => options.iterations = parse_number(name, &value()?)?,
+                "--warmup" => options.warmup = parse_number(name, &value()?)?,
+                "--model" => options.model = value()?,
+                "--image" => options.image = value()?,
+                "--target" => {
+                    options.target = value()?;
+                    if !["cpu", "gpu", "tpu"].contains(&options.target.as_str()) {
+                        bail!("invalid value for {}: {}", name, options.target);
+                    }
+                }
+                "--backend" => {
+                    options.backend = value()?;
+                    if !["onnx", "openvino"].contains(&options.backend.as_str()) {
+                        bail!("invalid value for {}: {}", name, options.backend);
+                    }
+                }
+                "--native" => options.native = parse_switch(name, &value()?)?,
+                "--workers" => options.workers = parse_number(name, &value()?)?,
+                "--requests" => options.requests = parse_number(name, &value()?)?,
+                "--qps" => options.qps = parse_number(name, &value()?)?,
+                "--request-images" => options.request_images = Some(value()?),
+                "--deadline-ms" => options.deadline = Some(DeadlinePolicy::parse(name, &value()?)?),
+                "--pipeline-dir" => options.pipeline_dir = Some(value()?),
+                "--pipeline-items" => options.pipeline_items = parse_number(name, &value()?)?,
+                "--pipeline-depth" => options.pipeline_depth = parse_number(name, &value()?)?,
+                "--component" => options.component = parse_switch(name, &value()?)?,
+                "--abi-bench" => options.abi_bench = parse_number(name, &value()?)?,
+                "--stream" => options.stream = Some(value()?),
+                "--stream-items" => options.stream_items = parse_number(name, &value()?)?,
+                "--instantiate-iterations" => {
+                    options.instantiate_iterations = parse_number(name, &value()?)?
+                }
+                "--inference-pool" => options.inference_pool = parse_number(name, &value()?)?,
+                "--pool-guests" => options.pool_guests = parse_number(name, &value()?)?,
+                "--pooling" => options.pooling = parse_switch(name, &value()?)?,
+                "--pool-instances" => options.pool_instances = parse_number(name, &value()?)?,
+                "--pool-max-memory" => options.pool_max_memory_mib = parse_number(name, &value()?)?,
+                "--pool-keep-resident" => {
+                    options.pool_keep_resident_kib = parse_number(name, &value()?)?
+                }
+                "--pool-warm-slots" => options.pool_warm_slots = parse_number(name, &value()?)?,
+                "--memory-init-cow" => options.memory_init_cow = parse_switch(name, &value()?)?,
+                "--host-preprocess" => options.host_preprocess = parse_switch(name, &value()?)?,
+                "--wasi-threads" => options.wasi_threads = parse_number(name, &value()?)?,
+                "--batch-dir" => options.batch_dir = Some(value()?),
+                "--detect" => options.detect = Some(value()?),
+                "--batch-size" => {
+                    options.batch_size = parse_number(name, &value()?)?;
+                    if options.batch_size == 0 {
+                        bail!("invalid value for {}: 0", name);
+                    }
+                }
+                "--top-k" => options.top_k = parse_number(name, &value()?)?,
+                "--softmax" => options.softmax = parse_switch(name, &value()?)?,
+                "--batch-passes" => options.batch_passes = parse_number(name, &value()?)?,
+                "--tensor-cache" => options.tensor_cache = parse_number(name, &value()?)?,
+                "--save-tensor" => options.save_tensor = Some(value()?),
+                "--labels" => options.labels = Some(value()?),
+                "--nn-graph" => options.graphs.push(GraphDirectory::parse(&value()?)?),
+                "--preload-background" => {
+                    options.preload_background = parse_switch(name, &value()?)?
+                }
+                "--result-cache" => options.result_cache_mib = parse_number(name, &value()?)?,
+                "--profile" => options.profile = Some(parse_profile(name, &value()?)?),
+                "--memory-timeline" => options.memory_timeline = parse_switch(name, &value()?)?,
+                "--perf-counters" => options.perf_counters = parse_switch(name, &value()?)?,
+                "--energy" => options.energy = parse_switch(name, &value()?)?,
+                "--trace-ring" => options.trace_ring = parse_switch(name, &value()?)?,
+                "--startup-timeline" => {
+                    options.startup_timeline = parse_switch(name, &value()?)?
+                }
+                "--startup-trace" => {
+                    options.startup_trace = Some(value()?);
+                    options.startup_timeline = true;
+                }
+                "--strategy" => {
+                    options.strategy = match value()?.as_str() {
+                        "cranelift" => Strategy::Cranelift,
+                        "winch" => Strategy::Winch,
+                        other => bail!("invalid value for {}: {}", name, other),
+                    }
+                }
+                "--opt-level" => {
+                    options.opt_level = match value()?.as_str() {
+                        "none" => OptLevel::None,
+                        "speed" => OptLevel::Speed,
+                        "speed-and-size" => OptLevel::SpeedAndSize,
+                        other => bail!("invalid value for {}: {}", name, other),
+                    }
+                }
+                "--simd" => options.simd = parse_switch(name, &value()?)?,
+                "--relaxed-simd" => options.relaxed_simd = parse_switch(name, &value()?)?,
+                "--compile-target" => options.compile_target = Some(value()?),
+                "--cpu-features" => {
+                    options.cpu_features = value()?.split(',').map(String::from).collect()
+                }
+                "--artifact-cache" => options.artifact_cache = parse_switch(name, &value()?)?,
+                "--compile-cache" => options.compile_cache = Some(value()?),
+                "--incremental-cache" => options.incremental_cache = Some(value()?),
+                "--ort-intra-threads" => {
+                    options.onnx.intra_threads = Some(parse_number(name, &value()?)?)
+                }
+                "--ort-inter-threads" => {
+                    options.onnx.inter_threads = Some(parse_number(name, &value()?)?)
+                }
+                "--ort-execution-mode" => {
+                    options.onnx.execution_mode = match value()?.as_str() {
+                        "sequential" => ExecutionMode::Sequential,
+                        "parallel" => ExecutionMode::Parallel,
+                        other => bail!("invalid value for {}: {}", name, other),
+                    }
+                }
+                "--ort-opt-level" => {
+                    options.onnx.optimization_level = match value()?.as_str() {
+                        "disable" | "0" => OptimizationLevel::Disable,
+                        "1" => OptimizationLevel::Level1,
+                        "2" => OptimizationLevel::Level2,
+                        "3" => OptimizationLevel::Level3,
+                        other => bail!("invalid value for {}: {}", name, other),
+                    }
+                }
+                "--ort-memory-pattern" => options.onnx.memory_pattern = parse_switch(name, &value()?)?,
+                "--ort-cpu-arena" => options.onnx.cpu_arena = parse_switch(name, &value()?)?,
+                "--ort-warmup" => options.onnx.warmup_runs = parse_number(name, &value()?)?,
+                "--ort-mapped-weights" => {
+                    options.onnx.mapped_weights = parse_switch(name, &value()?)?
+                }
+                "--openvino-requests" => {
+                    options.openvino.infer_requests = parse_number(name, &value()?)?
+                }
+                "--openvino-config" => options.openvino.config_file = Some(value()?.into()),
+                "--help" => bail!("{}", USAGE),
+                _ => bail!("unknown option: {}\n{}", name, USAGE),
+            }
+        }
+
+        match positional.len() {
+            1 => options.wasm_module = positional.remove(0),
+            2 if positional[0] == "compile" => {
+                options.compile_only = true;
+                options.wasm_module = positional.remove(1);
+            }
+            3 if positional[0] == "convert" => {
+                let output = positional.remove(2);
+                options.convert = Some((positional.remove(1), output));
+            }
+            3 if positional[0] == "snapshot" => {
+                let output = positional.remove(2);
+                options.snapshot = Some((positional.remove(1), output));
+            }
+            _ => bail!("{}", USAGE),
+        }
+        // An artifact for another CPU cannot be run here
+        if options.compile_target.is_some() && !options.compile_only {
+            bail!("--compile-target only works with compile");
+        }
+        if !options.cpu_features.is_empty() && options.compile_target.is_none() {
+            bail!("--cpu-features needs --compile-target");
+        }
+        if !(options.qps >= 0.0 && options.qps.is_finite()) {
+            bail!("invalid value for --qps: {}", options.qps);
+        }
+        let host_stream = options.stream.iter().any(|source| source != "-");
+        if options.qps > 0.0 && options.workers == 0 && !host_stream {
+            bail!("--qps only works with --workers or a --stream directory");
+        }
+        if (options.request_images.is_some() || options.deadline.is_some())
+            && options.workers == 0
+        {
+            bail!("--request-images and --deadline-ms only work with --workers");
+        }
+        // Every call into an async store goes through call_async, which only
+        // async mode does
+        if options.inference_pool > 0
+            && (options.component
+                || options.workers > 0
+                || options.pipeline_dir.is_some()
+                || options.instantiate_iterations > 0
+                || options.iterations > 0
+                || options.stream.is_some()
+                || options.wasi_threads > 0
+                || options.profile.is_some()
+                || options.memory_timeline
+                || options.perf_counters
+                || options.energy
+                || options.trace_ring
+                || options.startup_timeline)
+        {
+            bail!("--inference-pool only works on its own");
+        }
+        Ok(options)
+    }
+}
+
+/// `guest` or `guest,<interval in milliseconds>`.
+fn parse_profile(name: &str, value: &str) -> Result<Duration> {
+    let (kind, interval) = match value.find(',') {
+        Some(index) => (&value[..index], Some(&value[index + 1..])),
+        None => (value, None),
+    };
+    if kind != "guest" {
+        bail!("invalid value for {}: {} (only guest profiling is supported)", name, value);
+    }
+    match interval {
+        None => Ok(guest_profile::DEFAULT_INTERVAL),
+        Some(ms) => match ms.parse::<f64>() {
+            Ok(ms) if ms > 0.0 => Ok(Duration::from_secs_f64(ms / 1000.0)),
+            _ => bail!("invalid interval for {}: {}", name, ms),
+        },
+    }
+}
+
+fn parse_switch(name: &str, value: &str) -> Result<bool> {
+    match value {
+        "on" | "true" | "1" => Ok(true),
+        "off" | "false" | "0" => Ok(false),
+        _ => bail!("invalid value for {}: {} (expected on or off)", name, value),
+    }
+}
+
+fn parse_number<T: std::str::FromStr>(name: &str, value: &str) -> Result<T> {
+    value
+        .parse::<T>()
+        .map_err(|_| anyhow!("invalid value for {}: {}", name, value))
+}
@@ -0,0 +1,60 @@
+//! Per-request isolation mode: every request gets a fresh `Store` and
+//! instance that are dropped once it is answered.
+//!
+//! This is only viable when instantiation is cheap, which is what the pooling
+//! allocator and copy-on-write memory images are for (`--pooling`,
+//! `--memory-init-cow`). Each step is timed separately so their costs can be
+//! compared across allocator settings.
+
+use anyhow::Result;
+use std::time::Instant;
+use wasmtime::Store;
+
+use crate::inference_loop::{GuestPre, INFER_FUNCTION, INIT_FUNCTION};
+use crate::stats::LatencyStats;
+
+pub fn run<T>(
+    guest_pre: &GuestPre<T>,
+    mut new_store: impl FnMut() -> Result<Store<T>>,
+    model_path: &str,
+    image: &[u8],
+    iterations: u32,
+) -> Result<()> {
+    let capacity = iterations as usize;
+    let mut instantiate = LatencyStats::with_capacity(capacity);
+    let mut init = LatencyStats::with_capacity(capacity);
+    let mut infer = LatencyStats::with_capacity(capacity);
+    let mut teardown = LatencyStats::with_capacity(capacity);
+    let mut total = LatencyStats::with_capacity(capacity);
+
+    for _ in 0..iterations {
+        let start = Instant::now();
+        let mut store = new_store()?;
+        let guest = guest_pre.instantiate(&mut store)?;
+        let instantiated = Instant::now();
+
+        guest.init(&mut store, model_path)?;
+        let initialized = Instant::now();
+
+        let input = guest.write_buffer(&mut store, image)?;
+        guest.infer(&mut store, input)?;
+        let inferred = Instant::now();
+
+        // Returns the instance's slot to the pool, or unmaps its memory
+        drop(store);
+        let end = Instant::now();
+
+        instantiate.record(instantiated - start);
+        init.record(initialized - instantiated);
+        infer.record(inferred - initialized);
+        teardown.record(end - inferred);
+        total.record(end - start);
+    }
+
+    instantiate.print_histogram("store + instantiate latency");
+    init.print_histogram(&format!("{} latency", INIT_FUNCTION));
+    infer.print_histogram(&format!("{} latency", INFER_FUNCTION));
+    teardown.print_histogram("drop latency");
+    total.print_histogram("per-request latency");
+    Ok(())
+}
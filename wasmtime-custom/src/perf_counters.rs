@@ -0,0 +1,318 @@
+//! Hardware performance counters (`--perf-counters on`) per tracker phase
+//! and operation, read with `perf_event_open`.
+//!
+//! One counter group is opened on the thread the guest runs on: cycles,
+//! instructions, last-level cache misses, branch misses and, where the CPU
+//! has it, dTLB read misses. The guest's `BenchmarkTracker` marks the start
+//! and end of its phases and operations through the `bench` imports `phase`
+//! and `operation`. The native baseline (`--native on`) marks the same steps
+//! under the same names. Each step gets the difference of two group reads,
+//! scaled by the group's enabled and running time in case the kernel
+//! multiplexed it.
+//!
+//! Only user space is counted (`exclude_kernel`), so this works with the
+//! default `perf_event_paranoid` of 2. Only the calling thread is counted,
+//! because grouped reads do not combine with `inherit`. Inference with more
+//! than one ORT intra-op thread therefore shows only the caller's share;
+//! `--ort-intra-threads 1` keeps all of it on the calling thread.
+
+use anyhow::Result;
+use std::fs::OpenOptions;
+use std::io::{self, Write};
+use std::path::Path;
+
+use crate::perf_counters::Counter::*;
+
+/// The events of the group, the leader first.
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Counter {
+    Cycles,
+    Instructions,
+    LlcMisses,
+    BranchMisses,
+    DtlbMisses,
+}
+
+const COUNTERS: [Counter; 5] = [Cycles, Instructions, LlcMisses, BranchMisses, DtlbMisses];
+
+const PERF_TYPE_HARDWARE: u32 = 0;
+const PERF_TYPE_HW_CACHE: u32 = 3;
+const PERF_FORMAT_TOTAL_TIME_ENABLED: u64 = 1 << 0;
+const PERF_FORMAT_TOTAL_TIME_RUNNING: u64 = 1 << 1;
+const PERF_FORMAT_GROUP: u64 = 1 << 3;
+const EXCLUDE_KERNEL: u64 = 1 << 5;
+const EXCLUDE_HV: u64 = 1 << 6;
+
+impl Counter {
+    /// `perf_event_attr.type` and `.config` of the event.
+    fn event(self) -> (u32, u64) {
+        match self {
+            Cycles => (PERF_TYPE_HARDWARE, 0),
+            Instructions => (PERF_TYPE_HARDWARE, 1),
+            LlcMisses => (PERF_TYPE_HARDWARE, 3),
+            BranchMisses => (PERF_TYPE_HARDWARE, 5),
+            // PERF_COUNT_HW_CACHE_DTLB | OP_READ << 8 | RESULT_MISS << 16
+            DtlbMisses => (PERF_TYPE_HW_CACHE, 3 | 1 << 16),
+        }
+    }
+
+    /// An optional event that is left out if it cannot be opened.
+    fn optional(self) -> bool {
+        self == DtlbMisses
+    }
+}
+
+/// `struct perf_event_attr` up to `config1` (`PERF_ATTR_SIZE_VER0`), with
+/// its bit fields as one `flags` word.
+#[repr(C)]
+#[derive(Default)]
+struct PerfEventAttr {
+    kind: u32,
+    size: u32,
+    config: u64,
+    sample_period: u64,
+    sample_type: u64,
+    read_format: u64,
+    flags: u64,
+    wakeup_events: u32,
+    bp_type: u32,
+    config1: u64,
+}
+
+/// The events of one group, counting from the moment they are opened.
+struct CounterGroup {
+    /// Open events in the order the group reads them, the leader first.
+    events: Vec<(Counter, libc::c_int)>,
+}
+
+impl CounterGroup {
+    fn open() -> io::Result<Self> {
+        let mut group = CounterGroup { events: Vec::new() };
+        for &counter in COUNTERS.iter() {
+            let (kind, config) = counter.event();
+            let attr = PerfEventAttr {
+                kind,
+                size: std::mem::size_of::<PerfEventAttr>() as u32,
+                config,
+                read_format: PERF_FORMAT_GROUP
+                    | PERF_FORMAT_TOTAL_TIME_ENABLED
+                    | PERF_FORMAT_TOTAL_TIME_RUNNING,
+                flags: EXCLUDE_KERNEL | EXCLUDE_HV,
+                ..PerfEventAttr::default()
+            };
+            let leader = group.events.first().map_or(-1, |&(_, fd)| fd);
+            // SAFETY: `attr` is a valid `perf_event_attr` of the size it states
+            let fd = unsafe {
+                libc::syscall(
+                    libc::SYS_perf_event_open,
+                    &attr as *const PerfEventAttr,
+                    0 as libc::pid_t,
+                    -1 as libc::c_int,
+                    leader,
+                    0 as libc::c_ulong,
+                )
+            };
+            if fd >= 0 {
+                group.events.push((counter, fd as libc::c_int));
+            } else if !counter.optional() {
+                return Err(io::Error::last_os_error());
+            }
+        }
+        Ok(group)
+    }
+
+    /// The group's values, scaled for multiplexing, in `COUNTERS` order.
+    fn read(&self) -> io::Result<Reading> {
+        // `nr`, `time_enabled`, `time_running`, then one value per event
+        let mut buffer = [0u64; 3 + COUNTERS.len()];
+        let leader = self.events[0].1;
+        // SAFETY: the buffer holds `size_of_val(&buffer)` writable bytes
+        let read = unsafe {
+            libc::read(
+                leader,
+                buffer.as_mut_ptr() as *mut libc::c_void,
+                std::mem::size_of_val(&buffer),
+            )
+        };
+        if read < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let (enabled, running) = (buffer[1], buffer[2]);
+        let scale = if running > 0 {
+            enabled as f64 / running as f64
+        } else {
+            0.0
+        };
+        let mut reading = Reading::default();
+        for (&(counter, _), &value) in self.events.iter().zip(&buffer[3..]) {
+            let index = COUNTERS.iter().position(|&c| c == counter).unwrap();
+            reading.0[index] = Some((value as f64 * scale) as u64);
+        }
+        Ok(reading)
+    }
+}
+
+impl Drop for CounterGroup {
+    fn drop(&mut self) {
+        for &(_, fd) in self.events.iter().rev() {
+            // SAFETY: every fd was opened by `open` and is closed once
+            unsafe { libc::close(fd) };
+        }
+    }
+}
+
+/// One value per `COUNTERS` entry; `None` for events that are not open.
+#[derive(Debug, Clone, Copy, Default)]
+struct Reading([Option<u64>; 5]);
+
+impl Reading {
+    fn since(&self, start: &Reading) -> Reading {
+        let mut delta = Reading::default();
+        for (index, value) in delta.0.iter_mut().enumerate() {
+            if let (Some(end), Some(start)) = (self.0[index], start.0[index]) {
+                *value = Some(end.saturating_sub(start));
+            }
+        }
+        delta
+    }
+
+    fn get(&self, counter: Counter) -> Option<u64> {
+        self.0[COUNTERS.iter().position(|&c| c == counter).unwrap()]
+    }
+
+    /// Events of `counter` per thousand instructions.
+    fn per_kilo_instruction(&self, counter: Counter) -> Option<f64> {
+        match (self.get(counter), self.get(Instructions)) {
+            (Some(events), Some(instructions)) if instructions > 0 => {
+                Some(events as f64 * 1e3 / instructions as f64)
+            }
+            _ => None,
+        }
+    }
+
+    fn ipc(&self) -> Option<f64> {
+        match (self.get(Instructions), self.get(Cycles)) {
+            (Some(instructions), Some(cycles)) if cycles > 0 => {
+                Some(instructions as f64 / cycles as f64)
+            }
+            _ => None,
+        }
+    }
+}
+
+/// Counter values of the steps the tracker marked, for one store.
+pub struct PerfCounters {
+    /// `None` once the group failed to open, or if counting is off.
+    group: Option<CounterGroup>,
+    enabled: bool,
+    /// Steps started and not ended yet, with the reading at their start.
+    open: Vec<(String, String, Reading)>,
+    /// Finished steps: kind, name and counter deltas.
+    steps: Vec<(String, String, Reading)>,
+}
+
+impl PerfCounters {
+    pub fn new(enabled: bool) -> Self {
+        Self {
+            group: None,
+            enabled,
+            open: Vec::new(),
+            steps: Vec::new(),
+        }
+    }
+
+    /// Read the group, opening it on this thread the first time.
+    fn read(&mut self) -> Option<Reading> {
+        if !self.enabled {
+            return None;
+        }
+        if self.group.is_none() {
+            match CounterGroup::open() {
+                Ok(group) => self.group = Some(group),
+                Err(error) => {
+                    eprintln!("Warning: perf_event_open failed, no counters: {}", error);
+                    self.enabled = false;
+                    return None;
+                }
+            }
+        }
+        self.group.as_ref().and_then(|group| group.read().ok())
+    }
+
+    /// The tracker started (`start`) or ended the `kind` step `name`, where
+    /// `kind` is "phase" or "operation" as in the guest's JSONL records.
+    pub fn mark(&mut self, kind: &str, name: &str, start: bool) {
+        let reading = match self.read() {
+            Some(reading) => reading,
+            None => return,
+        };
+        if start {
+            self.open
+                .push((kind.to_string(), name.to_string(), reading));
+            return;
+        }
+        let position = self
+            .open
+            .iter()
+            .rposition(|(open_kind, open_name, _)| open_kind == kind && open_name == name);
+        if let Some(index) = position {
+            let (kind, name, start) = self.open.remove(index);
+            self.steps.push((kind, name, reading.since(&start)));
+        }
+    }
+
+    pub fn print(&self) {
+        if self.steps.is_empty() {
+            return;
+        }
+        println!("Hardware counters (user space, calling thread):");
+        println!(
+            "  {:<10} {:<20} {:>14} {:>14} {:>6} {:>9} {:>9} {:>9}",
+            "kind", "name", "cycles", "instructions", "IPC", "LLC MPKI", "br MPKI", "dTLB MPKI"
+        );
+        let optional = |value: Option<f64>, precision: usize| match value {
+            Some(value) => format!("{:.*}", precision, value),
+            None => String::from("-"),
+        };
+        for (kind, name, delta) in &self.steps {
+            println!(
+                "  {:<10} {:<20} {:>14} {:>14} {:>6} {:>9} {:>9} {:>9}",
+                kind,
+                name,
+                optional(delta.get(Cycles).map(|v| v as f64), 0),
+                optional(delta.get(Instructions).map(|v| v as f64), 0),
+                optional(delta.ipc(), 2),
+                optional(delta.per_kilo_instruction(LlcMisses), 2),
+                optional(delta.per_kilo_instruction(BranchMisses), 2),
+                optional(delta.per_kilo_instruction(DtlbMisses), 2),
+            );
+        }
+    }
+
+    /// Append one `counters` record per step to the JSONL file at `path`.
+    /// They carry no `wall_clock_us`, so `compare` passes over them.
+    pub fn export(&self, path: &Path) -> Result<()> {
+        if self.steps.is_empty() {
+            return Ok(());
+        }
+        let mut file = OpenOptions::new().create(true).append(true).open(path)?;
+        let number = |value: Option<u64>| value.map_or(String::from("null"), |v| v.to_string());
+        let ratio =
+            |value: Option<f64>| value.map_or(String::from("null"), |v| format!("{:.4}", v));
+        for (kind, name, delta) in &self.steps {
+            writeln!(
+                file,
+                "{{\"kind\":\"counters\",\"step\":\"{}\",\"name\":\"{}\",\"cycles\":{},\"instructions\":{},\"llc_misses\":{},\"branch_misses\":{},\"dtlb_misses\":{},\"ipc\":{}}}",
+                kind,
+                name,
+                number(delta.get(Cycles)),
+                number(delta.get(Instructions)),
+                number(delta.get(LlcMisses)),
+                number(delta.get(BranchMisses)),
+                number(delta.get(DtlbMisses)),
+                ratio(delta.ipc()),
+            )?;
+        }
+        Ok(())
+    }
+}
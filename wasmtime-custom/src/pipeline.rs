@@ -0,0 +1,201 @@
+//! Pipelined mode: `nn_preprocess`, `nn_compute` and `nn_postprocess` each
+//! run in their own instance on their own thread, connected by bounded
+//! queues, so request k+1 is decoded while request k is inferred and k-1 is
+//! post-processed.
+//!
+//! Every stage reports its occupancy, the share of the run it spent working
+//! rather than waiting on its queues; the stage close to 100% bounds the
+//! throughput, the others wait on it.
+
+use anyhow::{anyhow, bail, Result};
+use std::fs;
+use std::sync::mpsc::sync_channel;
+use std::sync::Barrier;
+use std::thread;
+use std::time::{Duration, Instant};
+use wasmtime::Store;
+
+use crate::inference_loop::{GuestPre, COMPUTE_FUNCTION, POSTPROCESS_FUNCTION, PREPROCESS_FUNCTION};
+use crate::stats::LatencyStats;
+
+/// Bytes of the `[1, 3, 224, 224]` f32 tensor passed from stage 1 to 2.
+const TENSOR_BYTES: u32 = 3 * 224 * 224 * 4;
+/// Room for the scores passed from stage 2 to 3; only the written ones are
+/// passed on.
+const SCORES_BYTES: u32 = 4000 * 4;
+
+/// An item travelling through the pipeline with the time it entered it.
+struct Item {
+    started: Instant,
+    bytes: Vec<u8>,
+}
+
+/// Time a stage spent working on items.
+struct StageReport {
+    name: &'static str,
+    items: u64,
+    busy: Duration,
+}
+
+/// Read every `.jpg`, `.jpeg` and `.png` file in the host directory `dir`.
+pub fn read_images(dir: &str) -> Result<Vec<Vec<u8>>> {
+    let mut paths: Vec<_> = fs::read_dir(dir)?
+        .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+        .filter(|path| {
+            let extension = path.extension().and_then(|e| e.to_str()).unwrap_or("");
+            ["jpg", "jpeg", "png"].contains(&extension.to_ascii_lowercase().as_str())
+        })
+        .collect();
+    paths.sort();
+    if paths.is_empty() {
+        bail!("no images in {}", dir);
+    }
+    paths.iter().map(|path| Ok(fs::read(path)?)).collect()
+}
+
+pub fn run<T>(
+    guest_pre: &GuestPre<T>,
+    new_store: impl Fn() -> Result<Store<T>> + Sync,
+    model_path: &str,
+    images: &[Vec<u8>],
+    items: u64,
+    depth: usize,
+) -> Result<()>
+where
+    T: Send + 'static,
+{
+    let largest_image = images.iter().map(|image| image.len()).max().unwrap_or(0) as u32;
+    let (tensors_in, tensors_out) = sync_channel::<Item>(depth);
+    let (scores_in, scores_out) = sync_channel::<Item>(depth);
+
+    // The three stages and this thread, so the clock starts once every stage
+    // is instantiated and the graph loaded
+    let ready = Barrier::new(4);
+
+    let (reports, latency, elapsed) = thread::scope(|scope| {
+        let new_store = &new_store;
+        let ready = &ready;
+        let preprocess = scope.spawn(move || -> Result<StageReport> {
+            let setup = (|| -> Result<_> {
+                let mut store = new_store()?;
+                let guest = guest_pre.instantiate(&mut store)?;
+                let input = guest.alloc_buffer(&mut store, largest_image)?;
+                let tensor = guest.alloc_buffer(&mut store, TENSOR_BYTES)?;
+                Ok((store, guest, input, tensor))
+            })();
+            ready.wait();
+            let (mut store, guest, input, tensor) = setup?;
+            let mut report = StageReport::new(PREPROCESS_FUNCTION);
+            for (_, image) in (0..items).zip(images.iter().cycle()) {
+                let started = Instant::now();
+                let encoded = guest.write_into(&mut store, input, image)?;
+                guest.preprocess(&mut store, encoded, tensor)?;
+                let mut bytes = vec![0; TENSOR_BYTES as usize];
+                guest.read_buffer(&mut store, tensor, &mut bytes)?;
+                report.record(started.elapsed());
+                if tensors_in.send(Item { started, bytes }).is_err() {
+                    break;
+                }
+            }
+            Ok(report)
+        });
+
+        let compute = scope.spawn(move || -> Result<StageReport> {
+            let setup = (|| -> Result<_> {
+                let mut store = new_store()?;
+                let guest = guest_pre.instantiate(&mut store)?;
+                guest.init(&mut store, model_path)?;
+                let tensor = guest.alloc_buffer(&mut store, TENSOR_BYTES)?;
+                let scores = guest.alloc_buffer(&mut store, SCORES_BYTES)?;
+                Ok((store, guest, tensor, scores))
+            })();
+            ready.wait();
+            let (mut store, guest, tensor, scores) = setup?;
+            let mut report = StageReport::new(COMPUTE_FUNCTION);
+            for Item { started, bytes } in tensors_out.iter() {
+                let working = Instant::now();
+                let tensor = guest.write_into(&mut store, tensor, &bytes)?;
+                let written = guest.compute(&mut store, tensor, scores)?;
+                let mut bytes = vec![0; written * 4];
+                guest.read_buffer(&mut store, scores, &mut bytes)?;
+                report.record(working.elapsed());
+                if scores_in.send(Item { started, bytes }).is_err() {
+                    break;
+                }
+            }
+            Ok(report)
+        });
+
+        let postprocess = scope.spawn(move || -> Result<(StageReport, LatencyStats)> {
+            let setup = (|| -> Result<_> {
+                let mut store = new_store()?;
+                let guest = guest_pre.instantiate(&mut store)?;
+                let scores = guest.alloc_buffer(&mut store, SCORES_BYTES)?;
+                Ok((store, guest, scores))
+            })();
+            ready.wait();
+            let (mut store, guest, scores) = setup?;
+            let mut report = StageReport::new(POSTPROCESS_FUNCTION);
+            let mut latency = LatencyStats::with_capacity(items as usize);
+            for Item { started, bytes } in scores_out.iter() {
+                let working = Instant::now();
+                let scores = guest.write_into(&mut store, scores, &bytes)?;
+                guest.postprocess(&mut store, scores)?;
+                report.record(working.elapsed());
+                latency.record(started.elapsed());
+            }
+            Ok((report, latency))
+        });
+
+        // Every stage reaches the barrier, even after a failure in its setup
+        ready.wait();
+        let start = Instant::now();
+
+        // A failing stage drops its queue ends, which stops its neighbours
+        let preprocess = join(preprocess);
+        let compute = join(compute);
+        let postprocess = join(postprocess);
+        let elapsed = start.elapsed();
+        let (postprocess, latency) = postprocess?;
+        Ok::<_, anyhow::Error>((vec![preprocess?, compute?, postprocess], latency, elapsed))
+    })?;
+
+    for report in &reports {
+        println!(
+            "{:>15}: {:>6.1}% occupied, {:?} per item",
+            report.name,
+            100.0 * report.busy.as_secs_f64() / elapsed.as_secs_f64(),
+            report.busy / report.items.max(1) as u32
+        );
+    }
+    println!(
+        "{} items through a {}-deep pipeline in {:?}: {:.1} items/s",
+        latency.len(),
+        depth,
+        elapsed,
+        latency.len() as f64 / elapsed.as_secs_f64()
+    );
+    latency.print_histogram("end-to-end latency");
+    Ok(())
+}
+
+impl StageReport {
+    fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            items: 0,
+            busy: Duration::default(),
+        }
+    }
+
+    fn record(&mut self, busy: Duration) {
+        self.items += 1;
+        self.busy += busy;
+    }
+}
+
+fn join<R>(handle: thread::ScopedJoinHandle<'_, Result<R>>) -> Result<R> {
+    handle
+        .join()
+        .map_err(|_| anyhow!("pipeline stage panicked"))?
+}
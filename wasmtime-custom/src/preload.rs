@@ -0,0 +1,105 @@
+//! Graph preloading, the custom host's counterpart of `wasmtime run -S
+//! nn-graph=<encoding>::<dir>`.
+//!
+//! Each `--nn-graph` directory is loaded into an `InMemoryRegistry` under the
+//! directory's last path component, so a guest can fetch it with
+//! `load_by_name` instead of building it on its request path. Loading may run
+//! on a background thread while the engine and module are being prepared.
+
+use anyhow::{anyhow, bail, Result};
+use std::path::{Path, PathBuf};
+use std::thread::{self, JoinHandle};
+use std::time::Instant;
+use wasmtime_wasi_nn::backend::onnxruntime::{OnnxBackend, OnnxOptions};
+use wasmtime_wasi_nn::wit::types::ExecutionTarget;
+use wasmtime_wasi_nn::InMemoryRegistry;
+
+/// One `--nn-graph <encoding>::<dir>` argument.
+#[derive(Debug, Clone)]
+pub struct GraphDirectory {
+    pub encoding: String,
+    pub dir: PathBuf,
+}
+
+impl GraphDirectory {
+    pub fn parse(value: &str) -> Result<Self> {
+        let (encoding, dir) = match value.find("::") {
+            Some(index) => (&value[..index], &value[index + 2..]),
+            None => bail!("invalid graph {}: expected <encoding>::<dir>", value),
+        };
+        // The host only registers the ONNX backend
+        if encoding != "onnx" {
+            bail!("unsupported graph encoding: {} (only onnx is available)", encoding);
+        }
+        if dir.is_empty() {
+            bail!("invalid graph {}: missing directory", value);
+        }
+        Ok(Self {
+            encoding: encoding.to_string(),
+            dir: PathBuf::from(dir),
+        })
+    }
+}
+
+pub fn execution_target(target: &str) -> ExecutionTarget {
+    match target {
+        "gpu" => ExecutionTarget::Gpu,
+        "tpu" => ExecutionTarget::Tpu,
+        _ => ExecutionTarget::Cpu,
+    }
+}
+
+/// Load every graph directory into a fresh registry, with the same session
+/// options and target the guest's own loads would use.
+pub fn load(
+    graphs: &[GraphDirectory],
+    onnx_options: &OnnxOptions,
+    target: ExecutionTarget,
+) -> Result<InMemoryRegistry> {
+    let mut registry = InMemoryRegistry::new();
+    let mut backend = OnnxBackend::new(onnx_options.clone());
+    for graph in graphs {
+        let start = Instant::now();
+        registry
+            .load_for_target(&mut backend, Path::new(&graph.dir), target)
+            .map_err(|e| anyhow!("failed to preload {}: {}", graph.dir.display(), e))?;
+        println!("preloading {} took {:?}", graph.dir.display(), start.elapsed());
+    }
+    Ok(registry)
+}
+
+/// A preload that is either done or still running on its own thread.
+pub enum Preload {
+    Ready(InMemoryRegistry),
+    Background(JoinHandle<Result<InMemoryRegistry>>),
+}
+
+impl Preload {
+    pub fn start(
+        graphs: Vec<GraphDirectory>,
+        onnx_options: OnnxOptions,
+        target: ExecutionTarget,
+        background: bool,
+    ) -> Result<Self> {
+        if graphs.is_empty() {
+            return Ok(Preload::Ready(InMemoryRegistry::new()));
+        }
+        if !background {
+            return Ok(Preload::Ready(load(&graphs, &onnx_options, target)?));
+        }
+        let handle = thread::Builder::new()
+            .name("nn-preload".to_string())
+            .spawn(move || load(&graphs, &onnx_options, target))?;
+        Ok(Preload::Background(handle))
+    }
+
+    /// Wait for the graphs to be loaded.
+    pub fn finish(self) -> Result<InMemoryRegistry> {
+        match self {
+            Preload::Ready(registry) => Ok(registry),
+            Preload::Background(handle) => handle
+                .join()
+                .map_err(|_| anyhow!("graph preload thread panicked"))?,
+        }
+    }
+}
@@ -0,0 +1,216 @@
+//! The `preprocess` import module: host-assisted image pre-processing.
+//!
+//! Decoding JPEG inside the guest runs the `image` crate's software pipeline
+//! compiled to wasm32. This import does the same work natively (the host
+//! build of `image` uses SIMD decoders) and writes the resulting tensor
+//! straight into a wasi-nn execution context, so it never travels back
+//! through guest memory:
+//! - `set_input_from_image(context: i32, index: i32, image: i32, image_len:
+//!   i32, width: i32, height: i32, normalization: i32) -> i32`: decode the
+//!   encoded image at `image`, resize it to `width`x`height`, normalize every
+//!   channel as `(v / 255 - mean) / std` and set it as the `[1, 3, height,
+//!   width]` f32 input `index` of `context`. `normalization` points to six
+//!   f32 (`mean[3]` then `std[3]`) or is 0 for the ImageNet statistics.
+//!   Returns 0 or a `wasi-nn` errno.
+
+use anyhow::Result;
+use image::imageops::FilterType;
+use image::RgbImage;
+use wasmtime::{Caller, Linker};
+use wasmtime_wasi_nn::backend::TensorView;
+use wasmtime_wasi_nn::wit::types::TensorType;
+use wasmtime_wasi_nn::WasiNnCtx;
+
+use crate::guest_memory::{copy_shared, GuestMemory};
+
+pub const MODULE_NAME: &str = "preprocess";
+
+pub const MEAN: [f32; 3] = [0.485, 0.456, 0.406];
+pub const STD: [f32; 3] = [0.229, 0.224, 0.225];
+
+// The subset of `nn_errno` (witx/wasi-nn.witx) this module reports
+const ERRNO_SUCCESS: i32 = 0;
+const ERRNO_INVALID_ARGUMENT: i32 = 1;
+const ERRNO_MISSING_MEMORY: i32 = 3;
+const ERRNO_RUNTIME_ERROR: i32 = 5;
+
+/// Decode, resize and normalize an encoded image into a CHW f32 tensor.
+pub fn decode_resize_normalize(
+    encoded: &[u8],
+    width: u32,
+    height: u32,
+    mean: [f32; 3],
+    std: [f32; 3],
+) -> Result<Vec<f32>> {
+    Ok(normalize(&decode_resize(encoded, width, height)?, mean, std))
+}
+
+/// The decoding and resizing half of [decode_resize_normalize].
+pub fn decode_resize(encoded: &[u8], width: u32, height: u32) -> Result<RgbImage> {
+    let image = image::load_from_memory(encoded)?;
+    Ok(image::imageops::resize(&image.to_rgb8(), width, height, FilterType::Triangle))
+}
+
+/// The normalizing half of [decode_resize_normalize].
+pub fn normalize(image: &RgbImage, mean: [f32; 3], std: [f32; 3]) -> Vec<f32> {
+    let scale = [0, 1, 2].map(|c| 1.0 / (255.0 * std[c]));
+    let bias = [0, 1, 2].map(|c| -mean[c] / std[c]);
+    let plane = (image.width() * image.height()) as usize;
+    let mut tensor = vec![0.0f32; 3 * plane];
+    for (i, pixel) in image.as_raw().chunks_exact(3).enumerate() {
+        for c in 0..3 {
+            tensor[c * plane + i] = pixel[c] as f32 * scale[c] + bias[c];
+        }
+    }
+    tensor
+}
+
+/// The little-endian bytes wasi-nn expects; a plain view on this host.
+#[cfg(target_endian = "little")]
+pub fn as_bytes(data: &[f32]) -> &[u8] {
+    unsafe { std::slice::from_raw_parts(data.as_ptr() as *const u8, data.len() * 4) }
+}
+
+fn guest_slice(memory: &[u8], ptr: usize, len: usize) -> Option<&[u8]> {
+    memory.get(ptr..ptr.checked_add(len)?)
+}
+
+fn read_f32s(memory: &[u8], ptr: usize, count: usize) -> Option<Vec<f32>> {
+    let bytes = guest_slice(memory, ptr, count * 4)?;
+    Some(
+        bytes
+            .chunks_exact(4)
+            .map(|c| f32::from_le_bytes([c[0], c[1], c[2], c[3]]))
+            .collect(),
+    )
+}
+
+/// Decode `encoded` and set it as input `index` of `context`; the body of
+/// `set_input_from_image` once its arguments are out of guest memory.
+fn set_input_from_encoded(
+    cx: &mut WasiNnCtx,
+    context: u32,
+    index: u32,
+    encoded: &[u8],
+    width: u32,
+    height: u32,
+    (mean, std): ([f32; 3], [f32; 3]),
+) -> i32 {
+    let tensor = match decode_resize_normalize(encoded, width, height, mean, std) {
+        Ok(tensor) => tensor,
+        Err(_) => return ERRNO_INVALID_ARGUMENT,
+    };
+    let dimensions = [1, 3, height, width];
+    let view = TensorView {
+        dimensions: &dimensions,
+        tensor_type: TensorType::Fp32,
+        data: as_bytes(&tensor),
+    };
+
+    let execution = match cx.execution_context_mut(context) {
+        Some(execution) => execution,
+        None => return ERRNO_INVALID_ARGUMENT,
+    };
+    match execution.set_input(index, &view) {
+        Ok(()) => ERRNO_SUCCESS,
+        Err(_) => ERRNO_RUNTIME_ERROR,
+    }
+}
+
+/// `mean` then `std` from the six f32 in `bytes`; no bytes select ImageNet's.
+fn normalization(bytes: Option<&[u8]>) -> Option<([f32; 3], [f32; 3])> {
+    match bytes {
+        None => Some((MEAN, STD)),
+        Some(bytes) => {
+            let values = read_f32s(bytes, 0, 6)?;
+            Some((
+                [values[0], values[1], values[2]],
+                [values[3], values[4], values[5]],
+            ))
+        }
+    }
+}
+
+pub fn add_to_linker<T: 'static>(
+    linker: &mut Linker<T>,
+    get_cx: impl Fn(&mut T) -> &mut WasiNnCtx + Send + Sync + Copy + 'static,
+) -> Result<()> {
+    linker.func_wrap(
+        MODULE_NAME,
+        "set_input_from_image",
+        move |mut caller: Caller<'_, T>,
+              context: i32,
+              index: i32,
+              image: i32,
+              image_len: i32,
+              width: i32,
+              height: i32,
+              normalization_ptr: i32|
+              -> Result<i32> {
+            if width <= 0 || height <= 0 {
+                return Ok(ERRNO_INVALID_ARGUMENT);
+            }
+            let (context, index) = (context as u32, index as u32);
+            let (width, height) = (width as u32, height as u32);
+            let (image, image_len) = (image as u32 as usize, image_len as u32 as usize);
+            let normalization_ptr = normalization_ptr as u32 as usize;
+            const NORMALIZATION_LEN: usize = 6 * 4;
+
+            match GuestMemory::of(&mut caller) {
+                Ok(GuestMemory::Unshared(memory)) => {
+                    let (data, host) = memory.data_and_store_mut(&mut caller);
+                    let encoded = match guest_slice(data, image, image_len) {
+                        Some(encoded) => encoded,
+                        None => return Ok(ERRNO_INVALID_ARGUMENT),
+                    };
+                    let norm = match normalization_ptr {
+                        0 => normalization(None),
+                        ptr => guest_slice(data, ptr, NORMALIZATION_LEN)
+                            .and_then(|bytes| normalization(Some(bytes))),
+                    };
+                    let norm = match norm {
+                        Some(norm) => norm,
+                        None => return Ok(ERRNO_INVALID_ARGUMENT),
+                    };
+                    Ok(set_input_from_encoded(
+                        get_cx(host),
+                        context,
+                        index,
+                        encoded,
+                        width,
+                        height,
+                        norm,
+                    ))
+                }
+                // Other guest threads may write to a shared memory, so the
+                // arguments are copied out before decoding
+                Ok(GuestMemory::Shared(memory)) => {
+                    let encoded = match copy_shared(&memory, image, image_len) {
+                        Some(encoded) => encoded,
+                        None => return Ok(ERRNO_INVALID_ARGUMENT),
+                    };
+                    let norm = match normalization_ptr {
+                        0 => normalization(None),
+                        ptr => copy_shared(&memory, ptr, NORMALIZATION_LEN)
+                            .and_then(|bytes| normalization(Some(&bytes))),
+                    };
+                    let norm = match norm {
+                        Some(norm) => norm,
+                        None => return Ok(ERRNO_INVALID_ARGUMENT),
+                    };
+                    Ok(set_input_from_encoded(
+                        get_cx(caller.data_mut()),
+                        context,
+                        index,
+                        &encoded,
+                        width,
+                        height,
+                        norm,
+                    ))
+                }
+                Err(_) => Ok(ERRNO_MISSING_MEMORY),
+            }
+        },
+    )?;
+    Ok(())
+}
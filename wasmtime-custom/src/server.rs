@@ -0,0 +1,382 @@
+//! Server mode: one engine, module and `GuestPre` shared by `workers`
+//! threads, each with its own `Store` (and so its own `WasiNnCtx`) that
+//! serves requests until `requests` have been answered in total.
+//!
+//! Requests cycle through `images`, so the queue is a shared ticket counter:
+//! a worker claims the next request with one `fetch_add`, which is lock-free
+//! for any number of producers and consumers. Graphs are shared through the
+//! `GraphCache`, and ORT sessions run concurrently, so workers only contend
+//! for cores.
+//!
+//! Without a rate the load is closed-loop: a worker takes the next request as
+//! soon as it finished the last one. With `qps` it is open-loop: request `i`
+//! arrives at `i / qps` seconds whether or not a worker is free, and its
+//! latency is measured from that arrival, so the time it waited in the queue
+//! is counted. Raising `qps` until the p99 leaves the service time behind
+//! finds the saturation point.
+//!
+//! With `deadlines` every request is due its budget after it arrives (see
+//! deadline.rs). In open loop the requests that have arrived then wait in a
+//! heap and are served earliest deadline first, so with mixed image sizes a
+//! small request does not queue behind a large one with more time left.
+
+use anyhow::{anyhow, Result};
+use std::cmp::Reverse;
+use std::collections::BinaryHeap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Barrier, Mutex, OnceLock};
+use std::thread;
+use std::time::{Duration, Instant};
+use wasmtime::Store;
+
+use crate::deadline::{DeadlineExceeded, DeadlinePolicy, DeadlineSlot, Ticker};
+use crate::inference_loop::{GuestBuffer, GuestExports, GuestPre, INFER_FUNCTION};
+use crate::stats::LatencyStats;
+
+/// Requests left to hand out.
+struct RequestQueue {
+    next: AtomicU64,
+    total: u64,
+    images: usize,
+    /// Time between two arrivals in open-loop mode.
+    interval: Option<Duration>,
+    /// When the first request arrives, set by the first worker ready to serve.
+    epoch: OnceLock<Instant>,
+    /// The budget of a request for each image, with deadlines.
+    budgets: Option<Vec<Duration>>,
+    /// Requests that have arrived, by deadline, in open loop with deadlines.
+    pending: Mutex<BinaryHeap<Reverse<(Instant, u64)>>>,
+}
+
+/// A request claimed from the queue.
+struct Request {
+    image: usize,
+    /// When it arrives in open-loop mode, or when it was claimed.
+    arrival: Instant,
+    deadline: Option<Instant>,
+}
+
+impl RequestQueue {
+    fn new(total: u64, images: usize, qps: f64, budgets: Option<Vec<Duration>>) -> Self {
+        Self {
+            next: AtomicU64::new(0),
+            total,
+            images,
+            interval: if qps > 0.0 {
+                Some(Duration::from_secs_f64(1.0 / qps))
+            } else {
+                None
+            },
+            epoch: OnceLock::new(),
+            budgets,
+            pending: Mutex::new(BinaryHeap::new()),
+        }
+    }
+
+    fn start(&self) -> Instant {
+        *self.epoch.get_or_init(Instant::now)
+    }
+
+    /// When `ticket` arrives in open-loop mode.
+    fn arrival(&self, ticket: u64) -> Option<Instant> {
+        self.interval
+            .map(|interval| self.start() + interval.mul_f64(ticket as f64))
+    }
+
+    fn image(&self, ticket: u64) -> usize {
+        (ticket % self.images as u64) as usize
+    }
+
+    fn request(&self, ticket: u64) -> Request {
+        let image = self.image(ticket);
+        let arrival = self.arrival(ticket).unwrap_or_else(Instant::now);
+        Request {
+            image,
+            arrival,
+            deadline: self
+                .budgets
+                .as_ref()
+                .map(|budgets| arrival + budgets[image]),
+        }
+    }
+
+    /// Claim the next request, or `None` once all have been claimed.
+    fn pop(&self) -> Option<Request> {
+        if self.budgets.is_some() && self.interval.is_some() {
+            return self.pop_earliest();
+        }
+        let ticket = self.next.fetch_add(1, Ordering::Relaxed);
+        if ticket < self.total {
+            Some(self.request(ticket))
+        } else {
+            None
+        }
+    }
+
+    /// Move the requests that have arrived into the heap and claim the one
+    /// due first. With none waiting, the next to arrive is claimed early, as
+    /// without deadlines.
+    fn pop_earliest(&self) -> Option<Request> {
+        let mut pending = self.pending.lock().unwrap();
+        let now = Instant::now();
+        // Only changed under the lock in this mode
+        while self.next.load(Ordering::Relaxed) < self.total {
+            let ticket = self.next.load(Ordering::Relaxed);
+            let arrival = self.arrival(ticket)?;
+            if arrival > now && !pending.is_empty() {
+                break;
+            }
+            self.next.store(ticket + 1, Ordering::Relaxed);
+            let budget = self.budgets.as_ref()?[self.image(ticket)];
+            pending.push(Reverse((arrival + budget, ticket)));
+            if arrival > now {
+                break;
+            }
+        }
+        pending
+            .pop()
+            .map(|Reverse((_, ticket))| self.request(ticket))
+    }
+}
+
+/// What became of the requests with a deadline.
+#[derive(Debug, Default, Clone, Copy)]
+struct DeadlineCounts {
+    /// Answered in time.
+    met: u64,
+    /// Answered late, when the overrun was inside a host call.
+    missed: u64,
+    /// Trapped by the epoch callback.
+    aborted: u64,
+    /// Past their deadline before a worker took them.
+    shed: u64,
+}
+
+impl DeadlineCounts {
+    fn merge(&mut self, other: &DeadlineCounts) {
+        self.met += other.met;
+        self.missed += other.missed;
+        self.aborted += other.aborted;
+        self.shed += other.shed;
+    }
+}
+
+/// One worker's latencies, overall and per image, its queueing delays, its
+/// deadline outcomes, and when it started and stopped serving.
+struct Served {
+    stats: LatencyStats,
+    per_image: Vec<LatencyStats>,
+    queued: LatencyStats,
+    deadlines: DeadlineCounts,
+    serving: Instant,
+    served: Instant,
+}
+
+/// A worker's instance with every image in its memory.
+struct Worker<T> {
+    store: Store<T>,
+    guest: GuestExports,
+    inputs: Vec<GuestBuffer>,
+}
+
+pub fn run<T>(
+    guest_pre: &GuestPre<T>,
+    new_store: impl Fn() -> Result<Store<T>> + Sync,
+    model_path: &str,
+    images: &[Vec<u8>],
+    workers: u32,
+    requests: u64,
+    qps: f64,
+    deadlines: Option<DeadlinePolicy>,
+) -> Result<()>
+where
+    T: Send + 'static,
+{
+    let budgets = deadlines.map(|policy| {
+        images
+            .iter()
+            .map(|image| policy.budget(image.len()))
+            .collect()
+    });
+    let queue = RequestQueue::new(requests, images.len(), qps, budgets);
+    let ready_barrier = Barrier::new(workers as usize);
+    let _ticker = deadlines.map(|_| Ticker::start(guest_pre.engine()));
+
+    let per_worker = thread::scope(|scope| {
+        let handles: Vec<_> = (0..workers)
+            .map(|_| {
+                scope.spawn(|| -> Result<Served> {
+                    let slot = DeadlineSlot::default();
+                    let start_guest = || -> Result<Worker<T>> {
+                        let mut store = new_store()?;
+                        if deadlines.is_some() {
+                            slot.watch(&mut store);
+                        }
+                        let guest = guest_pre.instantiate(&mut store)?;
+                        guest.init(&mut store, model_path)?;
+                        let inputs = images
+                            .iter()
+                            .map(|image| guest.write_buffer(&mut store, image))
+                            .collect::<Result<_>>()?;
+                        Ok(Worker {
+                            store,
+                            guest,
+                            inputs,
+                        })
+                    };
+                    // Instantiate and load the graph, then wait for the
+                    // others so no worker starts serving alone
+                    let ready = start_guest();
+                    // Every worker reaches this, even after a failure
+                    ready_barrier.wait();
+                    let mut worker = ready?;
+
+                    let mut stats = LatencyStats::default();
+                    let mut per_image = vec![LatencyStats::default(); images.len()];
+                    let mut queued = LatencyStats::default();
+                    let mut counts = DeadlineCounts::default();
+                    let serving = queue.start();
+                    while let Some(request) = queue.pop() {
+                        // In open loop, early: the request does not exist
+                        // yet. Late: it has been queued since arrival
+                        let now = Instant::now();
+                        if request.arrival > now {
+                            thread::sleep(request.arrival - now);
+                        }
+                        if queue.interval.is_some() {
+                            queued.record(now.saturating_duration_since(request.arrival));
+                        }
+                        let input = worker.inputs[request.image];
+                        let infer = match request.deadline {
+                            Some(deadline) if deadline <= Instant::now() => {
+                                counts.shed += 1;
+                                continue;
+                            }
+                            Some(deadline) => {
+                                slot.arm(&mut worker.store, deadline);
+                                let infer = worker.guest.infer(&mut worker.store, input);
+                                slot.disarm(&mut worker.store);
+                                infer
+                            }
+                            None => worker.guest.infer(&mut worker.store, input),
+                        };
+                        let latency = request.arrival.elapsed();
+                        match infer {
+                            Ok(_) => {
+                                if let Some(deadline) = request.deadline {
+                                    if request.arrival + latency <= deadline {
+                                        counts.met += 1;
+                                    } else {
+                                        counts.missed += 1;
+                                    }
+                                }
+                            }
+                            // The trap may have left the guest inconsistent
+                            Err(error) if error.downcast_ref::<DeadlineExceeded>().is_some() => {
+                                counts.aborted += 1;
+                                worker = start_guest()?;
+                            }
+                            Err(error) => return Err(error),
+                        }
+                        stats.record(latency);
+                        per_image[request.image].record(latency);
+                    }
+                    let served = Instant::now();
+                    for input in &worker.inputs {
+                        worker.guest.free_buffer(&mut worker.store, *input)?;
+                    }
+                    worker.guest.shutdown(&mut worker.store)?;
+                    Ok(Served {
+                        stats,
+                        per_image,
+                        queued,
+                        deadlines: counts,
+                        serving,
+                        served,
+                    })
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .map(|handle| {
+                handle
+                    .join()
+                    .map_err(|_| anyhow!("server worker panicked"))?
+            })
+            .collect::<Result<Vec<_>>>()
+    })?;
+
+    let mut all = LatencyStats::with_capacity(requests as usize);
+    let mut all_queued = LatencyStats::with_capacity(requests as usize);
+    let mut all_per_image = vec![LatencyStats::default(); images.len()];
+    let mut counts = DeadlineCounts::default();
+    for (worker, served) in per_worker.iter().enumerate() {
+        let stats = &served.stats;
+        println!(
+            "worker {:>3}: n={} p50={:?} p99={:?} p99.9={:?} max={:?}",
+            worker,
+            stats.len(),
+            stats.percentile(50.0),
+            stats.percentile(99.0),
+            stats.percentile(99.9),
+            stats.max()
+        );
+        all.merge(stats);
+        all_queued.merge(&served.queued);
+        for (all, stats) in all_per_image.iter_mut().zip(&served.per_image) {
+            all.merge(stats);
+        }
+        counts.merge(&served.deadlines);
+    }
+    // From the first request to the last one finishing, so instantiation and
+    // nn_init are not counted
+    let first = per_worker.iter().map(|served| served.serving).min();
+    let last = per_worker.iter().map(|served| served.served).max();
+    let elapsed = match (first, last) {
+        (Some(first), Some(last)) => last - first,
+        _ => Default::default(),
+    };
+    println!(
+        "{} requests on {} workers in {:?}: {:.1} requests/s",
+        all.len(),
+        workers,
+        elapsed,
+        all.len() as f64 / elapsed.as_secs_f64()
+    );
+    if qps > 0.0 {
+        let achieved = all.len() as f64 / elapsed.as_secs_f64();
+        println!(
+            "open loop at {:.1} requests/s offered: queued p50={:?} p99={:?} max={:?}{}",
+            qps,
+            all_queued.percentile(50.0),
+            all_queued.percentile(99.0),
+            all_queued.max(),
+            if achieved < qps * 0.95 {
+                ", saturated: requests arrive faster than they are served"
+            } else {
+                ""
+            }
+        );
+    }
+    if images.len() > 1 {
+        for (image, stats) in images.iter().zip(&all_per_image) {
+            println!(
+                "{:>9} byte image: n={} p50={:?} p99={:?} max={:?}",
+                image.len(),
+                stats.len(),
+                stats.percentile(50.0),
+                stats.percentile(99.0),
+                stats.max()
+            );
+        }
+    }
+    if let Some(policy) = deadlines {
+        println!(
+            "deadline {:?} + {:?}/MiB: {} met, {} missed, {} aborted, {} shed",
+            policy.base, policy.per_mib, counts.met, counts.missed, counts.aborted, counts.shed
+        );
+    }
+    all.print_histogram(&format!("{} latency, all workers", INFER_FUNCTION));
+    Ok(())
+}
@@ -0,0 +1,203 @@
+//! `wasmtime-test snapshot <guest> <snapshot>`: a pre-initialized guest, as
+//! Wizer makes them. The guest's `wizer.initialize` export runs once (see
+//! wasm-module/src/preinit.rs), and the linear memory it leaves behind is
+//! written back into a copy of the module as its data segments, with the
+//! memory's minimum size raised to match. Every instance of the snapshot
+//! starts from that memory, which copy-on-write memory images map instead
+//! of copying, so per-instance startup work moves to build time; in the
+//! pooling allocator the slots must be large enough for the grown memory.
+//!
+//! Wizer itself only links WASI, and the guest also imports `bench`,
+//! `preprocess` and `wasi_ephemeral_nn`. Here every import is a trap, which
+//! also guarantees the init function took no host state into the snapshot.
+//!
+//! Only linear memory is captured. Globals keep their initial values, which
+//! is right for a wasm32-wasip1 Rust guest: its one mutable global is
+//! `__stack_pointer`, back where it started once the init call returns. A
+//! module with more mutable globals, a shared memory (the threads build) or
+//! a start function is refused.
+
+use anyhow::{bail, Context, Result};
+use std::fs;
+use std::path::Path;
+use wasm_encoder::{
+    ConstExpr, DataCountSection, DataSection, ExportKind, ExportSection, MemorySection, MemoryType,
+    RawSection,
+};
+use wasmparser::{Encoding, ExternalKind, Parser, Payload};
+use wasmtime::{Engine, Linker, Module, Store};
+
+const INIT_EXPORT: &str = "wizer.initialize";
+const MEMORY_EXPORT: &str = "memory";
+/// Zero runs shorter than this stay inside a segment: the segments are
+/// fewer, and a memory image is made of whole pages anyway.
+const MIN_GAP: usize = 4096;
+
+/// What went into a snapshot.
+pub struct Snapshot {
+    pub pages: u64,
+    pub segments: usize,
+    pub data_bytes: usize,
+}
+
+/// Initialize the guest at `input` and write its snapshot to `output`.
+pub fn snapshot(engine: &Engine, input: &Path, output: &Path) -> Result<Snapshot> {
+    let wasm = fs::read(input).with_context(|| format!("reading {}", input.display()))?;
+    let module = Module::new(engine, &wasm)?;
+    let mut linker = Linker::new(engine);
+    linker.define_unknown_imports_as_traps(&module)?;
+    let mut store = Store::new(engine, ());
+    let instance = linker.instantiate(&mut store, &module)?;
+    let init = instance
+        .get_typed_func::<(), ()>(&mut store, INIT_EXPORT)
+        .with_context(|| format!("{} has no {} export", input.display(), INIT_EXPORT))?;
+    init.call(&mut store, ())
+        .with_context(|| format!("{} failed; it may not call any import", INIT_EXPORT))?;
+    let memory = match instance.get_memory(&mut store, MEMORY_EXPORT) {
+        Some(memory) => memory,
+        None => bail!("{} exports no {}", input.display(), MEMORY_EXPORT),
+    };
+    let pages = memory.size(&store);
+    let segments = segments(memory.data(&store));
+
+    let snapshot = rewrite(&wasm, pages, &segments)?;
+    Module::validate(engine, &snapshot).context("the snapshot does not validate")?;
+    fs::write(output, &snapshot).with_context(|| format!("writing {}", output.display()))?;
+    Ok(Snapshot {
+        pages,
+        segments: segments.len(),
+        data_bytes: segments.iter().map(|(_, data)| data.len()).sum(),
+    })
+}
+
+/// The non-zero parts of `image`, at their offsets.
+fn segments(image: &[u8]) -> Vec<(usize, &[u8])> {
+    let mut segments = Vec::new();
+    let mut start = None;
+    let mut last = 0;
+    for (offset, _) in image.iter().enumerate().filter(|(_, &byte)| byte != 0) {
+        match start {
+            Some(_) if offset - last <= MIN_GAP => {}
+            Some(first) => {
+                segments.push((first, &image[first..=last]));
+                start = Some(offset);
+            }
+            None => start = Some(offset),
+        }
+        last = offset;
+    }
+    if let Some(first) = start {
+        segments.push((first, &image[first..=last]));
+    }
+    segments
+}
+
+/// `wasm` with its memory grown to `pages`, its data replaced by `segments`
+/// and the init export removed; every other section is copied as it is.
+fn rewrite(wasm: &[u8], pages: u64, segments: &[(usize, &[u8])]) -> Result<Vec<u8>> {
+    let mut data = DataSection::new();
+    for (offset, bytes) in segments {
+        data.active(
+            0,
+            &ConstExpr::i32_const(*offset as i32),
+            bytes.iter().copied(),
+        );
+    }
+
+    let mut module = wasm_encoder::Module::new();
+    let mut has_memory = false;
+    let mut has_data = false;
+    for payload in Parser::new(0).parse_all(wasm) {
+        let payload = payload?;
+        match &payload {
+            Payload::Version { encoding, .. } if *encoding != Encoding::Module => {
+                bail!("snapshot only works with core modules")
+            }
+            Payload::MemorySection(reader) => {
+                let mut memories = MemorySection::new();
+                for ty in reader.clone() {
+                    let ty = ty?;
+                    if has_memory || ty.shared {
+                        bail!("snapshot only works with one unshared memory");
+                    }
+                    has_memory = true;
+                    memories.memory(MemoryType {
+                        minimum: pages,
+                        maximum: ty.maximum,
+                        memory64: ty.memory64,
+                        shared: ty.shared,
+                        page_size_log2: ty.page_size_log2,
+                    });
+                }
+                module.section(&memories);
+            }
+            Payload::GlobalSection(reader) => {
+                let mut mutable = 0;
+                for global in reader.clone() {
+                    mutable += global?.ty.mutable as usize;
+                }
+                if mutable > 1 {
+                    bail!(
+                        "{} mutable globals, only the stack pointer's is supported",
+                        mutable
+                    );
+                }
+                copy_section(&mut module, wasm, &payload);
+            }
+            Payload::ExportSection(reader) => {
+                let mut exports = ExportSection::new();
+                for export in reader.clone() {
+                    let export = export?;
+                    if export.name == INIT_EXPORT {
+                        continue;
+                    }
+                    let kind = match export.kind {
+                        ExternalKind::Func => ExportKind::Func,
+                        ExternalKind::Table => ExportKind::Table,
+                        ExternalKind::Memory => ExportKind::Memory,
+                        ExternalKind::Global => ExportKind::Global,
+                        ExternalKind::Tag => ExportKind::Tag,
+                    };
+                    exports.export(export.name, kind, export.index);
+                }
+                module.section(&exports);
+            }
+            Payload::StartSection { .. } => {
+                bail!("the start function would run again on the snapshot")
+            }
+            Payload::DataCountSection { .. } => {
+                module.section(&DataCountSection {
+                    count: segments.len() as u32,
+                });
+            }
+            Payload::DataSection(reader) => {
+                for segment in reader.clone() {
+                    if let wasmparser::DataKind::Passive = segment?.kind {
+                        bail!("passive data segments are not supported");
+                    }
+                }
+                has_data = true;
+                module.section(&data);
+            }
+            Payload::End(_) if !has_data => {
+                module.section(&data);
+            }
+            _ => copy_section(&mut module, wasm, &payload),
+        }
+    }
+    if !has_memory {
+        bail!("snapshot only works with a memory the module defines itself");
+    }
+    Ok(module.finish())
+}
+
+/// Copy the section of `payload` as it is; payloads inside a section, like
+/// the code section's function bodies, have none of their own.
+fn copy_section(module: &mut wasm_encoder::Module, wasm: &[u8], payload: &Payload) {
+    if let Some((id, range)) = payload.as_section() {
+        module.section(&RawSection {
+            id,
+            data: &wasm[range],
+        });
+    }
+}
@@ -0,0 +1,278 @@
+//! Cold-start timeline (`--startup-timeline on`, `--startup-trace <file>`):
+//! the host's steps before the guest runs, next to the tracker phases the
+//! guest reports through the `bench` import `phase`, on one clock.
+//!
+//! The host steps are the ones a cold start pays before main starts: the
+//! Engine, the module (deserialized from the artifact cache, or compiled and
+//! serialized first), the linker's imports, the graph preload, the WASI
+//! context and its preopened directories, the wasi-nn context,
+//! instantiation and the typed export lookups. Times count from the exec of
+//! the process, read from /proc/self/stat, which has the resolution of a
+//! clock tick (10 ms on most kernels); the first step, `exec to main`, is
+//! the loader and the static constructors of the linked libraries, ORT's
+//! among them.
+//!
+//! The timeline is printed at exit, appended to the results file as
+//! `startup` records, and with `--startup-trace` written as Chrome
+//! trace-event JSON for chrome://tracing or ui.perfetto.dev, with the host
+//! and the guest as two threads.
+
+use anyhow::Result;
+use std::fs::{self, File, OpenOptions};
+use std::io::{BufWriter, Write};
+use std::path::Path;
+use std::sync::OnceLock;
+use std::time::{Duration, Instant};
+
+const HOST: &str = "host";
+const GUEST: &str = "guest";
+
+/// When main started, and how long after the exec of the process.
+static MAIN: OnceLock<(Instant, Duration)> = OnceLock::new();
+
+/// Call first thing in main, so that host steps are placed after the time
+/// the process spent before it.
+pub fn main_started() {
+    MAIN.get_or_init(|| (Instant::now(), since_exec().unwrap_or_default()));
+}
+
+/// Time since the exec of this process: the uptime now less the uptime at
+/// its start, `starttime` in /proc/self/stat in clock ticks.
+fn since_exec() -> Option<Duration> {
+    let stat = fs::read_to_string("/proc/self/stat").ok()?;
+    // The command name may contain spaces, so count fields after it
+    let fields = &stat[stat.rfind(')')? + 2..];
+    let start_ticks: u64 = fields.split(' ').nth(19)?.parse().ok()?;
+    let ticks_per_second = unsafe { libc::sysconf(libc::_SC_CLK_TCK) };
+    if ticks_per_second <= 0 {
+        return None;
+    }
+    let uptime = unsafe {
+        let mut ts: libc::timespec = std::mem::zeroed();
+        if libc::clock_gettime(libc::CLOCK_BOOTTIME, &mut ts) != 0 {
+            return None;
+        }
+        Duration::new(ts.tv_sec as u64, ts.tv_nsec as u32)
+    };
+    let started = Duration::from_secs_f64(start_ticks as f64 / ticks_per_second as f64);
+    uptime.checked_sub(started)
+}
+
+/// `at` as time since the exec of the process.
+fn offset(at: Instant) -> Duration {
+    let (main, before_main) = *MAIN.get_or_init(|| (at, Duration::ZERO));
+    match at.checked_duration_since(main) {
+        Some(since_main) => before_main + since_main,
+        None => before_main.saturating_sub(main - at),
+    }
+}
+
+struct Step {
+    source: &'static str,
+    name: String,
+    start: Duration,
+    end: Duration,
+}
+
+/// The steps of a cold start, for one store or for main.
+pub struct StartupTimeline {
+    enabled: bool,
+    steps: Vec<Step>,
+    /// Guest phases started and not ended yet, with their start.
+    open: Vec<(String, Duration)>,
+}
+
+impl StartupTimeline {
+    pub fn new(enabled: bool) -> Self {
+        Self {
+            enabled,
+            steps: Vec::new(),
+            open: Vec::new(),
+        }
+    }
+
+    /// The process's time before main, as the step `exec to main`.
+    pub fn exec_to_main(&mut self) {
+        let before_main = MAIN
+            .get()
+            .map_or(Duration::ZERO, |&(_, before_main)| before_main);
+        if self.enabled && !before_main.is_zero() {
+            self.steps.push(Step {
+                source: HOST,
+                name: String::from("exec to main"),
+                start: Duration::ZERO,
+                end: before_main,
+            });
+        }
+    }
+
+    /// The host step `name` ran from `start` until now.
+    pub fn host(&mut self, name: &str, start: Instant) {
+        let end = Instant::now();
+        self.host_between(name, start, end);
+    }
+
+    /// The host step `name` ran from `start` to `end`.
+    pub fn host_between(&mut self, name: &str, start: Instant, end: Instant) {
+        if self.enabled {
+            self.steps.push(Step {
+                source: HOST,
+                name: name.to_string(),
+                start: offset(start),
+                end: offset(end),
+            });
+        }
+    }
+
+    /// Run `step` as the host step `name`.
+    pub fn time<R>(&mut self, name: &str, step: impl FnOnce() -> R) -> R {
+        let start = Instant::now();
+        let result = step();
+        self.host(name, start);
+        result
+    }
+
+    /// The guest started (`start`) or ended the tracker phase `name`.
+    pub fn phase(&mut self, name: &str, start: bool) {
+        if !self.enabled {
+            return;
+        }
+        let now = offset(Instant::now());
+        if start {
+            self.open.push((name.to_string(), now));
+        } else if let Some(index) = self.open.iter().rposition(|(open, _)| open == name) {
+            let (name, start) = self.open.remove(index);
+            self.steps.push(Step {
+                source: GUEST,
+                name,
+                start,
+                end: now,
+            });
+        }
+    }
+
+    /// Take over the steps of `other`, e.g. those a store recorded.
+    pub fn merge(&mut self, other: &mut StartupTimeline) {
+        self.steps.append(&mut other.steps);
+    }
+
+    /// The steps by start, each one before those it contains.
+    fn sorted(&self) -> Vec<&Step> {
+        let mut steps: Vec<&Step> = self.steps.iter().collect();
+        steps.sort_by(|a, b| a.start.cmp(&b.start).then(b.end.cmp(&a.end)));
+        steps
+    }
+
+    pub fn print(&self) {
+        if self.steps.is_empty() {
+            return;
+        }
+        let steps = self.sorted();
+        println!("Cold start (ms since exec):");
+        println!("  {:>10} {:>10}  {:<6} step", "start", "duration", "source");
+        // Open steps containing the current one, for indenting it
+        let mut enclosing: Vec<Duration> = Vec::new();
+        for step in &steps {
+            while enclosing.last().map_or(false, |&end| end < step.end) {
+                enclosing.pop();
+            }
+            println!(
+                "  {:>10.3} {:>10.3}  {:<6} {}{}",
+                millis(step.start),
+                millis(step.end.saturating_sub(step.start)),
+                step.source,
+                "  ".repeat(enclosing.len()),
+                step.name
+            );
+            enclosing.push(step.end);
+        }
+        let host_end = steps
+            .iter()
+            .filter(|step| step.source == HOST && step.name != "main")
+            .map(|step| step.end)
+            .max();
+        let first_phase = steps.iter().find(|step| step.source == GUEST);
+        if let (Some(host_end), Some(phase)) = (host_end, first_phase) {
+            println!(
+                "  {:.3} ms of host steps, the guest's first phase starts at {:.3} ms",
+                millis(host_end),
+                millis(phase.start)
+            );
+        }
+    }
+
+    /// Append one `startup` record per step to the JSONL file at `path`, in
+    /// microseconds since exec. They carry no `wall_clock_us`, so `compare`
+    /// passes over them.
+    pub fn export(&self, path: &Path) -> Result<()> {
+        let mut file = OpenOptions::new().create(true).append(true).open(path)?;
+        for step in self.sorted() {
+            writeln!(
+                file,
+                "{{\"kind\":\"startup\",\"source\":\"{}\",\"name\":{},\"start_us\":{:.3},\"duration_us\":{:.3}}}",
+                step.source,
+                json_string(&step.name),
+                micros(step.start),
+                micros(step.end.saturating_sub(step.start)),
+            )?;
+        }
+        Ok(())
+    }
+
+    /// Write the steps as complete (`X`) events of the Chrome trace-event
+    /// format, the host on thread 1 and the guest on thread 2.
+    pub fn write_trace(&self, path: &Path) -> Result<()> {
+        let mut file = BufWriter::new(File::create(path)?);
+        let pid = std::process::id();
+        write!(file, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[")?;
+        for (tid, name) in [(1, HOST), (2, GUEST)] {
+            write!(
+                file,
+                "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":\"{}\"}}}},",
+                pid, tid, name
+            )?;
+        }
+        let steps = self.sorted();
+        for (index, step) in steps.iter().enumerate() {
+            write!(
+                file,
+                "{{\"name\":{},\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{:.3},\"dur\":{:.3},\"pid\":{},\"tid\":{}}}{}",
+                json_string(&step.name),
+                step.source,
+                micros(step.start),
+                micros(step.end.saturating_sub(step.start)),
+                pid,
+                if step.source == HOST { 1 } else { 2 },
+                if index + 1 < steps.len() { "," } else { "" }
+            )?;
+        }
+        writeln!(file, "]}}")?;
+        file.flush()?;
+        println!("Wrote the cold-start trace to {}", path.display());
+        Ok(())
+    }
+}
+
+fn millis(time: Duration) -> f64 {
+    time.as_secs_f64() * 1e3
+}
+
+fn micros(time: Duration) -> f64 {
+    time.as_secs_f64() * 1e6
+}
+
+/// `value` as a JSON string; phase names come from the guest.
+fn json_string(value: &str) -> String {
+    let mut quoted = String::with_capacity(value.len() + 2);
+    quoted.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => quoted.push_str("\\\""),
+            '\\' => quoted.push_str("\\\\"),
+            c if (c as u32) < 0x20 => quoted.push_str(&format!("\\u{:04x}", c as u32)),
+            c => quoted.push(c),
+        }
+    }
+    quoted.push('"');
+    quoted
+}
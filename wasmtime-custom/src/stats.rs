@@ -0,0 +1,128 @@
+//! Latency samples collected on the host, summarized as percentiles and a
+//! power-of-two histogram.
+
+use std::time::Duration;
+
+#[derive(Debug, Default, Clone)]
+pub struct LatencyStats {
+    samples: Vec<Duration>,
+}
+
+impl LatencyStats {
+    pub fn with_capacity(capacity: usize) -> Self {
+        Self {
+            samples: Vec::with_capacity(capacity),
+        }
+    }
+
+    pub fn record(&mut self, sample: Duration) {
+        self.samples.push(sample);
+    }
+
+    pub fn len(&self) -> usize {
+        self.samples.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.samples.is_empty()
+    }
+
+    /// Append every sample of `other` to this one.
+    pub fn merge(&mut self, other: &LatencyStats) {
+        self.samples.extend_from_slice(&other.samples);
+    }
+
+    pub fn total(&self) -> Duration {
+        self.samples.iter().sum()
+    }
+
+    pub fn mean(&self) -> Duration {
+        if self.samples.is_empty() {
+            return Duration::default();
+        }
+        self.total() / self.samples.len() as u32
+    }
+
+    pub fn stddev(&self) -> Duration {
+        if self.samples.len() < 2 {
+            return Duration::default();
+        }
+        let mean = self.mean().as_secs_f64();
+        let squares: f64 = self
+            .samples
+            .iter()
+            .map(|s| (s.as_secs_f64() - mean).powi(2))
+            .sum();
+        Duration::from_secs_f64((squares / (self.samples.len() - 1) as f64).sqrt())
+    }
+
+    /// Nearest-rank percentile, `p` in [0, 100].
+    pub fn percentile(&self, p: f64) -> Duration {
+        if self.samples.is_empty() {
+            return Duration::default();
+        }
+        let mut sorted = self.samples.clone();
+        sorted.sort();
+        let rank = ((p / 100.0) * sorted.len() as f64).ceil() as usize;
+        sorted[rank.max(1).min(sorted.len()) - 1]
+    }
+
+    pub fn min(&self) -> Duration {
+        self.samples.iter().min().cloned().unwrap_or_default()
+    }
+
+    pub fn max(&self) -> Duration {
+        self.samples.iter().max().cloned().unwrap_or_default()
+    }
+
+    /// One line with the usual summary numbers.
+    pub fn summary(&self) -> String {
+        format!(
+            "n={} min={:?} p50={:?} p90={:?} p99={:?} p99.9={:?} max={:?} mean={:?} stddev={:?}",
+            self.len(),
+            self.min(),
+            self.percentile(50.0),
+            self.percentile(90.0),
+            self.percentile(99.0),
+            self.percentile(99.9),
+            self.max(),
+            self.mean(),
+            self.stddev()
+        )
+    }
+
+    /// Print the summary and a histogram with power-of-two microsecond
+    /// buckets.
+    pub fn print_histogram(&self, title: &str) {
+        println!("============= {} =============", title);
+        println!("{}", self.summary());
+        if self.samples.is_empty() {
+            return;
+        }
+
+        let mut buckets: Vec<usize> = Vec::new();
+        for sample in &self.samples {
+            let micros = sample.as_micros().max(1) as u64;
+            let bucket = 63 - micros.leading_zeros() as usize;
+            if buckets.len() <= bucket {
+                buckets.resize(bucket + 1, 0);
+            }
+            buckets[bucket] += 1;
+        }
+
+        const BAR_WIDTH: usize = 50;
+        let largest = *buckets.iter().max().unwrap_or(&1);
+        let first = buckets.iter().position(|&count| count > 0).unwrap_or(0);
+        for (bucket, &count) in buckets.iter().enumerate().skip(first) {
+            let bar = "#".repeat((count * BAR_WIDTH + largest - 1) / largest);
+            println!(
+                "[{:>9} us, {:>9} us) {:>8} {}",
+                1u64 << bucket,
+                1u64 << (bucket + 1),
+                count,
+                bar
+            );
+        }
+        println!("=======================================");
+    }
+}
@@ -0,0 +1,166 @@
+//! Streaming mode: the guest's `main` with NN_STREAM set reads length-prefixed
+//! encoded images from its stdin and answers each one on stdout as soon as it
+//! is classified, with the graph, context and buffers kept resident, like a
+//! camera feed.
+//!
+//! With `--stream -` the guest keeps the host's stdio, so any producer can be
+//! piped in. With `--stream <dir>` the host is the producer: it connects the
+//! guest's stdin and stdout to pipes, a feeder thread writes `items` frames
+//! cycling the images of `dir`, and a reader thread timestamps the answer
+//! lines. Per-item latency runs from the moment a frame is due, so with `qps`
+//! (open loop, one frame every 1/`qps` seconds) it includes the time the
+//! frame waited in the pipe behind a busy guest; without it the feeder writes
+//! as fast as the guest reads and latency is from the start of the write.
+
+use anyhow::{anyhow, Result};
+use std::fs::File;
+use std::io::{self, BufRead, BufReader, Write};
+use std::os::unix::io::FromRawFd;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use wasi_common::pipe::{ReadPipe, WritePipe};
+use wasi_common::sync::stdio;
+use wasi_common::WasiCtx;
+
+use crate::stats::LatencyStats;
+
+/// What the reader saw: when each answered item came back, by sequence
+/// number, and how many answers were errors.
+struct Answers {
+    done: Vec<(u64, Instant)>,
+    failed: u64,
+}
+
+/// The running feeder and reader of one streamed guest.
+pub struct Stream {
+    qps: f64,
+    feeder: JoinHandle<Vec<Instant>>,
+    reader: JoinHandle<io::Result<Answers>>,
+}
+
+/// A pipe as its (read, write) ends, closed on exec like std's own files.
+fn pipe() -> io::Result<(File, File)> {
+    let mut fds = [0; 2];
+    if unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { (File::from_raw_fd(fds[0]), File::from_raw_fd(fds[1])) })
+}
+
+impl Stream {
+    /// Connect the stdin and stdout of `wasi` to pipes and start feeding it
+    /// `items` frames of `images`, at `qps` frames per second, or back to back
+    /// with a `qps` of 0.
+    pub fn start(wasi: &WasiCtx, images: Vec<Vec<u8>>, items: u64, qps: f64) -> Result<Self> {
+        let (guest_stdin, mut frames) = pipe()?;
+        let (replies, guest_stdout) = pipe()?;
+        wasi.set_stdin(Box::new(ReadPipe::new(guest_stdin)));
+        wasi.set_stdout(Box::new(WritePipe::new(guest_stdout)));
+
+        let interval = if qps > 0.0 {
+            Some(Duration::from_secs_f64(1.0 / qps))
+        } else {
+            None
+        };
+        let feeder = thread::spawn(move || {
+            let mut sent = Vec::with_capacity(items as usize);
+            let epoch = Instant::now();
+            for item in 0..items {
+                let due = match interval {
+                    Some(interval) => {
+                        let due = epoch + interval.mul_f64(item as f64);
+                        let now = Instant::now();
+                        if due > now {
+                            thread::sleep(due - now);
+                        }
+                        due
+                    }
+                    None => Instant::now(),
+                };
+                let image = &images[(item % images.len() as u64) as usize];
+                let length = (image.len() as u32).to_le_bytes();
+                // The guest stopped reading: its end of the pipe is closed
+                if frames
+                    .write_all(&length)
+                    .and_then(|_| frames.write_all(image))
+                    .is_err()
+                {
+                    break;
+                }
+                sent.push(due);
+            }
+            // Dropping `frames` is the end of input for the guest
+            sent
+        });
+
+        let reader = thread::spawn(move || {
+            let mut answers = Answers {
+                done: Vec::with_capacity(items as usize),
+                failed: 0,
+            };
+            for line in BufReader::new(replies).lines() {
+                let line = line?;
+                let at = Instant::now();
+                let mut fields = line.split_whitespace();
+                match fields.next().and_then(|seq| seq.parse::<u64>().ok()) {
+                    Some(_) if fields.next() == Some("error") => {
+                        answers.failed += 1;
+                        eprintln!("Stream item {}", line);
+                    }
+                    Some(seq) => answers.done.push((seq, at)),
+                    // Not an answer: pass it through
+                    None => println!("{}", line),
+                }
+            }
+            Ok(answers)
+        });
+
+        Ok(Self {
+            qps,
+            feeder,
+            reader,
+        })
+    }
+
+    /// Once the guest's `main` returned, close its ends of the pipes, wait
+    /// for the feeder and reader, and print throughput and latency.
+    pub fn finish(self, wasi: &WasiCtx) -> Result<()> {
+        // Replacing the pipes drops the guest's ends: the reader sees the end
+        // of the answers and a feeder still writing sees a broken pipe
+        wasi.set_stdin(Box::new(stdio::stdin()));
+        wasi.set_stdout(Box::new(stdio::stdout()));
+        let sent = self
+            .feeder
+            .join()
+            .map_err(|_| anyhow!("stream feeder panicked"))?;
+        let answers = self
+            .reader
+            .join()
+            .map_err(|_| anyhow!("stream reader panicked"))??;
+
+        let mut latency = LatencyStats::with_capacity(answers.done.len());
+        for (seq, at) in &answers.done {
+            if let Some(due) = sent.get(*seq as usize) {
+                latency.record(at.saturating_duration_since(*due));
+            }
+        }
+        let elapsed = match (sent.first(), answers.done.last()) {
+            (Some(first), Some((_, last))) => last.saturating_duration_since(*first),
+            _ => Duration::ZERO,
+        };
+
+        println!(
+            "{} of {} items streamed answered in {:?}: {:.1} items/s, {} failed",
+            answers.done.len(),
+            sent.len(),
+            elapsed,
+            answers.done.len() as f64 / elapsed.as_secs_f64(),
+            answers.failed
+        );
+        if self.qps > 0.0 && (answers.done.len() as f64) < elapsed.as_secs_f64() * self.qps * 0.95 {
+            println!("saturated: items arrive faster than the guest answers them");
+        }
+        latency.print_histogram("stream latency, from arrival to answer");
+        Ok(())
+    }
+}
@@ -0,0 +1,147 @@
+//! Ring-buffer tracing (`--trace-ring on`): the host end of the guest's
+//! `trace` module.
+//!
+//! The guest registers its ring of events through the `bench` import
+//! `trace_ring` and the name of every probe through `trace_name`, and stamps
+//! its events with `monotonic_ns`. Nothing else crosses over while it runs.
+//! At exit the host copies the ring out of linear memory once, pairs the
+//! begin and end events of every probe, and prints count, mean, min, max and
+//! total per probe.
+
+use anyhow::Result;
+use std::collections::HashMap;
+use wasmtime::AsContext;
+
+use crate::guest_memory::GuestMemory;
+
+/// Size of one guest `trace::Event`: u32 probe, u32 padding, u64 timestamp.
+const EVENT_SIZE: usize = 16;
+const END: u32 = 1 << 31;
+
+/// Where the guest keeps its ring.
+struct Ring {
+    memory: GuestMemory,
+    events: usize,
+    capacity: usize,
+    head: usize,
+}
+
+#[derive(Default)]
+pub struct TraceRing {
+    ring: Option<Ring>,
+    names: HashMap<u32, String>,
+}
+
+/// The spans of one probe.
+struct Spans {
+    name: String,
+    durations_ns: Vec<u64>,
+}
+
+impl TraceRing {
+    pub fn register(&mut self, memory: GuestMemory, events: usize, capacity: usize, head: usize) {
+        self.ring = Some(Ring {
+            memory,
+            events,
+            capacity,
+            head,
+        });
+    }
+
+    pub fn name(&mut self, id: u32, name: String) {
+        self.names.insert(id, name);
+    }
+
+    /// Read the ring out of the guest's memory in `store` and print the
+    /// statistics of every probe.
+    pub fn print(&self, store: impl AsContext) -> Result<()> {
+        let ring = match &self.ring {
+            Some(ring) => ring,
+            None => {
+                println!("The guest registered no trace ring");
+                return Ok(());
+            }
+        };
+        let store = store.as_context();
+        let head = ring.memory.read(&store, ring.head, 4)?;
+        let written = u32::from_le_bytes([head[0], head[1], head[2], head[3]]) as usize;
+        let bytes = ring
+            .memory
+            .read(&store, ring.events, ring.capacity * EVENT_SIZE)?;
+
+        // Oldest event first; a wrapped ring starts at the next slot to write
+        let kept = written.min(ring.capacity);
+        let first = written - kept;
+        let mut open: HashMap<u32, Vec<u64>> = HashMap::new();
+        let mut spans: Vec<(u32, Spans)> = Vec::new();
+        for index in first..written {
+            let event = &bytes[(index % ring.capacity) * EVENT_SIZE..][..EVENT_SIZE];
+            let probe = u32::from_le_bytes([event[0], event[1], event[2], event[3]]);
+            let mut timestamp = [0u8; 8];
+            timestamp.copy_from_slice(&event[8..16]);
+            let timestamp = u64::from_le_bytes(timestamp);
+
+            let id = probe & !END;
+            if probe & END == 0 {
+                open.entry(id).or_insert_with(Vec::new).push(timestamp);
+                continue;
+            }
+            let start = match open.get_mut(&id).and_then(|starts| starts.pop()) {
+                Some(start) => start,
+                // Its begin was overwritten
+                None => continue,
+            };
+            let position = match spans.iter().position(|&(known, _)| known == id) {
+                Some(position) => position,
+                None => {
+                    let name = self
+                        .names
+                        .get(&id)
+                        .cloned()
+                        .unwrap_or_else(|| format!("#{}", id));
+                    spans.push((
+                        id,
+                        Spans {
+                            name,
+                            durations_ns: Vec::new(),
+                        },
+                    ));
+                    spans.len() - 1
+                }
+            };
+            spans[position]
+                .1
+                .durations_ns
+                .push(timestamp.saturating_sub(start));
+        }
+
+        println!(
+            "Trace ring: {} events, {} kept{}",
+            written,
+            kept,
+            if written > kept {
+                " (oldest overwritten)"
+            } else {
+                ""
+            }
+        );
+        println!(
+            "  {:<24} {:>8} {:>12} {:>12} {:>12} {:>14}",
+            "probe", "count", "mean us", "min us", "max us", "total ms"
+        );
+        for (_, spans) in &spans {
+            let durations = &spans.durations_ns;
+            let total: u64 = durations.iter().sum();
+            println!(
+                "  {:<24} {:>8} {:>12.3} {:>12.3} {:>12.3} {:>14.3}",
+                spans.name,
+                durations.len(),
+                total as f64 / durations.len() as f64 / 1e3,
+                *durations.iter().min().unwrap() as f64 / 1e3,
+                *durations.iter().max().unwrap() as f64 / 1e3,
+                total as f64 / 1e6,
+            );
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,214 @@
+//! Measure the wasi-nn host boundary: `load`, `init_execution_context` and,
+//! for tensors from 1 KiB to 64 MiB, `set_input`, `compute` and `get_output`
+//! through the WITX ABI and the ONNX Runtime backend.
+//!
+//! The model is an ONNX `Identity` over a float vector of any length, so
+//! what `compute` costs beyond ORT's own dispatch is one copy of the tensor,
+//! and `set_input` and `get_output` are all marshalling: the copies in
+//! `witx.rs` and `onnxruntime.rs`, measured per size to follow changes to
+//! those paths. Run with `cargo bench --bench wasi_nn --features wasi-nn-onnx`.
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use std::time::Instant;
+use wasmtime::{Engine, Instance, Linker, Memory, Module, Store, TypedFunc};
+use wasmtime_wasi_nn::backend::onnxruntime::OnnxBackend;
+use wasmtime_wasi_nn::{Backend, InMemoryRegistry, WasiNnCtx};
+
+criterion_group!(benches, bench_wasi_nn);
+criterion_main!(benches);
+
+/// Where the bench puts the guest's buffers; the guest writes its results
+/// below `BUILDERS`.
+const BUILDERS: usize = 64;
+const TENSOR: usize = 128;
+const DIMENSIONS: usize = 256;
+const MODEL: usize = 4096;
+const INPUT: usize = 64 * 1024;
+const MAX_SIZE: usize = 64 << 20;
+const OUTPUT: usize = INPUT + MAX_SIZE;
+/// `$tensor_type` f32.
+const F32: u8 = 1;
+
+fn bench_wasi_nn(c: &mut Criterion) {
+    let _ = env_logger::try_init();
+
+    let (mut store, instance) = instantiate();
+    let memory = instance.get_memory(&mut store, "memory").unwrap();
+    let pages = (OUTPUT + MAX_SIZE) as u64 / 65536;
+    memory.grow(&mut store, pages).unwrap();
+    let model = identity_model();
+    write(&memory, &mut store, MODEL, &model);
+    write_u32s(
+        &memory,
+        &mut store,
+        BUILDERS,
+        &[MODEL as u32, model.len() as u32],
+    );
+
+    let load_graph: TypedFunc<u32, u32> = typed(&instance, &mut store, "load_graph");
+    let new_context: TypedFunc<u32, u32> = typed(&instance, &mut store, "new_context");
+    let graph = load_graph.call(&mut store, BUILDERS as u32).unwrap();
+    let context = new_context.call(&mut store, graph).unwrap();
+
+    // As in `benches/wasi.rs`, the guest iterates, so that a sample is not
+    // dominated by the cost of entering it.
+    let load: TypedFunc<(u64, u32), u64> = typed(&instance, &mut store, "load");
+    c.bench_function("wasi_nn/load", |b| {
+        b.iter_custom(|iters| time(iters, || load.call(&mut store, (iters, BUILDERS as u32))))
+    });
+    let init: TypedFunc<(u64, u32), u64> = typed(&instance, &mut store, "init_execution_context");
+    c.bench_function("wasi_nn/init_execution_context", |b| {
+        b.iter_custom(|iters| time(iters, || init.call(&mut store, (iters, graph))))
+    });
+
+    let set_input: TypedFunc<(u64, u32, u32), u64> = typed(&instance, &mut store, "set_input");
+    let compute: TypedFunc<(u64, u32), u64> = typed(&instance, &mut store, "compute");
+    let get_output: TypedFunc<(u64, u32, u32, u32), u64> =
+        typed(&instance, &mut store, "get_output");
+    let mut group = c.benchmark_group("wasi_nn");
+    for size in (0..9).map(|step| 1024usize << (2 * step)) {
+        // The `$tensor` record: dimensions, type and data
+        write_u32s(&memory, &mut store, DIMENSIONS, &[size as u32 / 4]);
+        write_u32s(
+            &memory,
+            &mut store,
+            TENSOR,
+            &[DIMENSIONS as u32, 1, F32 as u32],
+        );
+        write_u32s(
+            &memory,
+            &mut store,
+            TENSOR + 12,
+            &[INPUT as u32, size as u32],
+        );
+        // The others need an input, and `get_output` a computed output
+        set_input
+            .call(&mut store, (1, context, TENSOR as u32))
+            .unwrap();
+        compute.call(&mut store, (1, context)).unwrap();
+
+        let label = if size < 1 << 20 {
+            format!("{}KiB", size >> 10)
+        } else {
+            format!("{}MiB", size >> 20)
+        };
+        group.throughput(Throughput::Bytes(size as u64));
+        group.sample_size(if size >= 16 << 20 { 10 } else { 100 });
+        group.bench_function(BenchmarkId::new("set_input", &label), |b| {
+            b.iter_custom(|iters| {
+                time(iters, || {
+                    set_input.call(&mut store, (iters, context, TENSOR as u32))
+                })
+            })
+        });
+        group.bench_function(BenchmarkId::new("compute", &label), |b| {
+            b.iter_custom(|iters| time(iters, || compute.call(&mut store, (iters, context))))
+        });
+        group.bench_function(BenchmarkId::new("get_output", &label), |b| {
+            b.iter_custom(|iters| {
+                time(iters, || {
+                    get_output.call(&mut store, (iters, context, OUTPUT as u32, size as u32))
+                })
+            })
+        });
+    }
+    group.finish();
+}
+
+/// Time one call of an export that makes `iters` calls.
+fn time(iters: u64, run: impl FnOnce() -> wasmtime::Result<u64>) -> std::time::Duration {
+    let start = Instant::now();
+    let result = run().unwrap();
+    let elapsed = start.elapsed();
+    assert_eq!(iters, result);
+    elapsed
+}
+
+fn instantiate() -> (Store<WasiNnCtx>, Instance) {
+    let engine = Engine::default();
+    let module = Module::from_file(&engine, "benches/wasi_nn/guest.wat").unwrap();
+    let mut linker = Linker::new(&engine);
+    wasmtime_wasi_nn::witx::add_to_linker(&mut linker, |cx: &mut WasiNnCtx| cx).unwrap();
+    let backend = Backend::from(OnnxBackend::default());
+    let wasi_nn = WasiNnCtx::new([backend], InMemoryRegistry::new().into());
+    let mut store = Store::new(&engine, wasi_nn);
+    let instance = linker.instantiate(&mut store, &module).unwrap();
+    (store, instance)
+}
+
+fn typed<Params, Results>(
+    instance: &Instance,
+    store: &mut Store<WasiNnCtx>,
+    name: &str,
+) -> TypedFunc<Params, Results>
+where
+    Params: wasmtime::WasmParams,
+    Results: wasmtime::WasmResults,
+{
+    instance.get_typed_func(store, name).unwrap()
+}
+
+fn write(memory: &Memory, store: &mut Store<WasiNnCtx>, offset: usize, bytes: &[u8]) {
+    memory.write(store, offset, bytes).unwrap();
+}
+
+fn write_u32s(memory: &Memory, store: &mut Store<WasiNnCtx>, offset: usize, values: &[u32]) {
+    let bytes = values
+        .iter()
+        .flat_map(|v| v.to_le_bytes())
+        .collect::<Vec<_>>();
+    write(memory, store, offset, &bytes);
+}
+
+/// `y = Identity(x)` for a float `x` of dynamic length `n`, as an ONNX
+/// `ModelProto` encoded by hand, so that the bench needs no model file.
+fn identity_model() -> Vec<u8> {
+    fn varint(out: &mut Vec<u8>, mut value: u64) {
+        while value >= 0x80 {
+            out.push(value as u8 | 0x80);
+            value >>= 7;
+        }
+        out.push(value as u8);
+    }
+    fn bytes(out: &mut Vec<u8>, field: u64, value: &[u8]) {
+        varint(out, (field << 3) | 2);
+        varint(out, value.len() as u64);
+        out.extend_from_slice(value);
+    }
+    fn int(out: &mut Vec<u8>, field: u64, value: u64) {
+        varint(out, field << 3);
+        varint(out, value);
+    }
+    fn value_info(name: &str) -> Vec<u8> {
+        let mut dim = Vec::new();
+        bytes(&mut dim, 2, b"n"); // dim_param
+        let mut shape = Vec::new();
+        bytes(&mut shape, 1, &dim);
+        let mut tensor = Vec::new();
+        int(&mut tensor, 1, 1); // elem_type: FLOAT
+        bytes(&mut tensor, 2, &shape);
+        let mut ty = Vec::new();
+        bytes(&mut ty, 1, &tensor);
+        let mut info = Vec::new();
+        bytes(&mut info, 1, name.as_bytes());
+        bytes(&mut info, 2, &ty);
+        info
+    }
+
+    let mut node = Vec::new();
+    bytes(&mut node, 1, b"x");
+    bytes(&mut node, 2, b"y");
+    bytes(&mut node, 4, b"Identity");
+    let mut graph = Vec::new();
+    bytes(&mut graph, 1, &node);
+    bytes(&mut graph, 2, b"identity");
+    bytes(&mut graph, 11, &value_info("x"));
+    bytes(&mut graph, 12, &value_info("y"));
+    let mut opset = Vec::new();
+    int(&mut opset, 2, 13);
+    let mut model = Vec::new();
+    int(&mut model, 1, 7); // ir_version
+    bytes(&mut model, 7, &graph);
+    bytes(&mut model, 8, &opset);
+    model
+}
@@ -0,0 +1,100 @@
+;; The guest of `benches/wasi_nn.rs`. Each benchmarked export makes one
+;; wasi-nn call `$iters` times, on buffers the bench has written to memory,
+;; and returns the number of calls made. A call that fails traps.
+(module
+    (import "wasi_ephemeral_nn" "load"
+        (func $load (param i32 i32 i32 i32 i32) (result i32)))
+    (import "wasi_ephemeral_nn" "drop_graph"
+        (func $drop_graph (param i32) (result i32)))
+    (import "wasi_ephemeral_nn" "init_execution_context"
+        (func $init_execution_context (param i32 i32) (result i32)))
+    (import "wasi_ephemeral_nn" "drop_execution_context"
+        (func $drop_execution_context (param i32) (result i32)))
+    (import "wasi_ephemeral_nn" "set_input"
+        (func $set_input (param i32 i32 i32) (result i32)))
+    (import "wasi_ephemeral_nn" "compute"
+        (func $compute (param i32) (result i32)))
+    (import "wasi_ephemeral_nn" "get_output"
+        (func $get_output (param i32 i32 i32 i32 i32) (result i32)))
+
+    ;; The calls write their graph, context or byte count here.
+    (global $result i32 (i32.const 0))
+
+    (func $check (param $errno i32)
+        (if (local.get $errno) (then (unreachable)))
+    )
+
+    ;; Load the ONNX graph of the one builder at $builders, for the CPU.
+    (func $load_graph (export "load_graph") (param $builders i32) (result i32)
+        (call $check (call $load
+            (local.get $builders) (i32.const 1) (i32.const 1) (i32.const 0) (global.get $result)))
+        (i32.load (global.get $result))
+    )
+
+    (func $new_context (export "new_context") (param $graph i32) (result i32)
+        (call $check (call $init_execution_context (local.get $graph) (global.get $result)))
+        (i32.load (global.get $result))
+    )
+
+    ;; `load`, and `drop_graph` so that handles do not pile up.
+    (func (export "load") (param $iters i64) (param $builders i32) (result i64)
+        (local $i i64)
+        (local.set $i (i64.const 0))
+        (loop $cont
+            (call $check (call $drop_graph (call $load_graph (local.get $builders))))
+            (local.set $i (i64.add (local.get $i) (i64.const 1)))
+            (br_if $cont (i64.lt_u (local.get $i) (local.get $iters)))
+        )
+        (local.get $i)
+    )
+
+    ;; `init_execution_context` and `drop_execution_context`.
+    (func (export "init_execution_context") (param $iters i64) (param $graph i32) (result i64)
+        (local $i i64)
+        (local.set $i (i64.const 0))
+        (loop $cont
+            (call $check (call $drop_execution_context (call $new_context (local.get $graph))))
+            (local.set $i (i64.add (local.get $i) (i64.const 1)))
+            (br_if $cont (i64.lt_u (local.get $i) (local.get $iters)))
+        )
+        (local.get $i)
+    )
+
+    ;; `set_input` of the `$tensor` record at $tensor as input 0.
+    (func (export "set_input") (param $iters i64) (param $context i32) (param $tensor i32) (result i64)
+        (local $i i64)
+        (local.set $i (i64.const 0))
+        (loop $cont
+            (call $check (call $set_input (local.get $context) (i32.const 0) (local.get $tensor)))
+            (local.set $i (i64.add (local.get $i) (i64.const 1)))
+            (br_if $cont (i64.lt_u (local.get $i) (local.get $iters)))
+        )
+        (local.get $i)
+    )
+
+    (func (export "compute") (param $iters i64) (param $context i32) (result i64)
+        (local $i i64)
+        (local.set $i (i64.const 0))
+        (loop $cont
+            (call $check (call $compute (local.get $context)))
+            (local.set $i (i64.add (local.get $i) (i64.const 1)))
+            (br_if $cont (i64.lt_u (local.get $i) (local.get $iters)))
+        )
+        (local.get $i)
+    )
+
+    ;; `get_output` of output 0 into the $len bytes at $out.
+    (func (export "get_output") (param $iters i64) (param $context i32) (param $out i32) (param $len i32) (result i64)
+        (local $i i64)
+        (local.set $i (i64.const 0))
+        (loop $cont
+            (call $check (call $get_output
+                (local.get $context) (i32.const 0) (local.get $out) (local.get $len) (global.get $result)))
+            (local.set $i (i64.add (local.get $i) (i64.const 1)))
+            (br_if $cont (i64.lt_u (local.get $i) (local.get $iters)))
+        )
+        (local.get $i)
+    )
+
+    (memory (export "memory") 1)
+)
@@ -32,6 +32,17 @@
 //!
 //! All API calls must happen on the same thread.
 //!
+//! # wasi-nn
+//!
+//! With the `wasi-nn` feature and `--wasi nn` among the execution flags the
+//! module may import `wasi_ephemeral_nn`; `--wasi nn-graph=<format>::<dir>`
+//! preloads a graph once, in `wasm_bench_create`, for the guest to find with
+//! `load_by_name` in every instantiation. Build with `wasi-nn-onnx` for the
+//! ONNX Runtime backend. A wasi-nn module without `bench` imports of its own
+//! is measured around each `compute`: the execution timer starts right
+//! before and ends right after every inference, so decoding and
+//! pre-processing in the guest stay out of the measurement.
+//!
 //! Functions which return pointers use null as an error value. Function which
 //! return `int` use `0` as OK and non-zero as an error value.
 //!
@@ -136,14 +147,14 @@
 mod unsafe_send_sync;
 
 use crate::unsafe_send_sync::UnsafeSendSync;
-use anyhow::{Context, Result};
+use anyhow::{anyhow, bail, Context, Result};
 use clap::Parser;
 use std::os::raw::{c_int, c_void};
 use std::slice;
 use std::{env, path::PathBuf};
 use target_lexicon::Triple;
 use wasi_common::{sync::WasiCtxBuilder, I32Exit, WasiCtx};
-use wasmtime::{Engine, Instance, Linker, Module, Store};
+use wasmtime::{Engine, ExternType, Instance, Linker, Module, Store, Val, ValType};
 use wasmtime_cli_flags::CommonOptions;
 
 pub type ExitCode = c_int;
@@ -408,13 +419,62 @@ struct BenchState {
     instantiation_timer: *mut u8,
     instantiation_start: extern "C" fn(*mut u8),
     instantiation_end: extern "C" fn(*mut u8),
+    #[cfg(feature = "wasi-nn")]
+    execution_timer: UnsafeSendSync<*mut u8>,
+    #[cfg(feature = "wasi-nn")]
+    execution_start: extern "C" fn(*mut u8),
+    #[cfg(feature = "wasi-nn")]
+    execution_end: extern "C" fn(*mut u8),
     make_wasi_cx: Box<dyn FnMut() -> Result<WasiCtx>>,
+    #[cfg(feature = "wasi-nn")]
+    wasi_nn_graphs: wasmtime_wasi_nn::InMemoryRegistry,
     module: Option<Module>,
+    /// Whether to time each wasi-nn `compute` because the module has no
+    /// `bench` markers of its own.
+    #[cfg(feature = "wasi-nn")]
+    measure_compute: bool,
     store_and_instance: Option<(Store<HostState>, Instance)>,
     epoch_interruption: bool,
     fuel: Option<u64>,
 }
 
+/// Define the imports of the wasi-nn guest (`wasm-module`) other than the
+/// benchmarking markers. Its `bench` accounting queries (resource usage, phase
+/// reports, the trace ring) only feed the guest's own report, so they return
+/// zeros; the `preprocess` functions of its host-assisted mode trap.
+fn define_guest_imports(linker: &mut Linker<HostState>, module: &Module) -> Result<()> {
+    for import in module.imports() {
+        let ty = match import.ty() {
+            ExternType::Func(ty) => ty,
+            _ => continue,
+        };
+        let (from, name) = (import.module(), import.name());
+        if from == "preprocess" {
+            let message = format!("{from}.{name} is not supported by the bench API");
+            linker.func_new(from, name, ty, move |_, _, _| Err(anyhow!("{message}")))?;
+            continue;
+        }
+        if from != "bench" || matches!(name, "start" | "end") {
+            continue;
+        }
+        let results = ty
+            .results()
+            .map(|ty| match ty {
+                ValType::I32 => Ok(Val::I32(0)),
+                ValType::I64 => Ok(Val::I64(0)),
+                ValType::F32 => Ok(Val::F32(0)),
+                ValType::F64 => Ok(Val::F64(0)),
+                _ => bail!("cannot define {from}.{name}: it returns a `{ty}`"),
+            })
+            .collect::<Result<Vec<_>>>()?;
+        linker.func_new(from, name, ty, move |_, _, out| {
+            out.clone_from_slice(&results);
+            Ok(())
+        })?;
+    }
+    Ok(())
+}
+
 struct HostState {
     wasi: WasiCtx,
     #[cfg(feature = "wasi-nn")]
@@ -468,6 +528,19 @@ impl BenchState {
             wasmtime_wasi_nn::witx::add_to_linker(&mut linker, |cx| &mut cx.wasi_nn)?;
         }
 
+        // Load the graphs once; every instantiation shares them.
+        #[cfg(feature = "wasi-nn")]
+        let wasi_nn_graphs = {
+            let graphs = options
+                .wasi
+                .nn_graph
+                .iter()
+                .map(|g| (g.format.clone(), g.dir.clone()))
+                .collect::<Vec<_>>();
+            wasmtime_wasi_nn::preload_into(&mut wasmtime_wasi_nn::backend::list(), &graphs)
+                .context("failed to preload the wasi-nn graphs")?
+        };
+
         Ok(Self {
             linker,
             compilation_timer,
@@ -476,8 +549,18 @@ impl BenchState {
             instantiation_timer,
             instantiation_start,
             instantiation_end,
+            #[cfg(feature = "wasi-nn")]
+            execution_timer,
+            #[cfg(feature = "wasi-nn")]
+            execution_start,
+            #[cfg(feature = "wasi-nn")]
+            execution_end,
             make_wasi_cx: Box::new(make_wasi_cx) as _,
+            #[cfg(feature = "wasi-nn")]
+            wasi_nn_graphs,
             module: None,
+            #[cfg(feature = "wasi-nn")]
+            measure_compute: false,
             store_and_instance: None,
             epoch_interruption,
             fuel,
@@ -494,6 +577,17 @@ impl BenchState {
         let module = Module::from_binary(self.linker.engine(), bytes)?;
         (self.compilation_end)(self.compilation_timer);
 
+        #[cfg(feature = "wasi-nn")]
+        {
+            let nn = module.imports().any(|i| i.module() == "wasi_ephemeral_nn");
+            // Other `bench` imports, like the accounting queries of the wasi-nn
+            // guest, are not markers.
+            let markers = module
+                .imports()
+                .any(|i| i.module() == "bench" && matches!(i.name(), "start" | "end"));
+            self.measure_compute = nn && !markers;
+        }
+        define_guest_imports(&mut self.linker, &module)?;
         self.module = Some(module);
         Ok(())
     }
@@ -508,8 +602,16 @@ impl BenchState {
             wasi: (self.make_wasi_cx)().context("failed to create a WASI context")?,
             #[cfg(feature = "wasi-nn")]
             wasi_nn: {
-                let (backends, registry) = wasmtime_wasi_nn::preload(&[])?;
-                wasmtime_wasi_nn::WasiNnCtx::new(backends, registry)
+                let backends = wasmtime_wasi_nn::backend::list();
+                let registry = self.wasi_nn_graphs.clone().into();
+                let cx = wasmtime_wasi_nn::WasiNnCtx::new(backends, registry);
+                if self.measure_compute {
+                    let timer = self.execution_timer;
+                    let (start, end) = (self.execution_start, self.execution_end);
+                    cx.with_compute_markers(move || start(*timer.get()), move || end(*timer.get()))
+                } else {
+                    cx
+                }
             },
         };
 
@@ -555,3 +657,96 @@ impl BenchState {
         }
     }
 }
+
+#[cfg(all(test, feature = "wasi-nn"))]
+mod tests {
+    use super::*;
+    use std::path::Path;
+    use std::ptr;
+
+    extern "C" fn ignore(_: *mut u8) {}
+
+    fn bench_state(flags: &[&str]) -> Result<BenchState> {
+        let options = CommonOptions::try_parse_from(
+            std::iter::once("wasmtime").chain(flags.iter().copied()),
+        )?;
+        BenchState::new(
+            options,
+            ptr::null_mut(),
+            ignore,
+            ignore,
+            ptr::null_mut(),
+            ignore,
+            ignore,
+            ptr::null_mut(),
+            ignore,
+            ignore,
+            || Ok(WasiCtxBuilder::new().build()),
+        )
+    }
+
+    /// The imports of the wasi-nn guest that are not wasi-nn or WASI.
+    const GUEST: &str = r#"
+        (module
+            (import "bench" "thread_cpu_time_ns" (func $cpu (result i64)))
+            (import "bench" "process_rusage" (func $rusage (param i32) (result i32)))
+            (import "bench" "memory_size" (func $memory_size (result i64)))
+            (import "bench" "phase" (func $phase (param i32 i32 i32)))
+            (import "bench" "operation" (func (param i32 i32 i32)))
+            (import "bench" "monotonic_ns" (func (result i64)))
+            (import "bench" "trace_ring" (func (param i32 i32 i32)))
+            (import "bench" "trace_name" (func (param i32 i32 i32)))
+            (import "preprocess" "set_input_from_image"
+                (func (param i32 i32 i32 i32 i32 i32 i32) (result i32)))
+            (import "wasi_ephemeral_nn" "compute" (func (param i32) (result i32)))
+            (memory (export "memory") 1)
+            (func (export "_start")
+                (call $phase (i32.const 0) (i32.const 0) (i32.const 1))
+                (drop (call $cpu))
+                (drop (call $rusage (i32.const 0)))
+                (drop (call $memory_size))
+                (call $phase (i32.const 0) (i32.const 0) (i32.const 0)))
+        )
+    "#;
+
+    #[test]
+    fn accounting_imports_are_not_markers() -> Result<()> {
+        let mut state = bench_state(&["-Snn"])?;
+        state.compile(&wat::parse_str(GUEST)?)?;
+        assert!(state.measure_compute);
+        state.instantiate()?;
+        state.execute()
+    }
+
+    #[test]
+    fn markers_turn_off_compute_measurement() -> Result<()> {
+        let mut state = bench_state(&["-Snn"])?;
+        state.compile(&wat::parse_str(
+            r#"
+            (module
+                (import "bench" "start" (func))
+                (import "bench" "end" (func))
+                (import "wasi_ephemeral_nn" "compute" (func (param i32) (result i32))))
+            "#,
+        )?)?;
+        assert!(!state.measure_compute);
+        Ok(())
+    }
+
+    /// The guest built from `wasm-module`: `WASI_NN_MODULE` if set, else the
+    /// prebuilt one in `scripts/binaries`.
+    #[test]
+    fn wasi_nn_guest_instantiates() -> Result<()> {
+        let path = match env::var_os("WASI_NN_MODULE") {
+            Some(path) => PathBuf::from(path),
+            None => Path::new(env!("CARGO_MANIFEST_DIR"))
+                .join("../../../scripts/binaries/wasi-nn-module.wasm"),
+        };
+        let bytes =
+            std::fs::read(&path).with_context(|| format!("failed to read {}", path.display()))?;
+        let mut state = bench_state(&["-Snn"])?;
+        state.compile(&bytes)?;
+        assert!(state.measure_compute);
+        state.instantiate()
+    }
+}
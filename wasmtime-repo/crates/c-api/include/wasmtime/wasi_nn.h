@@ -0,0 +1,406 @@
+/**
+ * \file wasmtime/wasi_nn.h
+ *
+ * \brief API for running machine learning inference with wasi-nn
+ *
+ * wasi-nn lets a guest load a model and run inference on it through a host
+ * backend such as ONNX Runtime or OpenVINO. An embedder creates a
+ * #wasmtime_wasi_nn_config_t once, picks its backends, optionally preloads
+ * graphs for the guest's `load_by_name`, defines the wasi-nn functions in a
+ * linker with #wasmtime_linker_define_wasi_nn and attaches the config to
+ * every store that instantiates a wasi-nn guest with
+ * #wasmtime_context_set_wasi_nn.
+ *
+ * This is the WITX ("preview1") ABI of wasi-nn, as used by guests built for
+ * `wasm32-wasip1` with the `wasi-nn` crate.
+ */
+
+#ifndef WASMTIME_WASI_NN_H
+#define WASMTIME_WASI_NN_H
+
+#include <wasm.h>
+#include <wasmtime/conf.h>
+#include <wasmtime/error.h>
+#include <wasmtime/linker.h>
+#include <wasmtime/store.h>
+
+#ifdef WASMTIME_FEATURE_WASI_NN
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Specifier of a wasi-nn graph encoding, values are in
+ * #wasmtime_wasi_nn_encoding_enum
+ */
+typedef uint8_t wasmtime_wasi_nn_encoding_t;
+
+/**
+ * \brief The backends a #wasmtime_wasi_nn_config_t can use.
+ *
+ * Each one is only available if the C API was built with the matching
+ * `WASMTIME_FEATURE_WASI_NN_*` feature.
+ */
+enum wasmtime_wasi_nn_encoding_enum { // GraphEncoding
+  /// OpenVINO IR models (`WASMTIME_FEATURE_WASI_NN_OPENVINO`).
+  WASMTIME_WASI_NN_ENCODING_OPENVINO,
+  /// ONNX models run by ONNX Runtime (`WASMTIME_FEATURE_WASI_NN_ONNX`).
+  WASMTIME_WASI_NN_ENCODING_ONNX,
+};
+
+/**
+ * \brief Specifier of the device a preloaded graph runs on, values are in
+ * #wasmtime_wasi_nn_target_enum
+ */
+typedef uint8_t wasmtime_wasi_nn_target_t;
+
+/**
+ * \brief Execution targets of wasi-nn graphs.
+ */
+enum wasmtime_wasi_nn_target_enum { // ExecutionTarget
+  /// The CPU.
+  WASMTIME_WASI_NN_TARGET_CPU,
+  /// A GPU, if the backend was built with support for one.
+  WASMTIME_WASI_NN_TARGET_GPU,
+  /// A TPU or other accelerator, if the backend was built with support for
+  /// one.
+  WASMTIME_WASI_NN_TARGET_TPU,
+};
+
+/**
+ * \brief Specifier of a tensor element type, values are in
+ * #wasmtime_wasi_nn_tensor_type_enum
+ */
+typedef uint8_t wasmtime_wasi_nn_tensor_type_t;
+
+/**
+ * \brief Element types of wasi-nn tensors. Tensor data is always passed as
+ * little-endian bytes.
+ */
+enum wasmtime_wasi_nn_tensor_type_enum { // TensorType
+  /// IEEE 754 half-precision floats.
+  WASMTIME_WASI_NN_TENSOR_TYPE_FP16,
+  /// 32-bit floats.
+  WASMTIME_WASI_NN_TENSOR_TYPE_FP32,
+  /// 64-bit floats.
+  WASMTIME_WASI_NN_TENSOR_TYPE_FP64,
+  /// bfloat16 floats.
+  WASMTIME_WASI_NN_TENSOR_TYPE_BF16,
+  /// Unsigned bytes.
+  WASMTIME_WASI_NN_TENSOR_TYPE_U8,
+  /// 32-bit signed integers.
+  WASMTIME_WASI_NN_TENSOR_TYPE_I32,
+  /// 64-bit signed integers.
+  WASMTIME_WASI_NN_TENSOR_TYPE_I64,
+};
+
+/// \brief Most dimensions a #wasmtime_wasi_nn_tensor_info_t can describe.
+#define WASMTIME_WASI_NN_MAX_DIMENSIONS 8
+
+/**
+ * \typedef wasmtime_wasi_nn_tensor_info_t
+ * \brief Convenience alias for #wasmtime_wasi_nn_tensor_info
+ *
+ * \struct wasmtime_wasi_nn_tensor_info
+ * \brief The element type and shape of an input or output tensor.
+ */
+typedef struct wasmtime_wasi_nn_tensor_info {
+  /// The element type.
+  wasmtime_wasi_nn_tensor_type_t tensor_type;
+  /// How many entries of `dimensions` are used.
+  size_t num_dimensions;
+  /// The extent of every dimension; negative for a dimension the model
+  /// leaves dynamic (e.g. the batch size) and no computation has fixed yet.
+  int64_t dimensions[WASMTIME_WASI_NN_MAX_DIMENSIONS];
+} wasmtime_wasi_nn_tensor_info_t;
+
+/**
+ * \brief Specifier of an ONNX Runtime graph optimization level, values are
+ * in #wasmtime_wasi_nn_onnx_opt_level_enum
+ */
+typedef uint8_t wasmtime_wasi_nn_onnx_opt_level_t;
+
+/**
+ * \brief ONNX Runtime graph optimization levels.
+ *
+ * The default value is #WASMTIME_WASI_NN_ONNX_OPT_LEVEL_3.
+ */
+enum wasmtime_wasi_nn_onnx_opt_level_enum { // OptimizationLevel
+  /// No graph optimizations.
+  WASMTIME_WASI_NN_ONNX_OPT_LEVEL_DISABLE,
+  /// Basic optimizations such as constant folding.
+  WASMTIME_WASI_NN_ONNX_OPT_LEVEL_1,
+  /// Extended optimizations such as node fusions.
+  WASMTIME_WASI_NN_ONNX_OPT_LEVEL_2,
+  /// All optimizations, including layout optimizations.
+  WASMTIME_WASI_NN_ONNX_OPT_LEVEL_3,
+};
+
+/**
+ * \typedef wasmtime_wasi_nn_config_t
+ * \brief Convenience alias for #wasmtime_wasi_nn_config
+ *
+ * \struct wasmtime_wasi_nn_config
+ * \brief Configuration of the wasi-nn state of stores.
+ *
+ * A config holds the set of backends, the ONNX Runtime session options, the
+ * preloaded graphs and a cache of loaded graphs. Unlike #wasi_config_t it is
+ * not consumed when attached to a store: every store it is attached to gets
+ * its own wasi-nn state sharing the preloaded graphs and the cache, so a
+ * model loaded by one store is not loaded again by the next. Deleting the
+ * config does not affect the stores it was attached to.
+ */
+typedef struct wasmtime_wasi_nn_config wasmtime_wasi_nn_config_t;
+
+/**
+ * \brief Creates a new empty configuration with no backends.
+ *
+ * The caller owns the returned config and must delete it with
+ * #wasmtime_wasi_nn_config_delete.
+ */
+WASM_API_EXTERN wasmtime_wasi_nn_config_t *wasmtime_wasi_nn_config_new(void);
+
+/**
+ * \brief Deletes a configuration.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_delete(wasmtime_wasi_nn_config_t *config);
+
+/**
+ * \brief Makes the backend for `encoding` available to guests.
+ *
+ * Returns an error if the backend is not compiled into this build of the C
+ * API, `NULL` otherwise. Adding a backend twice has no further effect.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_config_add_backend(wasmtime_wasi_nn_config_t *config,
+                                    wasmtime_wasi_nn_encoding_t encoding);
+
+/**
+ * \brief Loads the graph in the directory `path` for the guest's
+ * `load_by_name`.
+ *
+ * The graph is registered under the last component of `path`: with
+ * `models/mobilenet` the guest loads it with `load_by_name("mobilenet")`.
+ * The graph is loaded immediately with the current session options of
+ * `encoding`'s backend, so set those first, and shared by every store the
+ * config is attached to afterwards.
+ *
+ * Returns an error if the backend is unavailable or the graph fails to load,
+ * `NULL` otherwise.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_config_preload(wasmtime_wasi_nn_config_t *config,
+                                wasmtime_wasi_nn_encoding_t encoding,
+                                const char *path,
+                                wasmtime_wasi_nn_target_t target);
+
+/**
+ * \brief Returns how many guest `load` calls of all stores using this config
+ * were served from its graph cache.
+ */
+WASM_API_EXTERN uint64_t wasmtime_wasi_nn_config_graph_cache_hits(
+    const wasmtime_wasi_nn_config_t *config);
+
+/**
+ * \brief Returns how many guest `load` calls of all stores using this config
+ * had to load their graph.
+ */
+WASM_API_EXTERN uint64_t wasmtime_wasi_nn_config_graph_cache_misses(
+    const wasmtime_wasi_nn_config_t *config);
+
+#ifdef WASMTIME_FEATURE_WASI_NN_ONNX
+
+/**
+ * \brief Sets the number of threads ONNX Runtime uses within a node.
+ *
+ * 0, the default, leaves the choice to ONNX Runtime, which uses one thread
+ * per core. With many stores running inference at once that oversubscribes
+ * the machine, so set it explicitly there.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_onnx_intra_threads_set(wasmtime_wasi_nn_config_t *config,
+                                               size_t threads);
+
+/**
+ * \brief Sets the number of threads ONNX Runtime uses to run independent
+ * nodes with parallel execution; 0, the default, leaves it to ONNX Runtime.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_onnx_inter_threads_set(wasmtime_wasi_nn_config_t *config,
+                                               size_t threads);
+
+/**
+ * \brief Configures whether ONNX Runtime runs independent nodes
+ * concurrently.
+ *
+ * This setting is `false` by default.
+ */
+WASM_API_EXTERN void wasmtime_wasi_nn_config_onnx_parallel_execution_set(
+    wasmtime_wasi_nn_config_t *config, bool enable);
+
+/**
+ * \brief Sets the ONNX Runtime graph optimization level.
+ *
+ * The default is #WASMTIME_WASI_NN_ONNX_OPT_LEVEL_3.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_onnx_opt_level_set(wasmtime_wasi_nn_config_t *config,
+                                           wasmtime_wasi_nn_onnx_opt_level_t level);
+
+/**
+ * \brief Configures whether ONNX Runtime pre-plans allocations from the
+ * shapes of the first run.
+ *
+ * This setting is `true` by default.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_onnx_memory_pattern_set(wasmtime_wasi_nn_config_t *config,
+                                                bool enable);
+
+/**
+ * \brief Configures whether ONNX Runtime serves CPU allocations from its
+ * arena allocator.
+ *
+ * This setting is `true` by default.
+ */
+WASM_API_EXTERN void
+wasmtime_wasi_nn_config_onnx_cpu_arena_set(wasmtime_wasi_nn_config_t *config,
+                                           bool enable);
+
+#endif // WASMTIME_FEATURE_WASI_NN_ONNX
+
+/**
+ * \brief Defines the wasi-nn functions (`wasi_ephemeral_nn`) in this linker.
+ *
+ * \param linker the linker the functions are being defined in.
+ *
+ * \return On success `NULL` is returned, otherwise an error is returned which
+ * describes why the definition failed.
+ *
+ * Stores instantiating modules with these functions need their wasi-nn state
+ * configured with #wasmtime_context_set_wasi_nn, otherwise the first wasi-nn
+ * call trips an assert that aborts the process.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_linker_define_wasi_nn(wasmtime_linker_t *linker);
+
+/**
+ * \brief Configures the wasi-nn state within the specified store.
+ *
+ * This function is required if #wasmtime_linker_define_wasi_nn is called. It
+ * creates the store's backends from `config` and shares its preloaded graphs
+ * and graph cache. It takes ownership of neither `context` nor `config`;
+ * `config` can be attached to any number of stores.
+ *
+ * Returns an error if a backend of `config` cannot be created, `NULL`
+ * otherwise.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_context_set_wasi_nn(wasmtime_context_t *context,
+                             const wasmtime_wasi_nn_config_t *config);
+
+/**
+ * \brief Host-driven inference
+ *
+ * The functions below feed and read the wasi-nn state of a store directly
+ * from host memory, for hosts that already hold a decoded tensor: the input
+ * is copied once, from the host pointer into the backend, instead of into
+ * guest memory and out again. Graphs and execution contexts are identified
+ * by the same `uint32_t` handles the guest uses, so a host may drive a
+ * context the guest created (e.g. one whose handle an export returned) or
+ * create its own with #wasmtime_wasi_nn_load_by_name and
+ * #wasmtime_wasi_nn_init_execution_context.
+ *
+ * All of these return `NULL` on success or an error, e.g. for an unknown
+ * handle or a store without #wasmtime_context_set_wasi_nn.
+ */
+
+/**
+ * \brief Looks up a graph preloaded with #wasmtime_wasi_nn_config_preload by
+ * its name and returns a new graph handle in `graph`.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_load_by_name(wasmtime_context_t *context, const char *name,
+                              size_t name_len, uint32_t *graph);
+
+/**
+ * \brief Creates an execution context for `graph` and returns its handle in
+ * `exec_context`.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_init_execution_context(wasmtime_context_t *context,
+                                        uint32_t graph, uint32_t *exec_context);
+
+/**
+ * \brief Fills in `info` with the type and shape the model declares for
+ * input `index`.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_input_info(wasmtime_context_t *context, uint32_t exec_context,
+                            uint32_t index, wasmtime_wasi_nn_tensor_info_t *info);
+
+/**
+ * \brief Fills in `info` with the type and shape of output `index`.
+ *
+ * After #wasmtime_wasi_nn_compute the shape is the computed one, so dynamic
+ * dimensions are known; before it is the shape the model declares.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_output_info(wasmtime_context_t *context, uint32_t exec_context,
+                             uint32_t index,
+                             wasmtime_wasi_nn_tensor_info_t *info);
+
+/**
+ * \brief Sets input `index` of `exec_context` from host memory.
+ *
+ * `dimensions` and `data` are only borrowed for the duration of the call:
+ * the backend copies the `data_len` bytes into its own input buffer before
+ * this returns, so the caller may reuse or free them immediately.
+ */
+WASM_API_EXTERN wasmtime_error_t *wasmtime_wasi_nn_set_input(
+    wasmtime_context_t *context, uint32_t exec_context, uint32_t index,
+    wasmtime_wasi_nn_tensor_type_t type, const uint32_t *dimensions,
+    size_t num_dimensions, const uint8_t *data, size_t data_len);
+
+/**
+ * \brief Runs inference on `exec_context` on the calling thread.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_compute(wasmtime_context_t *context, uint32_t exec_context);
+
+/**
+ * \brief Copies output `index` of the last computation into the host buffer
+ * `out` of `out_len` bytes and stores the number of bytes in `written`.
+ *
+ * Returns an error without writing anything if the output is larger than
+ * `out_len`; #wasmtime_wasi_nn_output_info tells its size.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_get_output(wasmtime_context_t *context, uint32_t exec_context,
+                            uint32_t index, uint8_t *out, size_t out_len,
+                            size_t *written);
+
+/**
+ * \brief Borrows the backend's buffer of output `index` of the last
+ * computation without copying it.
+ *
+ * On success `data` and `data_len` describe the output bytes. The buffer
+ * stays owned by the backend and is only valid until the next call that
+ * uses the store's wasi-nn state (set_input, compute, any call into the
+ * guest) or until the store is deleted. Backends that keep no such buffer
+ * return an error; #wasmtime_wasi_nn_get_output works with all of them.
+ */
+WASM_API_EXTERN wasmtime_error_t *
+wasmtime_wasi_nn_output_data(const wasmtime_context_t *context,
+                             uint32_t exec_context, uint32_t index,
+                             const uint8_t **data, size_t *data_len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // WASMTIME_FEATURE_WASI_NN
+
+#endif // WASMTIME_WASI_NN_H
@@ -64,6 +64,10 @@ pub use crate::r#async::*;
 mod wasi;
 #[cfg(feature = "wasi")]
 pub use crate::wasi::*;
+#[cfg(feature = "wasi-nn")]
+mod wasi_nn;
+#[cfg(feature = "wasi-nn")]
+pub use crate::wasi_nn::*;
 
 #[cfg(feature = "wat")]
 mod wat2wasm;
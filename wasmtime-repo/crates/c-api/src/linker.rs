@@ -119,6 +119,21 @@ pub extern "C" fn wasmtime_linker_define_wasi(
     )
 }
 
+#[cfg(feature = "wasi-nn")]
+#[no_mangle]
+pub extern "C" fn wasmtime_linker_define_wasi_nn(
+    linker: &mut wasmtime_linker_t,
+) -> Option<Box<wasmtime_error_t>> {
+    handle_result(
+        wasmtime_wasi_nn::witx::add_to_linker(&mut linker.linker, |ctx| {
+            ctx.wasi_nn
+                .as_mut()
+                .expect("wasi-nn context must be populated")
+        }),
+        |_linker| (),
+    )
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn wasmtime_linker_define_instance(
     linker: &mut wasmtime_linker_t,
@@ -84,6 +84,8 @@ pub struct WasmtimeStoreData {
     foreign: crate::ForeignData,
     #[cfg(feature = "wasi")]
     pub(crate) wasi: Option<wasmtime_wasi::preview1::WasiP1Ctx>,
+    #[cfg(feature = "wasi-nn")]
+    pub(crate) wasi_nn: Option<wasmtime_wasi_nn::WasiNnCtx>,
 
     /// Temporary storage for usage during a wasm->host call to store values
     /// in a slice we pass to the C API.
@@ -110,6 +112,8 @@ pub extern "C" fn wasmtime_store_new(
                 foreign: ForeignData { data, finalizer },
                 #[cfg(feature = "wasi")]
                 wasi: None,
+                #[cfg(feature = "wasi-nn")]
+                wasi_nn: None,
                 hostcall_val_storage: Vec::new(),
                 wasm_val_storage: Vec::new(),
                 store_limits: StoreLimits::default(),
@@ -219,6 +223,17 @@ pub extern "C" fn wasmtime_context_set_wasi(
     })
 }
 
+#[cfg(feature = "wasi-nn")]
+#[no_mangle]
+pub extern "C" fn wasmtime_context_set_wasi_nn(
+    mut context: WasmtimeStoreContextMut<'_>,
+    config: &crate::wasmtime_wasi_nn_config_t,
+) -> Option<Box<wasmtime_error_t>> {
+    crate::handle_result(config.wasi_nn_ctx(), |wasi_nn| {
+        context.data_mut().wasi_nn = Some(wasi_nn);
+    })
+}
+
 #[no_mangle]
 pub extern "C" fn wasmtime_context_gc(mut context: WasmtimeStoreContextMut<'_>) {
     context.gc();
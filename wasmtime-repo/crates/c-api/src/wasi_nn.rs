@@ -0,0 +1,440 @@
+//! The wasi-nn embedding API definitions for Wasmtime.
+
+use crate::{handle_result, wasmtime_error_t, WasmtimeStoreContext, WasmtimeStoreContextMut};
+use anyhow::{anyhow, bail, Result};
+use std::ffi::{c_char, CStr};
+use std::path::Path;
+use std::slice;
+#[cfg(feature = "wasi-nn-onnx")]
+use wasmtime_wasi_nn::backend::onnxruntime::{
+    ExecutionMode, OnnxBackend, OnnxOptions, OptimizationLevel,
+};
+#[cfg(feature = "wasi-nn-openvino")]
+use wasmtime_wasi_nn::backend::openvino::OpenvinoBackend;
+use wasmtime_wasi_nn::backend::{BackendFromDir, TensorInfo, TensorView};
+use wasmtime_wasi_nn::wit::types::{ExecutionTarget, GraphEncoding, TensorType};
+use wasmtime_wasi_nn::{Backend, GraphCache, InMemoryRegistry, WasiNnCtx};
+
+#[repr(u8)]
+#[derive(Clone, Copy)]
+pub enum wasmtime_wasi_nn_encoding_t {
+    WASMTIME_WASI_NN_ENCODING_OPENVINO,
+    WASMTIME_WASI_NN_ENCODING_ONNX,
+}
+
+#[repr(u8)]
+#[derive(Clone, Copy)]
+pub enum wasmtime_wasi_nn_target_t {
+    WASMTIME_WASI_NN_TARGET_CPU,
+    WASMTIME_WASI_NN_TARGET_GPU,
+    WASMTIME_WASI_NN_TARGET_TPU,
+}
+
+#[repr(u8)]
+#[derive(Clone, Copy)]
+pub enum wasmtime_wasi_nn_tensor_type_t {
+    WASMTIME_WASI_NN_TENSOR_TYPE_FP16,
+    WASMTIME_WASI_NN_TENSOR_TYPE_FP32,
+    WASMTIME_WASI_NN_TENSOR_TYPE_FP64,
+    WASMTIME_WASI_NN_TENSOR_TYPE_BF16,
+    WASMTIME_WASI_NN_TENSOR_TYPE_U8,
+    WASMTIME_WASI_NN_TENSOR_TYPE_I32,
+    WASMTIME_WASI_NN_TENSOR_TYPE_I64,
+}
+
+/// Must match `WASMTIME_WASI_NN_MAX_DIMENSIONS` in `wasmtime/wasi_nn.h`.
+const MAX_DIMENSIONS: usize = 8;
+
+#[repr(C)]
+pub struct wasmtime_wasi_nn_tensor_info_t {
+    tensor_type: wasmtime_wasi_nn_tensor_type_t,
+    num_dimensions: usize,
+    dimensions: [i64; MAX_DIMENSIONS],
+}
+
+#[repr(u8)]
+#[derive(Clone, Copy)]
+pub enum wasmtime_wasi_nn_onnx_opt_level_t {
+    WASMTIME_WASI_NN_ONNX_OPT_LEVEL_DISABLE,
+    WASMTIME_WASI_NN_ONNX_OPT_LEVEL_1,
+    WASMTIME_WASI_NN_ONNX_OPT_LEVEL_2,
+    WASMTIME_WASI_NN_ONNX_OPT_LEVEL_3,
+}
+
+/// Everything needed to create the `WasiNnCtx` of a store. The registry of
+/// preloaded graphs and the graph cache are shared by every store the config
+/// is attached to.
+pub struct wasmtime_wasi_nn_config_t {
+    encodings: Vec<GraphEncoding>,
+    #[cfg(feature = "wasi-nn-onnx")]
+    onnx: OnnxOptions,
+    registry: InMemoryRegistry,
+    cache: GraphCache,
+}
+
+wasmtime_c_api_macros::declare_own!(wasmtime_wasi_nn_config_t);
+
+impl wasmtime_wasi_nn_config_t {
+    fn backend(&self, encoding: GraphEncoding) -> Result<Backend> {
+        match encoding {
+            #[cfg(feature = "wasi-nn-onnx")]
+            GraphEncoding::Onnx => Ok(OnnxBackend::new(self.onnx.clone()).into()),
+            #[cfg(feature = "wasi-nn-openvino")]
+            GraphEncoding::Openvino => Ok(OpenvinoBackend::default().into()),
+            _ => bail!("the {:?} backend is not compiled into this build", encoding),
+        }
+    }
+
+    pub(crate) fn wasi_nn_ctx(&self) -> Result<WasiNnCtx> {
+        let backends = self
+            .encodings
+            .iter()
+            .map(|encoding| self.backend(*encoding))
+            .collect::<Result<Vec<_>>>()?;
+        let registry = self.registry.clone().into();
+        Ok(WasiNnCtx::new(backends, registry).with_graph_cache(self.cache.clone()))
+    }
+}
+
+impl From<wasmtime_wasi_nn_encoding_t> for GraphEncoding {
+    fn from(encoding: wasmtime_wasi_nn_encoding_t) -> Self {
+        use wasmtime_wasi_nn_encoding_t::*;
+        match encoding {
+            WASMTIME_WASI_NN_ENCODING_OPENVINO => GraphEncoding::Openvino,
+            WASMTIME_WASI_NN_ENCODING_ONNX => GraphEncoding::Onnx,
+        }
+    }
+}
+
+impl From<wasmtime_wasi_nn_target_t> for ExecutionTarget {
+    fn from(target: wasmtime_wasi_nn_target_t) -> Self {
+        use wasmtime_wasi_nn_target_t::*;
+        match target {
+            WASMTIME_WASI_NN_TARGET_CPU => ExecutionTarget::Cpu,
+            WASMTIME_WASI_NN_TARGET_GPU => ExecutionTarget::Gpu,
+            WASMTIME_WASI_NN_TARGET_TPU => ExecutionTarget::Tpu,
+        }
+    }
+}
+
+impl From<wasmtime_wasi_nn_tensor_type_t> for TensorType {
+    fn from(tensor_type: wasmtime_wasi_nn_tensor_type_t) -> Self {
+        use wasmtime_wasi_nn_tensor_type_t::*;
+        match tensor_type {
+            WASMTIME_WASI_NN_TENSOR_TYPE_FP16 => TensorType::Fp16,
+            WASMTIME_WASI_NN_TENSOR_TYPE_FP32 => TensorType::Fp32,
+            WASMTIME_WASI_NN_TENSOR_TYPE_FP64 => TensorType::Fp64,
+            WASMTIME_WASI_NN_TENSOR_TYPE_BF16 => TensorType::Bf16,
+            WASMTIME_WASI_NN_TENSOR_TYPE_U8 => TensorType::U8,
+            WASMTIME_WASI_NN_TENSOR_TYPE_I32 => TensorType::I32,
+            WASMTIME_WASI_NN_TENSOR_TYPE_I64 => TensorType::I64,
+        }
+    }
+}
+
+impl From<TensorType> for wasmtime_wasi_nn_tensor_type_t {
+    fn from(tensor_type: TensorType) -> Self {
+        use wasmtime_wasi_nn_tensor_type_t::*;
+        match tensor_type {
+            TensorType::Fp16 => WASMTIME_WASI_NN_TENSOR_TYPE_FP16,
+            TensorType::Fp32 => WASMTIME_WASI_NN_TENSOR_TYPE_FP32,
+            TensorType::Fp64 => WASMTIME_WASI_NN_TENSOR_TYPE_FP64,
+            TensorType::Bf16 => WASMTIME_WASI_NN_TENSOR_TYPE_BF16,
+            TensorType::U8 => WASMTIME_WASI_NN_TENSOR_TYPE_U8,
+            TensorType::I32 => WASMTIME_WASI_NN_TENSOR_TYPE_I32,
+            TensorType::I64 => WASMTIME_WASI_NN_TENSOR_TYPE_I64,
+        }
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_new() -> Box<wasmtime_wasi_nn_config_t> {
+    Box::new(wasmtime_wasi_nn_config_t {
+        encodings: Vec::new(),
+        #[cfg(feature = "wasi-nn-onnx")]
+        onnx: OnnxOptions::default(),
+        registry: InMemoryRegistry::new(),
+        cache: GraphCache::new(),
+    })
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_add_backend(
+    config: &mut wasmtime_wasi_nn_config_t,
+    encoding: wasmtime_wasi_nn_encoding_t,
+) -> Option<Box<wasmtime_error_t>> {
+    let encoding = GraphEncoding::from(encoding);
+    handle_result(config.backend(encoding), |_backend| {
+        if !config.encodings.contains(&encoding) {
+            config.encodings.push(encoding);
+        }
+    })
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn wasmtime_wasi_nn_config_preload(
+    config: &mut wasmtime_wasi_nn_config_t,
+    encoding: wasmtime_wasi_nn_encoding_t,
+    path: *const c_char,
+    target: wasmtime_wasi_nn_target_t,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| {
+        let path = CStr::from_ptr(path)
+            .to_str()
+            .map_err(|_| anyhow!("graph directory is not valid UTF-8"))?;
+        let mut backend = config.backend(encoding.into())?;
+        let backend: &mut dyn BackendFromDir = backend
+            .as_dir_loadable()
+            .ok_or_else(|| anyhow!("the backend cannot load graphs from a directory"))?;
+        config
+            .registry
+            .load_for_target(backend, Path::new(path), target.into())
+    })();
+    handle_result(result, |()| {})
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_graph_cache_hits(
+    config: &wasmtime_wasi_nn_config_t,
+) -> u64 {
+    config.cache.hits()
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_graph_cache_misses(
+    config: &wasmtime_wasi_nn_config_t,
+) -> u64 {
+    config.cache.misses()
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_intra_threads_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    threads: usize,
+) {
+    config.onnx.intra_threads = if threads == 0 { None } else { Some(threads) };
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_inter_threads_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    threads: usize,
+) {
+    config.onnx.inter_threads = if threads == 0 { None } else { Some(threads) };
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_parallel_execution_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    enable: bool,
+) {
+    config.onnx.execution_mode = if enable {
+        ExecutionMode::Parallel
+    } else {
+        ExecutionMode::Sequential
+    };
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_opt_level_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    level: wasmtime_wasi_nn_onnx_opt_level_t,
+) {
+    use wasmtime_wasi_nn_onnx_opt_level_t::*;
+    config.onnx.optimization_level = match level {
+        WASMTIME_WASI_NN_ONNX_OPT_LEVEL_DISABLE => OptimizationLevel::Disable,
+        WASMTIME_WASI_NN_ONNX_OPT_LEVEL_1 => OptimizationLevel::Level1,
+        WASMTIME_WASI_NN_ONNX_OPT_LEVEL_2 => OptimizationLevel::Level2,
+        WASMTIME_WASI_NN_ONNX_OPT_LEVEL_3 => OptimizationLevel::Level3,
+    };
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_memory_pattern_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    enable: bool,
+) {
+    config.onnx.memory_pattern = enable;
+}
+
+#[cfg(feature = "wasi-nn-onnx")]
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_config_onnx_cpu_arena_set(
+    config: &mut wasmtime_wasi_nn_config_t,
+    enable: bool,
+) {
+    config.onnx.cpu_arena = enable;
+}
+
+// Host-driven inference on the store's wasi-nn state. Graphs and execution
+// contexts are named by the same `u32` handles the guest sees, so a host can
+// feed a context the guest created, or create its own.
+
+fn wasi_nn<'a>(context: &'a mut WasmtimeStoreContextMut<'_>) -> Result<&'a mut WasiNnCtx> {
+    context
+        .data_mut()
+        .wasi_nn
+        .as_mut()
+        .ok_or_else(|| anyhow!("wasi-nn is not configured in this store"))
+}
+
+fn tensor_info(info: Option<TensorInfo>, out: &mut wasmtime_wasi_nn_tensor_info_t) -> Result<()> {
+    let info =
+        info.ok_or_else(|| anyhow!("the backend has no such tensor or no metadata for it"))?;
+    if info.dimensions.len() > MAX_DIMENSIONS {
+        bail!(
+            "tensor has {} dimensions, more than {}",
+            info.dimensions.len(),
+            MAX_DIMENSIONS
+        );
+    }
+    out.tensor_type = info.tensor_type.into();
+    out.num_dimensions = info.dimensions.len();
+    out.dimensions[..info.dimensions.len()].copy_from_slice(&info.dimensions);
+    Ok(())
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn wasmtime_wasi_nn_load_by_name(
+    mut context: WasmtimeStoreContextMut<'_>,
+    name: *const u8,
+    name_len: usize,
+    graph: &mut u32,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<u32> {
+        let name = std::str::from_utf8(crate::slice_from_raw_parts(name, name_len))?;
+        Ok(wasi_nn(&mut context)?.graph_by_name(name)?)
+    })();
+    handle_result(result, |id| *graph = id)
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_init_execution_context(
+    mut context: WasmtimeStoreContextMut<'_>,
+    graph: u32,
+    exec_context: &mut u32,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<u32> { Ok(wasi_nn(&mut context)?.new_execution_context(graph)?) })();
+    handle_result(result, |id| *exec_context = id)
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_input_info(
+    mut context: WasmtimeStoreContextMut<'_>,
+    exec_context: u32,
+    index: u32,
+    info: &mut wasmtime_wasi_nn_tensor_info_t,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<()> {
+        let exec = execution_context(&mut context, exec_context)?;
+        tensor_info(exec.input_info(index), info)
+    })();
+    handle_result(result, |()| {})
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_output_info(
+    mut context: WasmtimeStoreContextMut<'_>,
+    exec_context: u32,
+    index: u32,
+    info: &mut wasmtime_wasi_nn_tensor_info_t,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<()> {
+        let exec = execution_context(&mut context, exec_context)?;
+        tensor_info(exec.output_info(index), info)
+    })();
+    handle_result(result, |()| {})
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn wasmtime_wasi_nn_set_input(
+    mut context: WasmtimeStoreContextMut<'_>,
+    exec_context: u32,
+    index: u32,
+    tensor_type: wasmtime_wasi_nn_tensor_type_t,
+    dimensions: *const u32,
+    num_dimensions: usize,
+    data: *const u8,
+    data_len: usize,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<()> {
+        // Borrowed for this call only: the backend copies the bytes into its
+        // own input buffer, the one copy on this path.
+        let tensor = TensorView {
+            dimensions: crate::slice_from_raw_parts(dimensions, num_dimensions),
+            tensor_type: tensor_type.into(),
+            data: crate::slice_from_raw_parts(data, data_len),
+        };
+        let exec = execution_context(&mut context, exec_context)?;
+        Ok(exec.set_input(index, &tensor)?)
+    })();
+    handle_result(result, |()| {})
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_compute(
+    mut context: WasmtimeStoreContextMut<'_>,
+    exec_context: u32,
+) -> Option<Box<wasmtime_error_t>> {
+    let result =
+        (|| -> Result<()> { Ok(execution_context(&mut context, exec_context)?.compute()?) })();
+    handle_result(result, |()| {})
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn wasmtime_wasi_nn_get_output(
+    mut context: WasmtimeStoreContextMut<'_>,
+    exec_context: u32,
+    index: u32,
+    out: *mut u8,
+    out_len: usize,
+    written: &mut usize,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<usize> {
+        let destination = crate::slice_from_raw_parts_mut(out, out_len);
+        let exec = execution_context(&mut context, exec_context)?;
+        Ok(exec.get_output(index, destination)? as usize)
+    })();
+    handle_result(result, |len| *written = len)
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_wasi_nn_output_data(
+    context: WasmtimeStoreContext<'_>,
+    exec_context: u32,
+    index: u32,
+    data: &mut *const u8,
+    data_len: &mut usize,
+) -> Option<Box<wasmtime_error_t>> {
+    let result = (|| -> Result<(*const u8, usize)> {
+        let exec = context
+            .data()
+            .wasi_nn
+            .as_ref()
+            .ok_or_else(|| anyhow!("wasi-nn is not configured in this store"))?
+            .execution_context(exec_context)
+            .ok_or_else(|| anyhow!("invalid execution context handle: {}", exec_context))?;
+        let bytes = exec
+            .output_bytes(index)
+            .ok_or_else(|| anyhow!("output {} has no borrowable buffer", index))?;
+        Ok((bytes.as_ptr(), bytes.len()))
+    })();
+    handle_result(result, |(ptr, len)| {
+        *data = ptr;
+        *data_len = len;
+    })
+}
+
+fn execution_context<'a>(
+    context: &'a mut WasmtimeStoreContextMut<'_>,
+    id: u32,
+) -> Result<&'a mut wasmtime_wasi_nn::ExecutionContext> {
+    wasi_nn(context)?
+        .execution_context_mut(id)
+        .ok_or_else(|| anyhow!("invalid execution context handle: {}", id))
+}
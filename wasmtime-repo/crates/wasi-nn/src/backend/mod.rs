@@ -16,11 +16,14 @@ use self::openvino::OpenvinoBackend;
 #[cfg(all(feature = "winml", target_os = "windows"))]
 use self::winml::WinMLBackend;
 
-use crate::wit::types::{ExecutionTarget, GraphEncoding, Tensor};
+use crate::wit::types::{ExecutionTarget, GraphEncoding, Tensor, TensorType};
 use crate::{Backend, ExecutionContext, Graph};
+use std::any::Any;
+use std::borrow::Cow;
 use std::fs::File;
 use std::io::Read;
 use std::path::Path;
+use std::sync::Arc;
 use thiserror::Error;
 use wiggle::GuestError;
 
@@ -47,6 +50,13 @@ pub trait BackendInner: Send + Sync {
     fn encoding(&self) -> GraphEncoding;
     fn load(&mut self, builders: &[&[u8]], target: ExecutionTarget) -> Result<Graph, BackendError>;
     fn as_dir_loadable<'a>(&'a mut self) -> Option<&'a mut dyn BackendFromDir>;
+
+    /// Describe the backend configuration that affects what [Self::load]
+    /// builds; a [GraphCache](crate::GraphCache) only shares graphs between
+    /// backends with the same fingerprint.
+    fn config_fingerprint(&self) -> String {
+        String::new()
+    }
 }
 
 /// Some [Backend]s support loading a [Graph] from a directory on the
@@ -69,9 +79,216 @@ pub trait BackendGraph: Send + Sync {
 /// A [BackendExecutionContext] performs the actual inference; this is the
 /// backing implementation for a user-facing execution context.
 pub trait BackendExecutionContext: Send + Sync {
-    fn set_input(&mut self, index: u32, tensor: &Tensor) -> Result<(), BackendError>;
+    fn set_input(&mut self, index: u32, tensor: &TensorView<'_>) -> Result<(), BackendError>;
     fn compute(&mut self) -> Result<(), BackendError>;
     fn get_output(&mut self, index: u32, destination: &mut [u8]) -> Result<u32, BackendError>;
+
+    /// The type and shape the model declares for input `index`, if the
+    /// backend knows them.
+    fn input_info(&self, _index: u32) -> Option<TensorInfo> {
+        None
+    }
+
+    /// The type and shape of output `index`: as computed by the last
+    /// [Self::compute], or as declared by the model before that.
+    fn output_info(&self, _index: u32) -> Option<TensorInfo> {
+        None
+    }
+
+    /// Borrow the bytes of output `index` of the last [Self::compute], for
+    /// hosts that read outputs without copying them; `None` if the backend
+    /// keeps no such buffer, in which case [Self::get_output] still works.
+    fn output_bytes(&self, _index: u32) -> Option<&[u8]> {
+        None
+    }
+
+    /// The name the model gives input `index`, if the backend knows it.
+    fn input_name(&self, _index: u32) -> Option<String> {
+        None
+    }
+
+    /// The name the model gives output `index`, if the backend knows it.
+    fn output_name(&self, _index: u32) -> Option<String> {
+        None
+    }
+
+    /// The index of the input the model calls `name`.
+    fn input_index(&self, name: &str) -> Option<u32> {
+        (0..)
+            .map_while(|i| Some((i, self.input_name(i)?)))
+            .find_map(|(i, n)| (n == name).then_some(i))
+    }
+
+    /// The index of the output the model calls `name`.
+    fn output_index(&self, name: &str) -> Option<u32> {
+        (0..)
+            .map_while(|i| Some((i, self.output_name(i)?)))
+            .find_map(|(i, n)| (n == name).then_some(i))
+    }
+
+    /// Produce only the outputs in `indices` from now on, or all of them
+    /// again for an empty list; the others are unavailable after a
+    /// [Self::compute]. Backends that cannot skip outputs ignore this.
+    fn select_outputs(&mut self, _indices: &[u32]) -> Result<(), BackendError> {
+        Ok(())
+    }
+
+    /// The number of bytes [Self::get_output] writes for output `index`: of
+    /// the last [Self::compute], or of the declared shape before that if it
+    /// has no dynamic dimensions.
+    fn output_len(&self, index: u32) -> Option<usize> {
+        match self.output_bytes(index) {
+            Some(bytes) => Some(bytes.len()),
+            None => self.output_info(index)?.byte_len(),
+        }
+    }
+
+    /// Output `index` of the last [Self::compute] as a tensor the host can
+    /// hand to [Self::bind_input] of another context; `None` if there is no
+    /// such output. By default a copy of its bytes, backends whose library
+    /// owns the output return it as it is.
+    fn output_tensor(&mut self, index: u32) -> Result<Option<SharedTensor>, BackendError> {
+        let Some(info) = self.output_info(index) else {
+            return Ok(None);
+        };
+        let data = match self.output_bytes(index) {
+            Some(bytes) => bytes.to_vec(),
+            None => {
+                let Some(len) = self.output_len(index) else {
+                    return Ok(None);
+                };
+                let mut data = vec![0; len];
+                let len = self.get_output(index, &mut data)?;
+                data.truncate(len as usize);
+                data
+            }
+        };
+        Ok(Some(Arc::new(BytesTensor { info, data })))
+    }
+
+    /// Use `tensor`, an output of another context, as input `index` until
+    /// the next [Self::set_input] or `bind_input` of that index. By default
+    /// its bytes are copied in as by [Self::set_input]; a backend that
+    /// recognizes its own tensors feeds them to the library directly.
+    fn bind_input(&mut self, index: u32, tensor: &SharedTensor) -> Result<(), BackendError> {
+        set_input_from(self, index, tensor.as_ref())
+    }
+}
+
+/// A tensor one execution context produced, shared with the contexts it is
+/// bound to; it stays valid, and unchanged, after its context computes again.
+pub trait OutputTensor: Send + Sync {
+    fn info(&self) -> &TensorInfo;
+
+    /// The elements as little-endian bytes, borrowed where the backend keeps
+    /// them in that layout.
+    fn data(&self) -> Result<Cow<'_, [u8]>, BackendError>;
+
+    /// For backends to recognize their own tensors in
+    /// [BackendExecutionContext::bind_input].
+    fn into_any(self: Arc<Self>) -> Arc<dyn Any + Send + Sync>;
+}
+
+pub type SharedTensor = Arc<dyn OutputTensor>;
+
+/// An output copied out of its backend, see
+/// [BackendExecutionContext::output_tensor].
+pub(crate) struct BytesTensor {
+    pub info: TensorInfo,
+    pub data: Vec<u8>,
+}
+
+impl OutputTensor for BytesTensor {
+    fn info(&self) -> &TensorInfo {
+        &self.info
+    }
+
+    fn data(&self) -> Result<Cow<'_, [u8]>, BackendError> {
+        Ok(Cow::Borrowed(&self.data))
+    }
+
+    fn into_any(self: Arc<Self>) -> Arc<dyn Any + Send + Sync> {
+        self
+    }
+}
+
+/// Set input `index` of `context` to a copy of `tensor`, for tensors the
+/// backend cannot take as they are.
+pub(crate) fn set_input_from<C: BackendExecutionContext + ?Sized>(
+    context: &mut C,
+    index: u32,
+    tensor: &dyn OutputTensor,
+) -> Result<(), BackendError> {
+    let info = tensor.info();
+    let dimensions = info
+        .fixed_dimensions()
+        .ok_or_else(|| anyhow::anyhow!("input {}: dynamic shape {:?}", index, info.dimensions))?;
+    let data = tensor.data()?;
+    context.set_input(
+        index,
+        &TensorView {
+            dimensions: &dimensions,
+            tensor_type: info.tensor_type,
+            data: &data,
+        },
+    )
+}
+
+/// The element type and dimensions of a tensor. Dimensions a model leaves
+/// dynamic (e.g. the batch size) are negative until a computation fixes them.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TensorInfo {
+    pub tensor_type: TensorType,
+    pub dimensions: Vec<i64>,
+}
+
+impl TensorInfo {
+    /// The size of the tensor's data, unless a dimension is still dynamic.
+    pub fn byte_len(&self) -> Option<usize> {
+        self.dimensions
+            .iter()
+            .try_fold(tensor_type_size(self.tensor_type), |size, &d| {
+                usize::try_from(d).ok().map(|d| size * d)
+            })
+    }
+
+    /// The dimensions as the ABIs pass them, unless one is still dynamic.
+    pub fn fixed_dimensions(&self) -> Option<Vec<u32>> {
+        self.dimensions
+            .iter()
+            .map(|&d| u32::try_from(d).ok())
+            .collect()
+    }
+}
+
+/// The size in bytes of one element of `tensor_type`.
+pub(crate) fn tensor_type_size(tensor_type: TensorType) -> usize {
+    match tensor_type {
+        TensorType::Fp16 | TensorType::Bf16 => 2,
+        TensorType::Fp32 | TensorType::I32 => 4,
+        TensorType::Fp64 | TensorType::I64 => 8,
+        TensorType::U8 => 1,
+    }
+}
+
+/// A borrowed tensor: the WITX ABI points `data` straight into guest memory so
+/// that backends copy it at most once, into whatever buffer they hand to the
+/// ML library.
+#[derive(Debug, Clone, Copy)]
+pub struct TensorView<'a> {
+    pub dimensions: &'a [u32],
+    pub tensor_type: TensorType,
+    pub data: &'a [u8],
+}
+
+impl<'a> From<&'a Tensor> for TensorView<'a> {
+    fn from(tensor: &'a Tensor) -> Self {
+        Self {
+            dimensions: &tensor.dimensions,
+            tensor_type: tensor.tensor_type,
+            data: &tensor.data,
+        }
+    }
 }
 
 /// Errors returned by a backend; [BackendError::BackendAccess] is a catch-all
@@ -88,10 +305,88 @@ pub enum BackendError {
     NotEnoughMemory(usize),
 }
 
-/// Read a file into a byte vector.
-fn read(path: &Path) -> anyhow::Result<Vec<u8>> {
+/// The contents of a model file: mapped read-only where the platform allows
+/// it, so that loading from a directory does not copy the file into a heap
+/// buffer first.
+enum ModelFile {
+    #[cfg(unix)]
+    Mapped { ptr: *mut std::ffi::c_void, len: usize },
+    Read(Vec<u8>),
+}
+
+// SAFETY: the mapping is private and read-only and is only unmapped on drop.
+unsafe impl Send for ModelFile {}
+unsafe impl Sync for ModelFile {}
+
+impl std::ops::Deref for ModelFile {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match self {
+            #[cfg(unix)]
+            ModelFile::Mapped { ptr, len } => unsafe {
+                std::slice::from_raw_parts(*ptr as *const u8, *len)
+            },
+            ModelFile::Read(buffer) => buffer,
+        }
+    }
+}
+
+impl Drop for ModelFile {
+    fn drop(&mut self) {
+        #[cfg(unix)]
+        if let ModelFile::Mapped { ptr, len } = *self {
+            unsafe {
+                let _ = rustix::mm::munmap(ptr, len);
+            }
+        }
+    }
+}
+
+/// Map a file into memory, falling back to reading it into a byte vector
+/// (e.g. for empty files, which cannot be mapped, or on non-Unix hosts).
+///
+/// The file must not be truncated while the returned bytes are in use.
+fn read(path: &Path) -> anyhow::Result<ModelFile> {
     let mut file = File::open(path)?;
+    #[cfg(unix)]
+    {
+        let len = file.metadata()?.len() as usize;
+        if len > 0 {
+            use rustix::mm::{mmap, MapFlags, ProtFlags};
+            let mapped = unsafe {
+                mmap(
+                    std::ptr::null_mut(),
+                    len,
+                    ProtFlags::READ,
+                    MapFlags::PRIVATE,
+                    &file,
+                    0,
+                )
+            };
+            match mapped {
+                Ok(ptr) => return Ok(ModelFile::Mapped { ptr, len }),
+                Err(e) => tracing::debug!("mmap of {} failed, reading it: {}", path.display(), e),
+            }
+        }
+    }
     let mut buffer = vec![];
     file.read_to_end(&mut buffer)?;
-    Ok(buffer)
+    Ok(ModelFile::Read(buffer))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn byte_len_of_static_and_dynamic_shapes() {
+        let info = |tensor_type, dimensions: &[i64]| TensorInfo {
+            tensor_type,
+            dimensions: dimensions.to_vec(),
+        };
+        assert_eq!(info(TensorType::Fp32, &[1, 1000]).byte_len(), Some(4000));
+        assert_eq!(info(TensorType::Fp16, &[2, 3, 4]).byte_len(), Some(48));
+        assert_eq!(info(TensorType::U8, &[]).byte_len(), Some(1));
+        assert_eq!(info(TensorType::Fp32, &[-1, 1000]).byte_len(), None);
+    }
 }
@@ -1,22 +1,227 @@
 //! Implements a `wasi-nn` [`BackendInner`] using ONNX via ort.
 
-use super::{BackendError, BackendExecutionContext, BackendFromDir, BackendGraph, BackendInner};
-use crate::backend::read;
-use crate::wit::types::{ExecutionTarget, GraphEncoding, Tensor, TensorType};
+use super::{
+    set_input_from, tensor_type_size, BackendError, BackendExecutionContext, BackendFromDir,
+    BackendGraph, BackendInner, OutputTensor, SharedTensor, TensorInfo, TensorView,
+};
+use crate::backend::{read, ModelFile};
+use crate::wit::types::{ExecutionTarget, GraphEncoding, TensorType};
 use crate::{ExecutionContext, Graph};
+use anyhow::{anyhow, bail};
+use half::{bf16, f16};
+#[allow(unused_imports)]
+use ort::execution_providers::{ExecutionProvider, ExecutionProviderDispatch};
 use ort::{
     inputs,
-    session::Session,
-    session::builder::GraphOptimizationLevel,
+    memory::{AllocationDevice, AllocatorType, MemoryInfo, MemoryType},
+    session::builder::{GraphOptimizationLevel, SessionBuilder},
+    session::{InMemorySession, OutputSelector, RunOptions, Session, SessionInputValue},
+    tensor::TensorElementType,
+    value::{DynValue, ValueType},
 };
+use std::any::Any;
+use std::borrow::Cow;
 use std::path::Path;
-use std::sync::{Arc, Mutex};
+use std::sync::Arc;
 
 #[derive(Default)]
-pub struct OnnxBackend();
+pub struct OnnxBackend(OnnxOptions);
 unsafe impl Send for OnnxBackend {}
 unsafe impl Sync for OnnxBackend {}
 
+impl OnnxBackend {
+    /// Create a backend whose sessions are all built with `options`.
+    pub fn new(options: OnnxOptions) -> Self {
+        Self(options)
+    }
+
+    /// Optimize the ONNX model at `model` once, with these options and the
+    /// execution providers for `target`, and save the result as the
+    /// ORT-format model `output`. Loading that file skips the optimization,
+    /// so convert once per model and hardware profile, e.g. at deploy time:
+    /// level 3 layouts depend on the CPU's vector extensions.
+    pub fn convert(
+        &self,
+        model: &Path,
+        output: &Path,
+        target: ExecutionTarget,
+    ) -> Result<(), BackendError> {
+        let output = output
+            .to_str()
+            .ok_or_else(|| anyhow!("invalid output path: {}", output.display()))?;
+        let model = read(model)?;
+        // ORT writes the optimized graph while committing, in the ORT format
+        // for a .ort extension
+        self.builder(target)?
+            .with_optimized_model_path(output)?
+            .commit_from_memory(&model)?;
+        Ok(())
+    }
+}
+
+/// Whether `bytes` are an ORT-format model rather than an ONNX protobuf: the
+/// ORT format is a flatbuffer with the file identifier `ORTM`.
+fn is_ort_format(bytes: &[u8]) -> bool {
+    bytes.get(4..8) == Some(b"ORTM".as_slice())
+}
+
+/// How ORT runs the nodes of a graph, see [`OnnxOptions::execution_mode`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ExecutionMode {
+    /// Run one node at a time, parallelizing within nodes only.
+    Sequential,
+    /// Also run independent nodes concurrently on the inter-op thread pool.
+    Parallel,
+}
+
+/// ORT graph optimization levels, see [`OnnxOptions::optimization_level`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum OptimizationLevel {
+    Disable,
+    Level1,
+    Level2,
+    Level3,
+}
+
+/// Session options applied to every graph the ONNX backend loads.
+///
+/// The defaults match ORT's own except for the optimization level, which is
+/// the most aggressive one. `None` thread counts leave the choice to ORT,
+/// which sizes its pools from the number of cores; with many instances per
+/// node that oversubscribes, so set them explicitly there.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct OnnxOptions {
+    /// Threads used to parallelize a single node.
+    pub intra_threads: Option<usize>,
+    /// Threads used to run independent nodes in [`ExecutionMode::Parallel`].
+    pub inter_threads: Option<usize>,
+    pub execution_mode: ExecutionMode,
+    pub optimization_level: OptimizationLevel,
+    /// Pre-plan allocations from the shapes of the first run.
+    pub memory_pattern: bool,
+    /// Serve CPU allocations from ORT's growing arena instead of the plain
+    /// device allocator.
+    pub cpu_arena: bool,
+    /// Inferences run on zero inputs when a graph is loaded, so arena growth,
+    /// kernel initialization and thread pool start-up are paid before the
+    /// first real `compute` rather than inside it.
+    pub warmup_runs: usize,
+    /// Load a graph directory's ORT-format `model.ort`, when it has one, from
+    /// a read-only mapping whose initializers the session uses in place
+    /// instead of copying them to its heap. The mapped pages are the file's
+    /// page cache, so every process on a node preloading the same file shares
+    /// one copy of the weights. Prepacking is turned off for these sessions,
+    /// since it would copy every weight it rearranges into private memory.
+    pub mapped_weights: bool,
+}
+
+impl Default for OnnxOptions {
+    fn default() -> Self {
+        Self {
+            intra_threads: None,
+            inter_threads: None,
+            execution_mode: ExecutionMode::Sequential,
+            optimization_level: OptimizationLevel::Level3,
+            memory_pattern: true,
+            cpu_arena: true,
+            warmup_runs: 0,
+            mapped_weights: false,
+        }
+    }
+}
+
+impl OnnxOptions {
+    /// Build an ORT session builder configured with these options.
+    pub fn session_builder(&self) -> Result<SessionBuilder, BackendError> {
+        let level = match self.optimization_level {
+            OptimizationLevel::Disable => GraphOptimizationLevel::Disable,
+            OptimizationLevel::Level1 => GraphOptimizationLevel::Level1,
+            OptimizationLevel::Level2 => GraphOptimizationLevel::Level2,
+            OptimizationLevel::Level3 => GraphOptimizationLevel::Level3,
+        };
+        let allocator = if self.cpu_arena {
+            AllocatorType::Arena
+        } else {
+            AllocatorType::Device
+        };
+
+        let mut builder = Session::builder()?
+            .with_optimization_level(level)?
+            .with_parallel_execution(self.execution_mode == ExecutionMode::Parallel)?
+            .with_memory_pattern(self.memory_pattern)?
+            .with_allocator(MemoryInfo::new(
+                AllocationDevice::CPU,
+                0,
+                allocator,
+                MemoryType::Default,
+            )?)?;
+        if let Some(threads) = self.intra_threads {
+            builder = builder.with_intra_threads(threads)?;
+        }
+        if let Some(threads) = self.inter_threads {
+            builder = builder.with_inter_threads(threads)?;
+        }
+        Ok(builder)
+    }
+}
+
+/// The execution providers compiled in (through the `onnx-*` features) and
+/// available on this machine for `target`, in order of preference. ORT falls
+/// back to the next one, and finally to its CPU provider, for any node the
+/// preferred providers cannot run.
+fn execution_providers(target: ExecutionTarget) -> Vec<(&'static str, ExecutionProviderDispatch)> {
+    #[allow(unused_mut)]
+    let mut providers: Vec<(&'static str, ExecutionProviderDispatch)> = Vec::new();
+
+    #[allow(unused_macros)]
+    macro_rules! try_provider {
+        ($provider:expr) => {{
+            let provider = $provider;
+            match provider.is_available() {
+                Ok(true) => providers.push((provider.as_str(), provider.build())),
+                _ => tracing::debug!("{} execution provider is not available", provider.as_str()),
+            }
+        }};
+    }
+
+    match target {
+        ExecutionTarget::Cpu => {
+            #[cfg(feature = "onnx-xnnpack")]
+            try_provider!(ort::execution_providers::XNNPACKExecutionProvider::default());
+        }
+        ExecutionTarget::Gpu => {
+            #[cfg(feature = "onnx-tensorrt")]
+            try_provider!(ort::execution_providers::TensorRTExecutionProvider::default());
+            #[cfg(feature = "onnx-cuda")]
+            try_provider!(ort::execution_providers::CUDAExecutionProvider::default());
+            #[cfg(feature = "onnx-coreml")]
+            try_provider!(ort::execution_providers::CoreMLExecutionProvider::default());
+            #[cfg(feature = "onnx-openvino")]
+            try_provider!(
+                ort::execution_providers::OpenVINOExecutionProvider::default()
+                    .with_device_type("GPU")
+            );
+        }
+        ExecutionTarget::Tpu => {
+            #[cfg(feature = "onnx-openvino")]
+            try_provider!(
+                ort::execution_providers::OpenVINOExecutionProvider::default()
+                    .with_device_type("NPU")
+            );
+            #[cfg(feature = "onnx-coreml")]
+            try_provider!(ort::execution_providers::CoreMLExecutionProvider::default());
+        }
+    }
+
+    if providers.is_empty() && target != ExecutionTarget::Cpu {
+        tracing::warn!(
+            "ONNX backend: no execution provider for {:?} is available, falling back to CPU",
+            target
+        );
+    }
+    providers
+}
+
 impl BackendInner for OnnxBackend {
     fn encoding(&self) -> GraphEncoding {
         GraphEncoding::Onnx
@@ -26,19 +231,92 @@ impl BackendInner for OnnxBackend {
         if builders.len() != 1 {
             return Err(BackendError::InvalidNumberOfBuilders(1, builders.len()).into());
         }
-
-        let session = Session::builder()?
-            .with_optimization_level(GraphOptimizationLevel::Level3)?
+        let session = self
+            .builder_for(builders[0], target)?
             .commit_from_memory(builders[0])?;
-
-        let box_: Box<dyn BackendGraph> =
-            Box::new(ONNXGraph(Arc::new(Mutex::new(session)), target));
-        Ok(box_.into())
+        self.graph(GraphSession::Owned(session))
     }
 
     fn as_dir_loadable<'a>(&'a mut self) -> Option<&'a mut dyn BackendFromDir> {
         Some(self)
     }
+
+    fn config_fingerprint(&self) -> String {
+        format!("{:?}", self.0)
+    }
+}
+
+impl OnnxBackend {
+    /// A session builder with the options and the execution providers for
+    /// `target`.
+    fn builder(&self, target: ExecutionTarget) -> Result<SessionBuilder, BackendError> {
+        let mut builder = self.0.session_builder()?;
+        let providers = execution_providers(target);
+        match providers.first() {
+            Some((name, _)) => tracing::info!("ONNX backend: {:?} target runs on {}", target, name),
+            None => tracing::info!("ONNX backend: {:?} target runs on the CPU provider", target),
+        }
+        if !providers.is_empty() {
+            builder = builder
+                .with_execution_providers(providers.into_iter().map(|(_, provider)| provider))?;
+        }
+        Ok(builder)
+    }
+
+    /// A session builder for `model`: an ORT-format model was optimized when
+    /// it was converted, so optimizing it again is skipped.
+    fn builder_for(
+        &self,
+        model: &[u8],
+        target: ExecutionTarget,
+    ) -> Result<SessionBuilder, BackendError> {
+        let builder = self.builder(target)?;
+        if is_ort_format(model) {
+            Ok(builder.with_optimization_level(GraphOptimizationLevel::Disable)?)
+        } else {
+            Ok(builder)
+        }
+    }
+
+    /// Wrap a committed session in a graph, warming it up first if asked.
+    fn graph(&self, session: GraphSession) -> Result<Graph, BackendError> {
+        let graph = ONNXGraph(Arc::new(session));
+        if self.0.warmup_runs > 0 {
+            let start = std::time::Instant::now();
+            graph.warm_up(self.0.warmup_runs)?;
+            tracing::info!(
+                "ONNX backend: {} warmup runs took {:?}",
+                self.0.warmup_runs,
+                start.elapsed()
+            );
+        }
+        let box_: Box<dyn BackendGraph> = Box::new(graph);
+        Ok(box_.into())
+    }
+
+    /// Build a session on the mapped ORT-format model at `path`, see
+    /// [`OnnxOptions::mapped_weights`].
+    fn load_mapped(&self, path: &Path, target: ExecutionTarget) -> Result<Graph, BackendError> {
+        let model = read(path)?;
+        let session = self
+            .builder_for(&model, target)?
+            .with_prepacking(false)?
+            .commit_from_memory_directly(&model)?;
+        // SAFETY: the session borrows the mapping, which is stored next to it
+        // and dropped after it; moving `model` does not move the mapped bytes.
+        let session = unsafe {
+            std::mem::transmute::<InMemorySession<'_>, InMemorySession<'static>>(session)
+        };
+        tracing::info!(
+            "ONNX backend: {} mapped, its {} bytes used in place",
+            path.display(),
+            model.len()
+        );
+        self.graph(GraphSession::Mapped {
+            session,
+            _model: model,
+        })
+    }
 }
 
 impl BackendFromDir for OnnxBackend {
@@ -47,86 +325,533 @@ impl BackendFromDir for OnnxBackend {
         path: &Path,
         target: ExecutionTarget,
     ) -> Result<Graph, BackendError> {
+        // A converted model.ort is preferred over the model.onnx it came from
+        let converted = path.join("model.ort");
+        if converted.is_file() {
+            if self.0.mapped_weights {
+                return self.load_mapped(&converted, target);
+            }
+            let model = read(&converted)?;
+            return self.load(&[&*model], target);
+        }
+        if self.0.mapped_weights {
+            tracing::warn!(
+                "ONNX backend: no model.ort in {}, loading model.onnx with private weights",
+                path.display()
+            );
+        }
         let model = read(&path.join("model.onnx"))?;
-        self.load(&[&model], target)
+        self.load(&[&*model], target)
+    }
+}
+
+/// A session, either owning its model or using a mapped ORT-format model in
+/// place.
+enum GraphSession {
+    Owned(Session),
+    Mapped {
+        // Declared before the mapping, so it is dropped first
+        session: InMemorySession<'static>,
+        _model: ModelFile,
+    },
+}
+
+impl std::ops::Deref for GraphSession {
+    type Target = Session;
+    fn deref(&self) -> &Session {
+        match self {
+            GraphSession::Owned(session) => session,
+            GraphSession::Mapped { session, .. } => session,
+        }
     }
 }
 
-struct ONNXGraph(Arc<Mutex<Session>>, #[allow(dead_code)] ExecutionTarget);
+/// ORT sessions support concurrent `Run` calls, so every execution context
+/// of a graph shares the session without a lock and contexts on different
+/// threads run inference in parallel. The execution target is only needed
+/// to pick the session's providers, see [`OnnxBackend::builder`].
+struct ONNXGraph(Arc<GraphSession>);
 
 unsafe impl Send for ONNXGraph {}
 unsafe impl Sync for ONNXGraph {}
 
+impl ONNXGraph {
+    /// Run the session `runs` times on zero inputs shaped from its metadata,
+    /// with dynamic dimensions set to 1.
+    fn warm_up(&self, runs: usize) -> Result<(), BackendError> {
+        let mut context = self.init_execution_context()?;
+        for (index, input) in self.0.inputs.iter().enumerate() {
+            let info = declared_info(&input.input_type)
+                .ok_or_else(|| anyhow!("input {}: only tensor inputs can be warmed up", index))?;
+            let dimensions = info
+                .dimensions
+                .iter()
+                .map(|&d| d.max(1) as u32)
+                .collect::<Vec<_>>();
+            let len = dimensions.iter().map(|&d| d as usize).product::<usize>();
+            let data = vec![0; len * tensor_type_size(info.tensor_type)];
+            let tensor = TensorView {
+                dimensions: &dimensions,
+                tensor_type: info.tensor_type,
+                data: &data,
+            };
+            context.set_input(index as u32, &tensor)?;
+        }
+        for _ in 0..runs {
+            context.compute()?;
+        }
+        Ok(())
+    }
+}
+
 impl BackendGraph for ONNXGraph {
     fn init_execution_context(&self) -> Result<ExecutionContext, BackendError> {
-        let session = self.0.lock().unwrap();
+        let session = &self.0;
         let inputs = session.inputs.iter().map(|_| None).collect::<Vec<_>>();
-        let outputs = session.outputs.iter().map(|_| None).collect::<Vec<_>>();
+        let output_dimensions = session.outputs.iter().map(|_| Vec::new()).collect();
         let box_: Box<dyn BackendExecutionContext> = Box::new(ONNXExecutionContext {
             session: self.0.clone(),
+            bound: session.inputs.iter().map(|_| None).collect(),
             inputs,
-            outputs,
+            output_dimensions,
+            values: session.outputs.iter().map(|_| None).collect(),
+            selected: None,
+            computed: false,
         });
         Ok(box_.into())
     }
 }
 
 struct ONNXExecutionContext {
-    session: Arc<Mutex<Session>>,
-    inputs: Vec<Option<Tensor>>,
-    outputs: Vec<Option<Vec<u8>>>,
+    session: Arc<GraphSession>,
+    inputs: Vec<Option<ONNXInput>>,
+    /// Outputs of other contexts bound as inputs, which take the place of
+    /// the `inputs` buffer of their index.
+    bound: Vec<Option<Arc<OnnxTensor>>>,
+    /// The shape of every output of the last `compute`.
+    output_dimensions: Vec<Vec<i64>>,
+    /// The ORT values of the outputs of the last `compute`. `get_output`
+    /// copies straight out of them and `output_bytes` borrows them, so an
+    /// output lives in ORT's buffer only and is never copied up front.
+    values: Vec<Option<Arc<OnnxTensor>>>,
+    /// The outputs `compute` asks ORT for, by index; `None` for all of them.
+    selected: Option<Vec<bool>>,
+    computed: bool,
+}
+
+impl ONNXExecutionContext {
+    /// Whether the last `compute` produced output `index`.
+    fn fetched(&self, index: usize) -> bool {
+        let selected = match &self.selected {
+            Some(selected) => selected.get(index).copied().unwrap_or(false),
+            None => index < self.values.len(),
+        };
+        self.computed && selected
+    }
+
+    /// Check a tensor of `tensor_type` and `dimensions` against input `index`
+    /// of the model.
+    fn check_input(
+        &self,
+        index: u32,
+        tensor_type: TensorType,
+        dimensions: &[i64],
+    ) -> Result<(), BackendError> {
+        let input = self
+            .session
+            .inputs
+            .get(index as usize)
+            .ok_or_else(|| anyhow!("invalid input index: {}", index))?;
+        // Dynamic dimensions (e.g. the batch size) accept any extent, static
+        // ones must match the model.
+        check_dimensions(&input.input_type, dimensions)
+            .map_err(|e| anyhow!("input {}: {}", index, e))?;
+        if let Some(expected) = tensor_type_of(&input.input_type) {
+            if expected != tensor_type {
+                return Err(BackendError::BackendAccess(anyhow!(
+                    "input {}: the model expects {:?}, passed {:?}",
+                    index,
+                    expected,
+                    tensor_type
+                )));
+            }
+        }
+        Ok(())
+    }
+}
+
+/// An output of a `compute` in the value ORT returned it as, so that binding
+/// it to an input of another ONNX context passes ORT the same memory.
+struct OnnxTensor {
+    info: TensorInfo,
+    value: DynValue,
+}
+
+unsafe impl Send for OnnxTensor {}
+unsafe impl Sync for OnnxTensor {}
+
+impl OutputTensor for OnnxTensor {
+    fn info(&self) -> &TensorInfo {
+        &self.info
+    }
+
+    fn data(&self) -> Result<Cow<'_, [u8]>, BackendError> {
+        macro_rules! data {
+            ($element:ty) => {{
+                let (_, data) = self.value.try_extract_raw_tensor::<$element>()?;
+                le_bytes(data)
+            }};
+        }
+        Ok(match self.info.tensor_type {
+            TensorType::Fp16 => data!(f16),
+            TensorType::Bf16 => data!(bf16),
+            TensorType::Fp32 => data!(f32),
+            TensorType::Fp64 => data!(f64),
+            TensorType::U8 => data!(u8),
+            TensorType::I32 => data!(i32),
+            TensorType::I64 => data!(i64),
+        })
+    }
+
+    fn into_any(self: Arc<Self>) -> Arc<dyn Any + Send + Sync> {
+        self
+    }
+}
+
+/// An input tensor in the form ort consumes it. The buffer is kept between
+/// calls: `set_input` overwrites it in place when the shape and type are
+/// unchanged and `compute` only hands ort another reference to it.
+struct ONNXInput {
+    dimensions: Vec<i64>,
+    data: InputData,
+}
+
+/// Input elements in their native type, so that half-precision, quantized
+/// and integer models are fed without a detour through f32.
+enum InputData {
+    Fp16(Arc<Box<[f16]>>),
+    Bf16(Arc<Box<[bf16]>>),
+    Fp32(Arc<Box<[f32]>>),
+    Fp64(Arc<Box<[f64]>>),
+    U8(Arc<Box<[u8]>>),
+    I32(Arc<Box<[i32]>>),
+    I64(Arc<Box<[i64]>>),
+}
+
+/// Evaluate `$body` with `$data` bound to the buffer of any [InputData]
+/// variant.
+macro_rules! with_input_data {
+    ($input:expr, $data:ident => $body:expr) => {
+        match $input {
+            InputData::Fp16($data) => $body,
+            InputData::Bf16($data) => $body,
+            InputData::Fp32($data) => $body,
+            InputData::Fp64($data) => $body,
+            InputData::U8($data) => $body,
+            InputData::I32($data) => $body,
+            InputData::I64($data) => $body,
+        }
+    };
+}
+
+impl InputData {
+    /// Decode `len` little-endian elements of `tensor_type` from `bytes`.
+    fn new(tensor_type: TensorType, bytes: &[u8], len: usize) -> Self {
+        fn decode<T: Copy + Default>(bytes: &[u8], len: usize) -> Arc<Box<[T]>> {
+            let mut data = vec![T::default(); len].into_boxed_slice();
+            copy_le_bytes(bytes, &mut data);
+            Arc::new(data)
+        }
+        match tensor_type {
+            TensorType::Fp16 => InputData::Fp16(decode(bytes, len)),
+            TensorType::Bf16 => InputData::Bf16(decode(bytes, len)),
+            TensorType::Fp32 => InputData::Fp32(decode(bytes, len)),
+            TensorType::Fp64 => InputData::Fp64(decode(bytes, len)),
+            TensorType::U8 => InputData::U8(decode(bytes, len)),
+            TensorType::I32 => InputData::I32(decode(bytes, len)),
+            TensorType::I64 => InputData::I64(decode(bytes, len)),
+        }
+    }
+
+    fn tensor_type(&self) -> TensorType {
+        match self {
+            InputData::Fp16(_) => TensorType::Fp16,
+            InputData::Bf16(_) => TensorType::Bf16,
+            InputData::Fp32(_) => TensorType::Fp32,
+            InputData::Fp64(_) => TensorType::Fp64,
+            InputData::U8(_) => TensorType::U8,
+            InputData::I32(_) => TensorType::I32,
+            InputData::I64(_) => TensorType::I64,
+        }
+    }
+
+    fn len(&self) -> usize {
+        with_input_data!(self, data => data.len())
+    }
+
+    /// Overwrite the buffer with `bytes` if ort no longer holds a reference
+    /// to it; returns whether it did.
+    fn overwrite(&mut self, bytes: &[u8]) -> bool {
+        with_input_data!(self, data => match Arc::get_mut(data) {
+            Some(data) => {
+                copy_le_bytes(bytes, data);
+                true
+            }
+            None => false,
+        })
+    }
 }
 
 unsafe impl Send for ONNXExecutionContext {}
 unsafe impl Sync for ONNXExecutionContext {}
 
 impl BackendExecutionContext for ONNXExecutionContext {
-    fn set_input(&mut self, index: u32, tensor: &Tensor) -> Result<(), BackendError> {
-        self.inputs[index as usize].replace(tensor.clone());
+    fn set_input(&mut self, index: u32, tensor: &TensorView<'_>) -> Result<(), BackendError> {
+        let dimensions = tensor.dimensions.iter().map(|d| *d as i64).collect::<Vec<_>>();
+        self.check_input(index, tensor.tensor_type, &dimensions)?;
+        // The dimensions come from the guest, so their product may overflow
+        let len = tensor
+            .dimensions
+            .iter()
+            .try_fold(1usize, |len, &d| len.checked_mul(d as usize));
+        let byte_len = len.and_then(|len| len.checked_mul(tensor_type_size(tensor.tensor_type)));
+        let (Some(len), Some(byte_len)) = (len, byte_len) else {
+            return Err(BackendError::BackendAccess(anyhow!(
+                "input {}: dimensions {:?} overflow the tensor size",
+                index,
+                tensor.dimensions
+            )));
+        };
+        if tensor.data.len() != byte_len {
+            return Err(BackendError::BackendAccess(anyhow!(
+                "input {}: {} bytes of {:?} data do not match dimensions {:?}",
+                index,
+                tensor.data.len(),
+                tensor.tensor_type,
+                tensor.dimensions
+            )));
+        }
+
+        self.bound[index as usize] = None;
+        let slot = &mut self.inputs[index as usize];
+        // Reuse the previous buffer if ort no longer holds a reference to it.
+        if let Some(input) = slot.as_mut() {
+            if input.data.tensor_type() == tensor.tensor_type
+                && input.data.len() == len
+                && input.data.overwrite(tensor.data)
+            {
+                input.dimensions = dimensions;
+                return Ok(());
+            }
+        }
+
+        slot.replace(ONNXInput {
+            dimensions,
+            data: InputData::new(tensor.tensor_type, tensor.data, len),
+        });
         Ok(())
     }
 
     fn compute(&mut self) -> Result<(), BackendError> {
-        let shaped_inputs: Vec<_> = self
-            .inputs
-            .iter()
-            .enumerate()
-            .map(|(i, _o)| {
-                let input = self.inputs[i].as_ref().unwrap();
-                let dims = input
-                    .dimensions
-                    .as_slice()
-                    .iter()
-                    .map(|d| *d as i64)
-                    .collect::<Vec<_>>();
-                match input.tensor_type {
-                    TensorType::Fp32 => {
-                        let data = bytes_to_f32_vec(input.data.to_vec());
-                        inputs![(dims, Arc::new(data.into_boxed_slice()))].unwrap()
-                    }
-                    _ => {
-                        unimplemented!("{:?} not supported by ONNX", input.tensor_type);
+        let mut shaped_inputs = Vec::with_capacity(self.inputs.len());
+        for (i, (input, bound)) in self.inputs.iter().zip(&self.bound).enumerate() {
+            if let Some(bound) = bound {
+                shaped_inputs.push(SessionInputValue::from(bound.value.view()));
+                continue;
+            }
+            let input = input
+                .as_ref()
+                .ok_or_else(|| anyhow!("input {} has not been set", i))?;
+            let dimensions = input.dimensions.clone();
+            let value = with_input_data!(&input.data, data => inputs![(dimensions, data.clone())]?);
+            shaped_inputs.extend(value);
+        }
+
+        // With a selection ORT only computes and allocates the outputs asked
+        // for; the run options naming them cost one small allocation a run.
+        let options = match &self.selected {
+            Some(selected) => {
+                let mut selector = OutputSelector::no_default();
+                for (output, &wanted) in self.session.outputs.iter().zip(selected) {
+                    if wanted {
+                        selector = selector.with(output.name.as_str());
                     }
                 }
-            })
-            .flatten()
-            .collect();
-
-        let session = self.session.lock().unwrap();
-        let res = session.run(shaped_inputs.as_slice())?;
+                Some(RunOptions::new()?.with_outputs(selector))
+            }
+            None => None,
+        };
+        let mut res = match &options {
+            Some(options) => self
+                .session
+                .run_with_options(shaped_inputs.as_slice(), options)?,
+            None => self.session.run(shaped_inputs.as_slice())?,
+        };
 
-        for i in 0..self.outputs.len() {
-            let (_shape, f32s) = res[i].try_extract_raw_tensor::<f32>()?;
-            self.outputs[i].replace(f32_vec_to_bytes(f32s.to_vec()));
+        for i in 0..self.values.len() {
+            if let Some(selected) = &self.selected {
+                if !selected[i] {
+                    self.output_dimensions[i].clear();
+                    self.values[i] = None;
+                    continue;
+                }
+            }
+            let value = res
+                .remove(self.session.outputs[i].name.as_str())
+                .ok_or_else(|| anyhow!("output {} is missing from the results", i))?;
+            // Check the element type and yield the shape; the data stays put
+            macro_rules! extract {
+                ($element:ty) => {{
+                    let (shape, _) = value.try_extract_raw_tensor::<$element>()?;
+                    shape
+                }};
+            }
+            let shape = match &self.session.outputs[i].output_type {
+                ValueType::Tensor { ty, .. } => match ty {
+                    TensorElementType::Float16 => extract!(f16),
+                    TensorElementType::Bfloat16 => extract!(bf16),
+                    TensorElementType::Float32 => extract!(f32),
+                    TensorElementType::Float64 => extract!(f64),
+                    TensorElementType::Uint8 => extract!(u8),
+                    TensorElementType::Int32 => extract!(i32),
+                    TensorElementType::Int64 => extract!(i64),
+                    other => {
+                        return Err(BackendError::BackendAccess(anyhow!(
+                            "output {}: {:?} not supported by ONNX",
+                            i,
+                            other
+                        )))
+                    }
+                },
+                other => {
+                    return Err(BackendError::BackendAccess(anyhow!(
+                        "output {}: {:?} is not a tensor",
+                        i,
+                        other
+                    )))
+                }
+            };
+            self.values[i] =
+                tensor_type_of(&self.session.outputs[i].output_type).map(|tensor_type| {
+                    Arc::new(OnnxTensor {
+                        info: TensorInfo {
+                            tensor_type,
+                            dimensions: shape.clone(),
+                        },
+                        value,
+                    })
+                });
+            self.output_dimensions[i] = shape;
         }
+        self.computed = true;
         Ok(())
     }
 
     fn get_output(&mut self, index: u32, destination: &mut [u8]) -> Result<u32, BackendError> {
-        let output = self.outputs[index as usize].as_ref().unwrap();
-        destination[..output.len()].copy_from_slice(output);
+        if !self.computed {
+            return Err(BackendError::BackendAccess(anyhow!(
+                "compute has not been called"
+            )));
+        }
+        let value = self
+            .values
+            .get(index as usize)
+            .ok_or_else(|| anyhow!("invalid output index: {}", index))?;
+        if !self.fetched(index as usize) {
+            return Err(BackendError::BackendAccess(anyhow!(
+                "output {} is not among the selected outputs",
+                index
+            )));
+        }
+        let output = value
+            .as_ref()
+            .ok_or_else(|| anyhow!("output {} has no wasi-nn tensor type", index))?
+            .data()?;
+        if output.len() > destination.len() {
+            return Err(BackendError::NotEnoughMemory(output.len()));
+        }
+        destination[..output.len()].copy_from_slice(&output);
         Ok(output.len() as u32)
     }
+
+    fn input_info(&self, index: u32) -> Option<TensorInfo> {
+        declared_info(&self.session.inputs.get(index as usize)?.input_type)
+    }
+
+    fn output_info(&self, index: u32) -> Option<TensorInfo> {
+        let mut info = declared_info(&self.session.outputs.get(index as usize)?.output_type)?;
+        if self.fetched(index as usize) {
+            info.dimensions = self.output_dimensions[index as usize].clone();
+        }
+        Some(info)
+    }
+
+    fn output_bytes(&self, index: u32) -> Option<&[u8]> {
+        if !self.fetched(index as usize) {
+            return None;
+        }
+        // Only a borrow of ORT's buffer will do; on big-endian hosts, where
+        // the bytes need swapping, callers fall back to `get_output`.
+        match self.values.get(index as usize)?.as_ref()?.data().ok()? {
+            Cow::Borrowed(bytes) => Some(bytes),
+            Cow::Owned(_) => None,
+        }
+    }
+
+    fn input_name(&self, index: u32) -> Option<String> {
+        Some(self.session.inputs.get(index as usize)?.name.clone())
+    }
+
+    fn output_name(&self, index: u32) -> Option<String> {
+        Some(self.session.outputs.get(index as usize)?.name.clone())
+    }
+
+    fn select_outputs(&mut self, indices: &[u32]) -> Result<(), BackendError> {
+        if indices.is_empty() {
+            self.selected = None;
+            return Ok(());
+        }
+        let mut selected = vec![false; self.session.outputs.len()];
+        for &index in indices {
+            *selected
+                .get_mut(index as usize)
+                .ok_or_else(|| anyhow!("invalid output index: {}", index))? = true;
+        }
+        self.selected = Some(selected);
+        Ok(())
+    }
+
+    fn output_tensor(&mut self, index: u32) -> Result<Option<SharedTensor>, BackendError> {
+        if !self.fetched(index as usize) {
+            return Ok(None);
+        }
+        Ok(self.values[index as usize]
+            .clone()
+            .map(|tensor| tensor as SharedTensor))
+    }
+
+    fn bind_input(&mut self, index: u32, tensor: &SharedTensor) -> Result<(), BackendError> {
+        // Another backend's tensor is copied in; an ONNX one is used as is
+        let onnx = match tensor.clone().into_any().downcast::<OnnxTensor>() {
+            Ok(onnx) => onnx,
+            Err(_) => return set_input_from(self, index, tensor.as_ref()),
+        };
+        self.check_input(index, onnx.info.tensor_type, &onnx.info.dimensions)?;
+        self.bound[index as usize] = Some(onnx);
+        Ok(())
+    }
+}
+
+/// The type and shape a model declares for a value; ORT marks dynamic
+/// dimensions with -1.
+fn declared_info(value_type: &ValueType) -> Option<TensorInfo> {
+    match value_type {
+        ValueType::Tensor { dimensions, .. } => Some(TensorInfo {
+            tensor_type: tensor_type_of(value_type)?,
+            dimensions: dimensions.clone(),
+        }),
+        _ => None,
+    }
 }
 
 impl From<ort::Error> for BackendError {
@@ -136,17 +861,106 @@ impl From<ort::Error> for BackendError {
 }
 
 pub fn f32_vec_to_bytes(data: Vec<f32>) -> Vec<u8> {
-    let chunks: Vec<[u8; 4]> = data.into_iter().map(|f| f.to_le_bytes()).collect();
-    let result: Vec<u8> = chunks.iter().flatten().copied().collect();
+    let mut result = Vec::with_capacity(data.len() * 4);
+    extend_with_le_bytes(&data, &mut result);
     result
 }
 
+/// The wasi-nn type of an ort element type, if wasi-nn has one.
+fn tensor_type_of(value_type: &ValueType) -> Option<TensorType> {
+    match value_type {
+        ValueType::Tensor { ty, .. } => match ty {
+            TensorElementType::Float16 => Some(TensorType::Fp16),
+            TensorElementType::Bfloat16 => Some(TensorType::Bf16),
+            TensorElementType::Float32 => Some(TensorType::Fp32),
+            TensorElementType::Float64 => Some(TensorType::Fp64),
+            TensorElementType::Uint8 => Some(TensorType::U8),
+            TensorElementType::Int32 => Some(TensorType::I32),
+            TensorElementType::Int64 => Some(TensorType::I64),
+            _ => None,
+        },
+        _ => None,
+    }
+}
+
+/// Append `source` to `destination` as little-endian bytes; on little-endian
+/// hosts this is a single `memcpy`.
+fn extend_with_le_bytes<T: Copy>(source: &[T], destination: &mut Vec<u8>) {
+    let size = std::mem::size_of::<T>();
+    let bytes = unsafe {
+        std::slice::from_raw_parts(source.as_ptr() as *const u8, source.len() * size)
+    };
+    #[cfg(target_endian = "little")]
+    destination.extend_from_slice(bytes);
+    #[cfg(target_endian = "big")]
+    for element in bytes.chunks_exact(size) {
+        destination.extend(element.iter().rev());
+    }
+}
+
+/// `source` as little-endian bytes, borrowed on little-endian hosts.
+fn le_bytes<T: Copy>(source: &[T]) -> Cow<'_, [u8]> {
+    #[cfg(target_endian = "little")]
+    {
+        Cow::Borrowed(unsafe {
+            std::slice::from_raw_parts(source.as_ptr() as *const u8, std::mem::size_of_val(source))
+        })
+    }
+    #[cfg(target_endian = "big")]
+    {
+        let mut bytes = Vec::new();
+        extend_with_le_bytes(source, &mut bytes);
+        Cow::Owned(bytes)
+    }
+}
+
+/// Check `dimensions` against the model's declared shape, where non-positive
+/// extents mark dynamic dimensions that accept any size.
+fn check_dimensions(value_type: &ValueType, dimensions: &[i64]) -> anyhow::Result<()> {
+    if let ValueType::Tensor {
+        dimensions: expected,
+        ..
+    } = value_type
+    {
+        if expected.len() != dimensions.len() {
+            bail!("expected {} dimensions, got {:?}", expected.len(), dimensions);
+        }
+        for (axis, (&expected, &actual)) in expected.iter().zip(dimensions).enumerate() {
+            if expected > 0 && expected != actual {
+                bail!(
+                    "dimension {} is {}, the model expects {} (shape {:?})",
+                    axis,
+                    actual,
+                    expected,
+                    dimensions
+                );
+            }
+        }
+    }
+    Ok(())
+}
+
 pub fn bytes_to_f32_vec(data: Vec<u8>) -> Vec<f32> {
-    let chunks: Vec<&[u8]> = data.chunks(4).collect();
-    let v: Vec<f32> = chunks
-        .into_iter()
-        .map(|c| f32::from_le_bytes(c.try_into().unwrap()))
-        .collect();
+    let mut v = vec![0.0; data.len() / 4];
+    copy_le_bytes(&data, &mut v);
+    v
+}
 
-    v.into_iter().collect()
+/// Decode little-endian elements from `source` into `destination`; on
+/// little-endian hosts this is a single `memcpy`. Trailing bytes that do not
+/// form a whole element are ignored.
+fn copy_le_bytes<T: Copy>(source: &[u8], destination: &mut [T]) {
+    let size = std::mem::size_of::<T>();
+    let len = destination.len().min(source.len() / size);
+    let bytes = unsafe {
+        std::slice::from_raw_parts_mut(destination.as_mut_ptr() as *mut u8, len * size)
+    };
+    #[cfg(target_endian = "little")]
+    bytes.copy_from_slice(&source[..len * size]);
+    #[cfg(target_endian = "big")]
+    for (d, c) in bytes.chunks_exact_mut(size).zip(source.chunks_exact(size)) {
+        for (d, c) in d.iter_mut().zip(c.iter().rev()) {
+            *d = *c;
+        }
+    }
 }
@@ -2,18 +2,55 @@
 
 use super::{
     read, BackendError, BackendExecutionContext, BackendFromDir, BackendGraph, BackendInner,
+    TensorView,
 };
-use crate::wit::types::{ExecutionTarget, GraphEncoding, Tensor, TensorType};
+use crate::wit::types::{ExecutionTarget, GraphEncoding, TensorType};
 use crate::{ExecutionContext, Graph};
 use openvino::{InferenceError, Layout, Precision, SetupError, TensorDesc};
-use std::path::Path;
+use std::cell::UnsafeCell;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::{Arc, Mutex};
 
+/// Configuration applied to every graph an [`OpenvinoBackend`] loads.
+///
+/// The `openvino` bindings load networks with an empty configuration, so
+/// plugin properties such as `NUM_STREAMS` or `PERFORMANCE_HINT` can only
+/// reach OpenVINO through the plugins file the core is created from, e.g.
+/// `<property key="PERFORMANCE_HINT" value="THROUGHPUT"/>` under the CPU
+/// plugin. Size `infer_requests` to the streams that file asks for, so each
+/// stream has a request ready.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct OpenvinoOptions {
+    /// Infer requests created with each graph and handed to its execution
+    /// contexts without locking the network; contexts beyond these create
+    /// their own under the lock.
+    pub infer_requests: usize,
+    /// The plugins XML file to create the OpenVINO core from, instead of the
+    /// one installed next to the libraries.
+    pub config_file: Option<PathBuf>,
+}
+
+impl Default for OpenvinoOptions {
+    fn default() -> Self {
+        Self {
+            infer_requests: 1,
+            config_file: None,
+        }
+    }
+}
+
 #[derive(Default)]
-pub struct OpenvinoBackend(Option<openvino::Core>);
+pub struct OpenvinoBackend(Option<openvino::Core>, OpenvinoOptions);
 unsafe impl Send for OpenvinoBackend {}
 unsafe impl Sync for OpenvinoBackend {}
 
+impl OpenvinoBackend {
+    pub fn new(options: OpenvinoOptions) -> Self {
+        Self(None, options)
+    }
+}
+
 impl BackendInner for OpenvinoBackend {
     fn encoding(&self) -> GraphEncoding {
         GraphEncoding::Openvino
@@ -29,7 +66,16 @@ impl BackendInner for OpenvinoBackend {
         // the OpenVINO libraries. The laziness limits the extent of the error
         // only to wasi-nn users, not all WASI users.
         if self.0.is_none() {
-            self.0.replace(openvino::Core::new(None)?);
+            let config_file = match &self.1.config_file {
+                Some(path) => Some(path.to_str().ok_or_else(|| {
+                    BackendError::BackendAccess(anyhow::anyhow!(
+                        "invalid OpenVINO config path: {}",
+                        path.display()
+                    ))
+                })?),
+                None => None,
+            };
+            self.0.replace(openvino::Core::new(config_file)?);
         }
 
         // Read the guest array.
@@ -52,18 +98,24 @@ impl BackendInner for OpenvinoBackend {
             cnn_network.set_input_layout(&name, Layout::NHWC)?;
         }
 
-        let exec_network =
+        let mut exec_network =
             core.load_network(&cnn_network, map_execution_target_to_string(target))?;
-        let box_: Box<dyn BackendGraph> = Box::new(OpenvinoGraph(
-            Arc::new(cnn_network),
-            Arc::new(Mutex::new(exec_network)),
-        ));
+        let requests = RequestPool::new(&mut exec_network, self.1.infer_requests)?;
+        let box_: Box<dyn BackendGraph> = Box::new(OpenvinoGraph {
+            network: Arc::new(cnn_network),
+            exec_network: Arc::new(Mutex::new(exec_network)),
+            requests: Arc::new(requests),
+        });
         Ok(box_.into())
     }
 
     fn as_dir_loadable(&mut self) -> Option<&mut dyn BackendFromDir> {
         Some(self)
     }
+
+    fn config_fingerprint(&self) -> String {
+        format!("{:?}", self.1)
+    }
 }
 
 impl BackendFromDir for OpenvinoBackend {
@@ -74,33 +126,110 @@ impl BackendFromDir for OpenvinoBackend {
     ) -> Result<Graph, BackendError> {
         let model = read(&path.join("model.xml"))?;
         let weights = read(&path.join("model.bin"))?;
-        self.load(&[&model, &weights], target)
+        self.load(&[&*model, &*weights], target)
     }
 }
 
-struct OpenvinoGraph(
-    Arc<openvino::CNNNetwork>,
-    Arc<Mutex<openvino::ExecutableNetwork>>,
-);
+struct OpenvinoGraph {
+    network: Arc<openvino::CNNNetwork>,
+    exec_network: Arc<Mutex<openvino::ExecutableNetwork>>,
+    requests: Arc<RequestPool>,
+}
 
 unsafe impl Send for OpenvinoGraph {}
 unsafe impl Sync for OpenvinoGraph {}
 
 impl BackendGraph for OpenvinoGraph {
     fn init_execution_context(&self) -> Result<ExecutionContext, BackendError> {
-        let mut network = self.1.lock().unwrap();
-        let infer_request = network.create_infer_request()?;
-        let box_: Box<dyn BackendExecutionContext> =
-            Box::new(OpenvinoExecutionContext(self.0.clone(), infer_request));
+        let (request, slot) = match self.requests.take() {
+            Some((slot, request)) => (request, Some((self.requests.clone(), slot))),
+            None => {
+                let mut network = self.exec_network.lock().unwrap();
+                (network.create_infer_request()?, None)
+            }
+        };
+        let box_: Box<dyn BackendExecutionContext> = Box::new(OpenvinoExecutionContext {
+            network: self.network.clone(),
+            request: Some(request),
+            slot,
+        });
         Ok(box_.into())
     }
 }
 
-struct OpenvinoExecutionContext(Arc<openvino::CNNNetwork>, openvino::InferRequest);
+/// The infer requests created with a graph. A context claims a free slot with
+/// a single compare-and-swap on its `busy` flag and puts the request back when
+/// it is dropped, so contexts on the same graph never wait for each other (or
+/// for the network's lock) to start.
+struct RequestPool {
+    slots: Vec<RequestSlot>,
+}
+
+struct RequestSlot {
+    busy: AtomicBool,
+    request: UnsafeCell<Option<openvino::InferRequest>>,
+}
+
+// SAFETY: a slot's request is only touched by whoever set its `busy` flag.
+unsafe impl Send for RequestPool {}
+unsafe impl Sync for RequestPool {}
+
+impl RequestPool {
+    fn new(network: &mut openvino::ExecutableNetwork, size: usize) -> Result<Self, BackendError> {
+        let mut slots = Vec::with_capacity(size);
+        for _ in 0..size {
+            slots.push(RequestSlot {
+                busy: AtomicBool::new(false),
+                request: UnsafeCell::new(Some(network.create_infer_request()?)),
+            });
+        }
+        Ok(Self { slots })
+    }
+
+    /// Claim a free request, with the index of the slot it goes back to.
+    fn take(&self) -> Option<(usize, openvino::InferRequest)> {
+        self.slots.iter().enumerate().find_map(|(index, slot)| {
+            slot.busy
+                .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .ok()?;
+            let request = unsafe { (*slot.request.get()).take() };
+            Some((index, request.expect("an idle slot holds its request")))
+        })
+    }
+
+    fn give_back(&self, index: usize, request: openvino::InferRequest) {
+        let slot = &self.slots[index];
+        unsafe { *slot.request.get() = Some(request) };
+        slot.busy.store(false, Ordering::Release);
+    }
+}
+
+struct OpenvinoExecutionContext {
+    network: Arc<openvino::CNNNetwork>,
+    request: Option<openvino::InferRequest>,
+    /// The pool slot `request` came from, if any.
+    slot: Option<(Arc<RequestPool>, usize)>,
+}
+
+impl OpenvinoExecutionContext {
+    fn request(&mut self) -> &mut openvino::InferRequest {
+        self.request
+            .as_mut()
+            .expect("the request is only taken when dropped")
+    }
+}
+
+impl Drop for OpenvinoExecutionContext {
+    fn drop(&mut self) {
+        if let (Some((pool, index)), Some(request)) = (self.slot.take(), self.request.take()) {
+            pool.give_back(index, request);
+        }
+    }
+}
 
 impl BackendExecutionContext for OpenvinoExecutionContext {
-    fn set_input(&mut self, index: u32, tensor: &Tensor) -> Result<(), BackendError> {
-        let input_name = self.0.get_input_name(index as usize)?;
+    fn set_input(&mut self, index: u32, tensor: &TensorView<'_>) -> Result<(), BackendError> {
+        let input_name = self.network.get_input_name(index as usize)?;
 
         // Construct the blob structure. TODO: there must be some good way to
         // discover the layout here; `desc` should not have to default to NHWC.
@@ -111,21 +240,21 @@ impl BackendExecutionContext for OpenvinoExecutionContext {
             .map(|&d| d as usize)
             .collect::<Vec<_>>();
         let desc = TensorDesc::new(Layout::NHWC, &dimensions, precision);
-        let blob = openvino::Blob::new(&desc, &tensor.data)?;
+        let blob = openvino::Blob::new(&desc, tensor.data)?;
 
         // Actually assign the blob to the request.
-        self.1.set_blob(&input_name, &blob)?;
+        self.request().set_blob(&input_name, &blob)?;
         Ok(())
     }
 
     fn compute(&mut self) -> Result<(), BackendError> {
-        self.1.infer()?;
+        self.request().infer()?;
         Ok(())
     }
 
     fn get_output(&mut self, index: u32, destination: &mut [u8]) -> Result<u32, BackendError> {
-        let output_name = self.0.get_output_name(index as usize)?;
-        let blob = self.1.get_blob(&output_name)?;
+        let output_name = self.network.get_output_name(index as usize)?;
+        let blob = self.request().get_blob(&output_name)?;
         let blob_size = blob.byte_len()?;
         if blob_size > destination.len() {
             return Err(BackendError::NotEnoughMemory(blob_size));
@@ -135,6 +264,20 @@ impl BackendExecutionContext for OpenvinoExecutionContext {
         destination[..blob_size].copy_from_slice(blob.buffer()?);
         Ok(blob_size as u32)
     }
+
+    fn input_name(&self, index: u32) -> Option<String> {
+        if index as usize >= self.network.get_inputs_len().ok()? {
+            return None;
+        }
+        self.network.get_input_name(index as usize).ok()
+    }
+
+    fn output_name(&self, index: u32) -> Option<String> {
+        if index as usize >= self.network.get_outputs_len().ok()? {
+            return None;
+        }
+        self.network.get_output_name(index as usize).ok()
+    }
 }
 
 impl From<InferenceError> for BackendError {
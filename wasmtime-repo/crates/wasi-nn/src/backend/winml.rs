@@ -1,7 +1,9 @@
 //! Implements a `wasi-nn` [`BackendInner`] using WinML.
 
-use super::{BackendError, BackendExecutionContext, BackendFromDir, BackendGraph, BackendInner};
-use crate::wit::types::{ExecutionTarget, GraphEncoding, Tensor};
+use super::{
+    BackendError, BackendExecutionContext, BackendFromDir, BackendGraph, BackendInner, TensorView,
+};
+use crate::wit::types::{ExecutionTarget, GraphEncoding};
 use crate::{ExecutionContext, Graph};
 use std::{fs::File, io::Read, mem::size_of, path::Path};
 use windows::core::{ComInterface, HSTRING};
@@ -57,7 +59,7 @@ impl BackendFromDir for WinMLBackend {
         target: ExecutionTarget,
     ) -> Result<Graph, BackendError> {
         let model = read(&path.join("model.onnx"))?;
-        self.load(&[&model], target)
+        self.load(&[&*model], target)
     }
 }
 
@@ -95,7 +97,7 @@ impl WinMLExecutionContext {
 }
 
 impl BackendExecutionContext for WinMLExecutionContext {
-    fn set_input(&mut self, index: u32, tensor: &Tensor) -> Result<(), BackendError> {
+    fn set_input(&mut self, index: u32, tensor: &TensorView<'_>) -> Result<(), BackendError> {
         // TODO: Support other tensor types. Only FP32 is supported right now.
         match tensor.tensor_type {
             crate::wit::types::TensorType::Fp32 => {}
@@ -1,15 +1,19 @@
 //! Implements the host state for the `wasi-nn` API: [WasiNnCtx].
 
 use crate::backend::{self, BackendError};
-use crate::wit::types::GraphEncoding;
-use crate::{Backend, ExecutionContext, Graph, InMemoryRegistry, Registry};
+use crate::wit::types::{GraphEncoding, Tensor};
+use crate::{
+    Backend, ExecutionContext, Graph, GraphCache, InMemoryRegistry, InferencePool, Registry,
+    ResultCache,
+};
 use anyhow::anyhow;
-use std::{collections::HashMap, hash::Hash, path::Path};
+use std::{collections::HashMap, marker::PhantomData, path::Path};
 use thiserror::Error;
 use wiggle::GuestError;
 
 type GraphId = u32;
 type GraphExecutionContextId = u32;
+type TensorId = u32;
 type BackendName = String;
 type GraphDirectory = String;
 
@@ -21,6 +25,16 @@ pub fn preload(
     preload_graphs: &[(BackendName, GraphDirectory)],
 ) -> anyhow::Result<(impl IntoIterator<Item = Backend>, Registry)> {
     let mut backends = backend::list();
+    let registry = preload_into(&mut backends, preload_graphs)?;
+    Ok((backends, Registry::from(registry)))
+}
+
+/// Like [preload] but return the registry itself, which embedders can clone
+/// into many contexts to load every graph only once.
+pub fn preload_into(
+    backends: &mut [Backend],
+    preload_graphs: &[(BackendName, GraphDirectory)],
+) -> anyhow::Result<InMemoryRegistry> {
     let mut registry = InMemoryRegistry::new();
     for (kind, path) in preload_graphs {
         let kind_ = kind.parse()?;
@@ -32,15 +46,24 @@ pub fn preload(
             .ok_or(anyhow!("{} does not support directory loading", kind))?;
         registry.load(backend, Path::new(path))?;
     }
-    Ok((backends, Registry::from(registry)))
+    Ok(registry)
 }
 
+/// A callback run around every `compute`; see [WasiNnCtx::with_compute_markers].
+type ComputeMarker = Box<dyn Fn() + Send + Sync>;
+
 /// Capture the state necessary for calling into the backend ML libraries.
 pub struct WasiNnCtx {
     pub(crate) backends: HashMap<GraphEncoding, Backend>,
     pub(crate) registry: Registry,
+    pub(crate) cache: Option<GraphCache>,
+    pub(crate) results: Option<ResultCache>,
+    pub(crate) pool: Option<InferencePool>,
+    pub(crate) compute_markers: Option<(ComputeMarker, ComputeMarker)>,
     pub(crate) graphs: Table<GraphId, Graph>,
     pub(crate) executions: Table<GraphExecutionContextId, ExecutionContext>,
+    /// The WIT ABI's `tensor-handle` resources, by their rep.
+    pub(crate) tensors: Table<TensorId, Tensor>,
 }
 
 impl WasiNnCtx {
@@ -50,8 +73,142 @@ impl WasiNnCtx {
         Self {
             backends,
             registry,
+            cache: None,
+            results: None,
+            pool: None,
+            compute_markers: None,
             graphs: Table::default(),
             executions: Table::default(),
+            tensors: Table::default(),
+        }
+    }
+
+    /// Serve `load` calls from `cache`, shared with any other context holding
+    /// a clone of it, instead of building a new backend graph every time.
+    pub fn with_graph_cache(mut self, cache: GraphCache) -> Self {
+        self.cache = Some(cache);
+        self
+    }
+
+    /// Serve `compute` calls on inputs already computed with the same graph
+    /// from `cache`, shared with any other context holding a clone of it.
+    pub fn with_result_cache(mut self, cache: ResultCache) -> Self {
+        self.results = Some(cache);
+        self
+    }
+
+    /// Create an execution context for `graph`, behind the result cache if
+    /// there is one.
+    pub(crate) fn context_for(&self, graph: &Graph) -> Result<ExecutionContext, BackendError> {
+        let context = graph.init_execution_context()?;
+        Ok(match &self.results {
+            Some(results) => results.wrap(graph, context),
+            None => context,
+        })
+    }
+
+    /// Run `compute` on `pool` instead of the calling thread. This needs the
+    /// async bindings, [`witx::add_to_linker_async`](crate::witx::add_to_linker_async);
+    /// through the synchronous ones the guest traps on `compute`.
+    pub fn with_inference_pool(mut self, pool: InferencePool) -> Self {
+        self.pool = Some(pool);
+        self
+    }
+
+    /// Call `start` right before and `end` right after every `compute` the
+    /// guest makes, e.g. to count only inference in a benchmark of a whole
+    /// program.
+    pub fn with_compute_markers(
+        mut self,
+        start: impl Fn() + Send + Sync + 'static,
+        end: impl Fn() + Send + Sync + 'static,
+    ) -> Self {
+        self.compute_markers = Some((Box::new(start), Box::new(end)));
+        self
+    }
+
+    pub(crate) fn compute_started(&self) {
+        if let Some((start, _)) = &self.compute_markers {
+            start();
+        }
+    }
+
+    pub(crate) fn compute_ended(&self) {
+        if let Some((_, end)) = &self.compute_markers {
+            end();
+        }
+    }
+
+    /// Look up the execution context behind a guest's handle, for host
+    /// extensions that feed inputs to it without going through guest memory.
+    pub fn execution_context_mut(&mut self, id: u32) -> Option<&mut ExecutionContext> {
+        self.executions.get_mut(id)
+    }
+
+    /// Like [Self::execution_context_mut], for reading outputs.
+    pub fn execution_context(&self, id: u32) -> Option<&ExecutionContext> {
+        self.executions.get(id)
+    }
+
+    /// The host's `load_by_name`: look `name` up in the registry and return
+    /// a graph handle, as the guest would get one.
+    pub fn graph_by_name(&mut self, name: &str) -> Result<u32, WasiNnError> {
+        match self.registry.get_mut(name) {
+            Some(graph) => Ok(self.graphs.insert(graph.clone())?),
+            None => Err(UsageError::NotFound(name.to_string()).into()),
+        }
+    }
+
+    /// The host's `init_execution_context`: create an execution context for
+    /// `graph` and return its handle, which the guest may use as well.
+    pub fn new_execution_context(&mut self, graph: u32) -> Result<u32, WasiNnError> {
+        let exec_context = match self.graphs.get(graph) {
+            Some(graph) => self.context_for(graph)?,
+            None => return Err(UsageError::InvalidGraphHandle.into()),
+        };
+        Ok(self.executions.insert(exec_context)?)
+    }
+
+    /// The host's `bind_input`: make output `source_index` of the last
+    /// `compute` of the context `source` input `index` of `context`, without
+    /// copying it through guest memory; between ONNX contexts the tensor
+    /// stays the value ORT returned. `source` may compute again right away,
+    /// `context` keeps the output it was bound.
+    pub fn bind_input(
+        &mut self,
+        context: u32,
+        index: u32,
+        source: u32,
+        source_index: u32,
+    ) -> Result<(), WasiNnError> {
+        let tensor = self
+            .executions
+            .get_mut(source)
+            .ok_or(UsageError::InvalidExecutionContextHandle)?
+            .output_tensor(source_index)?
+            .ok_or(UsageError::InvalidTensorIndex(source_index))?;
+        let exec_context = self
+            .executions
+            .get_mut(context)
+            .ok_or(UsageError::InvalidExecutionContextHandle)?;
+        Ok(exec_context.bind_input(index, &tensor)?)
+    }
+
+    /// The host's `drop_graph`: release the guest's handle to a graph; its
+    /// execution contexts stay usable, as they share the backend graph.
+    pub fn drop_graph(&mut self, graph: u32) -> Result<(), WasiNnError> {
+        match self.graphs.remove(graph) {
+            Some(_) => Ok(()),
+            None => Err(UsageError::InvalidGraphHandle.into()),
+        }
+    }
+
+    /// The host's `drop_execution_context`: free the context behind a handle,
+    /// and the backend session state it holds.
+    pub fn drop_execution_context(&mut self, id: u32) -> Result<(), WasiNnError> {
+        match self.executions.remove(id) {
+            Some(_) => Ok(()),
+            None => Err(UsageError::InvalidExecutionContextHandle.into()),
         }
     }
 }
@@ -83,47 +240,147 @@ pub enum UsageError {
     NotEnoughMemory(u32),
     #[error("No graph found with name: {0}")]
     NotFound(String),
+    #[error("No tensor at index {0}, or the backend cannot describe it")]
+    InvalidTensorIndex(u32),
+    #[error("No tensor named {0}")]
+    InvalidTensorName(String),
+    #[error("Invalid tensor handle; has it been dropped?")]
+    InvalidTensorHandle,
+    #[error("Too many live handles; are graphs and contexts being dropped?")]
+    TooManyHandles,
+    #[error("The tensor type {0:?} has no WITX equivalent")]
+    UnsupportedTensorType(crate::wit::types::TensorType),
 }
 
 pub(crate) type WasiNnResult<T> = std::result::Result<T, WasiNnError>;
 
-/// Record handle entries in a table.
+/// Record handle entries in a slab, so that a long-running guest which drops
+/// what it no longer uses keeps constant memory.
+///
+/// A key is a slot's index in its low [`INDEX_BITS`] bits and the slot's
+/// generation above them. Removing an entry puts its slot on the free list
+/// and bumps the generation, so a stale key finds nothing rather than the
+/// slot's next entry; a slot whose generation would wrap is retired instead.
 pub struct Table<K, V> {
-    entries: HashMap<K, V>,
-    next_key: u32,
+    slots: Vec<Slot<V>>,
+    free: Vec<u32>,
+    key: PhantomData<K>,
+}
+
+struct Slot<V> {
+    generation: u32,
+    entry: Entry<V>,
+}
+
+enum Entry<V> {
+    Occupied(V),
+    /// Out on another thread, see [`Table::take`].
+    Taken,
+    Vacant,
 }
 
+const INDEX_BITS: u32 = 20;
+const INDEX_MASK: u32 = (1 << INDEX_BITS) - 1;
+const MAX_GENERATION: u32 = u32::MAX >> INDEX_BITS;
+
 impl<K, V> Default for Table<K, V> {
     fn default() -> Self {
         Self {
-            entries: HashMap::new(),
-            next_key: 0,
+            slots: Vec::new(),
+            free: Vec::new(),
+            key: PhantomData,
         }
     }
 }
 
 impl<K, V> Table<K, V>
 where
-    K: Eq + Hash + From<u32> + Copy,
+    K: From<u32> + Into<u32> + Copy,
 {
-    pub fn insert(&mut self, value: V) -> K {
-        let key = self.use_next_key();
-        self.entries.insert(key, value);
-        key
+    pub fn insert(&mut self, value: V) -> Result<K, UsageError> {
+        let index = match self.free.pop() {
+            Some(index) => index,
+            None if self.slots.len() <= INDEX_MASK as usize => {
+                self.slots.push(Slot {
+                    generation: 0,
+                    entry: Entry::Vacant,
+                });
+                self.slots.len() as u32 - 1
+            }
+            None => return Err(UsageError::TooManyHandles),
+        };
+        let slot = &mut self.slots[index as usize];
+        slot.entry = Entry::Occupied(value);
+        Ok(K::from((slot.generation << INDEX_BITS) | index))
     }
 
     pub fn get(&self, key: K) -> Option<&V> {
-        self.entries.get(&key)
+        match &self.slot(key)?.entry {
+            Entry::Occupied(value) => Some(value),
+            _ => None,
+        }
     }
 
     pub fn get_mut(&mut self, key: K) -> Option<&mut V> {
-        self.entries.get_mut(&key)
+        match &mut self.slot_mut(key)?.entry {
+            Entry::Occupied(value) => Some(value),
+            _ => None,
+        }
     }
 
-    fn use_next_key(&mut self) -> K {
-        let current = self.next_key;
-        self.next_key += 1;
-        K::from(current)
+    /// Take the entry out, e.g. to hand it to another thread; the key stays
+    /// reserved for [`Table::restore`].
+    pub fn take(&mut self, key: K) -> Option<V> {
+        let slot = self.slot_mut(key)?;
+        match std::mem::replace(&mut slot.entry, Entry::Taken) {
+            Entry::Occupied(value) => Some(value),
+            entry => {
+                slot.entry = entry;
+                None
+            }
+        }
+    }
+
+    pub fn restore(&mut self, key: K, value: V) {
+        if let Some(slot) = self.slot_mut(key) {
+            if let Entry::Taken = slot.entry {
+                slot.entry = Entry::Occupied(value);
+            }
+        }
+    }
+
+    /// Remove the entry and free its slot for reuse; its key is invalid
+    /// from now on.
+    pub fn remove(&mut self, key: K) -> Option<V> {
+        let index = key.into() & INDEX_MASK;
+        let slot = self.slot_mut(key)?;
+        match std::mem::replace(&mut slot.entry, Entry::Vacant) {
+            Entry::Occupied(value) => {
+                if slot.generation < MAX_GENERATION {
+                    slot.generation += 1;
+                    self.free.push(index);
+                }
+                Some(value)
+            }
+            entry => {
+                slot.entry = entry;
+                None
+            }
+        }
+    }
+
+    fn slot(&self, key: K) -> Option<&Slot<V>> {
+        let key = key.into();
+        self.slots
+            .get((key & INDEX_MASK) as usize)
+            .filter(|slot| slot.generation == key >> INDEX_BITS)
+    }
+
+    fn slot_mut(&mut self, key: K) -> Option<&mut Slot<V>> {
+        let key = key.into();
+        self.slots
+            .get_mut((key & INDEX_MASK) as usize)
+            .filter(|slot| slot.generation == key >> INDEX_BITS)
     }
 }
 
@@ -143,4 +400,48 @@ mod test {
 
         let _ctx = WasiNnCtx::new([], Registry::from(FakeRegistry));
     }
+
+    #[test]
+    fn table_reuses_slots() {
+        let mut table = Table::<u32, &str>::default();
+        let a = table.insert("a").unwrap();
+        let b = table.insert("b").unwrap();
+        assert_eq!(table.remove(a), Some("a"));
+        assert_eq!(table.remove(a), None);
+
+        // The freed slot comes back with a new generation: the stale key
+        // does not find its new entry
+        let c = table.insert("c").unwrap();
+        assert_ne!(c, a);
+        assert_eq!(c & INDEX_MASK, a & INDEX_MASK);
+        assert_eq!(table.get(a), None);
+        assert_eq!(table.get(c), Some(&"c"));
+        assert_eq!(table.get(b), Some(&"b"));
+        assert_eq!(table.slots.len(), 2);
+    }
+
+    #[test]
+    fn table_keeps_taken_keys() {
+        let mut table = Table::<u32, &str>::default();
+        let a = table.insert("a").unwrap();
+        assert_eq!(table.take(a), Some("a"));
+        assert_eq!(table.get(a), None);
+        assert_eq!(table.remove(a), None);
+        let b = table.insert("b").unwrap();
+        assert_ne!(b & INDEX_MASK, a & INDEX_MASK);
+        table.restore(a, "a");
+        assert_eq!(table.get(a), Some(&"a"));
+    }
+
+    #[test]
+    fn table_retires_wrapped_slots() {
+        let mut table = Table::<u32, ()>::default();
+        for _ in 0..=MAX_GENERATION {
+            let key = table.insert(()).unwrap();
+            table.remove(key);
+        }
+        assert_eq!(table.slots.len(), 1);
+        assert!(table.free.is_empty());
+        assert_eq!(table.insert(()).unwrap() & INDEX_MASK, 1);
+    }
 }
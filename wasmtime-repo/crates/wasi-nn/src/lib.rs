@@ -1,9 +1,13 @@
 mod ctx;
+mod pool;
 mod registry;
+mod result_cache;
 
 pub mod backend;
-pub use ctx::{preload, WasiNnCtx};
-pub use registry::{GraphRegistry, InMemoryRegistry};
+pub use ctx::{preload, preload_into, WasiNnCtx};
+pub use pool::{InferencePool, JobHandle};
+pub use registry::{GraphCache, GraphRegistry, InMemoryRegistry};
+pub use result_cache::ResultCache;
 pub mod testing;
 pub mod wit;
 pub mod witx;
@@ -0,0 +1,178 @@
+//! A fixed set of native threads that run `compute` for async hosts.
+//!
+//! With [`witx::add_to_linker_async`](crate::witx::add_to_linker_async) and a
+//! pool attached through [`WasiNnCtx::with_inference_pool`], `compute` moves
+//! the execution context to one of these threads and the guest's fiber yields
+//! until it is done. The host thread is then free to run other guests, e.g.
+//! pre-processing the next request while this one is inferred, and the number
+//! of inferences in flight is bounded by the number of pool threads rather
+//! than by the number of host threads.
+//!
+//! [`WasiNnCtx::with_inference_pool`]: crate::WasiNnCtx::with_inference_pool
+
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll, Wake, Waker};
+use std::thread;
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// A handle to the pool; clones share the same threads, which exit once the
+/// last handle is dropped.
+#[derive(Clone)]
+pub struct InferencePool {
+    jobs: Arc<Mutex<Sender<Job>>>,
+    threads: usize,
+}
+
+impl InferencePool {
+    /// Start `threads` inference threads (at least one).
+    pub fn new(threads: usize) -> Self {
+        let threads = threads.max(1);
+        let (sender, receiver) = channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+        for i in 0..threads {
+            let receiver = receiver.clone();
+            thread::Builder::new()
+                .name(format!("wasi-nn-inference-{i}"))
+                .spawn(move || worker(&receiver))
+                .expect("failed to spawn a wasi-nn inference thread");
+        }
+        Self {
+            jobs: Arc::new(Mutex::new(sender)),
+            threads,
+        }
+    }
+
+    pub fn threads(&self) -> usize {
+        self.threads
+    }
+
+    /// Run `job` on a pool thread; the returned future resolves to its result.
+    pub fn spawn<R: Send + 'static>(
+        &self,
+        job: impl FnOnce() -> R + Send + 'static,
+    ) -> JobHandle<R> {
+        let state = Arc::new(Mutex::new(JobState {
+            result: None,
+            waker: None,
+        }));
+        let shared = state.clone();
+        let job: Job = Box::new(move || {
+            let result = job();
+            let mut state = shared.lock().unwrap();
+            state.result = Some(result);
+            if let Some(waker) = state.waker.take() {
+                waker.wake();
+            }
+        });
+        self.jobs
+            .lock()
+            .unwrap()
+            .send(job)
+            .expect("wasi-nn inference threads have exited");
+        JobHandle { state }
+    }
+}
+
+fn worker(jobs: &Mutex<Receiver<Job>>) {
+    loop {
+        // Only hold the lock while waiting for a job, not while running it
+        let job = match jobs.lock().unwrap().recv() {
+            Ok(job) => job,
+            Err(_) => return,
+        };
+        job();
+    }
+}
+
+struct JobState<R> {
+    result: Option<R>,
+    waker: Option<Waker>,
+}
+
+/// The pending result of [`InferencePool::spawn`].
+pub struct JobHandle<R> {
+    state: Arc<Mutex<JobState<R>>>,
+}
+
+impl<R> JobHandle<R> {
+    /// Block the calling thread until the job is done, for when the future
+    /// cannot be awaited, e.g. in a `Drop`.
+    pub fn wait(self) -> R {
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        loop {
+            let mut state = self.state.lock().unwrap();
+            if let Some(result) = state.result.take() {
+                return result;
+            }
+            state.waker = Some(waker.clone());
+            drop(state);
+            thread::park();
+        }
+    }
+}
+
+struct ThreadWaker(thread::Thread);
+impl Wake for ThreadWaker {
+    fn wake(self: Arc<Self>) {
+        self.0.unpark();
+    }
+}
+
+impl<R> Future for JobHandle<R> {
+    type Output = R;
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<R> {
+        let mut state = self.state.lock().unwrap();
+        match state.result.take() {
+            Some(result) => Poll::Ready(result),
+            None => {
+                state.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn block_on<F: Future>(future: F) -> F::Output {
+        let mut future = std::pin::pin!(future);
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        let mut cx = Context::from_waker(&waker);
+        loop {
+            match future.as_mut().poll(&mut cx) {
+                Poll::Ready(output) => return output,
+                Poll::Pending => thread::park(),
+            }
+        }
+    }
+
+    #[test]
+    fn jobs_run_off_thread() {
+        let pool = InferencePool::new(2);
+        let caller = thread::current().id();
+        let handles: Vec<_> = (0..8)
+            .map(|i| pool.spawn(move || (i * 2, thread::current().id())))
+            .collect();
+        for (i, handle) in handles.into_iter().enumerate() {
+            let (doubled, id) = block_on(handle);
+            assert_eq!(doubled, i * 2);
+            assert_ne!(id, caller);
+        }
+    }
+
+    #[test]
+    fn wait_blocks_until_done() {
+        let pool = InferencePool::new(1);
+        let handle = pool.spawn(|| {
+            thread::sleep(std::time::Duration::from_millis(20));
+            42
+        });
+        assert_eq!(handle.wait(), 42);
+    }
+}
@@ -0,0 +1,301 @@
+//! Implement a process-wide cache of loaded graphs keyed by model content.
+//!
+//! Every `load` through the WITX or WIT ABI would otherwise build a fresh
+//! backend graph (for ONNX: parse and optimize the model, create an ORT
+//! session) even when the same bytes were loaded a moment ago in another
+//! `Store`. A [`GraphCache`] shared between the [`WasiNnCtx`]s of a host turns
+//! those repeated loads into a hash lookup and hands back the same,
+//! `Arc`-shared [`Graph`].
+//!
+//! Models are known by the SHA-256 digest and the length of their builders,
+//! so a hit does not need the bytes again and an entry keeps nothing of them:
+//! a model loaded from a mapped file or shared read-only weights stays
+//! resident once, in the backend. Hashing costs a few tens of milliseconds
+//! for a 14 MB model, far less than the session it saves. The cache holds at
+//! most [`DEFAULT_CAPACITY`] graphs unless made with
+//! [`GraphCache::with_capacity`] and drops the least recently used one to
+//! make room.
+//!
+//! [`WasiNnCtx`]: crate::WasiNnCtx
+
+use crate::backend::BackendError;
+use crate::wit::types::{ExecutionTarget, GraphEncoding};
+use crate::{Backend, Graph};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::mem::{discriminant, Discriminant};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// The graphs a cache holds unless made with [`GraphCache::with_capacity`].
+pub const DEFAULT_CAPACITY: usize = 16;
+
+/// Identify a graph by the digest of its builders plus everything else that
+/// changes what the backend produces from them.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+struct GraphKey {
+    content_digest: [u8; 32],
+    content_len: usize,
+    encoding: Discriminant<GraphEncoding>,
+    target: Discriminant<ExecutionTarget>,
+    backend_config: String,
+}
+
+impl GraphKey {
+    fn new(backend: &Backend, builders: &[&[u8]], target: ExecutionTarget) -> Self {
+        // Every builder's length goes in first, so that the same bytes split
+        // differently between builders hash differently
+        let mut digest = Sha256::new();
+        digest.update((builders.len() as u64).to_le_bytes());
+        for builder in builders {
+            digest.update((builder.len() as u64).to_le_bytes());
+            digest.update(builder);
+        }
+        Self {
+            content_digest: digest.finalize().into(),
+            content_len: builders.iter().map(|b| b.len()).sum(),
+            encoding: discriminant(&backend.encoding()),
+            target: discriminant(&target),
+            backend_config: backend.config_fingerprint(),
+        }
+    }
+}
+
+struct Cached {
+    graph: Graph,
+    last_used: u64,
+}
+
+#[derive(Default)]
+struct Entries {
+    graphs: HashMap<GraphKey, Cached>,
+    /// Ticks on every use, for `last_used`.
+    clock: u64,
+}
+
+impl Entries {
+    fn get(&mut self, key: &GraphKey) -> Option<Graph> {
+        self.clock += 1;
+        let cached = self.graphs.get_mut(key)?;
+        cached.last_used = self.clock;
+        Some(cached.graph.clone())
+    }
+
+    /// Keep `graph` under `key` unless another load got there first, and
+    /// return the kept one and how many graphs were dropped for it.
+    fn insert(&mut self, key: GraphKey, graph: Graph, capacity: usize) -> (Graph, u64) {
+        if let Some(kept) = self.get(&key) {
+            return (kept, 0);
+        }
+        let mut evicted = 0;
+        while !self.graphs.is_empty() && self.graphs.len() >= capacity {
+            let oldest = self
+                .graphs
+                .iter()
+                .min_by_key(|(_, cached)| cached.last_used)
+                .map(|(key, _)| key.clone())
+                .unwrap();
+            self.graphs.remove(&oldest);
+            evicted += 1;
+        }
+        if capacity > 0 {
+            let cached = Cached {
+                graph: graph.clone(),
+                last_used: self.clock,
+            };
+            self.graphs.insert(key, cached);
+        }
+        (graph, evicted)
+    }
+}
+
+struct Inner {
+    capacity: usize,
+    entries: Mutex<Entries>,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    evictions: AtomicU64,
+}
+
+/// A cloneable handle to one shared cache; clones see the same entries.
+#[derive(Clone)]
+pub struct GraphCache(Arc<Inner>);
+
+impl Default for GraphCache {
+    fn default() -> Self {
+        Self::with_capacity(DEFAULT_CAPACITY)
+    }
+}
+
+impl GraphCache {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Make a cache that holds at most `capacity` graphs.
+    pub fn with_capacity(capacity: usize) -> Self {
+        Self(Arc::new(Inner {
+            capacity,
+            entries: Mutex::default(),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+            evictions: AtomicU64::new(0),
+        }))
+    }
+
+    /// Return the cached graph for these builders or load (and remember) it
+    /// with `backend`.
+    ///
+    /// The lock is not held while the backend loads, so concurrent misses on
+    /// the same model may both load it; the first one to finish is kept.
+    pub fn get_or_load(
+        &self,
+        backend: &mut Backend,
+        builders: &[&[u8]],
+        target: ExecutionTarget,
+    ) -> Result<Graph, BackendError> {
+        let key = GraphKey::new(backend, builders, target);
+        if let Some(graph) = self.0.entries.lock().unwrap().get(&key) {
+            self.0.hits.fetch_add(1, Ordering::Relaxed);
+            return Ok(graph);
+        }
+
+        self.0.misses.fetch_add(1, Ordering::Relaxed);
+        let graph = backend.load(builders, target)?;
+        let (graph, evicted) = self
+            .0
+            .entries
+            .lock()
+            .unwrap()
+            .insert(key, graph, self.0.capacity);
+        self.0.evictions.fetch_add(evicted, Ordering::Relaxed);
+        Ok(graph)
+    }
+
+    /// Number of loads served from the cache.
+    pub fn hits(&self) -> u64 {
+        self.0.hits.load(Ordering::Relaxed)
+    }
+
+    /// Number of loads that had to go to the backend.
+    pub fn misses(&self) -> u64 {
+        self.0.misses.load(Ordering::Relaxed)
+    }
+
+    /// Number of graphs dropped to make room for newer ones.
+    pub fn evictions(&self) -> u64 {
+        self.0.evictions.load(Ordering::Relaxed)
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.entries.lock().unwrap().graphs.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Drop every cached graph; graphs still in use stay alive until their
+    /// last handle is dropped.
+    pub fn clear(&self) {
+        self.0.entries.lock().unwrap().graphs.clear();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::backend::{BackendFromDir, BackendGraph, BackendInner};
+    use crate::ExecutionContext;
+    use std::sync::atomic::AtomicUsize;
+
+    struct FakeGraph;
+    impl BackendGraph for FakeGraph {
+        fn init_execution_context(&self) -> Result<ExecutionContext, BackendError> {
+            unimplemented!()
+        }
+    }
+
+    struct CountingBackend(Arc<AtomicUsize>);
+    impl BackendInner for CountingBackend {
+        fn encoding(&self) -> GraphEncoding {
+            GraphEncoding::Onnx
+        }
+        fn load(&mut self, _: &[&[u8]], _: ExecutionTarget) -> Result<Graph, BackendError> {
+            self.0.fetch_add(1, Ordering::SeqCst);
+            let graph: Box<dyn BackendGraph> = Box::new(FakeGraph);
+            Ok(graph.into())
+        }
+        fn as_dir_loadable<'a>(&'a mut self) -> Option<&'a mut dyn BackendFromDir> {
+            None
+        }
+    }
+
+    #[test]
+    fn repeated_loads_hit() {
+        let loads = Arc::new(AtomicUsize::new(0));
+        let mut backend = Backend::from(CountingBackend(loads.clone()));
+        let cache = GraphCache::new();
+        let model: &[u8] = b"model bytes";
+
+        let first = cache
+            .get_or_load(&mut backend, &[model], ExecutionTarget::Cpu)
+            .unwrap();
+        let second = cache
+            .clone()
+            .get_or_load(&mut backend, &[model], ExecutionTarget::Cpu)
+            .unwrap();
+        assert!(Arc::ptr_eq(&first.0, &second.0));
+        assert_eq!(loads.load(Ordering::SeqCst), 1);
+        assert_eq!((cache.hits(), cache.misses()), (1, 1));
+
+        cache
+            .get_or_load(&mut backend, &[model], ExecutionTarget::Gpu)
+            .unwrap();
+        cache
+            .get_or_load(&mut backend, &[&b"other model"[..]], ExecutionTarget::Cpu)
+            .unwrap();
+        assert_eq!(loads.load(Ordering::SeqCst), 3);
+        assert_eq!(cache.len(), 3);
+    }
+
+    #[test]
+    fn builders_split_differently_miss() {
+        let loads = Arc::new(AtomicUsize::new(0));
+        let mut backend = Backend::from(CountingBackend(loads.clone()));
+        let cache = GraphCache::new();
+
+        let whole = cache
+            .get_or_load(&mut backend, &[&b"ab"[..], &b"c"[..]], ExecutionTarget::Cpu)
+            .unwrap();
+        let split = cache
+            .get_or_load(&mut backend, &[&b"a"[..], &b"bc"[..]], ExecutionTarget::Cpu)
+            .unwrap();
+        assert!(!Arc::ptr_eq(&whole.0, &split.0));
+        assert_eq!(loads.load(Ordering::SeqCst), 2);
+    }
+
+    #[test]
+    fn least_recently_used_is_evicted() {
+        let loads = Arc::new(AtomicUsize::new(0));
+        let mut backend = Backend::from(CountingBackend(loads.clone()));
+        let cache = GraphCache::with_capacity(2);
+        let mut load = |model: &[u8]| {
+            cache
+                .get_or_load(&mut backend, &[model], ExecutionTarget::Cpu)
+                .unwrap()
+        };
+
+        load(b"first");
+        load(b"second");
+        // Using `first` again makes `second` the one to go
+        load(b"first");
+        load(b"third");
+        assert_eq!(loads.load(Ordering::SeqCst), 3);
+        load(b"first");
+        assert_eq!(loads.load(Ordering::SeqCst), 3);
+        load(b"second");
+        assert_eq!(loads.load(Ordering::SeqCst), 4);
+        assert_eq!((cache.len(), cache.evictions()), (2, 2));
+    }
+}
@@ -6,6 +6,8 @@ use crate::wit::types::ExecutionTarget;
 use anyhow::{anyhow, bail};
 use std::{collections::HashMap, path::Path};
 
+/// Cloning a registry is cheap: the clone shares the loaded graphs.
+#[derive(Clone, Default)]
 pub struct InMemoryRegistry(HashMap<String, Graph>);
 impl InMemoryRegistry {
     pub fn new() -> Self {
@@ -19,6 +21,16 @@ impl InMemoryRegistry {
     /// suffix: if the backend can find the files it expects in `/my/model/foo`,
     /// the registry will contain a new graph named `foo`.
     pub fn load(&mut self, backend: &mut dyn BackendFromDir, path: &Path) -> anyhow::Result<()> {
+        self.load_for_target(backend, path, ExecutionTarget::Cpu)
+    }
+
+    /// Like [`InMemoryRegistry::load`] but for a specific execution target.
+    pub fn load_for_target(
+        &mut self,
+        backend: &mut dyn BackendFromDir,
+        path: &Path,
+        target: ExecutionTarget,
+    ) -> anyhow::Result<()> {
         if !path.is_dir() {
             bail!(
                 "preload directory is not a valid directory: {}",
@@ -30,10 +42,18 @@ impl InMemoryRegistry {
             .map(|s| s.to_string_lossy())
             .ok_or(anyhow!("no file name in path"))?;
 
-        let graph = backend.load_from_dir(path, ExecutionTarget::Cpu)?;
+        let graph = backend.load_from_dir(path, target)?;
         self.0.insert(name.into_owned(), graph);
         Ok(())
     }
+
+    pub fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.0.is_empty()
+    }
 }
 
 impl GraphRegistry for InMemoryRegistry {
@@ -4,11 +4,14 @@
 //! by name. This API does not mandate how a graph is loaded or how it must be
 //! stored--it could be stored remotely and rematerialized when needed, e.g. A
 //! naive in-memory implementation, [`InMemoryRegistry`] is provided for use
-//! with the Wasmtime CLI.
+//! with the Wasmtime CLI. Graphs loaded from bytes can be shared across
+//! contexts through a [`GraphCache`].
 
+mod cache;
 mod in_memory;
 
 use crate::Graph;
+pub use cache::GraphCache;
 pub use in_memory::InMemoryRegistry;
 
 pub trait GraphRegistry: Send + Sync {
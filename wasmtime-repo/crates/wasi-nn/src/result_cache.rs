@@ -0,0 +1,540 @@
+//! Implement a cache of inference results keyed by graph and input content.
+//!
+//! A service that sees the same request again (a health check, a popular
+//! image, a retry) would otherwise run the model again to get the same
+//! outputs. With a [`ResultCache`] attached through
+//! [`WasiNnCtx::with_result_cache`], every execution context hashes the
+//! inputs it is given, and a `compute` whose graph and inputs were computed
+//! before does not reach the backend: `get_output` is served from the
+//! outputs stored by the first `compute`.
+//!
+//! The hash is SipHash with a key drawn for each cache, so a guest cannot
+//! craft inputs whose hash collides with another guest's and read its
+//! results; it hashes the 588 KiB MobileNet input in well under a millisecond,
+//! a small part of the `compute` it saves. The cache is bounded by the bytes
+//! of the outputs it holds and evicts the least recently used ones first.
+//!
+//! [`WasiNnCtx::with_result_cache`]: crate::WasiNnCtx::with_result_cache
+
+use crate::backend::{
+    BackendError, BackendExecutionContext, BackendGraph, BytesTensor, SharedTensor, TensorInfo,
+    TensorView,
+};
+use crate::{ExecutionContext, Graph};
+use anyhow::anyhow;
+use std::collections::hash_map::RandomState;
+use std::collections::{BTreeMap, HashMap};
+use std::hash::{BuildHasher, Hash, Hasher};
+use std::mem::discriminant;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, Weak};
+
+/// Identify a result by its graph and every input it was computed from.
+///
+/// The graph is known by its address; its entry keeps a [`Weak`] to it, so
+/// that the address is not reused by another graph while the entry exists.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct ResultKey {
+    graph: usize,
+    inputs: u64,
+}
+
+/// The outputs of one `compute`, by index; `None` for outputs that were not
+/// selected.
+struct Outputs(Vec<Option<Output>>);
+
+struct Output {
+    info: Option<TensorInfo>,
+    data: Vec<u8>,
+}
+
+impl Outputs {
+    fn bytes(&self) -> usize {
+        self.0
+            .iter()
+            .flatten()
+            .map(|output| output.data.len())
+            .sum()
+    }
+
+    fn get(&self, index: u32) -> Result<&Output, BackendError> {
+        match self.0.get(index as usize) {
+            Some(Some(output)) => Ok(output),
+            Some(None) => Err(BackendError::BackendAccess(anyhow!(
+                "output {} is not among the selected outputs",
+                index
+            ))),
+            None => Err(BackendError::BackendAccess(anyhow!(
+                "invalid output index: {}",
+                index
+            ))),
+        }
+    }
+}
+
+struct Entry {
+    outputs: Arc<Outputs>,
+    last_used: u64,
+    _graph: Weak<dyn BackendGraph>,
+}
+
+/// The entries and their order of use: `recency` maps every entry's
+/// `last_used` tick back to its key, oldest first.
+#[derive(Default)]
+struct Lru {
+    entries: HashMap<ResultKey, Entry>,
+    recency: BTreeMap<u64, ResultKey>,
+    clock: u64,
+    bytes: usize,
+}
+
+impl Lru {
+    fn get(&mut self, key: &ResultKey) -> Option<Arc<Outputs>> {
+        let entry = self.entries.get_mut(key)?;
+        self.recency.remove(&entry.last_used);
+        self.clock += 1;
+        entry.last_used = self.clock;
+        self.recency.insert(self.clock, *key);
+        Some(entry.outputs.clone())
+    }
+
+    /// Insert `entry` and evict the oldest entries until everything fits in
+    /// `capacity`; return how many were evicted.
+    fn insert(&mut self, key: ResultKey, mut entry: Entry, capacity: usize) -> u64 {
+        if let Some(old) = self.entries.remove(&key) {
+            self.recency.remove(&old.last_used);
+            self.bytes -= old.outputs.bytes();
+        }
+        let size = entry.outputs.bytes();
+        let mut evicted = 0;
+        while self.bytes + size > capacity {
+            let Some((_, oldest)) = self.recency.pop_first() else {
+                break;
+            };
+            let old = self.entries.remove(&oldest).unwrap();
+            self.bytes -= old.outputs.bytes();
+            evicted += 1;
+        }
+        self.clock += 1;
+        entry.last_used = self.clock;
+        self.recency.insert(self.clock, key);
+        self.entries.insert(key, entry);
+        self.bytes += size;
+        evicted
+    }
+}
+
+struct Inner {
+    capacity: usize,
+    hasher: RandomState,
+    lru: Mutex<Lru>,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    evictions: AtomicU64,
+}
+
+/// A cloneable handle to one shared cache; clones see the same entries.
+#[derive(Clone)]
+pub struct ResultCache(Arc<Inner>);
+
+impl ResultCache {
+    /// Make a cache that holds at most `capacity` bytes of outputs.
+    pub fn new(capacity: usize) -> Self {
+        Self(Arc::new(Inner {
+            capacity,
+            hasher: RandomState::new(),
+            lru: Mutex::default(),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+            evictions: AtomicU64::new(0),
+        }))
+    }
+
+    /// Put `context`, created from `graph`, behind this cache.
+    pub(crate) fn wrap(&self, graph: &Graph, context: ExecutionContext) -> ExecutionContext {
+        let context: Box<dyn BackendExecutionContext> = Box::new(CachedContext {
+            inner: context,
+            cache: self.clone(),
+            graph: Arc::downgrade(&graph.0),
+            inputs: Vec::new(),
+            selected: Vec::new(),
+            served: None,
+        });
+        context.into()
+    }
+
+    fn hash_tensor(&self, tensor: &TensorView<'_>) -> u64 {
+        let mut hasher = self.0.hasher.build_hasher();
+        tensor.dimensions.hash(&mut hasher);
+        discriminant(&tensor.tensor_type).hash(&mut hasher);
+        tensor.data.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    fn get(&self, key: &ResultKey) -> Option<Arc<Outputs>> {
+        let outputs = self.0.lru.lock().unwrap().get(key);
+        let counter = match outputs {
+            Some(_) => &self.0.hits,
+            None => &self.0.misses,
+        };
+        counter.fetch_add(1, Ordering::Relaxed);
+        outputs
+    }
+
+    fn insert(&self, key: ResultKey, graph: Weak<dyn BackendGraph>, outputs: Outputs) {
+        if outputs.bytes() > self.0.capacity {
+            return;
+        }
+        let entry = Entry {
+            outputs: Arc::new(outputs),
+            last_used: 0,
+            _graph: graph,
+        };
+        let evicted = self
+            .0
+            .lru
+            .lock()
+            .unwrap()
+            .insert(key, entry, self.0.capacity);
+        self.0.evictions.fetch_add(evicted, Ordering::Relaxed);
+    }
+
+    /// Number of computations served from the cache.
+    pub fn hits(&self) -> u64 {
+        self.0.hits.load(Ordering::Relaxed)
+    }
+
+    /// Number of computations that had to go to the backend.
+    pub fn misses(&self) -> u64 {
+        self.0.misses.load(Ordering::Relaxed)
+    }
+
+    /// Number of results dropped to make room for newer ones.
+    pub fn evictions(&self) -> u64 {
+        self.0.evictions.load(Ordering::Relaxed)
+    }
+
+    /// The bytes of outputs held now.
+    pub fn bytes(&self) -> usize {
+        self.0.lru.lock().unwrap().bytes
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.lru.lock().unwrap().entries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Drop every cached result.
+    pub fn clear(&self) {
+        *self.0.lru.lock().unwrap() = Lru::default();
+    }
+}
+
+/// An execution context that remembers the hash of every input it is given
+/// and looks its next `compute` up in the cache first.
+struct CachedContext {
+    inner: ExecutionContext,
+    cache: ResultCache,
+    graph: Weak<dyn BackendGraph>,
+    /// The hash of each input by index, `None` for inputs not set yet.
+    inputs: Vec<Option<u64>>,
+    selected: Vec<u32>,
+    /// The cached outputs of the last `compute` if it was a hit; after a miss
+    /// the outputs are the backend's.
+    served: Option<Arc<Outputs>>,
+}
+
+impl CachedContext {
+    fn key(&self) -> ResultKey {
+        let mut hasher = self.cache.0.hasher.build_hasher();
+        self.inputs.hash(&mut hasher);
+        self.selected.hash(&mut hasher);
+        ResultKey {
+            graph: self.graph.as_ptr() as *const () as usize,
+            inputs: hasher.finish(),
+        }
+    }
+
+    /// Copy the outputs of the backend's last `compute`, or `None` if the
+    /// backend cannot tell how many there are or how large one is.
+    fn copy_outputs(&mut self) -> Option<Outputs> {
+        let count = (0..)
+            .take_while(|&i| self.inner.output_name(i).is_some())
+            .count();
+        let mut outputs = Vec::with_capacity(count);
+        for index in 0..count as u32 {
+            let info = self.inner.output_info(index);
+            let data = match self.inner.output_bytes(index) {
+                Some(bytes) => Some(bytes.to_vec()),
+                None => {
+                    let mut data = vec![0; self.inner.output_len(index)?];
+                    match self.inner.get_output(index, &mut data) {
+                        Ok(len) => {
+                            data.truncate(len as usize);
+                            Some(data)
+                        }
+                        Err(_) => None,
+                    }
+                }
+            };
+            outputs.push(data.map(|data| Output { info, data }));
+        }
+        Some(Outputs(outputs))
+    }
+}
+
+impl BackendExecutionContext for CachedContext {
+    fn set_input(&mut self, index: u32, tensor: &TensorView<'_>) -> Result<(), BackendError> {
+        self.inner.set_input(index, tensor)?;
+        let index = index as usize;
+        if self.inputs.len() <= index {
+            self.inputs.resize(index + 1, None);
+        }
+        self.inputs[index] = Some(self.cache.hash_tensor(tensor));
+        Ok(())
+    }
+
+    fn bind_input(&mut self, index: u32, tensor: &SharedTensor) -> Result<(), BackendError> {
+        self.inner.bind_input(index, tensor)?;
+        // Hashed like a `set_input` of the same tensor, which reads its data
+        // in place
+        let info = tensor.info();
+        let dimensions = info.fixed_dimensions().unwrap_or_default();
+        let data = tensor.data()?;
+        let hash = self.cache.hash_tensor(&TensorView {
+            dimensions: &dimensions,
+            tensor_type: info.tensor_type,
+            data: &data,
+        });
+        let index = index as usize;
+        if self.inputs.len() <= index {
+            self.inputs.resize(index + 1, None);
+        }
+        self.inputs[index] = Some(hash);
+        Ok(())
+    }
+
+    fn compute(&mut self) -> Result<(), BackendError> {
+        self.served = None;
+        if self.inputs.is_empty() {
+            return self.inner.compute();
+        }
+        let key = self.key();
+        if let Some(outputs) = self.cache.get(&key) {
+            self.served = Some(outputs);
+            return Ok(());
+        }
+        self.inner.compute()?;
+        if let Some(outputs) = self.copy_outputs() {
+            self.cache.insert(key, self.graph.clone(), outputs);
+        }
+        Ok(())
+    }
+
+    fn get_output(&mut self, index: u32, destination: &mut [u8]) -> Result<u32, BackendError> {
+        let Some(outputs) = &self.served else {
+            return self.inner.get_output(index, destination);
+        };
+        let data = &outputs.get(index)?.data;
+        if data.len() > destination.len() {
+            return Err(BackendError::NotEnoughMemory(data.len()));
+        }
+        destination[..data.len()].copy_from_slice(data);
+        Ok(data.len() as u32)
+    }
+
+    fn input_info(&self, index: u32) -> Option<TensorInfo> {
+        self.inner.input_info(index)
+    }
+
+    fn output_info(&self, index: u32) -> Option<TensorInfo> {
+        match &self.served {
+            Some(outputs) => match outputs.get(index) {
+                Ok(output) => output.info.clone(),
+                Err(_) => self.inner.output_info(index),
+            },
+            None => self.inner.output_info(index),
+        }
+    }
+
+    fn output_bytes(&self, index: u32) -> Option<&[u8]> {
+        match &self.served {
+            Some(outputs) => outputs.get(index).ok().map(|output| &output.data[..]),
+            None => self.inner.output_bytes(index),
+        }
+    }
+
+    fn output_tensor(&mut self, index: u32) -> Result<Option<SharedTensor>, BackendError> {
+        let Some(outputs) = &self.served else {
+            return self.inner.output_tensor(index);
+        };
+        Ok(match outputs.get(index) {
+            Ok(Output {
+                info: Some(info),
+                data,
+            }) => Some(Arc::new(BytesTensor {
+                info: info.clone(),
+                data: data.clone(),
+            })),
+            _ => None,
+        })
+    }
+
+    fn input_name(&self, index: u32) -> Option<String> {
+        self.inner.input_name(index)
+    }
+
+    fn output_name(&self, index: u32) -> Option<String> {
+        self.inner.output_name(index)
+    }
+
+    fn input_index(&self, name: &str) -> Option<u32> {
+        self.inner.input_index(name)
+    }
+
+    fn output_index(&self, name: &str) -> Option<u32> {
+        self.inner.output_index(name)
+    }
+
+    fn select_outputs(&mut self, indices: &[u32]) -> Result<(), BackendError> {
+        self.inner.select_outputs(indices)?;
+        self.selected = indices.to_vec();
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::wit::types::TensorType;
+    use std::sync::atomic::AtomicUsize;
+
+    /// Doubles every input byte into output 0 and counts its computations.
+    struct DoublingGraph(Arc<AtomicUsize>);
+    impl BackendGraph for DoublingGraph {
+        fn init_execution_context(&self) -> Result<ExecutionContext, BackendError> {
+            let context: Box<dyn BackendExecutionContext> = Box::new(DoublingContext {
+                computes: self.0.clone(),
+                input: Vec::new(),
+                output: Vec::new(),
+            });
+            Ok(context.into())
+        }
+    }
+
+    struct DoublingContext {
+        computes: Arc<AtomicUsize>,
+        input: Vec<u8>,
+        output: Vec<u8>,
+    }
+    impl BackendExecutionContext for DoublingContext {
+        fn set_input(&mut self, _: u32, tensor: &TensorView<'_>) -> Result<(), BackendError> {
+            self.input = tensor.data.to_vec();
+            Ok(())
+        }
+        fn compute(&mut self) -> Result<(), BackendError> {
+            self.computes.fetch_add(1, Ordering::SeqCst);
+            self.output = self.input.iter().map(|b| b.wrapping_mul(2)).collect();
+            Ok(())
+        }
+        fn get_output(&mut self, _: u32, destination: &mut [u8]) -> Result<u32, BackendError> {
+            destination[..self.output.len()].copy_from_slice(&self.output);
+            Ok(self.output.len() as u32)
+        }
+        fn output_bytes(&self, index: u32) -> Option<&[u8]> {
+            (index == 0).then_some(&self.output[..])
+        }
+        fn output_info(&self, index: u32) -> Option<TensorInfo> {
+            (index == 0).then(|| TensorInfo {
+                tensor_type: TensorType::U8,
+                dimensions: vec![self.output.len() as i64],
+            })
+        }
+        fn output_name(&self, index: u32) -> Option<String> {
+            (index == 0).then(|| String::from("y"))
+        }
+    }
+
+    fn infer(context: &mut ExecutionContext, data: &[u8]) -> Vec<u8> {
+        let tensor = TensorView {
+            dimensions: &[data.len() as u32],
+            tensor_type: TensorType::U8,
+            data,
+        };
+        context.set_input(0, &tensor).unwrap();
+        context.compute().unwrap();
+        let mut output = vec![0; data.len()];
+        let len = context.get_output(0, &mut output).unwrap();
+        assert_eq!(len as usize, data.len());
+        output
+    }
+
+    #[test]
+    fn repeated_inputs_hit() {
+        let computes = Arc::new(AtomicUsize::new(0));
+        let graph: Box<dyn BackendGraph> = Box::new(DoublingGraph(computes.clone()));
+        let graph = Graph::from(graph);
+        let cache = ResultCache::new(1024);
+        let mut first = cache.wrap(&graph, graph.init_execution_context().unwrap());
+        let mut second = cache.wrap(&graph, graph.init_execution_context().unwrap());
+
+        assert_eq!(infer(&mut first, &[1, 2, 3]), [2, 4, 6]);
+        assert_eq!(infer(&mut second, &[1, 2, 3]), [2, 4, 6]);
+        assert_eq!(second.output_bytes(0), Some(&[2, 4, 6][..]));
+        assert_eq!(infer(&mut second, &[4, 5]), [8, 10]);
+        assert_eq!(computes.load(Ordering::SeqCst), 2);
+        assert_eq!((cache.hits(), cache.misses()), (1, 2));
+        assert_eq!((cache.len(), cache.bytes()), (2, 5));
+    }
+
+    #[test]
+    fn least_recently_used_is_evicted() {
+        let computes = Arc::new(AtomicUsize::new(0));
+        let graph: Box<dyn BackendGraph> = Box::new(DoublingGraph(computes.clone()));
+        let graph = Graph::from(graph);
+        let cache = ResultCache::new(8);
+        let mut context = cache.wrap(&graph, graph.init_execution_context().unwrap());
+
+        infer(&mut context, &[1; 4]);
+        infer(&mut context, &[2; 4]);
+        infer(&mut context, &[1; 4]);
+        // [2; 4] is the oldest now, and makes room for [3; 4]
+        infer(&mut context, &[3; 4]);
+        infer(&mut context, &[1; 4]);
+        assert_eq!(cache.evictions(), 1);
+        assert_eq!((cache.hits(), cache.misses()), (2, 3));
+        infer(&mut context, &[2; 4]);
+        assert_eq!(computes.load(Ordering::SeqCst), 4);
+
+        // Larger than the whole cache: computed and not kept
+        infer(&mut context, &[4; 9]);
+        assert_eq!(cache.bytes(), 8);
+    }
+
+    #[test]
+    fn bound_outputs_are_hashed() {
+        let computes = Arc::new(AtomicUsize::new(0));
+        let graph: Box<dyn BackendGraph> = Box::new(DoublingGraph(computes.clone()));
+        let graph = Graph::from(graph);
+        let cache = ResultCache::new(1024);
+        let mut first = cache.wrap(&graph, graph.init_execution_context().unwrap());
+        let mut second = cache.wrap(&graph, graph.init_execution_context().unwrap());
+
+        infer(&mut first, &[1, 2, 3]);
+        let output = first.output_tensor(0).unwrap().unwrap();
+        second.bind_input(0, &output).unwrap();
+        second.compute().unwrap();
+        assert_eq!(second.output_bytes(0), Some(&[4, 8, 12][..]));
+        // The source computes again, the bound tensor is the earlier output
+        infer(&mut first, &[7]);
+        second.compute().unwrap();
+        assert_eq!(second.output_bytes(0), Some(&[4, 8, 12][..]));
+        // Bound [2, 4, 6] and set [2, 4, 6] are the same input
+        assert_eq!(infer(&mut first, &[2, 4, 6]), [4, 8, 12]);
+        assert_eq!(computes.load(Ordering::SeqCst), 3);
+        assert_eq!((cache.hits(), cache.misses()), (2, 3));
+    }
+}
@@ -17,6 +17,7 @@
 
 use crate::{ctx::UsageError, WasiNnCtx};
 use std::{error::Error, fmt, hash::Hash, str::FromStr};
+use wasmtime::component::Resource;
 
 /// Generate the traits and types from the `wasi-nn` WIT specification.
 mod gen_ {
@@ -47,11 +48,14 @@ impl gen::graph::Host for WasiNnCtx {
     ) -> wasmtime::Result<Result<gen::graph::Graph, gen::errors::Error>> {
         let graph = if let Some(backend) = self.backends.get_mut(&encoding) {
             let slices = builders.iter().map(|s| s.as_slice()).collect::<Vec<_>>();
-            backend.load(&slices, target.into())?
+            match &self.cache {
+                Some(cache) => cache.get_or_load(backend, &slices, target.into())?,
+                None => backend.load(&slices, target.into())?,
+            }
         } else {
             return Err(UsageError::InvalidEncoding(encoding.into()).into());
         };
-        let graph_id = self.graphs.insert(graph);
+        let graph_id = self.graphs.insert(graph)?;
         Ok(Ok(graph_id))
     }
 
@@ -60,12 +64,23 @@ impl gen::graph::Host for WasiNnCtx {
         name: String,
     ) -> wasmtime::Result<Result<gen::graph::Graph, gen::errors::Error>> {
         if let Some(graph) = self.registry.get_mut(&name) {
-            let graph_id = self.graphs.insert(graph.clone().into());
+            let graph_id = self.graphs.insert(graph.clone().into())?;
             Ok(Ok(graph_id))
         } else {
             return Err(UsageError::NotFound(name.to_string()).into());
         }
     }
+
+    /// Release a graph handle; the slot is reused by later loads.
+    fn drop_graph(
+        &mut self,
+        graph_id: gen::graph::Graph,
+    ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
+        match self.graphs.remove(graph_id) {
+            Some(_) => Ok(Ok(())),
+            None => Err(UsageError::InvalidGraphHandle.into()),
+        }
+    }
 }
 
 impl gen::inference::Host for WasiNnCtx {
@@ -77,15 +92,26 @@ impl gen::inference::Host for WasiNnCtx {
         graph_id: gen::graph::Graph,
     ) -> wasmtime::Result<Result<gen::inference::GraphExecutionContext, gen::errors::Error>> {
         let exec_context = if let Some(graph) = self.graphs.get(graph_id) {
-            graph.init_execution_context()?
+            self.context_for(graph)?
         } else {
             return Err(UsageError::InvalidGraphHandle.into());
         };
 
-        let exec_context_id = self.executions.insert(exec_context);
+        let exec_context_id = self.executions.insert(exec_context)?;
         Ok(Ok(exec_context_id))
     }
 
+    /// Free an execution context and its backend state.
+    fn drop_execution_context(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+    ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
+        match self.executions.remove(exec_context_id) {
+            Some(_) => Ok(Ok(())),
+            None => Err(UsageError::InvalidExecutionContextHandle.into()),
+        }
+    }
+
     /// Define the inputs to use for inference.
     fn set_input(
         &mut self,
@@ -94,13 +120,33 @@ impl gen::inference::Host for WasiNnCtx {
         tensor: gen::tensor::Tensor,
     ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
         if let Some(exec_context) = self.executions.get_mut(exec_context_id) {
-            exec_context.set_input(index, &tensor)?;
+            exec_context.set_input(index, &(&tensor).into())?;
             Ok(Ok(()))
         } else {
             Err(UsageError::InvalidGraphHandle.into())
         }
     }
 
+    /// Define an input from a tensor the host already holds.
+    fn set_input_tensor(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+        tensor: Resource<gen::tensor::TensorHandle>,
+    ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
+        // A field borrow, as the execution context below is borrowed mutably
+        let tensor = self
+            .tensors
+            .get(tensor.rep())
+            .ok_or(UsageError::InvalidTensorHandle)?;
+        if let Some(exec_context) = self.executions.get_mut(exec_context_id) {
+            exec_context.set_input(index, &tensor.into())?;
+            Ok(Ok(()))
+        } else {
+            Err(UsageError::InvalidExecutionContextHandle.into())
+        }
+    }
+
     /// Compute the inference on the given inputs.
     ///
     /// TODO: refactor to compute(list<tensor>) -> result<list<tensor>, error>
@@ -109,7 +155,14 @@ impl gen::inference::Host for WasiNnCtx {
         exec_context_id: gen::inference::GraphExecutionContext,
     ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
         if let Some(exec_context) = self.executions.get_mut(exec_context_id) {
-            exec_context.compute()?;
+            if let Some((start, _)) = &self.compute_markers {
+                start();
+            }
+            let result = exec_context.compute();
+            if let Some((_, end)) = &self.compute_markers {
+                end();
+            }
+            result?;
             Ok(Ok(()))
         } else {
             Err(UsageError::InvalidExecutionContextHandle.into())
@@ -123,11 +176,10 @@ impl gen::inference::Host for WasiNnCtx {
         index: u32,
     ) -> wasmtime::Result<Result<gen::tensor::TensorData, gen::errors::Error>> {
         if let Some(exec_context) = self.executions.get_mut(exec_context_id) {
-            // Read the output bytes. TODO: this involves a hard-coded upper
-            // limit on the tensor size that is necessary because there is no
-            // way to introspect the graph outputs
-            // (https://github.com/WebAssembly/wasi-nn/issues/37).
-            let mut destination = vec![0; 1024 * 1024];
+            // Size the copy from the output's metadata; the hard-coded limit
+            // only remains for backends that cannot describe their outputs.
+            let len = exec_context.output_len(index).unwrap_or(1024 * 1024);
+            let mut destination = vec![0; len];
             let bytes_read = exec_context.get_output(index, &mut destination)?;
             destination.truncate(bytes_read as usize);
             Ok(Ok(destination))
@@ -135,12 +187,208 @@ impl gen::inference::Host for WasiNnCtx {
             Err(UsageError::InvalidGraphHandle.into())
         }
     }
+
+    /// Extract an output into a tensor kept on the host.
+    fn get_output_tensor(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<Resource<gen::tensor::TensorHandle>, gen::errors::Error>> {
+        let exec_context = self
+            .executions
+            .get_mut(exec_context_id)
+            .ok_or(UsageError::InvalidExecutionContextHandle)?;
+        let info = match exec_context.output_info(index) {
+            Some(info) => info,
+            None => return Ok(Err(gen::errors::Error::NotFound)),
+        };
+        let len = exec_context.output_len(index).unwrap_or(1024 * 1024);
+        let mut data = vec![0; len];
+        let bytes_read = exec_context.get_output(index, &mut data)?;
+        data.truncate(bytes_read as usize);
+        let tensor = gen::tensor::Tensor {
+            dimensions: info.dimensions.iter().map(|&d| d.max(0) as u32).collect(),
+            tensor_type: info.tensor_type,
+            data,
+        };
+        Ok(Ok(Resource::new_own(self.tensors.insert(tensor)?)))
+    }
+
+    /// Describe an input of the context's graph.
+    fn get_input_info(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<gen::tensor::TensorInfo, gen::errors::Error>> {
+        let info = self.execution(exec_context_id)?.input_info(index)?;
+        Ok(info.map(Into::into).ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Describe an output of the context's graph.
+    fn get_output_info(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<gen::tensor::TensorInfo, gen::errors::Error>> {
+        let info = self.execution(exec_context_id)?.output_info(index);
+        Ok(info.map(Into::into).ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Name an input of the context's graph.
+    fn get_input_name(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<String, gen::errors::Error>> {
+        let name = self.execution(exec_context_id)?.input_name(index);
+        Ok(name.ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Name an output of the context's graph.
+    fn get_output_name(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<String, gen::errors::Error>> {
+        let name = self.execution(exec_context_id)?.output_name(index);
+        Ok(name.ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// The size of an output's data.
+    fn get_output_size(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+    ) -> wasmtime::Result<Result<u32, gen::errors::Error>> {
+        let len = self.execution(exec_context_id)?.output_len(index);
+        Ok(len
+            .map(|len| len as u32)
+            .ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Look an input of the context's graph up by name.
+    fn get_input_index(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        name: String,
+    ) -> wasmtime::Result<Result<u32, gen::errors::Error>> {
+        let index = self.execution(exec_context_id)?.input_index(&name);
+        Ok(index.ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Look an output of the context's graph up by name.
+    fn get_output_index(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        name: String,
+    ) -> wasmtime::Result<Result<u32, gen::errors::Error>> {
+        let index = self.execution(exec_context_id)?.output_index(&name);
+        Ok(index.ok_or(gen::errors::Error::NotFound))
+    }
+
+    /// Restrict `compute` to the outputs the guest reads.
+    fn select_outputs(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        indices: Vec<u32>,
+    ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
+        if let Some(exec_context) = self.executions.get_mut(exec_context_id) {
+            exec_context.select_outputs(&indices)?;
+            Ok(Ok(()))
+        } else {
+            Err(UsageError::InvalidExecutionContextHandle.into())
+        }
+    }
+
+    /// Feed an output of one context to another without a guest copy.
+    fn bind_input(
+        &mut self,
+        exec_context_id: gen::inference::GraphExecutionContext,
+        index: u32,
+        source: gen::inference::GraphExecutionContext,
+        source_index: u32,
+    ) -> wasmtime::Result<Result<(), gen::errors::Error>> {
+        WasiNnCtx::bind_input(self, exec_context_id, index, source, source_index)?;
+        Ok(Ok(()))
+    }
+}
+
+impl WasiNnCtx {
+    /// The execution context behind the guest's handle `id`.
+    fn execution(&self, id: u32) -> Result<&crate::ExecutionContext, UsageError> {
+        self.executions
+            .get(id)
+            .ok_or(UsageError::InvalidExecutionContextHandle)
+    }
+
+    /// The tensor behind a guest's `tensor-handle`.
+    fn tensor(
+        &self,
+        handle: &Resource<gen::tensor::TensorHandle>,
+    ) -> Result<&gen::tensor::Tensor, UsageError> {
+        self.tensors
+            .get(handle.rep())
+            .ok_or(UsageError::InvalidTensorHandle)
+    }
 }
 
 impl gen::errors::Host for WasiNnCtx {}
 
 impl gen::tensor::Host for WasiNnCtx {}
 
+/// Tensors live in the context's own table rather than a `ResourceTable`, so
+/// a handle's rep is its key there.
+impl gen::tensor::HostTensorHandle for WasiNnCtx {
+    fn new(
+        &mut self,
+        dimensions: gen::tensor::TensorDimensions,
+        tensor_type: gen::tensor::TensorType,
+        data: gen::tensor::TensorData,
+    ) -> wasmtime::Result<Resource<gen::tensor::TensorHandle>> {
+        let tensor = gen::tensor::Tensor {
+            dimensions,
+            tensor_type,
+            data,
+        };
+        Ok(Resource::new_own(self.tensors.insert(tensor)?))
+    }
+
+    fn dimensions(
+        &mut self,
+        tensor: Resource<gen::tensor::TensorHandle>,
+    ) -> wasmtime::Result<gen::tensor::TensorDimensions> {
+        Ok(self.tensor(&tensor)?.dimensions.clone())
+    }
+
+    fn tensor_type(
+        &mut self,
+        tensor: Resource<gen::tensor::TensorHandle>,
+    ) -> wasmtime::Result<gen::tensor::TensorType> {
+        Ok(self.tensor(&tensor)?.tensor_type)
+    }
+
+    fn data(
+        &mut self,
+        tensor: Resource<gen::tensor::TensorHandle>,
+    ) -> wasmtime::Result<gen::tensor::TensorData> {
+        Ok(self.tensor(&tensor)?.data.clone())
+    }
+
+    fn drop(&mut self, tensor: Resource<gen::tensor::TensorHandle>) -> wasmtime::Result<()> {
+        self.tensors.take(tensor.rep()?);
+        Ok(())
+    }
+}
+
+impl From<crate::backend::TensorInfo> for gen::tensor::TensorInfo {
+    fn from(value: crate::backend::TensorInfo) -> Self {
+        Self {
+            tensor_type: value.tensor_type,
+            dimensions: value.dimensions,
+        }
+    }
+}
+
 impl Hash for gen::graph::GraphEncoding {
     fn hash<H: std::hash::Hasher>(&self, state: &mut H) {
         core::mem::discriminant(self).hash(state);
@@ -3,7 +3,8 @@
 //! `wasi-nn` was never included in the official "preview1" snapshot, but this
 //! module implements the ABI that is compatible with "preview1".
 //!
-//! The only export from this module is [`add_to_linker`]. To implement it, this
+//! The exports from this module are [`add_to_linker`] and, for hosts with
+//! `Config::async_support`, [`add_to_linker_async`]. To implement them, this
 //! module proceeds in steps:
 //! 1. generate all of the Wiggle glue code into a `gen::*` namespace
 //! 2. wire up the `gen::*` glue to the context state, delegating actual
@@ -11,19 +12,32 @@
 //! 3. wrap up with some conversions, i.e., from `gen::*` types to this crate's
 //!    [`types`].
 //!
+//! `compute` is an async function in the generated trait. [`add_to_linker`]
+//! runs it to completion on the calling thread; [`add_to_linker_async`] links
+//! it as an async host function, so with an [`InferencePool`] on the context
+//! the guest's fiber yields while a pool thread runs the inference.
+//!
+//! [`InferencePool`]: crate::InferencePool
+//!
 //! [`types`]: crate::wit::types
 
-use crate::ctx::{UsageError, WasiNnCtx, WasiNnError, WasiNnResult as Result};
+use crate::backend::{BackendError, TensorInfo, TensorView};
+use crate::ctx::{Table, UsageError, WasiNnCtx, WasiNnError, WasiNnResult as Result};
+use crate::{ExecutionContext, JobHandle};
+use std::borrow::Cow;
 use wiggle::{GuestMemory, GuestPtr};
 
-pub use gen::wasi_ephemeral_nn::add_to_linker;
+pub use gen_async::add_wasi_ephemeral_nn_to_linker as add_to_linker_async;
+pub use gen_sync::add_wasi_ephemeral_nn_to_linker as add_to_linker;
 
 /// Generate the traits and types from the `wasi-nn` WITX specification.
 mod gen {
     use super::*;
     wiggle::from_witx!({
         witx: ["$WASI_ROOT/wasi-nn.witx"],
-        errors: { nn_errno => WasiNnError }
+        errors: { nn_errno => WasiNnError },
+        async: { wasi_ephemeral_nn::compute },
+        wasmtime: false,
     });
 
     /// Additionally, we must let Wiggle know which of our error codes
@@ -42,15 +56,135 @@ mod gen {
         ) -> anyhow::Result<types::NnErrno> {
             tracing::debug!("host error: {:?}", e);
             match e {
-                WasiNnError::BackendError(_) => unimplemented!(),
-                WasiNnError::GuestError(_) => unimplemented!(),
-                WasiNnError::UsageError(_) => unimplemented!(),
+                // A batched output can outgrow the guest's buffer; report it
+                // rather than trapping so the guest can retry with more room.
+                WasiNnError::BackendError(BackendError::NotEnoughMemory(_))
+                | WasiNnError::UsageError(UsageError::NotEnoughMemory(_)) => {
+                    Ok(types::NnErrno::TooLarge)
+                }
+                WasiNnError::BackendError(BackendError::InvalidNumberOfBuilders(..))
+                | WasiNnError::UsageError(UsageError::InvalidNumberOfBuilders(_)) => {
+                    Ok(types::NnErrno::InvalidArgument)
+                }
+                WasiNnError::BackendError(BackendError::BackendAccess(_)) => {
+                    Ok(types::NnErrno::RuntimeError)
+                }
+                // A pointer out of the guest's memory, e.g. an output buffer
+                // it passed, is the guest's bug: an errno, never a host panic.
+                WasiNnError::BackendError(BackendError::GuestAccess(_))
+                | WasiNnError::GuestError(_) => Ok(types::NnErrno::InvalidArgument),
+                // Guests probe the registry with `load_by_name` before falling
+                // back to `load`, so a missing graph must be an errno.
+                WasiNnError::UsageError(UsageError::NotFound(_)) => Ok(types::NnErrno::NotFound),
+                WasiNnError::UsageError(UsageError::InvalidEncoding(_)) => {
+                    Ok(types::NnErrno::InvalidEncoding)
+                }
+                WasiNnError::UsageError(
+                    UsageError::InvalidTensorIndex(_) | UsageError::InvalidTensorName(_),
+                ) => Ok(types::NnErrno::NotFound),
+                WasiNnError::UsageError(UsageError::UnsupportedTensorType(_)) => {
+                    Ok(types::NnErrno::UnsupportedOperation)
+                }
+                // A stale handle, e.g. one already dropped, is the guest's
+                // bug but not a reason to take the host down.
+                WasiNnError::UsageError(
+                    UsageError::InvalidContext
+                    | UsageError::InvalidGraphHandle
+                    | UsageError::InvalidExecutionContextHandle
+                    | UsageError::InvalidTensorHandle,
+                ) => Ok(types::NnErrno::InvalidArgument),
+                WasiNnError::UsageError(UsageError::TooManyHandles) => Ok(types::NnErrno::Busy),
             }
         }
     }
 }
 
+/// Link `compute` as a synchronous host function that expects the future to be
+/// ready immediately, i.e. a context without an inference pool.
+mod gen_sync {
+    wiggle::wasmtime_integration!({
+        target: super::gen,
+        witx: ["$WASI_ROOT/wasi-nn.witx"],
+        errors: { nn_errno => WasiNnError },
+        block_on: { wasi_ephemeral_nn::compute },
+    });
+}
+
+/// Link `compute` as an async host function; needs `Config::async_support`.
+mod gen_async {
+    wiggle::wasmtime_integration!({
+        target: super::gen,
+        witx: ["$WASI_ROOT/wasi-nn.witx"],
+        errors: { nn_errno => WasiNnError },
+        async: { wasi_ephemeral_nn::compute },
+    });
+}
+
+impl WasiNnCtx {
+    /// The execution context behind the guest's handle `id`.
+    fn execution(&self, id: gen::types::GraphExecutionContext) -> Result<&ExecutionContext> {
+        match self.executions.get(id.into()) {
+            Some(exec_context) => Ok(exec_context),
+            None => Err(UsageError::InvalidExecutionContextHandle.into()),
+        }
+    }
+
+    /// Run `compute` for the guest's `id` on the inference pool, if there is
+    /// one, or else on the calling thread.
+    async fn compute_on(&mut self, id: u32) -> Result<()> {
+        let pool = match &self.pool {
+            Some(pool) => pool.clone(),
+            None => {
+                return match self.executions.get_mut(id) {
+                    Some(exec_context) => Ok(exec_context.compute()?),
+                    None => Err(UsageError::InvalidExecutionContextHandle.into()),
+                }
+            }
+        };
+
+        // The store is borrowed by this call until it returns, so nothing can
+        // look the context up while it is away on the pool thread.
+        let mut exec_context = match self.executions.take(id) {
+            Some(exec_context) => exec_context,
+            None => return Err(UsageError::InvalidExecutionContextHandle.into()),
+        };
+        let job = pool.spawn(move || {
+            let result = exec_context.compute();
+            (exec_context, result)
+        });
+        let mut away = Away {
+            executions: &mut self.executions,
+            id,
+            job: Some(job),
+        };
+        let (exec_context, result) = away.job.as_mut().unwrap().await;
+        away.job = None;
+        away.executions.restore(id, exec_context);
+        Ok(result?)
+    }
+}
+
+/// An execution context away on the inference pool. If the `compute` future
+/// is dropped before the job is done, e.g. with the store whose fiber awaits
+/// it, dropping this waits for the job and puts the context back in its
+/// slot, which would otherwise stay taken.
+struct Away<'a, R> {
+    executions: &'a mut Table<u32, ExecutionContext>,
+    id: u32,
+    job: Option<JobHandle<(ExecutionContext, R)>>,
+}
+
+impl<R> Drop for Away<'_, R> {
+    fn drop(&mut self) {
+        if let Some(job) = self.job.take() {
+            let (exec_context, _) = job.wait();
+            self.executions.restore(self.id, exec_context);
+        }
+    }
+}
+
 /// Wire up the WITX-generated trait to the `wasi-nn` host state.
+#[wiggle::async_trait]
 impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
     fn load(
         &mut self,
@@ -65,18 +199,17 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
             let mut slices = vec![];
             for builder in builders.iter() {
                 let builder = memory.read(builder?)?;
-                let slice = memory.as_slice(builder)?.expect(
-                    "cannot use with shared memories; \
-                     see https://github.com/bytecodealliance/wasmtime/issues/5235 (TODO)",
-                );
-                slices.push(slice);
+                slices.push(guest_bytes(memory, builder)?);
             }
             let slice_refs = slices.iter().map(|s| s.as_ref()).collect::<Vec<_>>();
-            backend.load(&slice_refs, target.into())?
+            match &self.cache {
+                Some(cache) => cache.get_or_load(backend, &slice_refs, target.into())?,
+                None => backend.load(&slice_refs, target.into())?,
+            }
         } else {
             return Err(UsageError::InvalidEncoding(encoding.into()).into());
         };
-        let graph_id = self.graphs.insert(graph);
+        let graph_id = self.graphs.insert(graph)?;
         Ok(graph_id.into())
     }
 
@@ -85,9 +218,9 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
         memory: &mut GuestMemory<'_>,
         name: wiggle::GuestPtr<str>,
     ) -> Result<gen::types::Graph> {
-        let name = memory.as_str(name)?.unwrap();
+        let name = memory.as_cow_str(name)?;
         if let Some(graph) = self.registry.get_mut(&name) {
-            let graph_id = self.graphs.insert(graph.clone().into());
+            let graph_id = self.graphs.insert(graph.clone().into())?;
             Ok(graph_id.into())
         } else {
             return Err(UsageError::NotFound(name.to_string()).into());
@@ -99,13 +232,13 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
         _memory: &mut GuestMemory<'_>,
         graph_id: gen::types::Graph,
     ) -> Result<gen::types::GraphExecutionContext> {
-        let exec_context = if let Some(graph) = self.graphs.get_mut(graph_id.into()) {
-            graph.init_execution_context()?
+        let exec_context = if let Some(graph) = self.graphs.get(graph_id.into()) {
+            self.context_for(graph)?
         } else {
             return Err(UsageError::InvalidGraphHandle.into());
         };
 
-        let exec_context_id = self.executions.insert(exec_context);
+        let exec_context_id = self.executions.insert(exec_context)?;
         Ok(exec_context_id.into())
     }
 
@@ -117,10 +250,14 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
         tensor: &gen::types::Tensor,
     ) -> Result<()> {
         if let Some(exec_context) = self.executions.get_mut(exec_context_id.into()) {
-            let tensor = crate::wit::types::Tensor {
-                dimensions: memory.to_vec(tensor.dimensions)?,
+            // Borrow the tensor bytes from guest memory; the backend makes the
+            // only copy (unless the memory is shared, see `guest_bytes`).
+            let dimensions = memory.to_vec(tensor.dimensions)?;
+            let data = guest_bytes(memory, tensor.data)?;
+            let tensor = TensorView {
+                dimensions: &dimensions,
                 tensor_type: tensor.type_.into(),
-                data: memory.to_vec(tensor.data)?,
+                data: &data,
             };
             Ok(exec_context.set_input(index, &tensor)?)
         } else {
@@ -128,16 +265,15 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
         }
     }
 
-    fn compute(
+    async fn compute(
         &mut self,
         _memory: &mut GuestMemory<'_>,
         exec_context_id: gen::types::GraphExecutionContext,
     ) -> Result<()> {
-        if let Some(exec_context) = self.executions.get_mut(exec_context_id.into()) {
-            Ok(exec_context.compute()?)
-        } else {
-            Err(UsageError::InvalidExecutionContextHandle.into())
-        }
+        self.compute_started();
+        let result = self.compute_on(exec_context_id.into()).await;
+        self.compute_ended();
+        result
     }
 
     fn get_output(
@@ -149,17 +285,202 @@ impl gen::wasi_ephemeral_nn::WasiEphemeralNn for WasiNnCtx {
         out_buffer_max_size: u32,
     ) -> Result<u32> {
         if let Some(exec_context) = self.executions.get_mut(exec_context_id.into()) {
-            let mut destination = memory
-                .as_slice_mut(out_buffer.as_array(out_buffer_max_size))?
-                .expect(
-                    "cannot use with shared memories; \
-                     see https://github.com/bytecodealliance/wasmtime/issues/5235 (TODO)",
-                );
-            Ok(exec_context.get_output(index, &mut destination)?)
+            let out_buffer = out_buffer.as_array(out_buffer_max_size);
+            if memory.is_shared_memory() {
+                // Other threads may access a shared memory, so write the
+                // output through a copy rather than a borrowed slice.
+                let mut destination = vec![0; out_buffer_max_size as usize];
+                let written = exec_context.get_output(index, &mut destination)?;
+                let written_buffer = out_buffer.as_ptr().as_array(written);
+                memory.copy_from_slice(&destination[..written as usize], written_buffer)?;
+                return Ok(written);
+            }
+            let destination = memory
+                .as_slice_mut(out_buffer)?
+                .expect("unshared memories can be borrowed");
+            Ok(exec_context.get_output(index, destination)?)
         } else {
             Err(UsageError::InvalidGraphHandle.into())
         }
     }
+
+    fn get_input_info(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+        out_dimensions: GuestPtr<i64>,
+        out_dimensions_max_len: u32,
+    ) -> Result<gen::types::TensorInfo> {
+        let info = self.execution(exec_context_id)?.input_info(index);
+        let info = info.ok_or(UsageError::InvalidTensorIndex(index))?;
+        write_tensor_info(memory, info, out_dimensions, out_dimensions_max_len)
+    }
+
+    fn get_output_info(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+        out_dimensions: GuestPtr<i64>,
+        out_dimensions_max_len: u32,
+    ) -> Result<gen::types::TensorInfo> {
+        let info = self.execution(exec_context_id)?.output_info(index);
+        let info = info.ok_or(UsageError::InvalidTensorIndex(index))?;
+        write_tensor_info(memory, info, out_dimensions, out_dimensions_max_len)
+    }
+
+    fn get_input_name(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+        out_buffer: GuestPtr<u8>,
+        out_buffer_max_size: u32,
+    ) -> Result<u32> {
+        let name = self.execution(exec_context_id)?.input_name(index);
+        let name = name.ok_or(UsageError::InvalidTensorIndex(index))?;
+        write_bytes(memory, name.as_bytes(), out_buffer, out_buffer_max_size)
+    }
+
+    fn get_output_name(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+        out_buffer: GuestPtr<u8>,
+        out_buffer_max_size: u32,
+    ) -> Result<u32> {
+        let name = self.execution(exec_context_id)?.output_name(index);
+        let name = name.ok_or(UsageError::InvalidTensorIndex(index))?;
+        write_bytes(memory, name.as_bytes(), out_buffer, out_buffer_max_size)
+    }
+
+    fn get_output_size(
+        &mut self,
+        _memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+    ) -> Result<u32> {
+        let len = self.execution(exec_context_id)?.output_len(index);
+        Ok(len.ok_or(UsageError::InvalidTensorIndex(index))? as u32)
+    }
+
+    fn get_input_index(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        name: GuestPtr<str>,
+    ) -> Result<u32> {
+        let name = memory.as_cow_str(name)?;
+        let index = self.execution(exec_context_id)?.input_index(&name);
+        Ok(index.ok_or_else(|| UsageError::InvalidTensorName(name.to_string()))?)
+    }
+
+    fn get_output_index(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        name: GuestPtr<str>,
+    ) -> Result<u32> {
+        let name = memory.as_cow_str(name)?;
+        let index = self.execution(exec_context_id)?.output_index(&name);
+        Ok(index.ok_or_else(|| UsageError::InvalidTensorName(name.to_string()))?)
+    }
+
+    fn select_outputs(
+        &mut self,
+        memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        indices: gen::types::OutputIndices,
+    ) -> Result<()> {
+        let indices = memory.to_vec(indices)?;
+        match self.executions.get_mut(exec_context_id.into()) {
+            Some(exec_context) => Ok(exec_context.select_outputs(&indices)?),
+            None => Err(UsageError::InvalidExecutionContextHandle.into()),
+        }
+    }
+
+    fn bind_input(
+        &mut self,
+        _memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+        index: u32,
+        source_id: gen::types::GraphExecutionContext,
+        source_index: u32,
+    ) -> Result<()> {
+        WasiNnCtx::bind_input(
+            self,
+            exec_context_id.into(),
+            index,
+            source_id.into(),
+            source_index,
+        )
+    }
+
+    fn drop_graph(
+        &mut self,
+        _memory: &mut GuestMemory<'_>,
+        graph_id: gen::types::Graph,
+    ) -> Result<()> {
+        match self.graphs.remove(graph_id.into()) {
+            Some(_) => Ok(()),
+            None => Err(UsageError::InvalidGraphHandle.into()),
+        }
+    }
+
+    fn drop_execution_context(
+        &mut self,
+        _memory: &mut GuestMemory<'_>,
+        exec_context_id: gen::types::GraphExecutionContext,
+    ) -> Result<()> {
+        match self.executions.remove(exec_context_id.into()) {
+            Some(_) => Ok(()),
+            None => Err(UsageError::InvalidExecutionContextHandle.into()),
+        }
+    }
+}
+
+/// Write the dimensions of `info` to the guest's buffer of `max_len` elements
+/// at `out` and describe the rest in the WITX record.
+fn write_tensor_info(
+    memory: &mut GuestMemory<'_>,
+    info: TensorInfo,
+    out: GuestPtr<i64>,
+    max_len: u32,
+) -> Result<gen::types::TensorInfo> {
+    let rank = info.dimensions.len() as u32;
+    if rank > max_len {
+        return Err(BackendError::NotEnoughMemory(rank as usize).into());
+    }
+    memory.copy_from_slice(&info.dimensions, out.as_array(rank))?;
+    Ok(gen::types::TensorInfo {
+        type_: info.tensor_type.try_into()?,
+        rank,
+    })
+}
+
+/// Write `bytes` to the guest's buffer of `max_len` bytes at `out`.
+fn write_bytes(
+    memory: &mut GuestMemory<'_>,
+    bytes: &[u8],
+    out: GuestPtr<u8>,
+    max_len: u32,
+) -> Result<u32> {
+    if bytes.len() > max_len as usize {
+        return Err(BackendError::NotEnoughMemory(bytes.len()).into());
+    }
+    memory.copy_from_slice(bytes, out.as_array(bytes.len() as u32))?;
+    Ok(bytes.len() as u32)
+}
+
+/// Borrow the bytes at `ptr`, or copy them if the memory is shared: a shared
+/// memory cannot be borrowed while other threads may write to it.
+fn guest_bytes<'a>(memory: &'a GuestMemory<'_>, ptr: GuestPtr<[u8]>) -> Result<Cow<'a, [u8]>> {
+    match memory.as_slice(ptr)? {
+        Some(slice) => Ok(Cow::Borrowed(slice)),
+        None => Ok(Cow::Owned(memory.to_vec(ptr)?)),
+    }
 }
 
 // Implement some conversion from `witx::types::*` to this crate's version.
@@ -187,6 +508,20 @@ impl From<gen::types::GraphEncoding> for crate::wit::types::GraphEncoding {
         }
     }
 }
+impl TryFrom<crate::wit::types::TensorType> for gen::types::TensorType {
+    type Error = UsageError;
+    fn try_from(value: crate::wit::types::TensorType) -> std::result::Result<Self, UsageError> {
+        match value {
+            crate::wit::types::TensorType::Fp16 => Ok(gen::types::TensorType::F16),
+            crate::wit::types::TensorType::Fp32 => Ok(gen::types::TensorType::F32),
+            crate::wit::types::TensorType::Fp64 => Ok(gen::types::TensorType::F64),
+            crate::wit::types::TensorType::U8 => Ok(gen::types::TensorType::U8),
+            crate::wit::types::TensorType::I32 => Ok(gen::types::TensorType::I32),
+            crate::wit::types::TensorType::I64 => Ok(gen::types::TensorType::I64),
+            crate::wit::types::TensorType::Bf16 => Err(UsageError::UnsupportedTensorType(value)),
+        }
+    }
+}
 impl From<gen::types::TensorType> for crate::wit::types::TensorType {
     fn from(value: gen::types::TensorType) -> Self {
         match value {
@@ -199,3 +534,259 @@ impl From<gen::types::TensorType> for crate::wit::types::TensorType {
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::{add_to_linker, add_to_linker_async};
+    use crate::backend::{BackendError, BackendExecutionContext, BackendGraph, TensorView};
+    use crate::{
+        Backend, ExecutionContext, Graph, GraphRegistry, InMemoryRegistry, InferencePool, Registry,
+        WasiNnCtx,
+    };
+    use std::future::Future;
+    use std::pin::Pin;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Arc;
+    use std::task::{Context, Poll, Wake, Waker};
+    use std::thread;
+    use std::time::{Duration, Instant};
+    use wasmtime::{Config, Engine, Linker, Memory, Module, Store, TypedFunc};
+
+    /// Every `compute` waits up to `patience` for `wanted` of them to have
+    /// started, so they only succeed if that many run at the same time.
+    struct Rendezvous {
+        started: Arc<AtomicUsize>,
+        wanted: usize,
+        patience: Duration,
+    }
+    impl BackendGraph for Rendezvous {
+        fn init_execution_context(&self) -> Result<ExecutionContext, BackendError> {
+            let context: Box<dyn BackendExecutionContext> = Box::new(Rendezvous {
+                started: self.started.clone(),
+                wanted: self.wanted,
+                patience: self.patience,
+            });
+            Ok(context.into())
+        }
+    }
+    impl BackendExecutionContext for Rendezvous {
+        fn set_input(&mut self, _: u32, _: &TensorView<'_>) -> Result<(), BackendError> {
+            Ok(())
+        }
+        fn compute(&mut self) -> Result<(), BackendError> {
+            self.started.fetch_add(1, Ordering::SeqCst);
+            let deadline = Instant::now() + self.patience;
+            while self.started.load(Ordering::SeqCst) < self.wanted {
+                if Instant::now() > deadline {
+                    return Err(anyhow::anyhow!("computes did not overlap").into());
+                }
+                thread::sleep(Duration::from_millis(1));
+            }
+            Ok(())
+        }
+        fn get_output(&mut self, _: u32, _: &mut [u8]) -> Result<u32, BackendError> {
+            Ok(0)
+        }
+    }
+
+    struct Named(Graph);
+    impl GraphRegistry for Named {
+        fn get_mut(&mut self, name: &str) -> Option<&mut Graph> {
+            (name == "model").then_some(&mut self.0)
+        }
+    }
+
+    /// Loads `model` by name, makes a context at 12 and computes once,
+    /// returning the first errno that is not success.
+    const GUEST: &str = r#"
+        (module
+            (import "wasi_ephemeral_nn" "load_by_name"
+                (func $load_by_name (param i32 i32 i32) (result i32)))
+            (import "wasi_ephemeral_nn" "init_execution_context"
+                (func $init (param i32 i32) (result i32)))
+            (import "wasi_ephemeral_nn" "compute" (func $compute (param i32) (result i32)))
+            (memory (export "memory") 1)
+            (data (i32.const 0) "model")
+            (func (export "infer") (result i32)
+                (local $errno i32)
+                (local.set $errno (call $load_by_name (i32.const 0) (i32.const 5) (i32.const 8)))
+                (if (local.get $errno) (then (return (local.get $errno))))
+                (local.set $errno (call $init (i32.load (i32.const 8)) (i32.const 12)))
+                (if (local.get $errno) (then (return (local.get $errno))))
+                (call $compute (i32.load (i32.const 12))))
+        )
+    "#;
+
+    struct ThreadWaker(thread::Thread);
+    impl Wake for ThreadWaker {
+        fn wake(self: Arc<Self>) {
+            self.0.unpark();
+        }
+    }
+
+    /// Poll `futures` on this thread until all of them are ready.
+    fn join_all<F: Future>(futures: Vec<F>) -> Vec<F::Output> {
+        let mut futures: Vec<_> = futures.into_iter().map(|f| Some(Box::pin(f))).collect();
+        let mut outputs: Vec<_> = futures.iter().map(|_| None).collect();
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        let mut cx = Context::from_waker(&waker);
+        while outputs.iter().any(Option::is_none) {
+            for (future, output) in futures.iter_mut().zip(&mut outputs) {
+                if let Some(pending) = future {
+                    if let Poll::Ready(ready) = pending.as_mut().poll(&mut cx) {
+                        *output = Some(ready);
+                        *future = None;
+                    }
+                }
+            }
+            if outputs.iter().any(Option::is_none) {
+                thread::park_timeout(Duration::from_millis(10));
+            }
+        }
+        outputs.into_iter().map(Option::unwrap).collect()
+    }
+
+    /// A store with the async bindings and `pool`, its `infer` export and
+    /// its memory.
+    fn guest(
+        engine: &Engine,
+        graph: &Graph,
+        pool: &InferencePool,
+    ) -> anyhow::Result<(Store<WasiNnCtx>, TypedFunc<(), i32>, Memory)> {
+        let mut linker = Linker::new(engine);
+        add_to_linker_async(&mut linker, |cx: &mut WasiNnCtx| cx)?;
+        let module = Module::new(engine, wat::parse_str(GUEST)?)?;
+        let registry = Registry::from(Named(graph.clone()));
+        let cx = WasiNnCtx::new(Vec::<Backend>::new(), registry).with_inference_pool(pool.clone());
+        let mut store = Store::new(engine, cx);
+        let instance = join_all(vec![linker.instantiate_async(&mut store, &module)]);
+        let instance = instance.into_iter().next().unwrap()?;
+        let infer = instance.get_typed_func(&mut store, "infer")?;
+        let memory = instance.get_memory(&mut store, "memory").unwrap();
+        Ok((store, infer, memory))
+    }
+
+    /// Loads the graph named by the string at `ptr`, from a shared memory.
+    const SHARED_GUEST: &str = r#"
+        (module
+            (import "wasi_ephemeral_nn" "load_by_name"
+                (func $load_by_name (param i32 i32 i32) (result i32)))
+            (memory (export "memory") 1 1 shared)
+            (data (i32.const 0) "model")
+            (data (i32.const 8) "missing")
+            (func (export "load") (param $ptr i32) (param $len i32) (result i32)
+                (call $load_by_name (local.get $ptr) (local.get $len) (i32.const 16)))
+            (func (export "graph") (result i32) (i32.load (i32.const 16)))
+        )
+    "#;
+
+    fn async_engine() -> anyhow::Result<Engine> {
+        let mut config = Config::new();
+        config.async_support(true);
+        Engine::new(&config)
+    }
+
+    #[test]
+    fn load_by_name_reads_shared_memory() -> anyhow::Result<()> {
+        let mut config = Config::new();
+        config.wasm_threads(true);
+        let engine = Engine::new(&config)?;
+        let mut linker = Linker::new(&engine);
+        add_to_linker(&mut linker, |cx: &mut WasiNnCtx| cx)?;
+        let module = Module::new(&engine, wat::parse_str(SHARED_GUEST)?)?;
+        let graph: Box<dyn BackendGraph> = Box::new(Rendezvous {
+            started: Arc::new(AtomicUsize::new(0)),
+            wanted: 1,
+            patience: Duration::ZERO,
+        });
+        let registry = Registry::from(Named(Graph::from(graph)));
+        let cx = WasiNnCtx::new(Vec::<Backend>::new(), registry);
+        let mut store = Store::new(&engine, cx);
+        let instance = linker.instantiate(&mut store, &module)?;
+        let load = instance.get_typed_func::<(i32, i32), i32>(&mut store, "load")?;
+        let graph = instance.get_typed_func::<(), u32>(&mut store, "graph")?;
+
+        // Names in a shared memory are copied out rather than borrowed
+        assert_eq!(load.call(&mut store, (0, 5))?, 0);
+        let id = graph.call(&mut store, ())?;
+        assert!(store.data().graphs.get(id).is_some());
+        assert_ne!(load.call(&mut store, (8, 7))?, 0);
+        Ok(())
+    }
+
+    #[test]
+    fn out_of_bounds_pointers_are_errnos() -> anyhow::Result<()> {
+        let engine = Engine::default();
+        let mut linker = Linker::new(&engine);
+        add_to_linker(&mut linker, |cx: &mut WasiNnCtx| cx)?;
+        let guest = SHARED_GUEST.replace("1 1 shared", "1");
+        let module = Module::new(&engine, wat::parse_str(guest)?)?;
+        let registry = Registry::from(InMemoryRegistry::new());
+        let cx = WasiNnCtx::new(Vec::<Backend>::new(), registry);
+        let mut store = Store::new(&engine, cx);
+        let instance = linker.instantiate(&mut store, &module)?;
+        let load = instance.get_typed_func::<(i32, i32), i32>(&mut store, "load")?;
+
+        // A name running off the end of memory is the guest's bug, reported
+        // to it rather than panicking the host
+        let errno = load.call(&mut store, (65530, 100))?;
+        assert_eq!(errno, super::gen::types::NnErrno::InvalidArgument as i32);
+        Ok(())
+    }
+
+    #[test]
+    fn computes_overlap_on_the_pool() -> anyhow::Result<()> {
+        let engine = async_engine()?;
+        let started = Arc::new(AtomicUsize::new(0));
+        let graph: Box<dyn BackendGraph> = Box::new(Rendezvous {
+            started: started.clone(),
+            wanted: 2,
+            patience: Duration::from_secs(10),
+        });
+        let graph = Graph::from(graph);
+        let pool = InferencePool::new(2);
+        let (mut first, first_infer, _) = guest(&engine, &graph, &pool)?;
+        let (mut second, second_infer, _) = guest(&engine, &graph, &pool)?;
+
+        // Both guests run on this thread; each yields while its compute is
+        // on the pool, so the other one gets to start its own.
+        let errnos = join_all(vec![
+            first_infer.call_async(&mut first, ()),
+            second_infer.call_async(&mut second, ()),
+        ]);
+        for errno in errnos {
+            assert_eq!(errno?, 0);
+        }
+        assert_eq!(started.load(Ordering::SeqCst), 2);
+        Ok(())
+    }
+
+    #[test]
+    fn dropped_compute_restores_its_context() -> anyhow::Result<()> {
+        let engine = async_engine()?;
+        let started = Arc::new(AtomicUsize::new(0));
+        // A lone compute waits out its patience and fails
+        let graph: Box<dyn BackendGraph> = Box::new(Rendezvous {
+            started: started.clone(),
+            wanted: 2,
+            patience: Duration::from_millis(100),
+        });
+        let graph = Graph::from(graph);
+        let pool = InferencePool::new(1);
+        let (mut store, infer, memory) = guest(&engine, &graph, &pool)?;
+
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        let mut call = Box::pin(infer.call_async(&mut store, ()));
+        let poll = call.as_mut().poll(&mut Context::from_waker(&waker));
+        assert!(poll.is_pending());
+        // Dropping the call waits for the pool to be done with the context
+        // and puts it back
+        drop(call);
+        assert_eq!(started.load(Ordering::SeqCst), 1);
+        let mut id = [0; 4];
+        memory.read(&store, 12, &mut id)?;
+        let id = u32::from_le_bytes(id);
+        assert!(store.data().executions.get(id).is_some());
+        Ok(())
+    }
+}
@@ -1,6 +1,6 @@
 use crate::prelude::*;
 use crate::runtime::vm::Backtrace;
-use crate::{instantiate::CompiledModule, AsContext, Module};
+use crate::{instantiate::CompiledModule, AsContext, CallHook, Module};
 #[allow(unused_imports)]
 use anyhow::bail;
 use anyhow::Result;
@@ -14,8 +14,6 @@ use std::time::{Duration, Instant};
 use wasmtime_environ::demangle_function_name_or_index;
 
 // TODO: collect more data
-// - Provide additional hooks for recording host-guest transitions, to be
-//   invoked from a Store::call_hook
 // - On non-Windows, measure thread-local CPU usage between events with
 //   rustix::time::clock_gettime(ClockId::ThreadCPUTime)
 // - Report which wasm module, and maybe instance, each frame came from
@@ -41,7 +39,9 @@ use wasmtime_environ::demangle_function_name_or_index;
 /// If you use epoch interruption, then samples will only be collected at
 /// function entry points and loop headers. This introduces some bias to the
 /// results. In addition, samples will only be taken at times when WebAssembly
-/// functions are running, not during host-calls.
+/// functions are running, not during host-calls. To account for time spent
+/// in the host as well, also call [`GuestProfiler::call_hook`] from a
+/// [`Store::call_hook()`](crate::Store::call_hook) callback.
 ///
 /// It is technically possible to use fuel interruption instead. That
 /// introduces worse bias since samples occur after a certain number of
@@ -79,6 +79,10 @@ pub struct GuestProfiler {
     process: fxprof_processed_profile::ProcessHandle,
     thread: fxprof_processed_profile::ThreadHandle,
     start: Instant,
+    interval: Duration,
+    /// The guest's stack, oldest frame first, and the time at which it
+    /// called into the host, while a host call is in progress.
+    host_call: Option<(Vec<usize>, Duration)>,
 }
 
 impl GuestProfiler {
@@ -123,6 +127,8 @@ impl GuestProfiler {
             process,
             thread,
             start,
+            interval,
+            host_call: None,
         }
     }
 
@@ -135,40 +141,73 @@ impl GuestProfiler {
     /// guest since the previous sample. It is allowed to pass `Duration::ZERO`
     /// here if recording CPU usage information is not needed.
     pub fn sample(&mut self, store: impl AsContext, delta: Duration) {
-        let now = Timestamp::from_nanos_since_reference(
-            self.start.elapsed().as_nanos().try_into().unwrap(),
-        );
+        let now = timestamp(self.start.elapsed());
 
         let backtrace = Backtrace::new(store.as_context().0.vmruntime_limits());
-        let frames = backtrace
-            .frames()
-            // Samply needs to see the oldest frame first, but we list the newest
-            // first, so iterate in reverse.
-            .rev()
-            .filter_map(|frame| {
-                // Find the first module whose start address includes this PC.
-                let module_idx = self
-                    .modules
-                    .partition_point(|(range, _)| range.start > frame.pc());
-                if let Some((range, lib)) = self.modules.get(module_idx) {
-                    if range.contains(&frame.pc()) {
-                        return Some(FrameInfo {
-                            frame: Frame::RelativeAddressFromReturnAddress(
-                                *lib,
-                                u32::try_from(frame.pc() - range.start).unwrap(),
-                            ),
-                            category_pair: CategoryHandle::OTHER.into(),
-                            flags: FrameFlags::empty(),
-                        });
-                    }
-                }
-                None
-            });
+        // Samply needs to see the oldest frame first, but we list the newest
+        // first, so iterate in reverse.
+        let frames = guest_frames(&self.modules, backtrace.frames().rev().map(|f| f.pc()));
 
         self.profile
             .add_sample(self.thread, now, frames, delta.into(), 1);
     }
 
+    /// Account for the time the guest spends in host calls, which samples
+    /// taken at epoch interruptions never see. This function should be called
+    /// from a callback registered using
+    /// [`Store::call_hook()`](crate::Store::call_hook), passing on the `kind`
+    /// of each transition.
+    ///
+    /// Every host call is added as one sample when it returns, weighted by
+    /// the number of sampling intervals it took, with the guest's stack at
+    /// the call followed by a frame named `host`.
+    pub fn call_hook(&mut self, store: impl AsContext, kind: CallHook) {
+        self.call_hook_named(store, kind, "host");
+    }
+
+    /// Like [`GuestProfiler::call_hook`], but name the host frame of a call
+    /// that returns `name`. Embedders that know which host function ran,
+    /// e.g. an inference library, can attribute its time separately.
+    pub fn call_hook_named(&mut self, store: impl AsContext, kind: CallHook, name: &str) {
+        match kind {
+            CallHook::CallingHost => {
+                let backtrace = Backtrace::new(store.as_context().0.vmruntime_limits());
+                let pcs = backtrace.frames().rev().map(|f| f.pc()).collect();
+                self.host_call = Some((pcs, self.start.elapsed()));
+            }
+            CallHook::ReturningFromHost => {
+                // A host call that called back into the guest has already been
+                // recorded by the nested return.
+                let (pcs, called) = match self.host_call.take() {
+                    Some(host_call) => host_call,
+                    None => return,
+                };
+                let now = self.start.elapsed();
+                let weight = if self.interval.is_zero() {
+                    1
+                } else {
+                    ((now - called).as_secs_f64() / self.interval.as_secs_f64())
+                        .round()
+                        .max(1.0) as i32
+                };
+                let host = FrameInfo {
+                    frame: Frame::Label(self.profile.intern_string(name)),
+                    category_pair: CategoryHandle::OTHER.into(),
+                    flags: FrameFlags::empty(),
+                };
+                let frames = guest_frames(&self.modules, pcs.into_iter()).chain(Some(host));
+                self.profile.add_sample(
+                    self.thread,
+                    timestamp(now),
+                    frames,
+                    Duration::ZERO.into(),
+                    weight,
+                );
+            }
+            CallHook::CallingWasm | CallHook::ReturningFromWasm => {}
+        }
+    }
+
     /// When the guest finishes running, call this function to write the
     /// profile to the given `output`. The output is a JSON-formatted object in
     /// the [Firefox "processed profile format"][fmt]. Files in this format may
@@ -176,9 +215,7 @@ impl GuestProfiler {
     ///
     /// [fmt]: https://github.com/firefox-devtools/profiler/blob/main/docs-developer/processed-profile-format.md
     pub fn finish(mut self, output: impl std::io::Write) -> Result<()> {
-        let now = Timestamp::from_nanos_since_reference(
-            self.start.elapsed().as_nanos().try_into().unwrap(),
-        );
+        let now = timestamp(self.start.elapsed());
         self.profile.set_thread_end_time(self.thread, now);
         self.profile.set_process_end_time(self.process, now);
 
@@ -187,6 +224,35 @@ impl GuestProfiler {
     }
 }
 
+fn timestamp(since_start: Duration) -> Timestamp {
+    Timestamp::from_nanos_since_reference(since_start.as_nanos().try_into().unwrap())
+}
+
+/// Map the program counters of a stack, oldest first, to the frames of the
+/// allowed modules they fall into, dropping all others.
+fn guest_frames<'a>(
+    modules: &'a [(Range<usize>, fxprof_processed_profile::LibraryHandle)],
+    pcs: impl Iterator<Item = usize> + 'a,
+) -> impl Iterator<Item = FrameInfo> + 'a {
+    pcs.filter_map(move |pc| {
+        // Find the first module whose start address includes this PC.
+        let module_idx = modules.partition_point(|(range, _)| range.start > pc);
+        if let Some((range, lib)) = modules.get(module_idx) {
+            if range.contains(&pc) {
+                return Some(FrameInfo {
+                    frame: Frame::RelativeAddressFromReturnAddress(
+                        *lib,
+                        u32::try_from(pc - range.start).unwrap(),
+                    ),
+                    category_pair: CategoryHandle::OTHER.into(),
+                    flags: FrameFlags::empty(),
+                });
+            }
+        }
+        None
+    })
+}
+
 fn module_symbols(name: String, compiled: &CompiledModule) -> Option<LibraryInfo> {
     let symbols = Vec::from_iter(compiled.finished_functions().map(|(defined_idx, _)| {
         let loc = compiled.func_loc(defined_idx);
@@ -0,0 +1,515 @@
+/*
+Example of benchmarking image classification through wasi-nn from C++: the
+mobilenet guest of this repository (`wasm-module`) is instantiated with WASI
+and wasi-nn, initialized once with `nn_init` and then asked to classify the
+same image with `nn_infer` repeatedly while the host times every call.
+
+The C API needs the `wasi-nn` feature and the backend of the model, e.g. for
+the ONNX model:
+
+   cargo build --release -p wasmtime-c-api --features wasi-nn-onnx
+   c++ examples/wasi-nn.cpp \
+       -I crates/c-api/include \
+       target/release/libwasmtime.a \
+       -std=c++11 \
+       -lpthread -ldl -lm \
+       -o wasi-nn
+   ./wasi-nn wasi-nn-module.wasm assets unseen_dog.jpg 1000
+
+The assets directory must hold `models/mobilenetv2-10.onnx` and the image in
+`imgs/`, as for `wasmtime-test`.
+
+You can also build using cmake:
+
+mkdir build && cd build && cmake .. -DWASMTIME_FEATURE_WASI_NN_ONNX=ON \
+    && cmake --build . --target wasmtime-wasi-nn
+*/
+
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <wasmtime.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+namespace {
+
+// `ctest` treats this exit code as a skipped test, see CMakeLists.txt.
+const int EXIT_SKIPPED = 77;
+
+template <typename T, void (*fn)(T *)> struct deleter {
+  void operator()(T *ptr) { fn(ptr); }
+};
+template <typename T, void (*fn)(T *)>
+using handle = std::unique_ptr<T, deleter<T, fn>>;
+
+void exit_with_error(std::string msg, wasmtime_error_t *err,
+                     wasm_trap_t *trap) {
+  std::cerr << "error: " << msg << std::endl;
+  wasm_byte_vec_t error_message;
+  if (err) {
+    wasmtime_error_message(err, &error_message);
+  } else {
+    wasm_trap_message(trap, &error_message);
+  }
+  std::cerr << std::string(error_message.data, error_message.size) << std::endl;
+  wasm_byte_vec_delete(&error_message);
+  std::exit(1);
+}
+
+void check(wasmtime_error_t *error, const std::string &msg) {
+  handle<wasmtime_error_t, wasmtime_error_delete> owned{error};
+  if (owned) {
+    exit_with_error(msg, owned.get(), nullptr);
+  }
+}
+
+bool read_file(const std::string &filename, std::string &content) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  content = buffer.str();
+  return !file.bad();
+}
+
+// The `bench` import module of the guest, see
+// wasmtime-custom/src/bench.rs: WASI has no getrusage, so the guest asks
+// the host for its resource usage.
+
+#ifndef _WIN32
+uint64_t timeval_to_us(const struct timeval &tv) {
+  return uint64_t(tv.tv_sec) * 1000000 + uint64_t(tv.tv_usec);
+}
+#endif
+
+wasm_trap_t *thread_cpu_time_ns(void *, wasmtime_caller_t *,
+                                const wasmtime_val_t *, size_t,
+                                wasmtime_val_t *results, size_t) {
+  uint64_t ns = 0;
+#ifndef _WIN32
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    ns = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+  }
+#endif
+  results[0].kind = WASMTIME_I64;
+  results[0].of.i64 = int64_t(ns);
+  return nullptr;
+}
+
+bool guest_memory(wasmtime_caller_t *caller, wasmtime_memory_t *memory) {
+  wasmtime_extern_t item;
+  if (!wasmtime_caller_export_get(caller, "memory", 6, &item) ||
+      item.kind != WASMTIME_EXTERN_MEMORY) {
+    return false;
+  }
+  *memory = item.of.memory;
+  return true;
+}
+
+wasm_trap_t *process_rusage(void *, wasmtime_caller_t *caller,
+                            const wasmtime_val_t *args, size_t,
+                            wasmtime_val_t *results, size_t) {
+  uint64_t usage[3] = {0, 0, 0};
+#ifndef _WIN32
+  struct rusage self;
+  if (getrusage(RUSAGE_SELF, &self) == 0) {
+    usage[0] = timeval_to_us(self.ru_utime);
+    usage[1] = timeval_to_us(self.ru_stime);
+    // Linux reports kilobytes
+    usage[2] = uint64_t(self.ru_maxrss) * 1024;
+  }
+#endif
+  wasmtime_memory_t memory;
+  if (!guest_memory(caller, &memory)) {
+    static const std::string msg = "guest does not export a memory";
+    return wasmtime_trap_new(msg.data(), msg.size());
+  }
+  wasmtime_context_t *context = wasmtime_caller_context(caller);
+  size_t offset = uint32_t(args[0].of.i32);
+  if (offset + sizeof(usage) > wasmtime_memory_data_size(context, &memory)) {
+    static const std::string msg = "out of bounds memory access";
+    return wasmtime_trap_new(msg.data(), msg.size());
+  }
+  // Assumes a little-endian host, like the guest's u64 fields
+  std::memcpy(wasmtime_memory_data(context, &memory) + offset, usage,
+              sizeof(usage));
+  results[0].kind = WASMTIME_I32;
+  results[0].of.i32 = 0;
+  return nullptr;
+}
+
+wasm_trap_t *memory_size(void *, wasmtime_caller_t *caller,
+                         const wasmtime_val_t *, size_t,
+                         wasmtime_val_t *results, size_t) {
+  wasmtime_memory_t memory;
+  size_t size = 0;
+  if (guest_memory(caller, &memory)) {
+    size = wasmtime_memory_data_size(wasmtime_caller_context(caller), &memory);
+  }
+  results[0].kind = WASMTIME_I64;
+  results[0].of.i64 = int64_t(size);
+  return nullptr;
+}
+
+wasm_trap_t *monotonic_ns(void *, wasmtime_caller_t *, const wasmtime_val_t *,
+                          size_t, wasmtime_val_t *results, size_t) {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  results[0].kind = WASMTIME_I64;
+  results[0].of.i64 =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+  return nullptr;
+}
+
+// The guest reports the start (`start` != 0) and end of its tracker phases
+// and of each operation within them, and with NN_TRACE where its trace ring
+// is and the names of its probes. This example times the calls itself, so it
+// only accepts the reports.
+wasm_trap_t *ignore_report(void *, wasmtime_caller_t *, const wasmtime_val_t *,
+                           size_t, wasmtime_val_t *, size_t) {
+  return nullptr;
+}
+
+wasm_functype_t *report_type() {
+  return wasm_functype_new_3_0(wasm_valtype_new_i32(), wasm_valtype_new_i32(),
+                               wasm_valtype_new_i32());
+}
+
+// A `bench` import this example does not know returns zeros, of the kinds in
+// `env`.
+wasm_trap_t *return_zeros(void *env, wasmtime_caller_t *,
+                          const wasmtime_val_t *, size_t,
+                          wasmtime_val_t *results, size_t nresults) {
+  const auto &kinds = *static_cast<std::vector<wasmtime_valkind_t> *>(env);
+  for (size_t i = 0; i < nresults; i++) {
+    std::memset(&results[i], 0, sizeof(results[i]));
+    results[i].kind = kinds[i];
+  }
+  return nullptr;
+}
+
+// Define the imports of `module` from `bench`: those above, and every other
+// function of `bench` the guest imports as returning zeros, so that a newer
+// guest still runs.
+void define_bench(wasmtime_linker_t *linker, const wasmtime_module_t *module) {
+  static const std::string bench = "bench";
+  struct import {
+    std::string name;
+    wasm_functype_t *type;
+    wasmtime_func_callback_t callback;
+  };
+  import known[] = {
+      {"thread_cpu_time_ns", wasm_functype_new_0_1(wasm_valtype_new_i64()),
+       thread_cpu_time_ns},
+      {"process_rusage",
+       wasm_functype_new_1_1(wasm_valtype_new_i32(), wasm_valtype_new_i32()),
+       process_rusage},
+      {"memory_size", wasm_functype_new_0_1(wasm_valtype_new_i64()),
+       memory_size},
+      {"phase", report_type(), ignore_report},
+      {"operation", report_type(), ignore_report},
+      {"monotonic_ns", wasm_functype_new_0_1(wasm_valtype_new_i64()),
+       monotonic_ns},
+      {"trace_ring", report_type(), ignore_report},
+      {"trace_name", report_type(), ignore_report},
+  };
+  std::vector<std::string> defined;
+  for (auto &entry : known) {
+    handle<wasm_functype_t, wasm_functype_delete> type{entry.type};
+    check(wasmtime_linker_define_func(linker, bench.data(), bench.size(),
+                                      entry.name.data(), entry.name.size(),
+                                      type.get(), entry.callback, nullptr,
+                                      nullptr),
+          "failed to define bench." + entry.name);
+    defined.push_back(entry.name);
+  }
+
+  wasm_importtype_vec_t imports;
+  wasmtime_module_imports(module, &imports);
+  for (size_t i = 0; i < imports.size; i++) {
+    const wasm_name_t *module_name = wasm_importtype_module(imports.data[i]);
+    const wasm_name_t *name = wasm_importtype_name(imports.data[i]);
+    const wasm_functype_t *type =
+        wasm_externtype_as_functype_const(wasm_importtype_type(imports.data[i]));
+    std::string import_name(name->data, name->size);
+    if (type == nullptr ||
+        std::string(module_name->data, module_name->size) != bench ||
+        std::find(defined.begin(), defined.end(), import_name) !=
+            defined.end()) {
+      continue;
+    }
+    auto *kinds = new std::vector<wasmtime_valkind_t>();
+    const wasm_valtype_vec_t *results = wasm_functype_results(type);
+    for (size_t j = 0; j < results->size; j++) {
+      switch (wasm_valtype_kind(results->data[j])) {
+      case WASM_I32:
+        kinds->push_back(WASMTIME_I32);
+        break;
+      case WASM_I64:
+        kinds->push_back(WASMTIME_I64);
+        break;
+      case WASM_F32:
+        kinds->push_back(WASMTIME_F32);
+        break;
+      case WASM_F64:
+        kinds->push_back(WASMTIME_F64);
+        break;
+      default:
+        std::cerr << "error: cannot stub bench." << import_name
+                  << ", it returns a reference" << std::endl;
+        std::exit(1);
+      }
+    }
+    check(wasmtime_linker_define_func(
+              linker, bench.data(), bench.size(), import_name.data(),
+              import_name.size(), type, return_zeros, kinds,
+              [](void *env) {
+                delete static_cast<std::vector<wasmtime_valkind_t> *>(env);
+              }),
+          "failed to define bench." + import_name);
+    defined.push_back(import_name);
+  }
+  wasm_importtype_vec_delete(&imports);
+}
+
+// The guest also imports `preprocess` for its host-assisted mode, which this
+// example does not implement; calling one of those functions traps.
+void define_preprocess_as_traps(wasmtime_linker_t *linker,
+                                const wasmtime_module_t *module) {
+  static const std::string preprocess = "preprocess";
+  wasm_importtype_vec_t imports;
+  wasmtime_module_imports(module, &imports);
+  for (size_t i = 0; i < imports.size; i++) {
+    const wasm_name_t *module_name = wasm_importtype_module(imports.data[i]);
+    const wasm_name_t *name = wasm_importtype_name(imports.data[i]);
+    const wasm_functype_t *type =
+        wasm_externtype_as_functype_const(wasm_importtype_type(imports.data[i]));
+    if (type == nullptr ||
+        std::string(module_name->data, module_name->size) != preprocess) {
+      continue;
+    }
+    check(wasmtime_linker_define_func(
+              linker, module_name->data, module_name->size, name->data,
+              name->size, type,
+              [](void *, wasmtime_caller_t *, const wasmtime_val_t *, size_t,
+                 wasmtime_val_t *, size_t) {
+                static const std::string msg =
+                    "host pre-processing is not supported by this example";
+                return wasmtime_trap_new(msg.data(), msg.size());
+              },
+              nullptr, nullptr),
+          "failed to define a preprocess import");
+  }
+  wasm_importtype_vec_delete(&imports);
+}
+
+class guest {
+public:
+  guest(wasmtime_context_t *context, const wasmtime_instance_t &instance)
+      : _context(context), _instance(instance) {}
+
+  wasmtime_memory_t memory() {
+    wasmtime_extern_t item;
+    bool found = wasmtime_instance_export_get(_context, &_instance, "memory",
+                                              6, &item);
+    assert(found && item.kind == WASMTIME_EXTERN_MEMORY);
+    return item.of.memory;
+  }
+
+  // Call the export `name` with i32 arguments and return its i32 result.
+  int32_t call(const std::string &name, std::vector<int32_t> arguments) {
+    wasmtime_extern_t item;
+    bool found = wasmtime_instance_export_get(_context, &_instance, name.data(),
+                                              name.size(), &item);
+    if (!found || item.kind != WASMTIME_EXTERN_FUNC) {
+      std::cerr << "error: the guest does not export " << name << std::endl;
+      std::exit(1);
+    }
+    std::vector<wasmtime_val_t> args(arguments.size());
+    for (size_t i = 0; i < arguments.size(); i++) {
+      args[i].kind = WASMTIME_I32;
+      args[i].of.i32 = arguments[i];
+    }
+    wasmtime_val_t result;
+    wasm_trap_t *trap_ptr = nullptr;
+    handle<wasmtime_error_t, wasmtime_error_delete> error{
+        wasmtime_func_call(_context, &item.of.func, args.data(), args.size(),
+                           &result, 1, &trap_ptr)};
+    handle<wasm_trap_t, wasm_trap_delete> trap{trap_ptr};
+    if (error || trap) {
+      exit_with_error("calling " + name + " failed", error.get(), trap.get());
+    }
+    return result.of.i32;
+  }
+
+  // Copy `bytes` into a buffer allocated with the guest's `nn_alloc`.
+  int32_t write(const std::string &bytes) {
+    int32_t ptr = call("nn_alloc", {int32_t(bytes.size())});
+    wasmtime_memory_t memory = this->memory();
+    assert(size_t(uint32_t(ptr)) + bytes.size() <=
+           wasmtime_memory_data_size(_context, &memory));
+    std::memcpy(wasmtime_memory_data(_context, &memory) + uint32_t(ptr),
+                bytes.data(), bytes.size());
+    return ptr;
+  }
+
+private:
+  wasmtime_context_t *_context;
+  wasmtime_instance_t _instance;
+};
+
+std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds> &sorted,
+                                    double p) {
+  size_t rank = size_t(p / 100.0 * double(sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string module_path = argc > 1 ? argv[1] : "wasi-nn-module.wasm";
+  std::string assets = argc > 2 ? argv[2] : "assets";
+  std::string image_name = argc > 3 ? argv[3] : "unseen_dog.jpg";
+  int iterations = argc > 4 ? std::atoi(argv[4]) : 100;
+  static const std::string model_path = "/assets/models/mobilenetv2-10.onnx";
+
+  std::string wasm;
+  if (!read_file(module_path, wasm)) {
+    std::cerr << "skipping: cannot read " << module_path
+              << "; usage: " << argv[0]
+              << " <wasi-nn-module.wasm> <assets dir> <image> <iterations>"
+              << std::endl;
+    return EXIT_SKIPPED;
+  }
+  std::string image;
+  if (!read_file(assets + "/imgs/" + image_name, image)) {
+    std::cerr << "skipping: cannot read " << assets << "/imgs/" << image_name
+              << std::endl;
+    return EXIT_SKIPPED;
+  }
+
+  handle<wasm_engine_t, wasm_engine_delete> engine{wasm_engine_new()};
+  assert(engine);
+
+  auto start = std::chrono::steady_clock::now();
+  wasmtime_module_t *module_ptr = nullptr;
+  check(wasmtime_module_new(engine.get(),
+                            reinterpret_cast<const uint8_t *>(wasm.data()),
+                            wasm.size(), &module_ptr),
+        "failed to compile module");
+  handle<wasmtime_module_t, wasmtime_module_delete> module{module_ptr};
+  auto compiled = std::chrono::steady_clock::now();
+
+  // One config for every store of the process: its preloaded graphs and
+  // graph cache are shared by all of them.
+  handle<wasmtime_wasi_nn_config_t, wasmtime_wasi_nn_config_delete> nn_config{
+      wasmtime_wasi_nn_config_new()};
+  check(wasmtime_wasi_nn_config_add_backend(nn_config.get(),
+                                            WASMTIME_WASI_NN_ENCODING_ONNX),
+        "failed to add the ONNX backend");
+
+  handle<wasmtime_linker_t, wasmtime_linker_delete> linker{
+      wasmtime_linker_new(engine.get())};
+  check(wasmtime_linker_define_wasi(linker.get()), "failed to link wasi");
+  check(wasmtime_linker_define_wasi_nn(linker.get()),
+        "failed to link wasi-nn");
+  define_bench(linker.get(), module.get());
+  define_preprocess_as_traps(linker.get(), module.get());
+
+  handle<wasmtime_store_t, wasmtime_store_delete> store{
+      wasmtime_store_new(engine.get(), nullptr, nullptr)};
+  wasmtime_context_t *context = wasmtime_store_context(store.get());
+
+  wasi_config_t *wasi_config = wasi_config_new();
+  assert(wasi_config);
+  wasi_config_inherit_stdout(wasi_config);
+  wasi_config_inherit_stderr(wasi_config);
+  if (!wasi_config_preopen_dir(wasi_config, (assets + "/models").c_str(),
+                               "/assets/models")) {
+    std::cerr << "error: cannot preopen " << assets << "/models" << std::endl;
+    return 1;
+  }
+  // this takes ownership of wasi_config
+  check(wasmtime_context_set_wasi(context, wasi_config),
+        "failed to configure wasi");
+  check(wasmtime_context_set_wasi_nn(context, nn_config.get()),
+        "failed to configure wasi-nn");
+
+  wasmtime_instance_t instance;
+  wasm_trap_t *trap_ptr = nullptr;
+  handle<wasmtime_error_t, wasmtime_error_delete> error{
+      wasmtime_linker_instantiate(linker.get(), context, module.get(),
+                                  &instance, &trap_ptr)};
+  handle<wasm_trap_t, wasm_trap_delete> trap{trap_ptr};
+  if (error || trap) {
+    exit_with_error("failed to instantiate module", error.get(), trap.get());
+  }
+  guest nn(context, instance);
+  auto instantiated = std::chrono::steady_clock::now();
+
+  int32_t model = nn.write(model_path);
+  if (nn.call("nn_init", {model, int32_t(model_path.size())}) != 0) {
+    std::cerr << "error: nn_init failed for " << model_path << std::endl;
+    return 1;
+  }
+  nn.call("nn_free", {model, int32_t(model_path.size())});
+  auto initialized = std::chrono::steady_clock::now();
+
+  // The encoded image stays in guest memory for every request
+  int32_t input = nn.write(image);
+  int32_t input_len = int32_t(image.size());
+  int32_t first = nn.call("nn_infer", {input, input_len});
+  std::vector<std::chrono::nanoseconds> latencies;
+  latencies.reserve(size_t(std::max(iterations, 0)));
+  auto loop_start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    auto request_start = std::chrono::steady_clock::now();
+    int32_t predicted = nn.call("nn_infer", {input, input_len});
+    latencies.push_back(std::chrono::steady_clock::now() - request_start);
+    if (predicted != first) {
+      std::cerr << "error: request " << i << " predicted " << predicted
+                << " instead of " << first << std::endl;
+      return 1;
+    }
+  }
+  auto loop_end = std::chrono::steady_clock::now();
+
+  auto ms = [](std::chrono::nanoseconds d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  std::cout << "compile: " << ms(compiled - start) << " ms" << std::endl;
+  std::cout << "instantiate: " << ms(instantiated - compiled) << " ms"
+            << std::endl;
+  std::cout << "nn_init: " << ms(initialized - instantiated) << " ms"
+            << std::endl;
+  std::cout << "predicted class: " << first << std::endl;
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    double seconds = std::chrono::duration<double>(loop_end - loop_start).count();
+    std::cout << iterations << " nn_infer calls: p50 "
+              << ms(percentile(latencies, 50)) << " ms, p99 "
+              << ms(percentile(latencies, 99)) << " ms, max "
+              << ms(latencies.back()) << " ms, " << iterations / seconds
+              << " inferences/s" << std::endl;
+  }
+  std::cout << "graph cache: " << wasmtime_wasi_nn_config_graph_cache_hits(
+                                      nn_config.get())
+            << " hits, "
+            << wasmtime_wasi_nn_config_graph_cache_misses(nn_config.get())
+            << " misses" << std::endl;
+  return 0;
+}